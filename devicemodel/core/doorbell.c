@@ -0,0 +1,175 @@
+/*-
+ * Copyright (c) 2018 Intel Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+/*
+ * Doorbells let the hypervisor complete guest writes to "queue N has work"
+ * style registers without a round trip through the DM. The hypervisor only
+ * sets the doorbell bit in the posted write request ring, and the DM calls
+ * the doorbell handler the next time it drains the ring.
+ */
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "vmmapi.h"
+#include "doorbell.h"
+
+static struct {
+	uint32_t	type;
+	uint64_t	addr;
+	uint64_t	data;
+	uint32_t	flags;
+	doorbell_func_t	handler;
+	void		*arg;
+} doorbells[VHM_DOORBELL_MAX];
+
+static uint64_t doorbell_used[VHM_DOORBELL_MAX / 64];
+static pthread_mutex_t doorbell_mtx = PTHREAD_MUTEX_INITIALIZER;
+static bool doorbell_disabled;
+
+static inline bool
+doorbell_inuse(int id)
+{
+	return (doorbell_used[id / 64] & (1UL << (id % 64))) != 0;
+}
+
+/*
+ * Register a doorbell, or do nothing if the same doorbell is registered
+ * already. Return 0 on success, -1 if writes to 'addr' keep going through
+ * the normal ioreq path.
+ */
+int
+doorbell_add(struct vmctx *ctx, uint32_t type, uint64_t addr, uint64_t data,
+	     uint32_t flags, doorbell_func_t handler, void *arg)
+{
+	int id, free_id = -1, error = 0;
+
+	if (ctx->buf_ioreq_ring == NULL || doorbell_disabled)
+		return -1;
+
+	pthread_mutex_lock(&doorbell_mtx);
+	for (id = 0; id < VHM_DOORBELL_MAX; id++) {
+		if (!doorbell_inuse(id)) {
+			if (free_id < 0)
+				free_id = id;
+			continue;
+		}
+		if (doorbells[id].type == type &&
+		    doorbells[id].addr == addr &&
+		    doorbells[id].data == data &&
+		    doorbells[id].flags == flags &&
+		    doorbells[id].handler == handler &&
+		    doorbells[id].arg == arg)
+			goto done;
+	}
+
+	if (free_id < 0) {
+		error = -1;
+		goto done;
+	}
+
+	error = vm_add_doorbell(ctx, type, free_id, addr, data,
+			(flags & DOORBELL_F_DATAMATCH) ?
+			ACRN_DOORBELL_DATAMATCH : 0);
+	if (error) {
+		/* don't retry on every notify if VHM doesn't know about it */
+		if (errno == ENOTTY || errno == EINVAL) {
+			fprintf(stderr, "doorbell not supported by VHM\n");
+			doorbell_disabled = true;
+		}
+		goto done;
+	}
+
+	doorbells[free_id].type = type;
+	doorbells[free_id].addr = addr;
+	doorbells[free_id].data = data;
+	doorbells[free_id].flags = flags;
+	doorbells[free_id].handler = handler;
+	doorbells[free_id].arg = arg;
+	doorbell_used[free_id / 64] |= 1UL << (free_id % 64);
+
+done:
+	pthread_mutex_unlock(&doorbell_mtx);
+	return error;
+}
+
+/*
+ * Remove all the doorbells in [base, base + size), e.g. when the BAR they
+ * are in gets unregistered.
+ */
+void
+doorbell_del_range(struct vmctx *ctx, uint32_t type, uint64_t base,
+		   uint64_t size)
+{
+	int id;
+
+	pthread_mutex_lock(&doorbell_mtx);
+	for (id = 0; id < VHM_DOORBELL_MAX; id++) {
+		if (!doorbell_inuse(id) || doorbells[id].type != type ||
+		    doorbells[id].addr < base ||
+		    doorbells[id].addr >= base + size)
+			continue;
+
+		vm_del_doorbell(ctx, id);
+		doorbell_used[id / 64] &= ~(1UL << (id % 64));
+	}
+	pthread_mutex_unlock(&doorbell_mtx);
+}
+
+/*
+ * Call the handlers of the doorbells rung since the last call.
+ */
+void
+doorbell_handle(struct vmctx *ctx)
+{
+	struct vhm_buf_request_ring *ring = ctx->buf_ioreq_ring;
+	uint64_t pending;
+	int i, id;
+
+	if (ring == NULL)
+		return;
+
+	for (i = 0; i < VHM_DOORBELL_MAX / 64; i++) {
+		if (ring->doorbell_pending[i] == 0)
+			continue;
+
+		pending = __atomic_exchange_n(&ring->doorbell_pending[i], 0,
+				__ATOMIC_SEQ_CST);
+
+		pthread_mutex_lock(&doorbell_mtx);
+		while (pending) {
+			id = i * 64 + __builtin_ctzl(pending);
+			pending &= pending - 1;
+			if (doorbell_inuse(id))
+				(*doorbells[id].handler)(doorbells[id].arg);
+		}
+		pthread_mutex_unlock(&doorbell_mtx);
+	}
+}
@@ -513,6 +513,51 @@ err:
 	return -ENOMEM;
 }
 
+/* the guest memory regions, to share them with another process */
+int hugetlb_get_regions(struct vmctx *ctx, struct vm_mem_region *regions,
+		int n)
+{
+	struct vm_mem_region *r;
+	vm_paddr_t gpa;
+	int level, i = 0;
+
+	if (total_size == 0)
+		return -EINVAL;
+
+	/* as mapped by mmap_hugetlbfs_lowmem/highmem */
+	gpa = 0;
+	for (level = hugetlb_lv_max - 1; level >= HUGETLB_LV1; level--) {
+		if (hugetlb_priv[level].lowmem == 0)
+			continue;
+		if (i == n)
+			return -ENOSPC;
+		r = &regions[i++];
+		r->gpa = gpa;
+		r->len = hugetlb_priv[level].lowmem;
+		r->hva = ctx->baseaddr + gpa;
+		r->fd = hugetlb_priv[level].fd;
+		r->fd_offset = 0;
+		gpa += r->len;
+	}
+
+	gpa = 4 * GB;
+	for (level = hugetlb_lv_max - 1; level >= HUGETLB_LV1; level--) {
+		if (hugetlb_priv[level].highmem == 0)
+			continue;
+		if (i == n)
+			return -ENOSPC;
+		r = &regions[i++];
+		r->gpa = gpa;
+		r->len = hugetlb_priv[level].highmem;
+		r->hva = ctx->baseaddr + gpa;
+		r->fd = hugetlb_priv[level].fd;
+		r->fd_offset = hugetlb_priv[level].lowmem;
+		gpa += r->len;
+	}
+
+	return i;
+}
+
 void hugetlb_unsetup_memory(struct vmctx *ctx)
 {
 	int level;
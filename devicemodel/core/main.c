@@ -55,6 +55,7 @@
 #include "ioapic.h"
 #include "mem.h"
 #include "mevent.h"
+#include "doorbell.h"
 #include "mptbl.h"
 #include "pci_core.h"
 #include "irq.h"
@@ -98,11 +99,45 @@ static void vm_loop(struct vmctx *ctx);
 
 static int quit_vm_loop;
 
+/*
+ * Number of threads emulating ioreqs. 0 means the vm_loop thread handles
+ * every request itself, otherwise vm_loop only dispatches requests and the
+ * request of vcpu N is emulated by ioreq_workers[N % ioreq_nworkers].
+ */
+static int ioreq_nworkers;
+
+struct ioreq_worker {
+	pthread_t	thr;
+	pthread_mutex_t	mtx;
+	pthread_cond_t	cond;
+	struct vmctx	*ctx;
+	uint32_t	pending;	/* bitmap of vcpus to be handled */
+	int		id;
+	int		quit;
+};
+
+static struct ioreq_worker ioreq_workers[VM_MAXCPU];
+
+/*
+ * If non-zero, how long the dispatcher waits for a worker to finish
+ * before it looks at the request buffer and the posted ring again, while
+ * requests are in flight. Otherwise new requests wait for one of those
+ * to finish, see ioreq_dispatch().
+ */
+static int ioreq_poll_us;
+
+/* bitmap of vcpus whose request is owned by an ioreq worker */
+static uint32_t ioreq_busy;
+static pthread_mutex_t ioreq_busy_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ioreq_busy_cond = PTHREAD_COND_INITIALIZER;
+
 static char vhm_request_page[4096] __attribute__ ((aligned(4096)));
 
 static struct vhm_request *vhm_req_buf =
 				(struct vhm_request *)&vhm_request_page;
 
+static struct vhm_buf_request_ring vhm_buf_req_ring;
+
 struct dmstats {
 	uint64_t	vmexit_bogus;
 	uint64_t	vmexit_reqidle;
@@ -161,7 +196,12 @@ usage(int code)
 		"       -i: ioc boot parameters\n"
 		"       --vsbl: vsbl file path\n"
 		"       --part_info: guest partition info file path\n"
-		"	--enable_trusty: enable trusty for guest\n",
+		"	--enable_trusty: enable trusty for guest\n"
+		"       --mt_ioreq[=n]: emulate ioreqs in n worker threads\n"
+		"                       (default: one per vcpu)\n"
+		"       --ioreq_poll=us: with --mt_ioreq, look for new ioreqs\n"
+		"                        every us while others are emulated,\n"
+		"                        keeping a host cpu busy meanwhile\n",
 		progname, (int)strlen(progname), "", (int)strlen(progname), "",
 		(int)strlen(progname), "");
 
@@ -323,7 +363,7 @@ vmexit_mmio_emul(struct vmctx *ctx, struct vhm_request *vhm_req, int *pvcpu)
 	int err;
 
 	stats.vmexit_mmio_emul++;
-	err = emulate_mem(ctx, &vhm_req->reqs.mmio_request);
+	err = emulate_mem(ctx, *pvcpu, &vhm_req->reqs.mmio_request);
 
 	if (err) {
 		if (err == -ESRCH)
@@ -445,7 +485,16 @@ handle_vmexit(struct vmctx *ctx, struct vhm_request *vhm_req, int vcpu)
 		exit(1);
 	}
 
+	/*
+	 * Inject the interrupts raised by the access before completing it,
+	 * so the guest sees them before its next instruction.
+	 */
+	vm_intr_batch_begin();
 	rc = (*handler[exitcode])(ctx, vhm_req, &vcpu);
+	if (vm_intr_batch_end())
+		fprintf(stderr, "vcpu %d: failed to inject batched interrupts\n",
+				vcpu);
+
 	switch (rc) {
 	case VMEXIT_CONTINUE:
 		vhm_req->processed = REQ_STATE_SUCCESS;
@@ -518,6 +567,271 @@ vm_deinit_vdevs(struct vmctx *ctx)
 	ioapic_deinit();
 }
 
+/*
+ * Emulate the writes the hypervisor queued for posted ranges, then call
+ * the handlers of the doorbells rung meanwhile. This must be called before
+ * handling requests from vhm_req_buf so that the guest sees its accesses
+ * emulated in order, and again once one is seen pending, see
+ * handle_buf_ioreqs_before().
+ */
+static void
+handle_buf_ioreqs(struct vmctx *ctx)
+{
+	struct vhm_buf_request_ring *ring = ctx->buf_ioreq_ring;
+	struct vhm_buf_request *buf_req;
+	struct pio_request pio_req;
+	struct mmio_request mmio_req;
+	uint32_t head, tail;
+	int vcpu, err;
+
+	if (ring == NULL)
+		return;
+
+	head = ring->head;
+	while ((tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE))
+			!= head) {
+		for (; head != tail; head++) {
+			buf_req = &ring->reqs[head & (VHM_BUF_REQUEST_MAX - 1)];
+			vcpu = buf_req->vcpu;
+
+			switch (buf_req->type) {
+			case REQ_PORTIO:
+				bzero(&pio_req, sizeof(pio_req));
+				pio_req.direction = REQUEST_WRITE;
+				pio_req.address = buf_req->address;
+				pio_req.size = buf_req->size;
+				pio_req.value = buf_req->value;
+				err = emulate_inout(ctx, &vcpu, &pio_req,
+						strictio);
+				break;
+			case REQ_MMIO:
+				bzero(&mmio_req, sizeof(mmio_req));
+				mmio_req.direction = REQUEST_WRITE;
+				mmio_req.address = buf_req->address;
+				mmio_req.size = buf_req->size;
+				mmio_req.value = buf_req->value;
+				err = emulate_mem_posted(ctx, vcpu, &mmio_req);
+				break;
+			default:
+				err = -1;
+				break;
+			}
+
+			if (err)
+				fprintf(stderr, "Unhandled posted write type %d "
+					"to 0x%lx\n", buf_req->type,
+					buf_req->address);
+		}
+
+		/* hand the drained slots back, then check for new ones */
+		__atomic_store_n(&ring->head, head, __ATOMIC_SEQ_CST);
+	}
+
+	doorbell_handle(ctx);
+}
+
+/* drain posted writes and doorbells, injecting their interrupts at once */
+static void
+handle_buf_ioreqs_batched(struct vmctx *ctx)
+{
+	vm_intr_batch_begin();
+	handle_buf_ioreqs(ctx);
+	if (vm_intr_batch_end())
+		fprintf(stderr, "failed to inject batched interrupts\n");
+}
+
+static inline bool
+ioreq_pending(struct vmctx *ctx, struct vhm_request *vhm_req)
+{
+	return vhm_req->valid
+		&& (vhm_req->processed == REQ_STATE_PROCESSING)
+		&& (vhm_req->client == ctx->ioreq_client);
+}
+
+/*
+ * A vcpu queues its posted writes before taking the exit that makes its
+ * request pending, and the ring may have been drained in between: once
+ * a request is seen pending, emulate the writes posted before it first.
+ */
+static void
+handle_buf_ioreqs_before(struct vmctx *ctx)
+{
+	/* read the ring after the request */
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	handle_buf_ioreqs_batched(ctx);
+}
+
+static void *
+ioreq_worker_thread(void *param)
+{
+	struct ioreq_worker *w = param;
+	uint32_t pending;
+	int vcpu, quit;
+
+	for (;;) {
+		pthread_mutex_lock(&w->mtx);
+		while (w->pending == 0 && !w->quit)
+			pthread_cond_wait(&w->cond, &w->mtx);
+		pending = w->pending;
+		w->pending = 0;
+		quit = w->quit;
+		pthread_mutex_unlock(&w->mtx);
+
+		if (pending == 0 && quit)
+			break;
+
+		while (pending) {
+			vcpu = ffs(pending) - 1;
+			pending &= ~(1U << vcpu);
+
+			handle_vmexit(w->ctx, &vhm_req_buf[vcpu], vcpu);
+
+			pthread_mutex_lock(&ioreq_busy_mtx);
+			ioreq_busy &= ~(1U << vcpu);
+			pthread_cond_signal(&ioreq_busy_cond);
+			pthread_mutex_unlock(&ioreq_busy_mtx);
+		}
+	}
+
+	return NULL;
+}
+
+static void
+ioreq_workers_start(struct vmctx *ctx)
+{
+	char tname[MAXCOMLEN + 1];
+	struct ioreq_worker *w;
+	int i, error;
+
+	if (ioreq_nworkers < 0 || ioreq_nworkers > guest_ncpus)
+		ioreq_nworkers = guest_ncpus;
+
+	ioreq_busy = 0;
+	for (i = 0; i < ioreq_nworkers; i++) {
+		w = &ioreq_workers[i];
+		w->ctx = ctx;
+		w->id = i;
+		w->pending = 0;
+		w->quit = 0;
+		pthread_mutex_init(&w->mtx, NULL);
+		pthread_cond_init(&w->cond, NULL);
+
+		error = pthread_create(&w->thr, NULL, ioreq_worker_thread, w);
+		assert(error == 0);
+
+		snprintf(tname, sizeof(tname), "ioreq %d", i);
+		pthread_setname_np(w->thr, tname);
+	}
+}
+
+static void
+ioreq_workers_stop(void)
+{
+	struct ioreq_worker *w;
+	int i;
+
+	for (i = 0; i < ioreq_nworkers; i++) {
+		w = &ioreq_workers[i];
+		pthread_mutex_lock(&w->mtx);
+		w->quit = 1;
+		pthread_cond_signal(&w->cond);
+		pthread_mutex_unlock(&w->mtx);
+
+		pthread_join(w->thr, NULL);
+		pthread_cond_destroy(&w->cond);
+		pthread_mutex_destroy(&w->mtx);
+	}
+}
+
+/*
+ * Hand every pending request that is not already being emulated over to
+ * the worker of its vcpu, so that exits from different vcpus are emulated
+ * concurrently. Called with ioreq_busy_mtx held, returns how many were
+ * handed over.
+ */
+static int
+ioreq_dispatch_pending(struct vmctx *ctx)
+{
+	struct ioreq_worker *w;
+	uint32_t ready = 0;
+	int vcpu, dispatched = 0;
+
+	for (vcpu = 0; vcpu < guest_ncpus; vcpu++) {
+		if (!(ioreq_busy & (1U << vcpu))
+			&& ioreq_pending(ctx, &vhm_req_buf[vcpu]))
+			ready |= 1U << vcpu;
+	}
+	if (ready == 0)
+		return 0;
+
+	/*
+	 * Only this thread hands requests over, so the ready ones stay
+	 * pending and not busy meanwhile.
+	 */
+	pthread_mutex_unlock(&ioreq_busy_mtx);
+	handle_buf_ioreqs_before(ctx);
+	pthread_mutex_lock(&ioreq_busy_mtx);
+
+	while (ready) {
+		vcpu = ffs(ready) - 1;
+		ready &= ~(1U << vcpu);
+
+		ioreq_busy |= 1U << vcpu;
+		dispatched++;
+
+		w = &ioreq_workers[vcpu % ioreq_nworkers];
+		pthread_mutex_lock(&w->mtx);
+		w->pending |= 1U << vcpu;
+		pthread_cond_signal(&w->cond);
+		pthread_mutex_unlock(&w->mtx);
+	}
+	return dispatched;
+}
+
+/*
+ * VHM keeps reporting a request as pending until the worker notifies its
+ * completion, so attaching again right away would just spin, and it has
+ * nothing else to wait on. Wait for a worker to finish instead, which the
+ * workers signal.
+ *
+ * New requests, posted writes and doorbells all show up in shared memory
+ * though, so with --ioreq_poll they are looked for meanwhile, every
+ * ioreq_poll_us. That keeps a host cpu busy as long as requests are in
+ * flight.
+ */
+static void
+ioreq_dispatch(struct vmctx *ctx)
+{
+	struct timespec ts;
+	uint32_t busy;
+
+	pthread_mutex_lock(&ioreq_busy_mtx);
+	while (ioreq_dispatch_pending(ctx) == 0 && ioreq_busy) {
+		busy = ioreq_busy;
+		if (ioreq_poll_us == 0) {
+			while (ioreq_busy == busy)
+				pthread_cond_wait(&ioreq_busy_cond,
+						  &ioreq_busy_mtx);
+			break;
+		}
+
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_nsec += ioreq_poll_us * 1000L;
+		while (ts.tv_nsec >= 1000000000) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000;
+		}
+		pthread_cond_timedwait(&ioreq_busy_cond, &ioreq_busy_mtx, &ts);
+		if ((ioreq_busy & busy) != busy)
+			break;
+
+		pthread_mutex_unlock(&ioreq_busy_mtx);
+		handle_buf_ioreqs_batched(ctx);
+		pthread_mutex_lock(&ioreq_busy_mtx);
+	}
+	pthread_mutex_unlock(&ioreq_busy_mtx);
+}
+
 static void
 vm_loop(struct vmctx *ctx)
 {
@@ -526,6 +840,9 @@ vm_loop(struct vmctx *ctx)
 	ctx->ioreq_client = vm_create_ioreq_client(ctx);
 	assert(ctx->ioreq_client > 0);
 
+	if (ioreq_nworkers)
+		ioreq_workers_start(ctx);
+
 	error = vm_run(ctx);
 	assert(error == 0);
 
@@ -537,14 +854,25 @@ vm_loop(struct vmctx *ctx)
 		if (error)
 			break;
 
-		for (vcpu = 0; vcpu < 4; vcpu++) {
+		handle_buf_ioreqs_batched(ctx);
+
+		if (ioreq_nworkers) {
+			ioreq_dispatch(ctx);
+			continue;
+		}
+
+		for (vcpu = 0; vcpu < guest_ncpus; vcpu++) {
 			vhm_req = &vhm_req_buf[vcpu];
-			if (vhm_req->valid
-				&& (vhm_req->processed == REQ_STATE_PROCESSING)
-				&& (vhm_req->client == ctx->ioreq_client))
+			if (ioreq_pending(ctx, vhm_req)) {
+				handle_buf_ioreqs_before(ctx);
 				handle_vmexit(ctx, vhm_req, vcpu);
+			}
 		}
 	}
+
+	if (ioreq_nworkers)
+		ioreq_workers_stop();
+
 	quit_vm_loop = 0;
 	printf("VM loop exit\n");
 }
@@ -592,6 +920,8 @@ enum {
 	CMD_OPT_VSBL = 1000,
 	CMD_OPT_PART_INFO,
 	CMD_OPT_TRUSTY_ENABLE,
+	CMD_OPT_MT_IOREQ,
+	CMD_OPT_IOREQ_POLL,
 };
 
 static struct option long_options[] = {
@@ -628,6 +958,8 @@ static struct option long_options[] = {
 	{"part_info",		required_argument,	0, CMD_OPT_PART_INFO},
 	{"enable_trusty",	no_argument,		0,
 					CMD_OPT_TRUSTY_ENABLE},
+	{"mt_ioreq",		optional_argument,	0, CMD_OPT_MT_IOREQ},
+	{"ioreq_poll",		required_argument,	0, CMD_OPT_IOREQ_POLL},
 	{0,			0,			0,  0  },
 };
 
@@ -788,6 +1120,19 @@ main(int argc, char *argv[])
 		case CMD_OPT_TRUSTY_ENABLE:
 			trusty_enabled = 1;
 			break;
+		case CMD_OPT_MT_IOREQ:
+			/* -1: one worker per vcpu, fixed up in vm_loop */
+			ioreq_nworkers = optarg ? atoi(optarg) : -1;
+			if (ioreq_nworkers == 0)
+				errx(EX_USAGE, "invalid mt_ioreq param %s",
+					optarg);
+			break;
+		case CMD_OPT_IOREQ_POLL:
+			ioreq_poll_us = atoi(optarg);
+			if (ioreq_poll_us <= 0)
+				errx(EX_USAGE, "invalid ioreq_poll param %s",
+					optarg);
+			break;
 		case 'h':
 			usage(0);
 		default:
@@ -810,6 +1155,10 @@ main(int argc, char *argv[])
 		if (error)
 			goto fail;
 
+		/* optional, writes are not posted if it fails */
+		memset(&vhm_buf_req_ring, 0, sizeof(vhm_buf_req_ring));
+		vm_set_buf_ioreq_ring(ctx, &vhm_buf_req_ring);
+
 		if (guest_ncpus < 1) {
 			fprintf(stderr, "Invalid guest vCPUs (%d)\n",
 				guest_ncpus);
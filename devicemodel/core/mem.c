@@ -30,6 +30,11 @@
  * Memory ranges are represented with an RB tree. On insertion, the range
  * is checked for overlaps. On lookup, the key has the same base and limit
  * so it can be searched within the range.
+ *
+ * The RB tree is only used by register/unregister, which are rare. Every
+ * update republishes a read-only snapshot of the tree as a sorted array,
+ * which emulate_mem() searches without taking any lock. A snapshot is
+ * freed once no vCPU can still be using it.
  */
 
 #include <sys/cdefs.h>
@@ -39,6 +44,7 @@
 #include <stdbool.h>
 #include <assert.h>
 #include <pthread.h>
+#include <sched.h>
 
 #include "vmm.h"
 #include "types.h"
@@ -57,14 +63,52 @@ RB_PROTOTYPE(mmio_rb_tree, mmio_rb_range, mr_link, mmio_rb_range_compare);
 
 RB_HEAD(mmio_rb_tree, mmio_rb_range) mmio_rb_root, mmio_rb_fallback;
 
+struct mmio_range {
+	uint64_t		base;
+	uint64_t		end;
+	struct mem_range	param;
+};
+
+/*
+ * Snapshot of mmio_rb_root followed by mmio_rb_fallback, both sorted by
+ * address.
+ */
+struct mmio_map {
+	uint64_t		gen;
+	int			nr_ranges;
+	int			nr_fallback;
+	struct mmio_range	ranges[];
+};
+
+static struct mmio_map *mmio_map;
+static uint64_t mmio_map_gen;
+
 /*
- * Per-VM cache. Since most accesses from a vCPU will be to
- * consecutive addresses in a range, it makes sense to cache the
- * result of a lookup.
+ * Per-vCPU state, one cache line each so that the lookup path only writes
+ * to memory private to its vCPU.
+ *
+ * 'seq' is odd while the vCPU is using a snapshot. Since most accesses from
+ * a vCPU will be to consecutive addresses in a range, the result of the
+ * last lookup is cached in 'hint', valid for snapshot 'hint_gen' only.
+ *
+ * The writes posted by the vCPUs are emulated by another thread than
+ * their ioreq worker, possibly at the same time, so they use the extra
+ * slot at the end.
  */
-static struct mmio_rb_range	*mmio_hint;
+struct mmio_vcpu {
+	unsigned long	seq;
+	uint64_t	hint_gen;
+	int		hint;
+} __attribute__((aligned(64)));
 
-static pthread_rwlock_t mmio_rwlock;
+static struct mmio_vcpu mmio_vcpu[VM_MAXCPU + 1];
+#define	MMIO_POSTED_SLOT	VM_MAXCPU
+
+/* set while the current thread is inside emulate_mem() */
+static __thread struct mmio_vcpu *mmio_cur_vcpu;
+
+/* serializes updates of the trees and of the snapshot */
+static pthread_mutex_t mmio_mtx = PTHREAD_MUTEX_INITIALIZER;
 
 static int
 mmio_rb_range_compare(struct mmio_rb_range *a, struct mmio_rb_range *b)
@@ -121,12 +165,12 @@ mmio_rb_dump(struct mmio_rb_tree *rbt)
 {
 	struct mmio_rb_range *np;
 
-	pthread_rwlock_rdlock(&mmio_rwlock);
+	pthread_mutex_lock(&mmio_mtx);
 	RB_FOREACH(np, mmio_rb_tree, rbt) {
 		printf(" %lx:%lx, %s\n", np->mr_base, np->mr_end,
 		       np->mr_param.name);
 	}
-	pthread_rwlock_unlock(&mmio_rwlock);
+	pthread_mutex_unlock(&mmio_mtx);
 }
 #endif
 
@@ -156,50 +200,193 @@ mem_write(void *ctx, int vcpu, uint64_t gpa, uint64_t wval, int size, void *arg)
 	return error;
 }
 
-int
-emulate_mem(struct vmctx *ctx, struct mmio_request *mmio_req)
+static int
+mmio_map_lookup(struct mmio_range *ranges, int nr, uint64_t addr)
+{
+	int lo = 0, hi = nr - 1, mid;
+
+	while (lo <= hi) {
+		mid = (lo + hi) / 2;
+		if (addr < ranges[mid].base)
+			hi = mid - 1;
+		else if (addr > ranges[mid].end)
+			lo = mid + 1;
+		else
+			return mid;
+	}
+
+	return -1;
+}
+
+static int
+mmio_map_fill(struct mmio_range *ranges, struct mmio_rb_tree *rbt)
+{
+	struct mmio_rb_range *np;
+	int i = 0;
+
+	RB_FOREACH(np, mmio_rb_tree, rbt) {
+		ranges[i].base = np->mr_base;
+		ranges[i].end = np->mr_end;
+		ranges[i].param = np->mr_param;
+		i++;
+	}
+
+	return i;
+}
+
+/*
+ * Wait until every vCPU that might have picked up the previous snapshot
+ * has left emulate_mem(), then free it. A vCPU updating the map from
+ * within its own handler is skipped, it no longer touches the snapshot
+ * on return.
+ *
+ * Must be called without mmio_mtx: a vCPU still inside the old snapshot
+ * may itself be blocked in register_mem()/unregister_mem().
+ */
+static void
+mmio_map_retire(struct mmio_map *old)
+{
+	unsigned long seq;
+	int i;
+
+	if (old == NULL)
+		return;
+
+	/* order the publication of the new map before reading the epochs */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	for (i = 0; i < nitems(mmio_vcpu); i++) {
+		if (&mmio_vcpu[i] == mmio_cur_vcpu)
+			continue;
+
+		seq = __atomic_load_n(&mmio_vcpu[i].seq, __ATOMIC_ACQUIRE);
+		if ((seq & 1) == 0)
+			continue;
+
+		while (__atomic_load_n(&mmio_vcpu[i].seq, __ATOMIC_ACQUIRE)
+				== seq)
+			sched_yield();
+	}
+
+	free(old);
+}
+
+/*
+ * Rebuild the snapshot from both trees and publish it. Called with
+ * mmio_mtx held; the replaced snapshot is returned in 'oldp' and must be
+ * passed to mmio_map_retire() once mmio_mtx is dropped.
+ */
+static int
+mmio_map_publish(struct mmio_map **oldp)
+{
+	struct mmio_rb_range *np;
+	struct mmio_map *map, *old;
+	int nr = 0;
+
+	RB_FOREACH(np, mmio_rb_tree, &mmio_rb_root)
+		nr++;
+	RB_FOREACH(np, mmio_rb_tree, &mmio_rb_fallback)
+		nr++;
+
+	map = malloc(sizeof(struct mmio_map) + nr * sizeof(struct mmio_range));
+	if (map == NULL)
+		return -1;
+
+	map->gen = ++mmio_map_gen;
+	map->nr_ranges = mmio_map_fill(map->ranges, &mmio_rb_root);
+	map->nr_fallback = mmio_map_fill(&map->ranges[map->nr_ranges],
+			&mmio_rb_fallback);
+
+	old = mmio_map;
+	__atomic_store_n(&mmio_map, map, __ATOMIC_SEQ_CST);
+	*oldp = old;
+
+	return 0;
+}
+
+static int
+emulate_mem_slot(struct vmctx *ctx, int vcpu, struct mmio_request *mmio_req,
+		 struct mmio_vcpu *mv)
 {
 	uint64_t paddr = mmio_req->address;
 	int size = mmio_req->size;
-	struct mmio_rb_range *entry = NULL;
-	int err;
+	struct mmio_map *map;
+	struct mmio_range *entry = NULL;
+	int idx, err;
+
+	/* enter the read side: pairs with the fence in mmio_map_retire */
+	__atomic_store_n(&mv->seq, mv->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	mmio_cur_vcpu = mv;
+
+	map = __atomic_load_n(&mmio_map, __ATOMIC_ACQUIRE);
+	if (map == NULL) {
+		err = -ESRCH;
+		goto done;
+	}
 
-	pthread_rwlock_rdlock(&mmio_rwlock);
 	/*
-	 * First check the per-VM cache
+	 * First check the per-vCPU cache
 	 */
-	if (mmio_hint && paddr >= mmio_hint->mr_base &&
-			paddr <= mmio_hint->mr_end)
-		entry = mmio_hint;
+	if (mv->hint_gen == map->gen) {
+		entry = &map->ranges[mv->hint];
+		if (paddr < entry->base || paddr > entry->end)
+			entry = NULL;
+	}
 
 	if (entry == NULL) {
-		if (mmio_rb_lookup(&mmio_rb_root, paddr, &entry) == 0)
-			/* Update the per-VMU cache */
-			mmio_hint = entry;
-		else if (mmio_rb_lookup(&mmio_rb_fallback, paddr, &entry)) {
-			pthread_rwlock_unlock(&mmio_rwlock);
-			return -ESRCH;
+		idx = mmio_map_lookup(map->ranges, map->nr_ranges, paddr);
+		if (idx >= 0) {
+			/* Update the per-vCPU cache */
+			mv->hint_gen = map->gen;
+			mv->hint = idx;
+			entry = &map->ranges[idx];
+		} else {
+			idx = mmio_map_lookup(&map->ranges[map->nr_ranges],
+					map->nr_fallback, paddr);
+			if (idx < 0) {
+				err = -ESRCH;
+				goto done;
+			}
+			entry = &map->ranges[map->nr_ranges + idx];
 		}
 	}
 
-	assert(entry != NULL);
-
 	if (mmio_req->direction == REQUEST_READ)
-		err = mem_read(ctx, 0, paddr, (uint64_t *)&mmio_req->value,
-				size, &entry->mr_param);
+		err = mem_read(ctx, vcpu, paddr, (uint64_t *)&mmio_req->value,
+				size, &entry->param);
 	else
-		err = mem_write(ctx, 0, paddr, mmio_req->value,
-				size, &entry->mr_param);
+		err = mem_write(ctx, vcpu, paddr, mmio_req->value,
+				size, &entry->param);
 
-	pthread_rwlock_unlock(&mmio_rwlock);
+done:
+	mmio_cur_vcpu = NULL;
+	__atomic_store_n(&mv->seq, mv->seq + 1, __ATOMIC_RELEASE);
 
 	return err;
 }
 
+int
+emulate_mem(struct vmctx *ctx, int vcpu, struct mmio_request *mmio_req)
+{
+	assert(vcpu >= 0 && vcpu < VM_MAXCPU);
+	return emulate_mem_slot(ctx, vcpu, mmio_req, &mmio_vcpu[vcpu]);
+}
+
+/* Emulate a write posted by 'vcpu', from the thread draining the ring */
+int
+emulate_mem_posted(struct vmctx *ctx, int vcpu, struct mmio_request *mmio_req)
+{
+	assert(vcpu >= 0 && vcpu < VM_MAXCPU);
+	return emulate_mem_slot(ctx, vcpu, mmio_req,
+				&mmio_vcpu[MMIO_POSTED_SLOT]);
+}
+
 static int
 register_mem_int(struct mmio_rb_tree *rbt, struct mem_range *memp)
 {
 	struct mmio_rb_range *entry, *mrp;
+	struct mmio_map *old = NULL;
 	int err;
 
 	err = 0;
@@ -210,10 +397,16 @@ register_mem_int(struct mmio_rb_tree *rbt, struct mem_range *memp)
 		mrp->mr_param = *memp;
 		mrp->mr_base = memp->base;
 		mrp->mr_end = memp->base + memp->size - 1;
-		pthread_rwlock_wrlock(&mmio_rwlock);
-		if (mmio_rb_lookup(rbt, memp->base, &entry) != 0)
+		pthread_mutex_lock(&mmio_mtx);
+		if (mmio_rb_lookup(rbt, memp->base, &entry) != 0) {
 			err = mmio_rb_add(rbt, mrp);
-		pthread_rwlock_unlock(&mmio_rwlock);
+			if (err == 0 && mmio_map_publish(&old) != 0) {
+				RB_REMOVE(mmio_rb_tree, rbt, mrp);
+				err = -1;
+			}
+		}
+		pthread_mutex_unlock(&mmio_mtx);
+		mmio_map_retire(old);
 		if (err)
 			free(mrp);
 	} else
@@ -239,9 +432,10 @@ unregister_mem_fallback(struct mem_range *memp)
 {
 	struct mem_range *mr;
 	struct mmio_rb_range *entry = NULL;
+	struct mmio_map *old = NULL;
 	int err;
 
-	pthread_rwlock_wrlock(&mmio_rwlock);
+	pthread_mutex_lock(&mmio_mtx);
 	err = mmio_rb_lookup(&mmio_rb_fallback, memp->base, &entry);
 	if (err == 0) {
 		mr = &entry->mr_param;
@@ -250,11 +444,15 @@ unregister_mem_fallback(struct mem_range *memp)
 		assert((mr->flags & MEM_F_IMMUTABLE) == 0);
 		RB_REMOVE(mmio_rb_tree, &mmio_rb_fallback, entry);
 
-		/* flush Per-VM cache */
-		if (mmio_hint == entry)
-			mmio_hint = NULL;
+		/* stale per-vCPU caches are dropped with the old snapshot */
+		if (mmio_map_publish(&old) != 0) {
+			mmio_rb_add(&mmio_rb_fallback, entry);
+			entry = NULL;
+			err = -1;
+		}
 	}
-	pthread_rwlock_unlock(&mmio_rwlock);
+	pthread_mutex_unlock(&mmio_mtx);
+	mmio_map_retire(old);
 
 	if (entry)
 		free(entry);
@@ -267,9 +465,10 @@ unregister_mem(struct mem_range *memp)
 {
 	struct mem_range *mr;
 	struct mmio_rb_range *entry = NULL;
+	struct mmio_map *old = NULL;
 	int err;
 
-	pthread_rwlock_wrlock(&mmio_rwlock);
+	pthread_mutex_lock(&mmio_mtx);
 	err = mmio_rb_lookup(&mmio_rb_root, memp->base, &entry);
 	if (err == 0) {
 		mr = &entry->mr_param;
@@ -278,11 +477,15 @@ unregister_mem(struct mem_range *memp)
 		assert((mr->flags & MEM_F_IMMUTABLE) == 0);
 		RB_REMOVE(mmio_rb_tree, &mmio_rb_root, entry);
 
-		/* flush Per-VM cache */
-		if (mmio_hint == entry)
-			mmio_hint = NULL;
+		/* stale per-vCPU caches are dropped with the old snapshot */
+		if (mmio_map_publish(&old) != 0) {
+			mmio_rb_add(&mmio_rb_root, entry);
+			entry = NULL;
+			err = -1;
+		}
 	}
-	pthread_rwlock_unlock(&mmio_rwlock);
+	pthread_mutex_unlock(&mmio_mtx);
+	mmio_map_retire(old);
 
 	if (entry)
 		free(entry);
@@ -293,7 +496,14 @@ unregister_mem(struct mem_range *memp)
 void
 init_mem(void)
 {
+	struct mmio_map *old = NULL;
+
 	RB_INIT(&mmio_rb_root);
 	RB_INIT(&mmio_rb_fallback);
-	pthread_rwlock_init(&mmio_rwlock, NULL);
+
+	pthread_mutex_lock(&mmio_mtx);
+	if (mmio_map_publish(&old) != 0)
+		fprintf(stderr, "%s: failed to allocate mmio map\n", __func__);
+	pthread_mutex_unlock(&mmio_mtx);
+	mmio_map_retire(old);
 }
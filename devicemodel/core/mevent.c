@@ -331,9 +331,13 @@ mevent_dispatch(void)
 			perror("Error return from epoll_wait");
 
 		/*
-		 * Handle reported events
+		 * Handle reported events, and inject the interrupts they
+		 * raise all at once
 		 */
+		vm_intr_batch_begin();
 		mevent_handle(eventlist, ret);
+		if (vm_intr_batch_end())
+			fprintf(stderr, "failed to inject batched interrupts\n");
 
 		if (vm_get_suspend_mode() != VM_SUSPEND_NONE)
 			break;
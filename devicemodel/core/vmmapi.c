@@ -104,6 +104,16 @@ check_api(int fd)
 
 static int devfd = -1;
 
+/* an empty batch tells whether VHM supports IC_INJECT_INTR_BATCH */
+static int
+vm_probe_intr_batch(struct vmctx *ctx)
+{
+	struct acrn_intr_batch batch;
+
+	bzero(&batch, sizeof(batch));
+	return ioctl(ctx->fd, IC_INJECT_INTR_BATCH, &batch) == 0;
+}
+
 struct vmctx *
 vm_open(const char *name)
 {
@@ -164,6 +174,7 @@ vm_open(const char *name)
 	}
 
 	ctx->vmid = create_vm.vmid;
+	ctx->intr_batch = vm_probe_intr_batch(ctx);
 
 	return ctx;
 
@@ -199,6 +210,88 @@ vm_set_shared_io_page(struct vmctx *ctx, uint64_t page_vma)
 	return 0;
 }
 
+/*
+ * Writes to posted ranges are queued by the hypervisor in 'ring' without
+ * pausing the vcpu. If VHM doesn't support it, all writes keep going
+ * through the shared io page and posted ranges are silently ignored.
+ */
+int
+vm_set_buf_ioreq_ring(struct vmctx *ctx, struct vhm_buf_request_ring *ring)
+{
+	int error;
+
+	ctx->buf_ioreq_ring = NULL;
+	error = ioctl(ctx->fd, IC_SET_BUF_IOREQ_RING, (unsigned long)ring);
+	if (error) {
+		fprintf(stderr, "posted ioreq not supported by VHM\n");
+		return -1;
+	}
+
+	ctx->buf_ioreq_ring = ring;
+	return 0;
+}
+
+static int
+vm_posted_range(struct vmctx *ctx, uint32_t type, uint64_t start,
+		uint64_t size, unsigned long call_id)
+{
+	struct acrn_posted_range range;
+
+	if (ctx->buf_ioreq_ring == NULL)
+		return -1;
+
+	bzero(&range, sizeof(range));
+	range.type = type;
+	range.start = start;
+	range.size = size;
+
+	return ioctl(ctx->fd, call_id, &range);
+}
+
+int
+vm_add_posted_range(struct vmctx *ctx, uint32_t type, uint64_t start,
+		    uint64_t size)
+{
+	return vm_posted_range(ctx, type, start, size, IC_ADD_POSTED_RANGE);
+}
+
+int
+vm_del_posted_range(struct vmctx *ctx, uint32_t type, uint64_t start,
+		    uint64_t size)
+{
+	return vm_posted_range(ctx, type, start, size, IC_DEL_POSTED_RANGE);
+}
+
+int
+vm_add_doorbell(struct vmctx *ctx, uint32_t type, uint32_t id, uint64_t addr,
+		uint64_t data, uint32_t flags)
+{
+	struct acrn_doorbell db;
+
+	if (ctx->buf_ioreq_ring == NULL)
+		return -1;
+
+	bzero(&db, sizeof(db));
+	db.type = type;
+	db.id = id;
+	db.addr = addr;
+	db.data = data;
+	db.flags = flags;
+
+	return ioctl(ctx->fd, IC_ADD_DOORBELL, &db);
+}
+
+int
+vm_del_doorbell(struct vmctx *ctx, uint32_t id)
+{
+	struct acrn_doorbell db;
+
+	bzero(&db, sizeof(db));
+	db.id = id;
+
+	return ioctl(ctx->fd, IC_DEL_DOORBELL, &db);
+}
+
 int
 vm_create_ioreq_client(struct vmctx *ctx)
 {
@@ -455,35 +548,6 @@ vm_unsetup_memory(struct vmctx *ctx)
 		munmap(ctx->mmap_highmem, ctx->highmem);
 }
 
-/*
- * Returns a non-NULL pointer if [gaddr, gaddr+len) is entirely contained in
- * the lowmem or highmem regions.
- *
- * In particular return NULL if [gaddr, gaddr+len) falls in guest MMIO region.
- * The instruction emulation code depends on this behavior.
- */
-void *
-vm_map_gpa(struct vmctx *ctx, vm_paddr_t gaddr, size_t len)
-{
-
-	if (ctx->lowmem > 0) {
-		if (gaddr < ctx->lowmem && len <= ctx->lowmem &&
-		    gaddr + len <= ctx->lowmem)
-			return (ctx->baseaddr + gaddr);
-	}
-
-	if (ctx->highmem > 0) {
-		if (gaddr >= 4*GB) {
-			if (gaddr < 4*GB + ctx->highmem &&
-			    len <= ctx->highmem &&
-			    gaddr + len <= 4*GB + ctx->highmem)
-				return (ctx->baseaddr + gaddr);
-		}
-	}
-
-	return NULL;
-}
-
 size_t
 vm_get_lowmem_size(struct vmctx *ctx)
 {
@@ -551,71 +615,159 @@ vm_apicid2vcpu(struct vmctx *ctx, int apicid)
 	return apicid;
 }
 
-int
-vm_lapic_msi(struct vmctx *ctx, uint64_t addr, uint64_t msg)
+/*
+ * Interrupts raised by a thread between vm_intr_batch_begin() and
+ * vm_intr_batch_end() are injected in order with a single
+ * IC_INJECT_INTR_BATCH ioctl, when the batch gets full or at
+ * vm_intr_batch_end(). Batches may nest, only the outermost one flushes
+ * and reports whether any of the interrupts in the batch failed.
+ */
+static __thread struct {
+	struct vmctx *ctx;
+	int depth;
+	int error;
+	uint32_t nr_ops;
+	struct acrn_intr_op ops[ACRN_INTR_BATCH_MAX];
+} intr_batch;
+
+static int
+vm_intr_op_now(struct vmctx *ctx, struct acrn_intr_op *op)
+{
+	switch (op->op) {
+	case ACRN_INTR_OP_ASSERT:
+		return ioctl(ctx->fd, IC_ASSERT_IRQLINE, &op->irqline);
+	case ACRN_INTR_OP_DEASSERT:
+		return ioctl(ctx->fd, IC_DEASSERT_IRQLINE, &op->irqline);
+	case ACRN_INTR_OP_PULSE:
+		return ioctl(ctx->fd, IC_PULSE_IRQLINE, &op->irqline);
+	case ACRN_INTR_OP_MSI:
+		return ioctl(ctx->fd, IC_INJECT_MSI, &op->msi);
+	default:
+		return -1;
+	}
+}
+
+static void
+vm_intr_batch_flush(void)
 {
-	struct acrn_msi_entry msi;
+	struct acrn_intr_batch batch;
 
-	bzero(&msi, sizeof(msi));
-	msi.msi_addr = addr;
-	msi.msi_data = msg;
+	if (intr_batch.nr_ops == 0)
+		return;
+
+	bzero(&batch, sizeof(batch));
+	batch.nr_ops = intr_batch.nr_ops;
+	batch.ops = (uint64_t)intr_batch.ops;
 
-	return ioctl(ctx->fd, IC_INJECT_MSI, &msi);
+	if (ioctl(intr_batch.ctx->fd, IC_INJECT_INTR_BATCH, &batch))
+		intr_batch.error = -1;
+	intr_batch.nr_ops = 0;
+}
+
+static int
+vm_intr_op(struct vmctx *ctx, struct acrn_intr_op *op)
+{
+	if (intr_batch.depth == 0 || !ctx->intr_batch)
+		return vm_intr_op_now(ctx, op);
+
+	if (intr_batch.nr_ops == ACRN_INTR_BATCH_MAX ||
+	    (intr_batch.nr_ops && intr_batch.ctx != ctx))
+		vm_intr_batch_flush();
+
+	intr_batch.ctx = ctx;
+	intr_batch.ops[intr_batch.nr_ops++] = *op;
+	return 0;
+}
+
+void
+vm_intr_batch_begin(void)
+{
+	intr_batch.depth++;
 }
 
 int
-vm_ioapic_assert_irq(struct vmctx *ctx, int irq)
+vm_intr_batch_end(void)
 {
-	struct acrn_irqline ioapic_irq;
+	int error;
 
-	bzero(&ioapic_irq, sizeof(ioapic_irq));
-	ioapic_irq.intr_type = ACRN_INTR_TYPE_IOAPIC;
-	ioapic_irq.ioapic_irq = irq;
+	assert(intr_batch.depth > 0);
+	if (--intr_batch.depth > 0)
+		return 0;
 
-	return ioctl(ctx->fd, IC_ASSERT_IRQLINE, &ioapic_irq);
+	vm_intr_batch_flush();
+	error = intr_batch.error;
+	intr_batch.error = 0;
+	return error;
 }
 
 int
-vm_ioapic_deassert_irq(struct vmctx *ctx, int irq)
+vm_lapic_msi(struct vmctx *ctx, uint64_t addr, uint64_t msg)
 {
-	struct acrn_irqline ioapic_irq;
+	struct acrn_intr_op op;
 
-	bzero(&ioapic_irq, sizeof(ioapic_irq));
-	ioapic_irq.intr_type = ACRN_INTR_TYPE_IOAPIC;
-	ioapic_irq.ioapic_irq = irq;
+	bzero(&op, sizeof(op));
+	op.op = ACRN_INTR_OP_MSI;
+	op.msi.msi_addr = addr;
+	op.msi.msi_data = msg;
 
-	return ioctl(ctx->fd, IC_DEASSERT_IRQLINE, &ioapic_irq);
+	return vm_intr_op(ctx, &op);
+}
+
+static int
+vm_ioapic_irq(struct vmctx *ctx, int irq, uint32_t intr_op)
+{
+	struct acrn_intr_op op;
+
+	bzero(&op, sizeof(op));
+	op.op = intr_op;
+	op.irqline.intr_type = ACRN_INTR_TYPE_IOAPIC;
+	op.irqline.ioapic_irq = irq;
+
+	return vm_intr_op(ctx, &op);
+}
+
+int
+vm_ioapic_assert_irq(struct vmctx *ctx, int irq)
+{
+	return vm_ioapic_irq(ctx, irq, ACRN_INTR_OP_ASSERT);
+}
+
+int
+vm_ioapic_deassert_irq(struct vmctx *ctx, int irq)
+{
+	return vm_ioapic_irq(ctx, irq, ACRN_INTR_OP_DEASSERT);
 }
 
 static int
-vm_isa_irq(struct vmctx *ctx, int irq, int ioapic_irq, unsigned long call_id)
+vm_isa_irq(struct vmctx *ctx, int irq, int ioapic_irq, uint32_t intr_op)
 {
-	struct acrn_irqline isa_irq;
+	struct acrn_intr_op op;
 
-	bzero(&isa_irq, sizeof(isa_irq));
-	isa_irq.intr_type = ACRN_INTR_TYPE_ISA;
-	isa_irq.pic_irq = irq;
-	isa_irq.ioapic_irq = ioapic_irq;
+	bzero(&op, sizeof(op));
+	op.op = intr_op;
+	op.irqline.intr_type = ACRN_INTR_TYPE_ISA;
+	op.irqline.pic_irq = irq;
+	op.irqline.ioapic_irq = ioapic_irq;
 
-	return ioctl(ctx->fd, call_id, &isa_irq);
+	return vm_intr_op(ctx, &op);
 }
 
 int
 vm_isa_assert_irq(struct vmctx *ctx, int atpic_irq, int ioapic_irq)
 {
-	return vm_isa_irq(ctx, atpic_irq, ioapic_irq, IC_ASSERT_IRQLINE);
+	return vm_isa_irq(ctx, atpic_irq, ioapic_irq, ACRN_INTR_OP_ASSERT);
 }
 
 int
 vm_isa_deassert_irq(struct vmctx *ctx, int atpic_irq, int ioapic_irq)
 {
-	return vm_isa_irq(ctx, atpic_irq, ioapic_irq, IC_DEASSERT_IRQLINE);
+	return vm_isa_irq(ctx, atpic_irq, ioapic_irq, ACRN_INTR_OP_DEASSERT);
 }
 
 int
 vm_isa_pulse_irq(struct vmctx *ctx, int atpic_irq, int ioapic_irq)
 {
-	return vm_isa_irq(ctx, atpic_irq, ioapic_irq, IC_PULSE_IRQLINE);
+	return vm_isa_irq(ctx, atpic_irq, ioapic_irq, ACRN_INTR_OP_PULSE);
 }
 
 int
@@ -0,0 +1,471 @@
+/*-
+ * Copyright (c) 2018 Intel Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+/*
+ * Shared read cache.
+ *
+ * The cache of an image is a POSIX shared memory segment named after the
+ * device, inode, size and mtime of the file, so every acrn-dm opening the
+ * same unmodified image attaches to the same segment, and a modified
+ * image gets a new one. The segment counts the instances attached to it
+ * and is unlinked by the last one to close it. A segment left half set up
+ * by a process that died is unlinked and created again.
+ *
+ * The cache is set associative: a block goes in one of the ways of the
+ * set its number hashes to, replacing the least recently used one. Each
+ * way is protected by a sequence count, so hits only read shared memory:
+ * the data is copied out, and thrown away if the sequence count changed
+ * meanwhile. Fills take the set lock with a single try, and are simply
+ * skipped if another process holds it, so a process dying in there can
+ * not block the others.
+ */
+
+#include <sys/param.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "dm.h"
+#include "block_cache.h"
+
+#define	BCACHE_MAGIC		0x48434342	/* "BCCH" */
+#define	BCACHE_VERSION		2
+#define	BCACHE_BLOCK		(64 * 1024)
+#define	BCACHE_WAYS		8
+#define	BCACHE_WAIT_MS		1000	/* for another process to set it up */
+
+#define WPRINTF(params) (printf params)
+
+struct bcache_way {
+	uint64_t	tag;		/* block number + 1, 0 if empty */
+	uint64_t	stamp;		/* last use, for LRU */
+	uint32_t	seq;		/* odd while being filled */
+	uint32_t	pad;
+};
+
+struct bcache_set {
+	uint32_t	lock;
+	uint32_t	pad;
+	struct bcache_way way[BCACHE_WAYS];
+};
+
+struct bcache_shm {
+	uint32_t	magic;		/* set last by the creator */
+	uint32_t	version;
+	uint64_t	dev;
+	uint64_t	ino;
+	uint64_t	size;
+	int64_t		mtime;
+	int64_t		mtime_nsec;
+	uint32_t	refs;		/* attached instances, 0 once unlinked */
+	uint32_t	nsets;
+	uint32_t	block_size;
+	uint64_t	data_offset;
+	uint64_t	clock;
+	struct bcache_set set[];
+};
+
+struct bcache {
+	int		fd;		/* the image */
+	char		name[NAME_MAX];	/* of the segment */
+	struct bcache_shm *shm;
+	size_t		map_size;
+	uint32_t	nsets;
+	uint8_t		*data;
+};
+
+static inline struct bcache_set *
+bcache_set(struct bcache *bc, uint64_t blk)
+{
+	return &bc->shm->set[(blk * 0x9e3779b97f4a7c15ULL >> 32) % bc->nsets];
+}
+
+static inline uint8_t *
+bcache_data(struct bcache *bc, struct bcache_set *set, int way)
+{
+	return bc->data +
+		((size_t)(set - bc->shm->set) * BCACHE_WAYS + way) *
+		BCACHE_BLOCK;
+}
+
+/* Copy 'len' bytes of 'buf' to 'iov', starting 'pos' bytes in */
+static void
+bcache_to_iov(const struct iovec *iov, int iovcnt, size_t pos,
+	      const uint8_t *buf, size_t len)
+{
+	size_t n;
+	int i;
+
+	for (i = 0; i < iovcnt && pos >= iov[i].iov_len; i++)
+		pos -= iov[i].iov_len;
+
+	for (; i < iovcnt && len > 0; i++) {
+		n = MIN(iov[i].iov_len - pos, len);
+		memcpy((uint8_t *)iov[i].iov_base + pos, buf, n);
+		buf += n;
+		len -= n;
+		pos = 0;
+	}
+}
+
+/*
+ * Copy a cached block part to 'iov'. Return 0 on a miss, or if the
+ * block was replaced while being copied.
+ */
+static int
+bcache_lookup(struct bcache *bc, uint64_t blk, size_t boff,
+	      const struct iovec *iov, int iovcnt, size_t pos, size_t len)
+{
+	struct bcache_set *set;
+	struct bcache_way *way;
+	uint32_t seq;
+	int i;
+
+	set = bcache_set(bc, blk);
+	for (i = 0; i < BCACHE_WAYS; i++) {
+		way = &set->way[i];
+		seq = __atomic_load_n(&way->seq, __ATOMIC_ACQUIRE);
+		if ((seq & 1) ||
+		    __atomic_load_n(&way->tag, __ATOMIC_RELAXED) != blk + 1)
+			continue;
+
+		bcache_to_iov(iov, iovcnt, pos,
+			      bcache_data(bc, set, i) + boff, len);
+
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&way->seq, __ATOMIC_RELAXED) != seq)
+			return 0;
+
+		__atomic_store_n(&way->stamp,
+			__atomic_add_fetch(&bc->shm->clock, 1,
+					   __ATOMIC_RELAXED),
+			__ATOMIC_RELAXED);
+		return 1;
+	}
+	return 0;
+}
+
+static void
+bcache_fill(struct bcache *bc, uint64_t blk, const uint8_t *buf)
+{
+	struct bcache_set *set;
+	struct bcache_way *way;
+	uint32_t seq;
+	int i, victim;
+
+	set = bcache_set(bc, blk);
+	if (__atomic_exchange_n(&set->lock, 1, __ATOMIC_ACQUIRE))
+		return;
+
+	victim = 0;
+	for (i = 0; i < BCACHE_WAYS; i++) {
+		way = &set->way[i];
+		if (way->tag == blk + 1)
+			goto out;	/* filled by someone else */
+		if (way->tag == 0 ||
+		    way->stamp < set->way[victim].stamp)
+			victim = i;
+		if (way->tag == 0)
+			break;
+	}
+
+	/*
+	 * Move to a new odd count, also if a process died filling this way
+	 * and left it odd, and make it even only once the data is written.
+	 */
+	way = &set->way[victim];
+	seq = (way->seq + 1) | 1;
+	__atomic_store_n(&way->seq, seq, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	way->tag = blk + 1;
+	memcpy(bcache_data(bc, set, victim), buf, BCACHE_BLOCK);
+	way->stamp = __atomic_add_fetch(&bc->shm->clock, 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&way->seq, seq + 1, __ATOMIC_RELEASE);
+
+out:
+	__atomic_store_n(&set->lock, 0, __ATOMIC_RELEASE);
+}
+
+/* Read a whole block, zero filled past the end of the file */
+static int
+bcache_read_block(struct bcache *bc, uint64_t blk, uint8_t *buf)
+{
+	size_t done;
+	ssize_t n;
+
+	for (done = 0; done < BCACHE_BLOCK; done += n) {
+		n = pread(bc->fd, buf + done, BCACHE_BLOCK - done,
+			  blk * BCACHE_BLOCK + done);
+		if (n < 0 && errno == EINTR) {
+			n = 0;
+			continue;
+		}
+		if (n < 0)
+			return errno;
+		if (n == 0) {
+			memset(buf + done, 0, BCACHE_BLOCK - done);
+			break;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Read 'iov' from the image at 'off', through the cache.
+ */
+int
+bcache_readv(struct bcache *bc, const struct iovec *iov, int iovcnt,
+	     off_t off)
+{
+	uint8_t *buf;
+	size_t pos, len, total, boff;
+	uint64_t blk;
+	int i, err;
+
+	total = 0;
+	for (i = 0; i < iovcnt; i++)
+		total += iov[i].iov_len;
+
+	buf = NULL;
+	err = 0;
+	for (pos = 0; pos < total; pos += len) {
+		blk = (off + pos) / BCACHE_BLOCK;
+		boff = (off + pos) % BCACHE_BLOCK;
+		len = MIN(BCACHE_BLOCK - boff, total - pos);
+
+		if (bcache_lookup(bc, blk, boff, iov, iovcnt, pos, len))
+			continue;
+
+		/* aligned, as the image may be opened with O_DIRECT */
+		if (buf == NULL &&
+		    posix_memalign((void **)&buf, BCACHE_BLOCK,
+				   BCACHE_BLOCK) != 0) {
+			buf = NULL;
+			err = ENOMEM;
+			break;
+		}
+		err = bcache_read_block(bc, blk, buf);
+		if (err)
+			break;
+		bcache_to_iov(iov, iovcnt, pos, buf + boff, len);
+		bcache_fill(bc, blk, buf);
+	}
+
+	free(buf);
+	return err;
+}
+
+/*
+ * Take a reference on a segment, unless its last user already dropped
+ * it and is unlinking it.
+ */
+static bool
+bcache_get(struct bcache_shm *shm)
+{
+	uint32_t refs;
+
+	refs = __atomic_load_n(&shm->refs, __ATOMIC_RELAXED);
+	do {
+		if (refs == 0)
+			return false;
+	} while (!__atomic_compare_exchange_n(&shm->refs, &refs, refs + 1,
+			false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED));
+	return true;
+}
+
+/*
+ * Unlink a segment left unusable by a creator that died setting it up,
+ * unless it was already replaced by a new one.
+ */
+static void
+bcache_unlink_stale(const char *name, ino_t ino)
+{
+	struct stat sbuf;
+	int sfd;
+
+	WPRINTF(("block_cache: %s is stale, recreating it\n", name));
+	sfd = shm_open(name, O_RDWR, 0600);
+	if (sfd < 0)
+		return;
+	if (fstat(sfd, &sbuf) == 0 && sbuf.st_ino == ino)
+		shm_unlink(name);
+	close(sfd);
+}
+
+/*
+ * Attach to the cache of the image open on 'fd', creating it with
+ * 'size_mb' MB of data if it doesn't exist yet.
+ */
+struct bcache *
+bcache_open(int fd, size_t size_mb)
+{
+	struct bcache *bc;
+	struct bcache_shm *shm;
+	struct stat sbuf, ibuf;
+	char name[NAME_MAX];
+	size_t hdr_size, map_size;
+	uint32_t nsets;
+	int sfd, i, retries;
+	bool creator;
+
+	if (fstat(fd, &ibuf) < 0)
+		return NULL;
+
+	snprintf(name, sizeof(name), "/acrn-bcache-%lx-%lx-%lx-%lx.%lx",
+		 (unsigned long)ibuf.st_dev, (unsigned long)ibuf.st_ino,
+		 (unsigned long)ibuf.st_size, (unsigned long)ibuf.st_mtime,
+		 (unsigned long)ibuf.st_mtim.tv_nsec);
+
+	nsets = MAX(size_mb * 1024 * 1024 / (BCACHE_BLOCK * BCACHE_WAYS), 1);
+	hdr_size = roundup(sizeof(struct bcache_shm) +
+			   nsets * sizeof(struct bcache_set), BCACHE_BLOCK);
+	retries = 0;
+again:
+	map_size = hdr_size + (size_t)nsets * BCACHE_WAYS * BCACHE_BLOCK;
+
+	creator = true;
+	sfd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+	if (sfd < 0 && errno == EEXIST) {
+		creator = false;
+		sfd = shm_open(name, O_RDWR, 0600);
+	}
+	if (sfd < 0) {
+		WPRINTF(("block_cache: shm_open %s failed, errno %d\n",
+			 name, errno));
+		return NULL;
+	}
+
+	if (creator) {
+		if (ftruncate(sfd, map_size) < 0)
+			goto fail_unlink;
+	} else {
+		/* the creator sets the size */
+		for (i = 0; i < BCACHE_WAIT_MS; i++) {
+			if (fstat(sfd, &sbuf) < 0)
+				goto fail;
+			if (sbuf.st_size > 0)
+				break;
+			usleep(1000);
+		}
+		map_size = sbuf.st_size;
+		if (map_size < sizeof(struct bcache_shm)) {
+			close(sfd);
+			goto stale;
+		}
+	}
+
+	shm = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, sfd, 0);
+	close(sfd);
+	sfd = -1;
+	if (shm == MAP_FAILED)
+		goto fail_unlink;
+
+	if (creator) {
+		shm->version = BCACHE_VERSION;
+		shm->dev = ibuf.st_dev;
+		shm->ino = ibuf.st_ino;
+		shm->size = ibuf.st_size;
+		shm->mtime = ibuf.st_mtime;
+		shm->mtime_nsec = ibuf.st_mtim.tv_nsec;
+		shm->refs = 1;
+		shm->nsets = nsets;
+		shm->block_size = BCACHE_BLOCK;
+		shm->data_offset = hdr_size;
+		__atomic_store_n(&shm->magic, BCACHE_MAGIC, __ATOMIC_RELEASE);
+	} else {
+		for (i = 0; i < BCACHE_WAIT_MS; i++) {
+			if (__atomic_load_n(&shm->magic, __ATOMIC_ACQUIRE) ==
+			    BCACHE_MAGIC)
+				break;
+			usleep(1000);
+		}
+		if (shm->magic != BCACHE_MAGIC ||
+		    shm->version != BCACHE_VERSION ||
+		    shm->dev != ibuf.st_dev || shm->ino != ibuf.st_ino ||
+		    shm->size != ibuf.st_size ||
+		    shm->block_size != BCACHE_BLOCK || shm->nsets == 0 ||
+		    shm->data_offset < sizeof(struct bcache_shm) +
+		    (size_t)shm->nsets * sizeof(struct bcache_set) ||
+		    shm->data_offset + (size_t)shm->nsets * BCACHE_WAYS *
+		    BCACHE_BLOCK > map_size) {
+			munmap(shm, map_size);
+			goto stale;
+		}
+		if (!bcache_get(shm)) {
+			/* being unlinked by its last user, make a new one */
+			munmap(shm, map_size);
+			if (++retries >= BCACHE_WAIT_MS)
+				return NULL;
+			usleep(1000);
+			goto again;
+		}
+	}
+
+	bc = calloc(1, sizeof(struct bcache));
+	if (bc == NULL) {
+		munmap(shm, map_size);
+		return NULL;
+	}
+	bc->fd = fd;
+	snprintf(bc->name, sizeof(bc->name), "%s", name);
+	bc->shm = shm;
+	bc->map_size = map_size;
+	bc->nsets = shm->nsets;
+	bc->data = (uint8_t *)shm + shm->data_offset;
+	return bc;
+
+stale:
+	bcache_unlink_stale(name, sbuf.st_ino);
+	if (++retries >= BCACHE_WAIT_MS)
+		return NULL;
+	goto again;
+
+fail_unlink:
+	if (creator)
+		shm_unlink(name);
+fail:
+	if (sfd >= 0)
+		close(sfd);
+	WPRINTF(("block_cache: could not set up %s\n", name));
+	return NULL;
+}
+
+void
+bcache_close(struct bcache *bc)
+{
+	if (__atomic_sub_fetch(&bc->shm->refs, 1, __ATOMIC_RELEASE) == 0)
+		shm_unlink(bc->name);
+	munmap(bc->shm, bc->map_size);
+	free(bc);
+}
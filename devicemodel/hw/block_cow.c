@@ -0,0 +1,826 @@
+/*-
+ * Copyright (c) 2018 Intel Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+/*
+ * Copy-on-write disk image format.
+ *
+ * The image starts with a header cluster, holding the header and the path
+ * of the backing file, followed by the L1 table. The virtual disk is split
+ * in clusters; an L1 entry gives the image offset of an L2 table, which
+ * is one cluster of entries giving the image offset of each data cluster.
+ * Zero means not allocated: the data is then read from the backing file,
+ * or is zero if there is none. All offsets are little endian. Whether
+ * the backing file is itself a CoW image is recorded in the header, the
+ * contents of a raw file are never probed.
+ *
+ * The first write to a cluster copies it from the backing file into a new
+ * cluster appended to the image, and the L2 entry is written only after
+ * the data, so a crash at worst leaks the new cluster. L2 tables are
+ * cached write-through, the L1 table is kept in memory.
+ */
+
+#include <sys/param.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "dm.h"
+#include "block_cow.h"
+#include "block_cache.h"
+
+#define	COW_MAGIC		0x574f4341	/* "ACOW" */
+#define	COW_VERSION		1
+#define	COW_CLUSTER_BITS	16		/* 64KB clusters */
+#define	COW_CLUSTER_BITS_MIN	12
+#define	COW_CLUSTER_BITS_MAX	21
+#define	COW_L2_CACHE		16		/* L2 tables cached per image */
+#define	COW_CHAIN_MAX		16		/* max depth of backing files */
+
+#define WPRINTF(params) (printf params)
+
+struct cow_header {
+	uint32_t	magic;
+	uint32_t	version;
+	uint64_t	size;		/* virtual disk size in bytes */
+	uint32_t	cluster_bits;
+	uint32_t	l1_size;	/* entries in the L1 table */
+	uint64_t	l1_offset;
+	uint64_t	backing_offset;	/* backing file path, no NUL */
+	uint32_t	backing_len;	/* 0 if no backing file */
+	uint32_t	flags;
+} __attribute__((packed));
+
+/*
+ * The backing file is a CoW image. Without it, the backing file is raw and
+ * never probed, since the guest controls the contents of raw images.
+ */
+#define	COW_F_BACKING_COW	(1U << 0)
+
+struct cow_l2 {
+	uint32_t	l1_idx;
+	uint64_t	lru;
+	uint64_t	*table;		/* host endian, NULL if slot unused */
+};
+
+struct cow_image {
+	int		fd;
+	bool		ro;
+	bool		sync;		/* opened with O_DSYNC */
+	bool		raw;		/* plain file, no CoW metadata */
+	struct bcache	*bcache;	/* shared cache of a raw backing file */
+	off_t		size;
+	uint32_t	cluster_bits;
+	uint32_t	cluster_size;
+	uint32_t	l2_bits;	/* log2 of the entries per L2 table */
+	uint32_t	l1_size;
+	uint64_t	l1_offset;
+	uint64_t	*l1;		/* host endian */
+
+	pthread_mutex_t	mtx;		/* protects everything below */
+	off_t		next_free;	/* end of the image, cluster aligned */
+	uint64_t	lru_clock;
+	struct cow_l2	l2_cache[COW_L2_CACHE];
+	uint8_t		*cbuf;		/* one cluster for copy-on-write */
+
+	struct cow_image *backing;
+};
+
+static size_t
+iov_len(const struct iovec *iov, int iovcnt)
+{
+	size_t len = 0;
+	int i;
+
+	for (i = 0; i < iovcnt; i++)
+		len += iov[i].iov_len;
+	return len;
+}
+
+/*
+ * Fill 'out' with the iovecs covering 'len' bytes of 'iov', starting
+ * 'skip' bytes in. Return the number of iovecs used.
+ */
+static int
+iov_slice(const struct iovec *iov, int iovcnt, size_t skip, size_t len,
+	  struct iovec *out)
+{
+	size_t n;
+	int i, cnt;
+
+	for (i = 0; i < iovcnt && skip >= iov[i].iov_len; i++)
+		skip -= iov[i].iov_len;
+
+	for (cnt = 0; i < iovcnt && len > 0; i++, cnt++) {
+		n = MIN(iov[i].iov_len - skip, len);
+		out[cnt].iov_base = (uint8_t *)iov[i].iov_base + skip;
+		out[cnt].iov_len = n;
+		len -= n;
+		skip = 0;
+	}
+	return cnt;
+}
+
+static void
+iov_zero(const struct iovec *iov, int iovcnt)
+{
+	int i;
+
+	for (i = 0; i < iovcnt; i++)
+		memset(iov[i].iov_base, 0, iov[i].iov_len);
+}
+
+static void
+iov_to_buf(const struct iovec *iov, int iovcnt, uint8_t *buf)
+{
+	int i;
+
+	for (i = 0; i < iovcnt; i++) {
+		memcpy(buf, iov[i].iov_base, iov[i].iov_len);
+		buf += iov[i].iov_len;
+	}
+}
+
+static int
+cow_pread(int fd, void *buf, size_t len, off_t off)
+{
+	ssize_t n;
+
+	while (len > 0) {
+		n = pread(fd, buf, len, off);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			return errno;
+		if (n == 0)
+			return EIO;
+		buf = (uint8_t *)buf + n;
+		len -= n;
+		off += n;
+	}
+	return 0;
+}
+
+static int
+cow_pwrite(int fd, const void *buf, size_t len, off_t off)
+{
+	ssize_t n;
+
+	while (len > 0) {
+		n = pwrite(fd, buf, len, off);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			return errno;
+		if (n == 0)
+			return EIO;
+		buf = (const uint8_t *)buf + n;
+		len -= n;
+		off += n;
+	}
+	return 0;
+}
+
+/*
+ * Vectored read or write of the whole of 'iov', resuming short transfers.
+ * Reads past the end of the file return zeros.
+ */
+static int
+cow_rwv(int fd, const struct iovec *iov, int iovcnt, off_t off, bool write)
+{
+	struct iovec *sl;
+	size_t total, done;
+	ssize_t n;
+	int cnt, err;
+
+	sl = malloc(iovcnt * sizeof(struct iovec));
+	if (sl == NULL)
+		return ENOMEM;
+
+	err = 0;
+	total = iov_len(iov, iovcnt);
+	for (done = 0; done < total; done += n) {
+		cnt = iov_slice(iov, iovcnt, done, total - done, sl);
+		cnt = MIN(cnt, IOV_MAX);
+		if (write)
+			n = pwritev(fd, sl, cnt, off + done);
+		else
+			n = preadv(fd, sl, cnt, off + done);
+		if (n < 0 && errno == EINTR) {
+			n = 0;
+			continue;
+		}
+		if (n < 0) {
+			err = errno;
+			break;
+		}
+		if (n == 0) {
+			if (write)
+				err = EIO;
+			else
+				iov_zero(sl, iov_slice(iov, iovcnt, done,
+						       total - done, sl));
+			break;
+		}
+	}
+
+	free(sl);
+	return err;
+}
+
+static off_t
+cow_raw_size(int fd)
+{
+	struct stat sbuf;
+	uint64_t size;
+
+	if (fstat(fd, &sbuf) < 0)
+		return -1;
+	if (S_ISBLK(sbuf.st_mode)) {
+		if (ioctl(fd, BLKGETSIZE64, &size) < 0)
+			return -1;
+		return size;
+	}
+	return sbuf.st_size;
+}
+
+static int
+cow_read_header(int fd, struct cow_header *hdr)
+{
+	int err;
+
+	err = cow_pread(fd, hdr, sizeof(*hdr), 0);
+	if (err)
+		return err;
+
+	hdr->magic = le32toh(hdr->magic);
+	hdr->version = le32toh(hdr->version);
+	hdr->size = le64toh(hdr->size);
+	hdr->cluster_bits = le32toh(hdr->cluster_bits);
+	hdr->l1_size = le32toh(hdr->l1_size);
+	hdr->l1_offset = le64toh(hdr->l1_offset);
+	hdr->backing_offset = le64toh(hdr->backing_offset);
+	hdr->backing_len = le32toh(hdr->backing_len);
+	hdr->flags = le32toh(hdr->flags);
+	return hdr->magic == COW_MAGIC ? 0 : EINVAL;
+}
+
+static void
+cow_free(struct cow_image *img)
+{
+	int i;
+
+	if (img->backing)
+		cow_free(img->backing);
+	for (i = 0; i < COW_L2_CACHE; i++)
+		free(img->l2_cache[i].table);
+	free(img->cbuf);
+	free(img->l1);
+	if (img->bcache)
+		bcache_close(img->bcache);
+	if (img->fd >= 0)
+		close(img->fd);
+	pthread_mutex_destroy(&img->mtx);
+	free(img);
+}
+
+/* Backing paths which are not absolute are relative to the image */
+static int
+cow_backing_path(const char *path, const char *backing, char *buf)
+{
+	const char *slash;
+	int n;
+
+	slash = strrchr(path, '/');
+	if (backing[0] == '/' || slash == NULL)
+		n = snprintf(buf, PATH_MAX, "%s", backing);
+	else
+		n = snprintf(buf, PATH_MAX, "%.*s/%s", (int)(slash - path),
+			     path, backing);
+	return n < PATH_MAX ? 0 : ENAMETOOLONG;
+}
+
+static int
+cow_load(struct cow_image *img, const char *path, struct cow_header *hdr,
+	 int depth, size_t cache_mb);
+
+/*
+ * Open 'path' as a CoW image, or as a raw file if 'raw' is set.
+ */
+static struct cow_image *
+cow_open_chain(const char *path, bool raw, bool ro, bool sync, int depth,
+	       size_t cache_mb)
+{
+	struct cow_image *img;
+	struct cow_header hdr;
+	int flags;
+
+	img = calloc(1, sizeof(struct cow_image));
+	if (img == NULL)
+		return NULL;
+	pthread_mutex_init(&img->mtx, NULL);
+	img->ro = ro;
+	img->sync = sync;
+
+	flags = ro ? O_RDONLY : O_RDWR;
+	if (sync)
+		flags |= O_DSYNC;
+	img->fd = open(path, flags);
+	if (img->fd < 0) {
+		WPRINTF(("block_cow: could not open %s, errno %d\n",
+			 path, errno));
+		goto err;
+	}
+
+	if (raw) {
+		img->raw = true;
+		img->size = cow_raw_size(img->fd);
+		if (img->size < 0)
+			goto err;
+		if (cache_mb)
+			img->bcache = bcache_open(img->fd, cache_mb);
+		return img;
+	}
+
+	if (cow_read_header(img->fd, &hdr) != 0) {
+		WPRINTF(("block_cow: %s is not a CoW image\n", path));
+		goto err;
+	}
+	if (cow_load(img, path, &hdr, depth, cache_mb) != 0)
+		goto err;
+	return img;
+
+err:
+	cow_free(img);
+	return NULL;
+}
+
+static int
+cow_load(struct cow_image *img, const char *path, struct cow_header *hdr,
+	 int depth, size_t cache_mb)
+{
+	char *bpath, bname[PATH_MAX];
+	uint64_t l2_span;
+	off_t fsize;
+	uint32_t i;
+
+	if (hdr->version != COW_VERSION ||
+	    hdr->cluster_bits < COW_CLUSTER_BITS_MIN ||
+	    hdr->cluster_bits > COW_CLUSTER_BITS_MAX ||
+	    hdr->backing_len >= PATH_MAX) {
+		WPRINTF(("block_cow: %s: unsupported image\n", path));
+		return EINVAL;
+	}
+
+	img->size = hdr->size;
+	img->cluster_bits = hdr->cluster_bits;
+	img->cluster_size = 1U << hdr->cluster_bits;
+	img->l2_bits = hdr->cluster_bits - 3;
+	img->l1_size = hdr->l1_size;
+	img->l1_offset = hdr->l1_offset;
+
+	l2_span = (uint64_t)img->cluster_size << img->l2_bits;
+	if (img->l1_size < howmany(img->size, l2_span)) {
+		WPRINTF(("block_cow: %s: L1 table too small\n", path));
+		return EINVAL;
+	}
+
+	img->l1 = calloc(img->l1_size, sizeof(uint64_t));
+	img->cbuf = malloc(img->cluster_size);
+	if (img->l1 == NULL || img->cbuf == NULL)
+		return ENOMEM;
+	if (cow_pread(img->fd, img->l1, img->l1_size * sizeof(uint64_t),
+		      img->l1_offset) != 0)
+		return EIO;
+	for (i = 0; i < img->l1_size; i++)
+		img->l1[i] = le64toh(img->l1[i]);
+
+	fsize = cow_raw_size(img->fd);
+	if (fsize < 0)
+		return errno;
+	img->next_free = roundup(fsize, img->cluster_size);
+
+	if (hdr->backing_len == 0)
+		return 0;
+
+	if (depth + 1 >= COW_CHAIN_MAX) {
+		WPRINTF(("block_cow: %s: backing chain too long\n", path));
+		return ELOOP;
+	}
+	bpath = calloc(1, hdr->backing_len + 1);
+	if (bpath == NULL)
+		return ENOMEM;
+	if (cow_pread(img->fd, bpath, hdr->backing_len,
+		      hdr->backing_offset) != 0 ||
+	    cow_backing_path(path, bpath, bname) != 0) {
+		free(bpath);
+		return EIO;
+	}
+	free(bpath);
+
+	img->backing = cow_open_chain(bname,
+				      !(hdr->flags & COW_F_BACKING_COW),
+				      true, false, depth + 1, cache_mb);
+	return img->backing ? 0 : EIO;
+}
+
+/*
+ * With 'cache_mb', raw backing files are read through the shared cache.
+ */
+struct cow_image *
+cow_open(const char *path, bool ro, bool sync, size_t cache_mb)
+{
+	return cow_open_chain(path, false, ro, sync, 0, cache_mb);
+}
+
+void
+cow_close(struct cow_image *img)
+{
+	cow_free(img);
+}
+
+int
+cow_fd(struct cow_image *img)
+{
+	return img->fd;
+}
+
+off_t
+cow_size(struct cow_image *img)
+{
+	return img->size;
+}
+
+/*
+ * Create an empty image on top of 'backing', with the same size.
+ * 'backing_cow' tells whether the backing file is a CoW image or raw.
+ */
+int
+cow_create(const char *path, const char *backing, bool backing_cow)
+{
+	struct cow_image *base;
+	struct cow_header hdr;
+	char bname[PATH_MAX];
+	uint64_t size, l2_span;
+	uint32_t cs, len;
+	int fd, err;
+
+	if (realpath(backing, bname) == NULL)
+		return errno;
+	len = strlen(bname);
+
+	base = cow_open_chain(bname, !backing_cow, true, false, 1, 0);
+	if (base == NULL)
+		return EINVAL;
+	size = base->size;
+	cow_free(base);
+
+	cs = 1U << COW_CLUSTER_BITS;
+	if (sizeof(hdr) + len > cs)
+		return ENAMETOOLONG;
+	l2_span = (uint64_t)cs << (COW_CLUSTER_BITS - 3);
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = htole32(COW_MAGIC);
+	hdr.version = htole32(COW_VERSION);
+	hdr.size = htole64(size);
+	hdr.cluster_bits = htole32(COW_CLUSTER_BITS);
+	hdr.l1_size = htole32(howmany(size, l2_span));
+	hdr.l1_offset = htole64(cs);
+	hdr.backing_offset = htole64(sizeof(hdr));
+	hdr.backing_len = htole32(len);
+	hdr.flags = htole32(backing_cow ? COW_F_BACKING_COW : 0);
+
+	fd = open(path, O_RDWR | O_CREAT | O_EXCL, 0644);
+	if (fd < 0)
+		return errno;
+
+	err = cow_pwrite(fd, &hdr, sizeof(hdr), 0);
+	if (!err)
+		err = cow_pwrite(fd, bname, len, sizeof(hdr));
+	if (!err && ftruncate(fd, cs + roundup(howmany(size, l2_span) *
+				sizeof(uint64_t), cs)) < 0)
+		err = errno;
+	if (!err && fsync(fd) < 0)
+		err = errno;
+	close(fd);
+
+	if (err)
+		unlink(path);
+	return err;
+}
+
+/*
+ * Return the L2 table for 'l1_idx', reading it in the cache if needed.
+ * If it is not allocated, return NULL, or allocate it if 'alloc' is set.
+ * Called with img->mtx held.
+ */
+static uint64_t *
+cow_get_l2(struct cow_image *img, uint32_t l1_idx, bool alloc, int *errp)
+{
+	struct cow_l2 *slot, *victim;
+	uint64_t off, le;
+	bool fresh;
+	int i, err;
+
+	*errp = 0;
+	victim = &img->l2_cache[0];
+	for (i = 0; i < COW_L2_CACHE; i++) {
+		slot = &img->l2_cache[i];
+		if (slot->table && slot->l1_idx == l1_idx) {
+			slot->lru = ++img->lru_clock;
+			return slot->table;
+		}
+		if (victim->table && (!slot->table || slot->lru < victim->lru))
+			victim = slot;
+	}
+
+	fresh = false;
+	if (img->l1[l1_idx] == 0) {
+		if (!alloc)
+			return NULL;
+
+		off = img->next_free;
+		if (ftruncate(img->fd, off + img->cluster_size) < 0) {
+			*errp = errno;
+			return NULL;
+		}
+		img->next_free += img->cluster_size;
+		le = htole64(off);
+		err = cow_pwrite(img->fd, &le, sizeof(le),
+				 img->l1_offset + l1_idx * sizeof(uint64_t));
+		if (err) {
+			*errp = err;
+			return NULL;
+		}
+		img->l1[l1_idx] = off;
+		fresh = true;
+	}
+
+	if (victim->table == NULL) {
+		victim->table = malloc(img->cluster_size);
+		if (victim->table == NULL) {
+			*errp = ENOMEM;
+			return NULL;
+		}
+	}
+	victim->l1_idx = l1_idx;
+	victim->lru = ++img->lru_clock;
+
+	if (fresh) {
+		memset(victim->table, 0, img->cluster_size);
+		return victim->table;
+	}
+
+	err = cow_pread(img->fd, victim->table, img->cluster_size,
+			img->l1[l1_idx]);
+	if (err) {
+		free(victim->table);
+		victim->table = NULL;
+		*errp = err;
+		return NULL;
+	}
+	for (i = 0; i < (1 << img->l2_bits); i++)
+		victim->table[i] = le64toh(victim->table[i]);
+	return victim->table;
+}
+
+/*
+ * Image offset of a virtual cluster, 0 if not allocated.
+ * Called with img->mtx held.
+ */
+static int
+cow_lookup(struct cow_image *img, uint64_t vcl, uint64_t *hostp)
+{
+	uint64_t l1_idx, *l2;
+	int err;
+
+	*hostp = 0;
+	l1_idx = vcl >> img->l2_bits;
+	if (l1_idx >= img->l1_size)
+		return 0;
+	l2 = cow_get_l2(img, l1_idx, false, &err);
+	if (l2 != NULL)
+		*hostp = l2[vcl & ((1U << img->l2_bits) - 1)];
+	return err;
+}
+
+/*
+ * Find the run of clusters from the one at 'voff' which are either all
+ * unallocated, or allocated contiguously in the image, up to 'max' bytes.
+ * Called with img->mtx held.
+ */
+static int
+cow_extent(struct cow_image *img, off_t voff, size_t max, uint64_t *hostp,
+	   size_t *lenp)
+{
+	uint64_t vcl, host, next, k;
+	size_t len;
+	int err;
+
+	vcl = voff >> img->cluster_bits;
+	err = cow_lookup(img, vcl, &host);
+	if (err)
+		return err;
+
+	len = img->cluster_size - (voff & (img->cluster_size - 1));
+	for (k = 1; len < max; k++) {
+		err = cow_lookup(img, vcl + k, &next);
+		if (err)
+			return err;
+		if (next != (host ? host + (k << img->cluster_bits) : 0))
+			break;
+		len += img->cluster_size;
+	}
+
+	*hostp = host ? host + (voff & (img->cluster_size - 1)) : 0;
+	*lenp = MIN(len, max);
+	return 0;
+}
+
+static int
+cow_read(struct cow_image *img, const struct iovec *iov, int iovcnt,
+	 off_t off)
+{
+	struct iovec *sl;
+	uint64_t host;
+	size_t pos, len, total;
+	int n, err;
+
+	if (img->raw && img->bcache)
+		return bcache_readv(img->bcache, iov, iovcnt, off);
+	if (img->raw)
+		return cow_rwv(img->fd, iov, iovcnt, off, false);
+
+	sl = malloc(iovcnt * sizeof(struct iovec));
+	if (sl == NULL)
+		return ENOMEM;
+
+	err = 0;
+	total = iov_len(iov, iovcnt);
+	for (pos = 0; pos < total; pos += len) {
+		pthread_mutex_lock(&img->mtx);
+		err = cow_extent(img, off + pos, total - pos, &host, &len);
+		pthread_mutex_unlock(&img->mtx);
+		if (err)
+			break;
+
+		n = iov_slice(iov, iovcnt, pos, len, sl);
+		if (host != 0)
+			err = cow_rwv(img->fd, sl, n, host, false);
+		else if (img->backing != NULL)
+			err = cow_read(img->backing, sl, n, off + pos);
+		else
+			iov_zero(sl, n);
+		if (err)
+			break;
+	}
+
+	free(sl);
+	return err;
+}
+
+/*
+ * Allocate the cluster 'vcl' and fill it with the old data overlaid
+ * with 'len' bytes at 'coff' from 'iov'.
+ * Called with img->mtx held, which serializes the allocations.
+ */
+static int
+cow_alloc(struct cow_image *img, uint64_t vcl, const struct iovec *iov,
+	  int iovcnt, size_t coff, size_t len)
+{
+	struct iovec old;
+	uint64_t *l2, host, le, l2_idx;
+	int err;
+
+	l2 = cow_get_l2(img, vcl >> img->l2_bits, true, &err);
+	if (l2 == NULL)
+		return err;
+	l2_idx = vcl & ((1U << img->l2_bits) - 1);
+
+	if (len < img->cluster_size) {
+		if (img->backing != NULL) {
+			old.iov_base = img->cbuf;
+			old.iov_len = img->cluster_size;
+			err = cow_read(img->backing, &old, 1,
+				       vcl << img->cluster_bits);
+			if (err)
+				return err;
+		} else
+			memset(img->cbuf, 0, img->cluster_size);
+	}
+	iov_to_buf(iov, iovcnt, img->cbuf + coff);
+
+	host = img->next_free;
+	err = cow_pwrite(img->fd, img->cbuf, img->cluster_size, host);
+	if (err)
+		return err;
+	img->next_free += img->cluster_size;
+
+	/* without O_DSYNC, the data must be stable before the L2 entry */
+	if (!img->sync && fdatasync(img->fd) < 0)
+		return errno;
+
+	le = htole64(host);
+	err = cow_pwrite(img->fd, &le, sizeof(le),
+			 img->l1[vcl >> img->l2_bits] +
+			 l2_idx * sizeof(uint64_t));
+	if (err)
+		return err;
+	l2[l2_idx] = host;
+	return 0;
+}
+
+static int
+cow_write(struct cow_image *img, const struct iovec *iov, int iovcnt,
+	  off_t off)
+{
+	struct iovec *sl;
+	uint64_t host;
+	size_t pos, len, total, coff;
+	int n, err;
+
+	if (img->ro)
+		return EROFS;
+
+	sl = malloc(iovcnt * sizeof(struct iovec));
+	if (sl == NULL)
+		return ENOMEM;
+
+	err = 0;
+	total = iov_len(iov, iovcnt);
+	for (pos = 0; pos < total; pos += len) {
+		pthread_mutex_lock(&img->mtx);
+		err = cow_extent(img, off + pos, total - pos, &host, &len);
+		if (err) {
+			pthread_mutex_unlock(&img->mtx);
+			break;
+		}
+
+		if (host != 0) {
+			pthread_mutex_unlock(&img->mtx);
+			n = iov_slice(iov, iovcnt, pos, len, sl);
+			err = cow_rwv(img->fd, sl, n, host, true);
+		} else {
+			/* one cluster at a time */
+			coff = (off + pos) & (img->cluster_size - 1);
+			len = MIN(len, img->cluster_size - coff);
+			n = iov_slice(iov, iovcnt, pos, len, sl);
+			err = cow_alloc(img, (off + pos) >> img->cluster_bits,
+					sl, n, coff, len);
+			pthread_mutex_unlock(&img->mtx);
+		}
+		if (err)
+			break;
+	}
+
+	free(sl);
+	return err;
+}
+
+int
+cow_readv(struct cow_image *img, const struct iovec *iov, int iovcnt,
+	  off_t off)
+{
+	return cow_read(img, iov, iovcnt, off);
+}
+
+int
+cow_writev(struct cow_image *img, const struct iovec *iov, int iovcnt,
+	   off_t off)
+{
+	return cow_write(img, iov, iovcnt, off);
+}
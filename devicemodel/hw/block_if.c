@@ -31,14 +31,22 @@
 #include <sys/queue.h>
 #include <sys/stat.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
 #include <linux/fs.h>
+#include <linux/aio_abi.h>
+#include <linux/io_uring.h>
 #include <errno.h>
 #include <assert.h>
 #include <err.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdbool.h>
 #include <string.h>
+#include <time.h>
 #include <pthread.h>
 #include <signal.h>
 #include <sysexits.h>
@@ -46,7 +54,11 @@
 
 #include "dm.h"
 #include "mevent.h"
+#include "monitor.h"
 #include "block_if.h"
+#include "block_cow.h"
+#include "block_cache.h"
+#include "block_trace.h"
 #include "ahci.h"
 
 /*
@@ -66,6 +78,27 @@
 #define BLOCKIF_NUMTHR	8
 #define BLOCKIF_MAXREQ	(64 + BLOCKIF_NUMTHR)
 
+/* size of the O_DIRECT bounce buffers, one per blockif thread */
+#define BLOCKIF_BOUNCE_SZ	(256 * 1024)
+
+/* iovecs per write when zeroing by hand, of 64KB each */
+#define BLOCKIF_ZERO_IOV	16
+
+/* default size of the shared read cache */
+#define BLOCKIF_CACHE_MB	256
+
+/* Default boot trace length, in seconds */
+#define BLOCKIF_TRACE_SECS	30
+
+/* ring size of the async engines, a power of 2 >= BLOCKIF_MAXREQ */
+#define BLOCKIF_AIO_DEPTH	128
+
+/* buckets of the in-flight offset hashes, a power of 2 */
+#define BLOCKIF_HASHSZ		64
+
+/* max size of contiguous requests merged into one */
+#define BLOCKIF_MERGE_MAX	(1024 * 1024)
+
 /*
  * Debug printf
  */
@@ -77,7 +110,8 @@ enum blockop {
 	BOP_READ,
 	BOP_WRITE,
 	BOP_FLUSH,
-	BOP_DELETE
+	BOP_DELETE,
+	BOP_ZERO
 };
 
 enum blockstat {
@@ -90,18 +124,89 @@ enum blockstat {
 
 struct blockif_elem {
 	TAILQ_ENTRY(blockif_elem) link;
+	TAILQ_ENTRY(blockif_elem) rlink;	/* in readyq while BST_PEND,
+						 * in flushq while BST_BUSY */
+	LIST_ENTRY(blockif_elem) shash;	/* by start offset, while pending */
+	LIST_ENTRY(blockif_elem) ehash;	/* by end offset, until complete */
 	struct blockif_req  *req;
 	enum blockop	     op;
 	enum blockstat	     status;
 	pthread_t            tid;
 	off_t		     block;
+	int		     noaio;	/* async engine refused it */
+	struct iocb	     iocb;	/* for the native aio engine */
+	struct blockif_elem *merged;	/* next request merged into this one */
+	struct iovec	    *miov;	/* iovecs of all the merged requests */
+	int		     miovcnt;
+};
+
+enum blockif_aio {
+	BLOCKIF_AIO_THREADS,
+	BLOCKIF_AIO_URING,
+	BLOCKIF_AIO_NATIVE
+};
+
+struct blockif_ctxt;
+
+/*
+ * Asynchronous engine. Requests are queued under bc->mtx, then the whole
+ * batch is submitted at once. Completions are reaped under bc->mtx too.
+ */
+struct blockif_engine {
+	const char	*name;
+	uint32_t	ops;	/* (1 << BOP_*) handled by the engine */
+	int	(*init)(struct blockif_ctxt *bc);
+	void	(*deinit)(struct blockif_ctxt *bc);
+	void	(*queue)(struct blockif_ctxt *bc, struct blockif_elem *be);
+	int	(*submit)(struct blockif_ctxt *bc, int n);
+	int	(*reap)(struct blockif_ctxt *bc, bool wait,
+			struct blockif_elem **bep, ssize_t *res, int max);
+};
+
+struct blockif_uring {
+	int			fd;
+	unsigned int		*sq_head;
+	unsigned int		*sq_tail;
+	unsigned int		sq_mask;
+	unsigned int		*sq_array;
+	unsigned int		*cq_head;
+	unsigned int		*cq_tail;
+	unsigned int		cq_mask;
+	struct io_uring_sqe	*sqes;
+	struct io_uring_cqe	*cqes;
+	void			*sq_ring;
+	void			*cq_ring;
+	size_t			sq_ring_sz;
+	size_t			cq_ring_sz;
+};
+
+/*
+ * Token bucket: 'rate' tokens a second, up to 'burst'. A request may go
+ * if the bucket isn't empty, and may leave it in debt.
+ */
+struct blockif_tb {
+	uint64_t		rate;		/* 0 if unlimited */
+	uint64_t		burst;
+	double			tokens;
+};
+
+/* I/O limits of an image, shared by its blockif and their clones */
+struct blockif_limits {
+	pthread_mutex_t		mtx;
+	struct blockif_tb	iops;
+	struct blockif_tb	bps;
+	uint64_t		last;		/* last refill, in ns */
 };
 
 struct blockif_ctxt {
 	int			magic;
+	struct blockif_ctxt	*parent;	/* NULL unless a clone */
+	int			cpu;		/* threads run on, or -1 */
 	int			fd;
+	struct cow_image	*cow;	/* NULL unless a CoW image */
+	struct bcache		*bcache; /* shared read cache, if any */
+	struct btrace		*btrace; /* boot I/O trace, if any */
 	int			isblk;
-	int			isgeom;
 	int			candelete;
 	int			rdonly;
 	off_t			size;
@@ -111,20 +216,59 @@ struct blockif_ctxt {
 	int			sectsz;
 	int			psectsz;
 	int			psectoff;
+	int			direct;		/* opened with O_DIRECT */
+	int			dio_align;	/* host physical sector size */
+	int			writeback;	/* page cache, flushed by guest */
 	int			closing;
 	pthread_t		btid[BLOCKIF_NUMTHR];
+	int			nthr;
 	pthread_mutex_t		mtx;
 	pthread_cond_t		cond;
 
-	/* Request elements and free/pending/busy queues */
+	/* Async engine, NULL if all requests go to the blockif threads */
+	const struct blockif_engine *engine;
+	int			aio_efd;
+	struct mevent		*aio_mevp;
+	int			aio_inflight;
+	struct blockif_uring	uring;
+	aio_context_t		aio_ctx;
+	struct iocb		*aio_iocbs[BLOCKIF_MAXREQ];
+	int			aio_nr;
+
+	/* Aligned bounce buffers for misaligned O_DIRECT requests */
+	void			*bounce[BLOCKIF_NUMTHR];
+	int			nbounce;
+	pthread_mutex_t		rmw_mtx;	/* partial sector writes */
+
+	/* I/O limits, and when the requests held back by them may go */
+	struct blockif_limits	*limits;
+	uint64_t		throttle_until;	/* in ns, 0 if not throttled */
+
+	char			ident[16];
+	LIST_ENTRY(blockif_ctxt) list;	/* in blockif_list */
+
+	/* Flushes waiting for the next fdatasync, and one is running */
+	TAILQ_HEAD(, blockif_elem) flushq;
+	int			syncing;
+
+	/* Request elements and free/pending/ready/busy queues */
 	TAILQ_HEAD(, blockif_elem) freeq;
 	TAILQ_HEAD(, blockif_elem) pendq;
+	TAILQ_HEAD(, blockif_elem) readyq;
 	TAILQ_HEAD(, blockif_elem) busyq;
 	struct blockif_elem	reqs[BLOCKIF_MAXREQ];
+
+	/* Read/write/delete requests by start offset and end offset */
+	LIST_HEAD(, blockif_elem) shash[BLOCKIF_HASHSZ];
+	LIST_HEAD(, blockif_elem) ehash[BLOCKIF_HASHSZ];
 };
 
 static pthread_once_t blockif_once = PTHREAD_ONCE_INIT;
 
+/* All the open blockifs, for the monitor */
+static LIST_HEAD(, blockif_ctxt) blockif_list;
+static pthread_mutex_t blockif_list_mtx = PTHREAD_MUTEX_INITIALIZER;
+
 struct blockif_sig_elem {
 	pthread_mutex_t			mtx;
 	pthread_cond_t			cond;
@@ -134,9 +278,63 @@ struct blockif_sig_elem {
 
 static struct blockif_sig_elem *blockif_bse_head;
 
+/*
+ * O_DIRECT needs the buffers and the offset aligned on the sector size of
+ * the host device, which may be larger than the emulated one.
+ */
+static bool
+blockif_aligned(struct blockif_ctxt *bc, const struct iovec *iov, int iovcnt,
+		off_t off)
+{
+	int i;
+
+	if ((off + bc->sub_file_start_lba) & (bc->dio_align - 1))
+		return false;
+
+	for (i = 0; i < iovcnt; i++) {
+		if (((uintptr_t)iov[i].iov_base | iov[i].iov_len) &
+		    (bc->dio_align - 1))
+			return false;
+	}
+	return true;
+}
+
+/*
+ * Whether a request the async engine takes must go to the blockif threads
+ * instead: the engines use the guest buffers as they are, and the kernel
+ * fails writes to a read-only image with EBADF, where the threads return
+ * EROFS.
+ */
+static bool
+blockif_noaio(struct blockif_ctxt *bc, struct blockif_req *breq,
+	      enum blockop op)
+{
+	if (bc->rdonly && op != BOP_READ && op != BOP_FLUSH)
+		return true;
+	return bc->direct &&
+		!blockif_aligned(bc, breq->iov, breq->iovcnt, breq->offset);
+}
+
+static inline int
+blockif_hash(off_t off)
+{
+	return ((off >> 9) ^ (off >> 15)) & (BLOCKIF_HASHSZ - 1);
+}
+
+static inline void
+blockif_ready(struct blockif_ctxt *bc, struct blockif_elem *be)
+{
+	be->status = BST_PEND;
+	TAILQ_INSERT_TAIL(&bc->readyq, be, rlink);
+}
+
+/*
+ * A request is blocked while another pending or busy one ends where it
+ * starts, so that sequential requests are done in order.
+ */
 static int
 blockif_enqueue(struct blockif_ctxt *bc, struct blockif_req *breq,
-		enum blockop op)
+		enum blockop op, bool noaio)
 {
 	struct blockif_elem *be, *tbe;
 	off_t off;
@@ -148,196 +346,1113 @@ blockif_enqueue(struct blockif_ctxt *bc, struct blockif_req *breq,
 	TAILQ_REMOVE(&bc->freeq, be, link);
 	be->req = breq;
 	be->op = op;
+	be->status = BST_PEND;
+	be->noaio = noaio;
 	switch (op) {
 	case BOP_READ:
 	case BOP_WRITE:
 	case BOP_DELETE:
+	case BOP_ZERO:
 		off = breq->offset;
-		for (i = 0; i < breq->iovcnt; i++)
-			off += breq->iov[i].iov_len;
+		if (op == BOP_DELETE || op == BOP_ZERO)
+			off += breq->resid;	/* no data buffers */
+		else {
+			for (i = 0; i < breq->iovcnt; i++)
+				off += breq->iov[i].iov_len;
+		}
+		be->block = off;
+		if (op == BOP_READ && bc->btrace)
+			btrace_read(bc->btrace, breq->offset,
+				    off - breq->offset);
+
+		LIST_FOREACH(tbe, &bc->ehash[blockif_hash(breq->offset)],
+			     ehash) {
+			if (tbe->block == breq->offset) {
+				be->status = BST_BLOCK;
+				break;
+			}
+		}
+		LIST_INSERT_HEAD(&bc->ehash[blockif_hash(be->block)], be,
+				 ehash);
+		LIST_INSERT_HEAD(&bc->shash[blockif_hash(breq->offset)], be,
+				 shash);
 		break;
 	default:
-		/* off = OFF_MAX; */
-		off = 1 << (sizeof(off_t) - 1);
+		/* flushes are never blocked and never block */
+		be->block = -1;
+		break;
 	}
-	be->block = off;
-	TAILQ_FOREACH(tbe, &bc->pendq, link) {
-		if (tbe->block == breq->offset)
-			break;
+	TAILQ_INSERT_TAIL(&bc->pendq, be, link);
+	if (be->status == BST_PEND)
+		blockif_ready(bc, be);
+	return (be->status == BST_PEND);
+}
+
+/* Is the request for the async engine rather than the blockif threads? */
+static inline bool
+blockif_use_aio(struct blockif_ctxt *bc, struct blockif_elem *be)
+{
+	return bc->engine != NULL && !be->noaio &&
+		(bc->engine->ops & (1U << be->op)) != 0;
+}
+
+static void
+blockif_busy(struct blockif_ctxt *bc, struct blockif_elem *be, pthread_t t)
+{
+	if (be->status == BST_PEND)
+		TAILQ_REMOVE(&bc->readyq, be, rlink);
+	TAILQ_REMOVE(&bc->pendq, be, link);
+	if (be->op != BOP_FLUSH)
+		LIST_REMOVE(be, shash);
+	be->status = BST_BUSY;
+	be->tid = t;
+	TAILQ_INSERT_TAIL(&bc->busyq, be, link);
+}
+
+/* Is 'be' waiting for nothing else than 'prev'? */
+static bool
+blockif_only_after(struct blockif_ctxt *bc, struct blockif_elem *be,
+		   struct blockif_elem *prev)
+{
+	struct blockif_elem *tbe;
+
+	LIST_FOREACH(tbe, &bc->ehash[blockif_hash(be->req->offset)], ehash) {
+		if (tbe != prev && tbe->block == be->req->offset)
+			return false;
 	}
-	if (tbe == NULL) {
-		TAILQ_FOREACH(tbe, &bc->busyq, link) {
-			if (tbe->block == breq->offset)
+	return true;
+}
+
+/*
+ * Merge the pending requests which continue 'be' into it, so they are
+ * done with a single vectored read or write.
+ */
+static void
+blockif_merge(struct blockif_ctxt *bc, struct blockif_elem *be, pthread_t t)
+{
+	struct blockif_elem *chain[BLOCKIF_MAXREQ], *last, *nbe;
+	struct iovec *iov;
+	ssize_t len;
+	int i, n, iovcnt;
+
+	if (be->op != BOP_READ && be->op != BOP_WRITE)
+		return;
+
+	n = 0;
+	last = be;
+	iovcnt = be->req->iovcnt;
+	len = be->block - be->req->offset;
+	for (;;) {
+		LIST_FOREACH(nbe, &bc->shash[blockif_hash(last->block)],
+			     shash) {
+			if (nbe->req->offset == last->block &&
+			    nbe->op == be->op && nbe->noaio == be->noaio)
 				break;
 		}
+		if (nbe == NULL ||
+		    iovcnt + nbe->req->iovcnt > IOV_MAX ||
+		    len + nbe->block - nbe->req->offset > BLOCKIF_MERGE_MAX ||
+		    !blockif_only_after(bc, nbe, last))
+			break;
+
+		chain[n++] = nbe;
+		iovcnt += nbe->req->iovcnt;
+		len += nbe->block - nbe->req->offset;
+		last = nbe;
 	}
-	if (tbe == NULL)
-		be->status = BST_PEND;
-	else
-		be->status = BST_BLOCK;
-	TAILQ_INSERT_TAIL(&bc->pendq, be, link);
-	return (be->status == BST_PEND);
+	if (n == 0)
+		return;
+
+	iov = malloc(iovcnt * sizeof(struct iovec));
+	if (iov == NULL)
+		return;
+
+	be->miov = iov;
+	be->miovcnt = iovcnt;
+	memcpy(iov, be->req->iov, be->req->iovcnt * sizeof(struct iovec));
+	iov += be->req->iovcnt;
+	last = be;
+	for (i = 0; i < n; i++) {
+		nbe = chain[i];
+		blockif_busy(bc, nbe, t);
+		memcpy(iov, nbe->req->iov,
+		       nbe->req->iovcnt * sizeof(struct iovec));
+		iov += nbe->req->iovcnt;
+		last->merged = nbe;
+		last = nbe;
+	}
+}
+
+static uint64_t
+blockif_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void
+blockif_tb_refill(struct blockif_tb *tb, uint64_t ns)
+{
+	if (tb->rate)
+		tb->tokens = MIN(tb->tokens + (double)tb->rate * ns / 1e9,
+				 (double)tb->burst);
+}
+
+/* ns until the bucket isn't empty */
+static uint64_t
+blockif_tb_wait(struct blockif_tb *tb)
+{
+	if (tb->rate == 0 || tb->tokens > 0)
+		return 0;
+	return (uint64_t)((1 - tb->tokens) * 1e9 / tb->rate);
+}
+
+/* Called with lim->mtx held */
+static void
+blockif_tb_charge(struct blockif_limits *lim, struct blockif_elem *be)
+{
+	if (lim->iops.rate)
+		lim->iops.tokens -= 1;
+	if (lim->bps.rate && (be->op == BOP_READ || be->op == BOP_WRITE))
+		lim->bps.tokens -= be->req->resid;
+}
+
+/*
+ * May 'be' go now as far as the I/O limits are concerned? If not, set
+ * when it may. Flushes are never held back.
+ */
+static bool
+blockif_throttle(struct blockif_ctxt *bc, struct blockif_elem *be)
+{
+	struct blockif_limits *lim = bc->limits;
+	uint64_t now, wait;
+
+	if ((lim->iops.rate == 0 && lim->bps.rate == 0) ||
+	    be->op == BOP_FLUSH)
+		return true;
+
+	pthread_mutex_lock(&lim->mtx);
+	now = blockif_now();
+	blockif_tb_refill(&lim->iops, now - lim->last);
+	blockif_tb_refill(&lim->bps, now - lim->last);
+	lim->last = now;
+
+	wait = MAX(blockif_tb_wait(&lim->iops), blockif_tb_wait(&lim->bps));
+	if (wait) {
+		pthread_mutex_unlock(&lim->mtx);
+		bc->throttle_until = now + wait;
+		return false;
+	}
+	bc->throttle_until = 0;
+	blockif_tb_charge(lim, be);
+	pthread_mutex_unlock(&lim->mtx);
+	return true;
+}
+
+/*
+ * Requests are taken in order: when the oldest one is held back by the
+ * I/O limits, so are the ones behind it.
+ */
+static int
+blockif_dequeue(struct blockif_ctxt *bc, pthread_t t, struct blockif_elem **bep,
+		bool aio)
+{
+	struct blockif_limits *lim = bc->limits;
+	struct blockif_elem *be, *mbe;
+
+	TAILQ_FOREACH(be, &bc->readyq, rlink) {
+		if (blockif_use_aio(bc, be) == aio)
+			break;
+	}
+	if (be == NULL || !blockif_throttle(bc, be))
+		return 0;
+	blockif_busy(bc, be, t);
+	blockif_merge(bc, be, t);
+	if (be->merged && (lim->iops.rate || lim->bps.rate)) {
+		pthread_mutex_lock(&lim->mtx);
+		for (mbe = be->merged; mbe != NULL; mbe = mbe->merged)
+			blockif_tb_charge(lim, mbe);
+		pthread_mutex_unlock(&lim->mtx);
+	}
+	*bep = be;
+	return 1;
+}
+
+/*
+ * Release 'be' and the requests merged into it, and unblock the ones
+ * which were waiting for them.
+ */
+static void
+blockif_complete(struct blockif_ctxt *bc, struct blockif_elem *be)
+{
+	struct blockif_elem *tbe, *next;
+
+	free(be->miov);
+	for (; be != NULL; be = next) {
+		next = be->merged;
+
+		if (be->status == BST_DONE || be->status == BST_BUSY)
+			TAILQ_REMOVE(&bc->busyq, be, link);
+		else {
+			if (be->status == BST_PEND)
+				TAILQ_REMOVE(&bc->readyq, be, rlink);
+			TAILQ_REMOVE(&bc->pendq, be, link);
+			if (be->op != BOP_FLUSH)
+				LIST_REMOVE(be, shash);
+		}
+
+		if (be->op != BOP_FLUSH) {
+			LIST_REMOVE(be, ehash);
+			LIST_FOREACH(tbe, &bc->shash[blockif_hash(be->block)],
+				     shash) {
+				if (tbe->req->offset == be->block &&
+				    tbe->status == BST_BLOCK)
+					blockif_ready(bc, tbe);
+			}
+		}
+
+		be->tid = 0;
+		be->status = BST_FREE;
+		be->req = NULL;
+		be->noaio = 0;
+		be->merged = NULL;
+		be->miov = NULL;
+		be->miovcnt = 0;
+		TAILQ_INSERT_TAIL(&bc->freeq, be, link);
+	}
+}
+
+/*
+ * Call the callbacks of 'be' and the requests merged into it, 'len' being
+ * the number of bytes done for all of them.
+ */
+static void
+blockif_finish(struct blockif_elem *be, int err, ssize_t len)
+{
+	struct blockif_req *br;
+	ssize_t n;
+
+	for (; be != NULL; be = be->merged) {
+		br = be->req;
+		n = MIN(len, br->resid);
+		br->resid -= n;
+		len -= n;
+		be->status = BST_DONE;
+		(*br->callback)(br, err);
+	}
+}
+
+/* Copy between 'len' bytes of 'buf' and 'iov', starting 'pos' bytes in */
+static void
+blockif_iov_copy(const struct iovec *iov, int iovcnt, size_t pos,
+		 uint8_t *buf, size_t len, bool to_iov)
+{
+	size_t n;
+	int i;
+
+	for (i = 0; i < iovcnt && pos >= iov[i].iov_len; i++)
+		pos -= iov[i].iov_len;
+
+	for (; i < iovcnt && len > 0; i++) {
+		n = MIN(iov[i].iov_len - pos, len);
+		if (to_iov)
+			memcpy((uint8_t *)iov[i].iov_base + pos, buf, n);
+		else
+			memcpy(buf, (uint8_t *)iov[i].iov_base + pos, n);
+		buf += n;
+		len -= n;
+		pos = 0;
+	}
+}
+
+/*
+ * Do a misaligned O_DIRECT request through a bounce buffer of the pool,
+ * BLOCKIF_BOUNCE_SZ at a time. There are as many buffers as blockif
+ * threads, so there is always one for the caller.
+ *
+ * Each chunk is widened to whole host sectors. Writes which only cover
+ * part of a host sector read it first, serialized with the other partial
+ * writes to the image so that they don't undo each other.
+ */
+static int
+blockif_rw_bounce(struct blockif_ctxt *bc, struct iovec *iovs, int iovcnt,
+		  off_t off, ssize_t resid, int write, ssize_t *donep)
+{
+	pthread_mutex_t *rmw_mtx;
+	uint8_t *buf;
+	off_t pos, start;
+	ssize_t len, alen, head, n;
+	bool partial;
+	int err;
+
+	pthread_mutex_lock(&bc->mtx);
+	assert(bc->nbounce > 0);
+	buf = bc->bounce[--bc->nbounce];
+	pthread_mutex_unlock(&bc->mtx);
+
+	rmw_mtx = bc->parent ? &bc->parent->rmw_mtx : &bc->rmw_mtx;
+	off += bc->sub_file_start_lba;
+	*donep = 0;
+	err = 0;
+	while (*donep < resid) {
+		pos = off + *donep;
+		start = rounddown2(pos, (off_t)bc->dio_align);
+		head = pos - start;
+		len = MIN(resid - *donep, BLOCKIF_BOUNCE_SZ - head);
+		alen = roundup2(head + len, (ssize_t)bc->dio_align);
+		partial = head != 0 || alen != head + len;
+
+		if (write) {
+			if (partial) {
+				pthread_mutex_lock(rmw_mtx);
+				n = pread(bc->fd, buf, alen, start);
+				if (n < 0) {
+					err = errno;
+					pthread_mutex_unlock(rmw_mtx);
+					break;
+				}
+				memset(buf + n, 0, alen - n);
+			}
+			blockif_iov_copy(iovs, iovcnt, *donep, buf + head, len,
+					 false);
+			n = pwrite(bc->fd, buf, alen, start);
+			if (partial)
+				pthread_mutex_unlock(rmw_mtx);
+		} else
+			n = pread(bc->fd, buf, alen, start);
+		if (n < 0) {
+			err = errno;
+			break;
+		}
+		if (n <= head)
+			break;		/* end of file */
+		n = MIN(n - head, len);
+		if (!write)
+			blockif_iov_copy(iovs, iovcnt, *donep, buf + head, n,
+					 true);
+		*donep += n;
+	}
+
+	pthread_mutex_lock(&bc->mtx);
+	bc->bounce[bc->nbounce++] = buf;
+	pthread_mutex_unlock(&bc->mtx);
+	return err;
+}
+
+/*
+ * Read or write 'resid' bytes at 'off' straight from/to the iovecs.
+ * They are passed to the kernel at most IOV_MAX at a time, and short
+ * transfers are resumed where they stopped. Return 0 or an errno, with
+ * the number of bytes done in *donep.
+ */
+static int
+blockif_rwv(struct blockif_ctxt *bc, struct iovec *iovs, int iovcnt, off_t off,
+	    ssize_t resid, int write, ssize_t *donep)
+{
+	struct iovec *iov, save;
+	ssize_t len, voff;
+	int i, cnt, err;
+
+	if (bc->direct && !blockif_aligned(bc, iovs, iovcnt, off))
+		return blockif_rw_bounce(bc, iovs, iovcnt, off, resid, write,
+					 donep);
+
+	off += bc->sub_file_start_lba;
+	*donep = 0;
+	err = 0;
+	i = 0;
+	voff = 0;
+	while (i < iovcnt && *donep < resid) {
+		iov = &iovs[i];
+		cnt = MIN(iovcnt - i, IOV_MAX);
+
+		/* skip the part of the first iovec already done */
+		save = *iov;
+		iov->iov_base = (uint8_t *)iov->iov_base + voff;
+		iov->iov_len -= voff;
+		if (write)
+			len = pwritev(bc->fd, iov, cnt, off);
+		else
+			len = preadv(bc->fd, iov, cnt, off);
+		*iov = save;
+
+		if (len < 0) {
+			err = errno;
+			break;
+		}
+		if (len == 0)
+			break;		/* end of file */
+
+		off += len;
+		*donep += len;
+
+		len += voff;
+		while (i < iovcnt && len >= iovs[i].iov_len) {
+			len -= iovs[i].iov_len;
+			i++;
+		}
+		voff = len;
+	}
+
+	return err;
+}
+
+/* Total bytes to transfer for 'be' and the requests merged into it */
+static ssize_t
+blockif_chain_resid(struct blockif_elem *be)
+{
+	ssize_t resid;
+
+	for (resid = 0; be != NULL; be = be->merged)
+		resid += be->req->resid;
+	return resid;
+}
+
+/* Only read by the kernel, aligned for O_DIRECT */
+static uint8_t blockif_zeros[64 * 1024] __attribute__((aligned(4096)));
+
+/*
+ * Write zeros over 'len' bytes at 'off' when the file can't do it in
+ * place, BLOCKIF_ZERO_IOV times blockif_zeros at a time.
+ */
+static int
+blockif_zero_write(struct blockif_ctxt *bc, off_t off, ssize_t len)
+{
+	struct iovec iov[BLOCKIF_ZERO_IOV];
+	ssize_t n, done;
+	int cnt, err;
+
+	while (len > 0) {
+		n = 0;
+		for (cnt = 0; cnt < BLOCKIF_ZERO_IOV && n < len; cnt++) {
+			iov[cnt].iov_base = blockif_zeros;
+			iov[cnt].iov_len = MIN(sizeof(blockif_zeros), len - n);
+			n += iov[cnt].iov_len;
+		}
+		if (bc->cow) {
+			err = cow_writev(bc->cow, iov, cnt, off);
+			done = n;
+		} else
+			err = blockif_rwv(bc, iov, cnt, off, n, 1, &done);
+		if (err)
+			return err;
+		if (done == 0)
+			return EIO;
+		off += done;
+		len -= done;
+	}
+	return 0;
+}
+
+/*
+ * Discard, or zero if 'zero' is set, 'len' bytes at 'off': in place on
+ * block devices and on files which support it, by writing zeros
+ * otherwise when zeroing.
+ */
+static int
+blockif_discard(struct blockif_ctxt *bc, off_t off, ssize_t len, bool zero)
+{
+	uint64_t arg[2];
+	int mode;
+
+	if (bc->rdonly)
+		return EROFS;
+	if (!zero && !bc->candelete)
+		return EOPNOTSUPP;
+	if (len == 0)
+		return 0;
+
+	if (bc->cow == NULL) {
+		arg[0] = off + bc->sub_file_start_lba;
+		arg[1] = len;
+		if (bc->isblk) {
+			if (ioctl(bc->fd, zero ? BLKZEROOUT : BLKDISCARD,
+				  arg) == 0)
+				return 0;
+		} else {
+			mode = FALLOC_FL_KEEP_SIZE | (zero ?
+				FALLOC_FL_ZERO_RANGE : FALLOC_FL_PUNCH_HOLE);
+			if (fallocate(bc->fd, mode, arg[0], len) == 0)
+				return 0;
+			/* a hole reads as zeros too */
+			if (zero && (errno == EOPNOTSUPP) &&
+			    fallocate(bc->fd, FALLOC_FL_KEEP_SIZE |
+				      FALLOC_FL_PUNCH_HOLE, arg[0], len) == 0)
+				return 0;
+		}
+		if (!zero || (errno != EOPNOTSUPP && errno != ENOTTY &&
+			      errno != EINVAL))
+			return errno;
+	}
+
+	return blockif_zero_write(bc, off, len);
+}
+
+/*
+ * In write-back mode, start writing back what was just written, so that
+ * dirty pages don't pile up until the next flush.
+ */
+static inline void
+blockif_writeback(struct blockif_ctxt *bc, off_t off, ssize_t len)
+{
+	if (bc->writeback && len > 0)
+		sync_file_range(bc->fd, off + bc->sub_file_start_lba, len,
+				SYNC_FILE_RANGE_WRITE);
+}
+
+static void
+blockif_proc(struct blockif_ctxt *bc, struct blockif_elem *be)
+{
+	struct blockif_req *br;
+	struct iovec *iov;
+	ssize_t done;
+	int err, iovcnt;
+
+	br = be->req;
+	err = 0;
+	done = 0;
+	if (be->miov != NULL) {
+		iov = be->miov;
+		iovcnt = be->miovcnt;
+	} else {
+		iov = br->iov;
+		iovcnt = br->iovcnt;
+	}
+	switch (be->op) {
+	case BOP_READ:
+		if (bc->cow) {
+			err = cow_readv(bc->cow, iov, iovcnt, br->offset);
+			done = err ? 0 : blockif_chain_resid(be);
+			break;
+		}
+		if (bc->bcache) {
+			err = bcache_readv(bc->bcache, iov, iovcnt,
+					   br->offset + bc->sub_file_start_lba);
+			done = err ? 0 : blockif_chain_resid(be);
+			break;
+		}
+		err = blockif_rwv(bc, iov, iovcnt, br->offset,
+				  blockif_chain_resid(be), 0, &done);
+		break;
+	case BOP_WRITE:
+		if (bc->rdonly) {
+			err = EROFS;
+			break;
+		}
+		if (bc->cow) {
+			err = cow_writev(bc->cow, iov, iovcnt, br->offset);
+			done = err ? 0 : blockif_chain_resid(be);
+			break;
+		}
+		err = blockif_rwv(bc, iov, iovcnt, br->offset,
+				  blockif_chain_resid(be), 1, &done);
+		blockif_writeback(bc, br->offset, done);
+		break;
+	case BOP_FLUSH:
+		/* see blockif_flush_batch() */
+		if (fdatasync(bc->fd))
+			err = errno;
+		break;
+	case BOP_DELETE:
+	case BOP_ZERO:
+		err = blockif_discard(bc, br->offset, br->resid,
+				      be->op == BOP_ZERO);
+		if (!err)
+			done = br->resid;
+		break;
+	default:
+		err = EINVAL;
+		break;
+	}
+
+	blockif_finish(be, err, done);
+}
+
+/*
+ * io_uring engine, through the raw system calls.
+ */
+static int
+blockif_uring_init(struct blockif_ctxt *bc)
+{
+	struct blockif_uring *ring = &bc->uring;
+	struct io_uring_params p;
+	void *sqes;
+
+	memset(&p, 0, sizeof(p));
+	ring->fd = syscall(__NR_io_uring_setup, BLOCKIF_AIO_DEPTH, &p);
+	if (ring->fd < 0)
+		return -1;
+
+	ring->sq_ring_sz = p.sq_off.array + p.sq_entries * sizeof(uint32_t);
+	ring->cq_ring_sz = p.cq_off.cqes +
+		p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		ring->sq_ring_sz = ring->cq_ring_sz =
+			MAX(ring->sq_ring_sz, ring->cq_ring_sz);
+
+	ring->sq_ring = mmap(NULL, ring->sq_ring_sz, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	if (ring->sq_ring == MAP_FAILED)
+		goto fail;
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		ring->cq_ring = ring->sq_ring;
+	else {
+		ring->cq_ring = mmap(NULL, ring->cq_ring_sz,
+				PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_POPULATE, ring->fd,
+				IORING_OFF_CQ_RING);
+		if (ring->cq_ring == MAP_FAILED)
+			goto fail_sq;
+	}
+
+	sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+			PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			ring->fd, IORING_OFF_SQES);
+	if (sqes == MAP_FAILED)
+		goto fail_cq;
+
+	if (syscall(__NR_io_uring_register, ring->fd,
+			IORING_REGISTER_EVENTFD, &bc->aio_efd, 1) < 0) {
+		munmap(sqes, p.sq_entries * sizeof(struct io_uring_sqe));
+		goto fail_cq;
+	}
+
+	ring->sq_head = ring->sq_ring + p.sq_off.head;
+	ring->sq_tail = ring->sq_ring + p.sq_off.tail;
+	ring->sq_mask = *(unsigned int *)(ring->sq_ring + p.sq_off.ring_mask);
+	ring->sq_array = ring->sq_ring + p.sq_off.array;
+	ring->sqes = sqes;
+	ring->cq_head = ring->cq_ring + p.cq_off.head;
+	ring->cq_tail = ring->cq_ring + p.cq_off.tail;
+	ring->cq_mask = *(unsigned int *)(ring->cq_ring + p.cq_off.ring_mask);
+	ring->cqes = ring->cq_ring + p.cq_off.cqes;
+	return 0;
+
+fail_cq:
+	if (ring->cq_ring != ring->sq_ring)
+		munmap(ring->cq_ring, ring->cq_ring_sz);
+fail_sq:
+	munmap(ring->sq_ring, ring->sq_ring_sz);
+fail:
+	close(ring->fd);
+	return -1;
+}
+
+static void
+blockif_uring_deinit(struct blockif_ctxt *bc)
+{
+	struct blockif_uring *ring = &bc->uring;
+
+	munmap(ring->sqes, (ring->sq_mask + 1) * sizeof(struct io_uring_sqe));
+	if (ring->cq_ring != ring->sq_ring)
+		munmap(ring->cq_ring, ring->cq_ring_sz);
+	munmap(ring->sq_ring, ring->sq_ring_sz);
+	close(ring->fd);
+}
+
+static void
+blockif_uring_queue(struct blockif_ctxt *bc, struct blockif_elem *be)
+{
+	struct blockif_uring *ring = &bc->uring;
+	struct blockif_req *br = be->req;
+	struct io_uring_sqe *sqe;
+	unsigned int tail, idx;
+
+	/* only this thread produces, and the kernel never moves the tail */
+	tail = *ring->sq_tail;
+	idx = tail & ring->sq_mask;
+	sqe = &ring->sqes[idx];
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->fd = bc->fd;
+	sqe->user_data = (uintptr_t)be;
+	switch (be->op) {
+	case BOP_READ:
+	case BOP_WRITE:
+		sqe->opcode = be->op == BOP_READ ? IORING_OP_READV :
+			IORING_OP_WRITEV;
+		if (be->miov != NULL) {
+			sqe->addr = (uintptr_t)be->miov;
+			sqe->len = be->miovcnt;
+		} else {
+			sqe->addr = (uintptr_t)br->iov;
+			sqe->len = br->iovcnt;
+		}
+		sqe->off = br->offset + bc->sub_file_start_lba;
+		break;
+	default:
+		assert(0);
+	}
+
+	ring->sq_array[idx] = idx;
+	__atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+static int
+blockif_uring_submit(struct blockif_ctxt *bc, int n)
+{
+	struct blockif_uring *ring = &bc->uring;
+	int ret;
+
+	do {
+		ret = syscall(__NR_io_uring_enter, ring->fd, n, 0, 0, NULL, 0);
+	} while (ret < 0 && errno == EINTR);
+
+	/*
+	 * The kernel only consumes sqes in io_uring_enter, so take back the
+	 * ones it didn't: they are handed to the blockif thread instead.
+	 */
+	if (ret < n)
+		__atomic_store_n(ring->sq_tail,
+			__atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE),
+			__ATOMIC_RELEASE);
+
+	return ret < 0 ? 0 : ret;
+}
+
+static int
+blockif_uring_reap(struct blockif_ctxt *bc, bool wait,
+		   struct blockif_elem **bep, ssize_t *res, int max)
+{
+	struct blockif_uring *ring = &bc->uring;
+	struct io_uring_cqe *cqe;
+	unsigned int head, tail;
+	int n = 0;
+
+	head = *ring->cq_head;
+	tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+	if (head == tail && wait) {
+		syscall(__NR_io_uring_enter, ring->fd, 0, 1,
+			IORING_ENTER_GETEVENTS, NULL, 0);
+		tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+	}
+
+	for (; head != tail && n < max; head++, n++) {
+		cqe = &ring->cqes[head & ring->cq_mask];
+		bep[n] = (struct blockif_elem *)(uintptr_t)cqe->user_data;
+		res[n] = cqe->res;
+	}
+	__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+
+	return n;
+}
+
+static const struct blockif_engine blockif_uring_engine = {
+	.name	= "io_uring",
+	.ops	= (1U << BOP_READ) | (1U << BOP_WRITE),
+	.init	= blockif_uring_init,
+	.deinit	= blockif_uring_deinit,
+	.queue	= blockif_uring_queue,
+	.submit	= blockif_uring_submit,
+	.reap	= blockif_uring_reap,
+};
+
+/*
+ * Linux native aio engine, through the raw system calls. It is only
+ * really asynchronous with O_DIRECT, which blockif_open uses unless
+ * writeback is set: buffered requests are then done in io_submit().
+ */
+static int
+blockif_native_init(struct blockif_ctxt *bc)
+{
+	bc->aio_ctx = 0;
+	return syscall(__NR_io_setup, BLOCKIF_AIO_DEPTH, &bc->aio_ctx);
+}
+
+static void
+blockif_native_deinit(struct blockif_ctxt *bc)
+{
+	syscall(__NR_io_destroy, bc->aio_ctx);
+}
+
+static void
+blockif_native_queue(struct blockif_ctxt *bc, struct blockif_elem *be)
+{
+	struct blockif_req *br = be->req;
+	struct iocb *iocb = &be->iocb;
+
+	memset(iocb, 0, sizeof(*iocb));
+	iocb->aio_data = (uintptr_t)be;
+	iocb->aio_lio_opcode = be->op == BOP_READ ? IOCB_CMD_PREADV :
+		IOCB_CMD_PWRITEV;
+	iocb->aio_fildes = bc->fd;
+	if (be->miov != NULL) {
+		iocb->aio_buf = (uintptr_t)be->miov;
+		iocb->aio_nbytes = be->miovcnt;
+	} else {
+		iocb->aio_buf = (uintptr_t)br->iov;
+		iocb->aio_nbytes = br->iovcnt;
+	}
+	iocb->aio_offset = br->offset + bc->sub_file_start_lba;
+	iocb->aio_flags = IOCB_FLAG_RESFD;
+	iocb->aio_resfd = bc->aio_efd;
+
+	bc->aio_iocbs[bc->aio_nr++] = iocb;
+}
+
+static int
+blockif_native_submit(struct blockif_ctxt *bc, int n)
+{
+	int ret, done = 0;
+
+	while (done < n) {
+		ret = syscall(__NR_io_submit, bc->aio_ctx, n - done,
+			      &bc->aio_iocbs[done]);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			break;
+		done += ret;
+	}
+
+	bc->aio_nr = 0;
+	return done;
+}
+
+static int
+blockif_native_reap(struct blockif_ctxt *bc, bool wait,
+		    struct blockif_elem **bep, ssize_t *res, int max)
+{
+	struct io_event events[BLOCKIF_MAXREQ];
+	struct timespec ts = { 0, 0 };
+	int i, n;
+
+	n = syscall(__NR_io_getevents, bc->aio_ctx, wait ? 1 : 0,
+		    MIN(max, BLOCKIF_MAXREQ), events, wait ? NULL : &ts);
+	if (n < 0)
+		return 0;
+
+	for (i = 0; i < n; i++) {
+		bep[i] = (struct blockif_elem *)(uintptr_t)events[i].data;
+		res[i] = events[i].res;
+	}
+	return n;
+}
+
+static const struct blockif_engine blockif_native_engine = {
+	.name	= "native",
+	.ops	= (1U << BOP_READ) | (1U << BOP_WRITE),
+	.init	= blockif_native_init,
+	.deinit	= blockif_native_deinit,
+	.queue	= blockif_native_queue,
+	.submit	= blockif_native_submit,
+	.reap	= blockif_native_reap,
+};
+
+/*
+ * Put back a busy request and the ones merged into it at the head of the
+ * pending queue, for the blockif threads. The merged ones wait for their
+ * predecessor again.
+ */
+static void
+blockif_unmerge(struct blockif_ctxt *bc, struct blockif_elem *be)
+{
+	struct blockif_elem *chain[BLOCKIF_MAXREQ];
+	int i, n;
+
+	free(be->miov);
+	be->miov = NULL;
+	be->miovcnt = 0;
+	for (n = 0; be != NULL; be = be->merged)
+		chain[n++] = be;
+
+	for (i = n - 1; i >= 0; i--) {
+		be = chain[i];
+		TAILQ_REMOVE(&bc->busyq, be, link);
+		be->merged = NULL;
+		be->noaio = 1;
+		be->tid = 0;
+		TAILQ_INSERT_HEAD(&bc->pendq, be, link);
+		if (be->op != BOP_FLUSH)
+			LIST_INSERT_HEAD(&bc->shash[blockif_hash(be->req->offset)],
+					 be, shash);
+		if (i == 0) {
+			be->status = BST_PEND;
+			TAILQ_INSERT_HEAD(&bc->readyq, be, rlink);
+		} else
+			be->status = BST_BLOCK;
+	}
+}
+
+/*
+ * Submit all the pending requests for the async engine in one batch.
+ * Called with bc->mtx held.
+ */
+static void
+blockif_aio_submit(struct blockif_ctxt *bc)
+{
+	struct blockif_elem *be, *batch[BLOCKIF_MAXREQ];
+	int i, n, done;
+
+	n = 0;
+	while (blockif_dequeue(bc, 0, &be, true)) {
+		(*bc->engine->queue)(bc, be);
+		batch[n++] = be;
+	}
+	/* the blockif thread resubmits when the I/O limits allow it */
+	if (bc->throttle_until)
+		pthread_cond_signal(&bc->cond);
+	if (n == 0)
+		return;
+
+	done = (*bc->engine->submit)(bc, n);
+	bc->aio_inflight += done;
+	if (done == n)
+		return;
+
+	/* let the blockif thread do what the kernel didn't take */
+	WPRINTF(("block_if: %s submit failed, errno %d\n",
+		 bc->engine->name, errno));
+	for (i = n - 1; i >= done; i--)
+		blockif_unmerge(bc, batch[i]);
+	pthread_cond_signal(&bc->cond);
+}
+
+/*
+ * Complete the requests the async engine is done with. Callbacks are
+ * called without bc->mtx held, as for the blockif threads.
+ */
+static void
+blockif_aio_reap(struct blockif_ctxt *bc, bool wait)
+{
+	struct blockif_elem *done[BLOCKIF_MAXREQ];
+	ssize_t res[BLOCKIF_MAXREQ];
+	int i, n;
+
+	pthread_mutex_lock(&bc->mtx);
+	n = (*bc->engine->reap)(bc, wait, done, res, BLOCKIF_MAXREQ);
+	bc->aio_inflight -= n;
+	pthread_mutex_unlock(&bc->mtx);
+
+	for (i = 0; i < n; i++) {
+		if (res[i] < 0)
+			blockif_finish(done[i], -res[i], 0);
+		else {
+			if (done[i]->op == BOP_WRITE)
+				blockif_writeback(bc, done[i]->req->offset,
+						  res[i]);
+			blockif_finish(done[i], 0, res[i]);
+		}
+	}
+
+	if (n == 0)
+		return;
+
+	pthread_mutex_lock(&bc->mtx);
+	for (i = 0; i < n; i++)
+		blockif_complete(bc, done[i]);
+	/* some blocked requests may be ready now */
+	blockif_aio_submit(bc);
+	pthread_cond_signal(&bc->cond);
+	pthread_mutex_unlock(&bc->mtx);
 }
 
-static int
-blockif_dequeue(struct blockif_ctxt *bc, pthread_t t, struct blockif_elem **bep)
+static void
+blockif_aio_event(int fd, enum ev_type type, void *arg)
 {
-	struct blockif_elem *be;
+	uint64_t cnt;
 
-	TAILQ_FOREACH(be, &bc->pendq, link) {
-		if (be->status == BST_PEND)
-			break;
-		assert(be->status == BST_BLOCK);
-	}
-	if (be == NULL)
-		return 0;
-	TAILQ_REMOVE(&bc->pendq, be, link);
-	be->status = BST_BUSY;
-	be->tid = t;
-	TAILQ_INSERT_TAIL(&bc->busyq, be, link);
-	*bep = be;
-	return 1;
+	if (read(fd, &cnt, sizeof(cnt)) < 0 && errno != EAGAIN)
+		WPRINTF(("block_if: eventfd read failed, errno %d\n", errno));
+
+	blockif_aio_reap(arg, false);
 }
 
+/*
+ * Set up the requested async engine, falling back from io_uring to native
+ * aio, then to the blockif threads only.
+ */
 static void
-blockif_complete(struct blockif_ctxt *bc, struct blockif_elem *be)
+blockif_aio_init(struct blockif_ctxt *bc, enum blockif_aio aio)
 {
-	struct blockif_elem *tbe;
+	bc->engine = NULL;
+	if (aio == BLOCKIF_AIO_THREADS)
+		return;
 
-	if (be->status == BST_DONE || be->status == BST_BUSY)
-		TAILQ_REMOVE(&bc->busyq, be, link);
-	else
-		TAILQ_REMOVE(&bc->pendq, be, link);
-	TAILQ_FOREACH(tbe, &bc->pendq, link) {
-		if (tbe->req->offset == be->block)
-			tbe->status = BST_PEND;
+	bc->aio_efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (bc->aio_efd < 0)
+		return;
+
+	if (aio == BLOCKIF_AIO_URING) {
+		if (blockif_uring_init(bc) == 0)
+			bc->engine = &blockif_uring_engine;
+		else {
+			WPRINTF(("block_if: io_uring not available, "
+				 "using native aio\n"));
+			aio = BLOCKIF_AIO_NATIVE;
+		}
 	}
-	be->tid = 0;
-	be->status = BST_FREE;
-	be->req = NULL;
-	TAILQ_INSERT_TAIL(&bc->freeq, be, link);
+	if (aio == BLOCKIF_AIO_NATIVE) {
+		if (blockif_native_init(bc) == 0)
+			bc->engine = &blockif_native_engine;
+		else
+			WPRINTF(("block_if: native aio not available, "
+				 "using threads\n"));
+	}
+
+	if (bc->engine != NULL) {
+		bc->aio_mevp = mevent_add(bc->aio_efd, EVF_READ,
+					  blockif_aio_event, bc);
+		if (bc->aio_mevp != NULL)
+			return;
+		(*bc->engine->deinit)(bc);
+		bc->engine = NULL;
+	}
+
+	close(bc->aio_efd);
 }
 
 static void
-blockif_proc(struct blockif_ctxt *bc, struct blockif_elem *be, uint8_t *buf)
+blockif_aio_deinit(struct blockif_ctxt *bc)
 {
-	struct blockif_req *br;
-	off_t arg[2];
-	ssize_t clen, len, off, boff, voff;
-	int i, err;
+	if (bc->engine == NULL)
+		return;
+
+	mevent_delete_close(bc->aio_mevp);
+	while (bc->aio_inflight > 0)
+		blockif_aio_reap(bc, true);
+	(*bc->engine->deinit)(bc);
+	bc->engine = NULL;
+}
 
-	br = be->req;
-	if (br->iovcnt <= 1)
-		buf = NULL;
-	err = 0;
-	switch (be->op) {
-	case BOP_READ:
-		if (buf == NULL) {
-			len = preadv(bc->fd, br->iov, br->iovcnt,
-				     br->offset + bc->sub_file_start_lba);
-			if (len < 0)
-				err = errno;
-			else
-				br->resid -= len;
-			break;
-		}
-		i = 0;
-		off = voff = 0;
-		while (br->resid > 0) {
-			len = MIN(br->resid, MAXPHYS);
-			if (pread(bc->fd, buf, len, br->offset +
-			    off + bc->sub_file_start_lba) < 0) {
-				err = errno;
-				break;
-			}
-			boff = 0;
-			do {
-				clen = MIN(len - boff, br->iov[i].iov_len -
-				    voff);
-				memcpy(br->iov[i].iov_base + voff,
-				    buf + boff, clen);
-				if (clen < br->iov[i].iov_len - voff)
-					voff += clen;
-				else {
-					i++;
-					voff = 0;
-				}
-				boff += clen;
-			} while (boff < len);
-			off += len;
-			br->resid -= len;
-		}
-		break;
-	case BOP_WRITE:
-		if (bc->rdonly) {
-			err = EROFS;
-			break;
-		}
-		if (buf == NULL) {
-			len = pwritev(bc->fd, br->iov, br->iovcnt,
-				      br->offset + bc->sub_file_start_lba);
-			if (len < 0)
-				err = errno;
-			else
-				br->resid -= len;
-			break;
-		}
-		i = 0;
-		off = voff = 0;
-		while (br->resid > 0) {
-			len = MIN(br->resid, MAXPHYS);
-			boff = 0;
-			do {
-				clen = MIN(len - boff, br->iov[i].iov_len -
-				    voff);
-				memcpy(buf + boff,
-				    br->iov[i].iov_base + voff, clen);
-				if (clen < br->iov[i].iov_len - voff)
-					voff += clen;
-				else {
-					i++;
-					voff = 0;
-				}
-				boff += clen;
-			} while (boff < len);
-			if (pwrite(bc->fd, buf, len, br->offset +
-			    off + bc->sub_file_start_lba) < 0) {
-				err = errno;
-				break;
-			}
-			off += len;
-			br->resid -= len;
-		}
-		break;
-	case BOP_FLUSH:
-		if (fsync(bc->fd))
-			err = errno;
-		break;
-	case BOP_DELETE:
-		/* only used by AHCI */
-		if (!bc->candelete)
-			err = EOPNOTSUPP;
-		else if (bc->rdonly)
-			err = EROFS;
-		else if (bc->isblk) {
-			arg[0] = br->offset;
-			arg[1] = br->resid;
-			if (ioctl(bc->fd, BLKDISCARD, arg))
-				err = errno;
-			else
-				br->resid = 0;
-		}
-		else
-			err = EOPNOTSUPP;
-		break;
-	default:
-		err = EINVAL;
-		break;
-	}
+/*
+ * Flushes are coalesced: a flush dequeued while an fdatasync runs waits
+ * in the flushq, and the thread running it then does one more fdatasync
+ * for all the flushes which queued up meanwhile. Each flush is thus only
+ * completed by an fdatasync started after it was dequeued, which covers
+ * all the writes completed before it was issued.
+ * Called with bc->mtx held, which is dropped around the fdatasync.
+ */
+static void
+blockif_flush_batch(struct blockif_ctxt *bc, struct blockif_elem *be)
+{
+	TAILQ_HEAD(, blockif_elem) batch;
+	int err;
+
+	TAILQ_INSERT_TAIL(&bc->flushq, be, rlink);
+	if (bc->syncing)
+		return;
 
-	be->status = BST_DONE;
+	bc->syncing = 1;
+	while (!TAILQ_EMPTY(&bc->flushq)) {
+		TAILQ_INIT(&batch);
+		TAILQ_CONCAT(&batch, &bc->flushq, rlink);
+		pthread_mutex_unlock(&bc->mtx);
+
+		err = fdatasync(bc->fd) ? errno : 0;
+		TAILQ_FOREACH(be, &batch, rlink)
+			blockif_finish(be, err, 0);
 
-	(*br->callback)(br, err);
+		pthread_mutex_lock(&bc->mtx);
+		while ((be = TAILQ_FIRST(&batch)) != NULL) {
+			TAILQ_REMOVE(&batch, be, rlink);
+			blockif_complete(bc, be);
+		}
+	}
+	bc->syncing = 0;
 }
 
 static void *
@@ -345,33 +1460,43 @@ blockif_thr(void *arg)
 {
 	struct blockif_ctxt *bc;
 	struct blockif_elem *be;
+	struct timespec ts;
 	pthread_t t;
-	uint8_t *buf;
 
 	bc = arg;
-	if (bc->isgeom)
-		buf = malloc(MAXPHYS);
-	else
-		buf = NULL;
 	t = pthread_self();
 
 	pthread_mutex_lock(&bc->mtx);
 	for (;;) {
-		while (blockif_dequeue(bc, t, &be)) {
+		if (bc->engine)
+			blockif_aio_submit(bc);
+		while (blockif_dequeue(bc, t, &be, false)) {
+			if (be->op == BOP_FLUSH) {
+				blockif_flush_batch(bc, be);
+				continue;
+			}
 			pthread_mutex_unlock(&bc->mtx);
-			blockif_proc(bc, be, buf);
+			blockif_proc(bc, be);
 			pthread_mutex_lock(&bc->mtx);
 			blockif_complete(bc, be);
+			if (bc->engine)
+				blockif_aio_submit(bc);
 		}
 		/* Check ctxt status here to see if exit requested */
 		if (bc->closing)
 			break;
-		pthread_cond_wait(&bc->cond, &bc->mtx);
+		/* wait for new requests, or for the I/O limits to allow more */
+		if (bc->throttle_until == 0)
+			pthread_cond_wait(&bc->cond, &bc->mtx);
+		else if (bc->throttle_until > blockif_now()) {
+			ts.tv_sec = bc->throttle_until / 1000000000ULL;
+			ts.tv_nsec = bc->throttle_until % 1000000000ULL;
+			pthread_cond_timedwait(&bc->cond, &bc->mtx, &ts);
+		} else
+			bc->throttle_until = 0;
 	}
 	pthread_mutex_unlock(&bc->mtx);
 
-	if (buf)
-		free(buf);
 	pthread_exit(NULL);
 	return NULL;
 }
@@ -404,10 +1529,124 @@ blockif_sigcont_handler(int signal)
 	}
 }
 
+/*
+ * Set the I/O limits of 'bc' and its clones. A rate of 0 lifts the
+ * limit, a burst of 0 means one second worth of the rate.
+ */
+static void
+blockif_set_limits(struct blockif_ctxt *bc, uint64_t iops, uint64_t iops_burst,
+		   uint64_t bps, uint64_t bps_burst)
+{
+	struct blockif_limits *lim = bc->limits;
+
+	pthread_mutex_lock(&lim->mtx);
+	lim->iops.rate = iops;
+	lim->iops.burst = iops_burst ? iops_burst : iops;
+	lim->iops.tokens = lim->iops.burst;
+	lim->bps.rate = bps;
+	lim->bps.burst = bps_burst ? bps_burst : bps;
+	lim->bps.tokens = lim->bps.burst;
+	lim->last = blockif_now();
+	pthread_mutex_unlock(&lim->mtx);
+}
+
+/* Requests held back by the old limits may go now */
+static void
+blockif_wake(struct blockif_ctxt *bc)
+{
+	pthread_mutex_lock(&bc->mtx);
+	bc->throttle_until = 0;
+	if (bc->engine)
+		blockif_aio_submit(bc);
+	pthread_mutex_unlock(&bc->mtx);
+	pthread_cond_broadcast(&bc->cond);
+}
+
+/* REQ_BLKIO_LIMIT handler, query or change the I/O limits of a device */
+static VMM_MSG_STR(blkio_limit_nodev, "Error: no such block device!");
+
+static void
+blockif_limit_handler(struct vmm_msg *msg, struct msg_sender *sender,
+		      void *priv)
+{
+	struct vmm_msg_blkio_limit *req = (void *)msg;
+	struct vmm_msg_blkio_limit ack;
+	struct blockif_ctxt *bc, *tbc;
+	struct blockif_limits *lim;
+	void *reply;
+	size_t len;
+
+	reply = &blkio_limit_nodev;
+	len = sizeof(blkio_limit_nodev);
+
+	pthread_mutex_lock(&blockif_list_mtx);
+	bc = NULL;
+	if (msg->len >= sizeof(*req)) {
+		LIST_FOREACH(bc, &blockif_list, list) {
+			if (bc->parent == NULL &&
+			    !strncmp(bc->ident, req->ident, sizeof(bc->ident)))
+				break;
+		}
+	}
+	if (bc != NULL) {
+		if (req->set) {
+			blockif_set_limits(bc, req->iops, req->iops_burst,
+					   req->bps, req->bps_burst);
+			LIST_FOREACH(tbc, &blockif_list, list) {
+				if (tbc->limits == bc->limits)
+					blockif_wake(tbc);
+			}
+		}
+
+		lim = bc->limits;
+		ack = *req;
+		ack.vmsg.timestamp = time(NULL);
+		ack.vmsg.len = sizeof(ack);
+		ack.set = 0;
+		pthread_mutex_lock(&lim->mtx);
+		ack.iops = lim->iops.rate;
+		ack.iops_burst = lim->iops.burst;
+		ack.bps = lim->bps.rate;
+		ack.bps_burst = lim->bps.burst;
+		pthread_mutex_unlock(&lim->mtx);
+		reply = &ack;
+		len = sizeof(ack);
+	}
+	pthread_mutex_unlock(&blockif_list_mtx);
+
+	if (write(sender->fd, reply, len) != len)
+		WPRINTF(("block_if: failed to reply to %s\n", sender->name));
+}
+
 static void
 blockif_init(void)
 {
+	struct vmm_msg msg = { .msgid = REQ_BLKIO_LIMIT };
+
 	signal(SIGCONT, blockif_sigcont_handler);
+	LIST_INIT(&blockif_list);
+
+	/* fails if there's no monitor, the limits are then fixed */
+	monitor_register_handler(&msg, blockif_limit_handler, NULL);
+}
+
+/*
+ * Read ahead for a boot trace replay, into whichever cache the guest
+ * reads go through.
+ */
+static int
+blockif_trace_fill(void *arg, off_t off, void *buf, size_t len)
+{
+	struct blockif_ctxt *bc = arg;
+	struct iovec iov = { .iov_base = buf, .iov_len = len };
+
+	if (bc->cow)
+		return cow_readv(bc->cow, &iov, 1, off);
+	if (bc->bcache)
+		return bcache_readv(bc->bcache, &iov, 1,
+				    off + bc->sub_file_start_lba);
+	return posix_fadvise(bc->fd, off + bc->sub_file_start_lba, len,
+			     POSIX_FADV_WILLNEED);
 }
 
 /*
@@ -456,33 +1695,133 @@ sub_file_unlock(struct blockif_ctxt *bc)
 	}
 }
 
+/* Run the threads of 'bc' on its CPU, if it has one */
+static int
+blockif_pin(struct blockif_ctxt *bc)
+{
+	cpu_set_t cpuset;
+	int i, err;
+
+	if (bc->cpu < 0)
+		return 0;
+
+	CPU_ZERO(&cpuset);
+	CPU_SET(bc->cpu, &cpuset);
+	for (i = 0; i < bc->nthr; i++) {
+		err = pthread_setaffinity_np(bc->btid[i], sizeof(cpuset),
+					     &cpuset);
+		if (err) {
+			WPRINTF(("block_if: can't run %s on cpu %d, "
+				 "error %d\n", bc->ident, bc->cpu, err));
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Set up the queues of 'bc', and start its async engine and threads.
+ */
+static void
+blockif_start(struct blockif_ctxt *bc, const char *ident, enum blockif_aio aio)
+{
+	char tname[MAXCOMLEN + 1];
+	pthread_condattr_t cattr;
+	int i;
+
+	pthread_mutex_init(&bc->mtx, NULL);
+	/* throttled threads wait for an absolute CLOCK_MONOTONIC time */
+	pthread_condattr_init(&cattr);
+	pthread_condattr_setclock(&cattr, CLOCK_MONOTONIC);
+	pthread_cond_init(&bc->cond, &cattr);
+	pthread_condattr_destroy(&cattr);
+	TAILQ_INIT(&bc->freeq);
+	TAILQ_INIT(&bc->pendq);
+	TAILQ_INIT(&bc->readyq);
+	TAILQ_INIT(&bc->busyq);
+	TAILQ_INIT(&bc->flushq);
+	for (i = 0; i < BLOCKIF_HASHSZ; i++) {
+		LIST_INIT(&bc->shash[i]);
+		LIST_INIT(&bc->ehash[i]);
+	}
+	for (i = 0; i < BLOCKIF_MAXREQ; i++) {
+		bc->reqs[i].status = BST_FREE;
+		TAILQ_INSERT_HEAD(&bc->freeq, &bc->reqs[i], link);
+	}
+
+	/*
+	 * With an async engine, one thread is enough for the requests it
+	 * doesn't handle.
+	 */
+	blockif_aio_init(bc, aio);
+	bc->nthr = bc->engine ? 1 : BLOCKIF_NUMTHR;
+
+	if (bc->direct) {
+		for (i = 0; i < bc->nthr; i++) {
+			if (posix_memalign(&bc->bounce[i], getpagesize(),
+					   BLOCKIF_BOUNCE_SZ) != 0) {
+				perror("posix_memalign");
+				exit(1);
+			}
+		}
+		bc->nbounce = bc->nthr;
+		pthread_mutex_init(&bc->rmw_mtx, NULL);
+	}
+
+	snprintf(bc->ident, sizeof(bc->ident), "%s", ident);
+	pthread_mutex_lock(&blockif_list_mtx);
+	LIST_INSERT_HEAD(&blockif_list, bc, list);
+	pthread_mutex_unlock(&blockif_list_mtx);
+
+	for (i = 0; i < bc->nthr; i++) {
+		pthread_create(&bc->btid[i], NULL, blockif_thr, bc);
+		snprintf(tname, sizeof(tname), "blk-%s-%d", ident, i);
+		pthread_setname_np(bc->btid[i], tname);
+	}
+	blockif_pin(bc);
+}
 
 struct blockif_ctxt *
 blockif_open(const char *optstr, const char *ident)
 {
-	char tname[MAXCOMLEN + 1];
 	/* char name[MAXPATHLEN]; */
-	char *nopt, *xopts, *cp;
+	char *nopt, *xopts, *cp, *backing;
+	char aioopt[16];
 	struct blockif_ctxt *bc;
+	struct cow_image *cow;
 	struct stat sbuf;
 	/* struct diocgattr_arg arg; */
 	off_t size, psectsz, psectoff;
-	int extra, fd, i, sectsz;
-	int nocache, sync, ro, candelete, geom, ssopt, pssopt;
+	int extra, fd, sectsz, dio_align;
+	int nocache, sync, writeback, ro, candelete, ssopt, pssopt;
+	int cowfmt, backing_cow;
 	long sz;
 	long long b;
+	uint64_t arg[2];
 	int err_code = -1;
 	off_t sub_file_start_lba, sub_file_size;
+	size_t cache_mb;
 	int sub_file_assign;
+	unsigned long long iops, iops_burst, bps, bps_burst;
+	int trace_secs;
+	enum blockif_aio aio;
 
 	pthread_once(&blockif_once, blockif_init);
 
 	fd = -1;
+	cow = NULL;
+	backing = NULL;
+	cache_mb = 0;
 	ssopt = 0;
 	nocache = 0;
 	sync = 0;
+	writeback = 0;
 	ro = 0;
+	cowfmt = backing_cow = 0;
 	sub_file_assign = 0;
+	iops = iops_burst = bps = bps_burst = 0;
+	trace_secs = 0;
+	aio = BLOCKIF_AIO_THREADS;
 
 	/*
 	 * The first element in the optstring is always a pathname.
@@ -501,6 +1840,8 @@ blockif_open(const char *optstr, const char *ident)
 			nocache = 1;
 		else if (!strcmp(cp, "sync") || !strcmp(cp, "direct"))
 			sync = 1;
+		else if (!strcmp(cp, "writeback"))
+			writeback = 1;
 		else if (!strcmp(cp, "ro"))
 			ro = 1;
 		else if (sscanf(cp, "sectorsize=%d/%d", &ssopt, &pssopt) == 2)
@@ -510,15 +1851,57 @@ blockif_open(const char *optstr, const char *ident)
 		else if (sscanf(cp, "range=%ld/%ld", &sub_file_start_lba,
 				&sub_file_size) == 2)
 			sub_file_assign = 1;
-		else {
+		else if (!strcmp(cp, "format=raw"))
+			cowfmt = 0;
+		else if (!strcmp(cp, "format=cow"))
+			cowfmt = 1;
+		else if (!strncmp(cp, "backing=", strlen("backing=")))
+			backing = cp + strlen("backing=");
+		else if (!strcmp(cp, "backing_format=raw"))
+			backing_cow = 0;
+		else if (!strcmp(cp, "backing_format=cow"))
+			backing_cow = 1;
+		else if (!strcmp(cp, "shared_cache"))
+			cache_mb = BLOCKIF_CACHE_MB;
+		else if (sscanf(cp, "shared_cache=%zu", &cache_mb) == 1)
+			;
+		else if (!strcmp(cp, "boot_trace"))
+			trace_secs = BLOCKIF_TRACE_SECS;
+		else if (sscanf(cp, "boot_trace=%d", &trace_secs) == 1)
+			;
+		else if (sscanf(cp, "iops=%llu/%llu", &iops, &iops_burst) >= 1)
+			;
+		else if (sscanf(cp, "bps=%llu/%llu", &bps, &bps_burst) >= 1)
+			;
+		else if (sscanf(cp, "aio=%15s", aioopt) == 1) {
+			if (!strcmp(aioopt, "threads"))
+				aio = BLOCKIF_AIO_THREADS;
+			else if (!strcmp(aioopt, "io_uring"))
+				aio = BLOCKIF_AIO_URING;
+			else if (!strcmp(aioopt, "native"))
+				aio = BLOCKIF_AIO_NATIVE;
+			else {
+				fprintf(stderr, "Invalid aio engine \"%s\"\n",
+					aioopt);
+				goto err;
+			}
+		} else {
 			fprintf(stderr, "Invalid device option \"%s\"\n", cp);
 			goto err;
 		}
 	}
 
-	/* enforce a write-through policy by default */
-	nocache = 1;
-	sync = 1;
+	/*
+	 * Enforce a write-through policy by default. In write-back mode,
+	 * writes go to the page cache and the guest flushes them.
+	 */
+	if (writeback) {
+		nocache = 0;
+		sync = 0;
+	} else {
+		nocache = 1;
+		sync = 1;
+	}
 
 	extra = 0;
 	if (nocache)
@@ -526,11 +1909,50 @@ blockif_open(const char *optstr, const char *ident)
 	if (sync)
 		extra |= O_SYNC;
 
-	fd = open(nopt, (ro ? O_RDONLY : O_RDWR) | extra);
-	if (fd < 0 && !ro) {
-		/* Attempt a r/w fail with a r/o open */
-		fd = open(nopt, O_RDONLY | extra);
-		ro = 1;
+	/*
+	 * Images are only opened as CoW when asked to: the guest could write
+	 * a CoW header naming any host file to sector 0 of a raw image.
+	 */
+	if (backing != NULL && !cowfmt) {
+		fprintf(stderr, "backing needs format=cow\n");
+		goto err;
+	}
+
+	/* create a CoW image on top of the backing file on first use */
+	if (backing != NULL && access(nopt, F_OK) < 0 && errno == ENOENT) {
+		err_code = cow_create(nopt, backing, backing_cow);
+		if (err_code) {
+			fprintf(stderr, "Could not create %s on %s: %s\n",
+				nopt, backing, strerror(err_code));
+			goto err;
+		}
+	}
+
+	if (cowfmt) {
+		if (sub_file_assign) {
+			fprintf(stderr, "range is not supported on CoW images\n");
+			goto err;
+		}
+		/*
+		 * Metadata I/O isn't sector aligned, so no O_DIRECT. The async
+		 * engines can't follow the cluster mapping, so all requests go
+		 * to the blockif threads.
+		 */
+		cow = cow_open(nopt, ro, sync, cache_mb);
+		if (cow == NULL && !ro) {
+			cow = cow_open(nopt, true, sync, cache_mb);
+			ro = 1;
+		}
+		if (cow != NULL)
+			fd = cow_fd(cow);
+		aio = BLOCKIF_AIO_THREADS;
+	} else {
+		fd = open(nopt, (ro ? O_RDONLY : O_RDWR) | extra);
+		if (fd < 0 && !ro) {
+			/* Attempt a r/w fail with a r/o open */
+			fd = open(nopt, O_RDONLY | extra);
+			ro = 1;
+		}
 	}
 
 	if (fd < 0) {
@@ -549,7 +1971,7 @@ blockif_open(const char *optstr, const char *ident)
 	size = sbuf.st_size;
 	sectsz = DEV_BSIZE;
 	psectsz = psectoff = 0;
-	candelete = geom = 0;
+	candelete = 0;
 
 	if (S_ISBLK(sbuf.st_mode)) {
 		/* get size */
@@ -584,9 +2006,28 @@ blockif_open(const char *optstr, const char *ident)
 		DPRINTF(("block partition physical sector size is 0x%lx\n",
 			 psectsz));
 
-	} else
+		/* an empty discard fails if the device can't discard */
+		arg[0] = arg[1] = 0;
+		candelete = ioctl(fd, BLKDISCARD, arg) == 0;
+	} else {
 		psectsz = sbuf.st_blksize;
 
+		/* so does punching a hole past the end of a file */
+		candelete = fallocate(fd, FALLOC_FL_KEEP_SIZE |
+				      FALLOC_FL_PUNCH_HOLE, size, 1) == 0;
+	}
+
+	if (cow != NULL) {
+		size = cow_size(cow);
+		candelete = 0;
+	}
+
+	/* what O_DIRECT needs, whatever sector size is emulated */
+	dio_align = psectsz;
+	if (!powerof2(dio_align) || dio_align < DEV_BSIZE ||
+	    dio_align > BLOCKIF_BOUNCE_SZ)
+		dio_align = DEV_BSIZE;
+
 	if (ssopt != 0) {
 		if (!powerof2(ssopt) || !powerof2(pssopt) || ssopt < 512 ||
 		    ssopt > pssopt) {
@@ -643,41 +2084,134 @@ blockif_open(const char *optstr, const char *ident)
 
 	bc->magic = BLOCKIF_SIG;
 	bc->fd = fd;
+	bc->cow = cow;
+
+	/*
+	 * Only read-only images can be cached, the cache is not told about
+	 * writes. Cached reads are done by the blockif threads.
+	 */
+	if (cache_mb && cow == NULL) {
+		if (ro)
+			bc->bcache = bcache_open(fd, cache_mb);
+		else
+			WPRINTF(("block_if: shared_cache ignored, %s is "
+				 "writable\n", nopt));
+		if (bc->bcache)
+			aio = BLOCKIF_AIO_THREADS;
+	}
 	bc->isblk = S_ISBLK(sbuf.st_mode);
-	bc->isgeom = geom;
 	bc->candelete = candelete;
 	bc->rdonly = ro;
 	bc->size = size;
 	bc->sectsz = sectsz;
 	bc->psectsz = psectsz;
 	bc->psectoff = psectoff;
-	pthread_mutex_init(&bc->mtx, NULL);
-	pthread_cond_init(&bc->cond, NULL);
-	TAILQ_INIT(&bc->freeq);
-	TAILQ_INIT(&bc->pendq);
-	TAILQ_INIT(&bc->busyq);
-	for (i = 0; i < BLOCKIF_MAXREQ; i++) {
-		bc->reqs[i].status = BST_FREE;
-		TAILQ_INSERT_HEAD(&bc->freeq, &bc->reqs[i], link);
+	bc->direct = cow == NULL && (extra & O_DIRECT) != 0;
+	bc->dio_align = dio_align;
+	bc->writeback = writeback && cow == NULL;
+	bc->cpu = -1;
+
+	bc->limits = calloc(1, sizeof(struct blockif_limits));
+	if (bc->limits == NULL) {
+		perror("calloc");
+		free(bc);
+		goto err;
 	}
+	pthread_mutex_init(&bc->limits->mtx, NULL);
+	blockif_set_limits(bc, iops, iops_burst, bps, bps_burst);
 
-	for (i = 0; i < BLOCKIF_NUMTHR; i++) {
-		pthread_create(&bc->btid[i], NULL, blockif_thr, bc);
-		snprintf(tname, sizeof(tname), "blk-%s-%d", ident, i);
-		pthread_setname_np(bc->btid[i], tname);
+	/*
+	 * With O_DIRECT and no shared cache, there's no cache to read a
+	 * boot trace ahead into.
+	 */
+	if (trace_secs > 0) {
+		if (bc->direct && bc->bcache == NULL)
+			WPRINTF(("block_if: boot_trace needs writeback or "
+				 "shared_cache, ignored\n"));
+		else
+			bc->btrace = btrace_start(nopt, sub_file_assign ?
+						  bc->sub_file_start_lba : -1,
+						  size, trace_secs,
+						  blockif_trace_fill, bc);
 	}
 
+	blockif_start(bc, ident, aio);
 	return bc;
 err:
-	if (fd >= 0)
+	if (cow != NULL)
+		cow_close(cow);
+	else if (fd >= 0)
 		close(fd);
 	return NULL;
 }
 
+/*
+ * Open another blockif on the image of 'bc', with its own queues and
+ * threads, run on 'cpu' if it isn't -1. It shares the file, caches and
+ * I/O limits of 'bc', and has to be closed before it.
+ */
+struct blockif_ctxt *
+blockif_clone(struct blockif_ctxt *bc, int cpu)
+{
+	struct blockif_ctxt *clone;
+	enum blockif_aio aio;
+
+	assert(bc->magic == BLOCKIF_SIG && bc->parent == NULL);
+
+	clone = calloc(1, sizeof(struct blockif_ctxt));
+	if (clone == NULL) {
+		perror("calloc");
+		return NULL;
+	}
+
+	clone->magic = BLOCKIF_SIG;
+	clone->parent = bc;
+	clone->cpu = cpu;
+	clone->fd = bc->fd;
+	clone->cow = bc->cow;
+	clone->bcache = bc->bcache;
+	clone->btrace = bc->btrace;
+	clone->isblk = bc->isblk;
+	clone->candelete = bc->candelete;
+	clone->rdonly = bc->rdonly;
+	clone->size = bc->size;
+	clone->sub_file_start_lba = bc->sub_file_start_lba;
+	clone->sectsz = bc->sectsz;
+	clone->psectsz = bc->psectsz;
+	clone->psectoff = bc->psectoff;
+	clone->direct = bc->direct;
+	clone->dio_align = bc->dio_align;
+	clone->writeback = bc->writeback;
+	clone->limits = bc->limits;
+
+	if (bc->engine == &blockif_uring_engine)
+		aio = BLOCKIF_AIO_URING;
+	else if (bc->engine == &blockif_native_engine)
+		aio = BLOCKIF_AIO_NATIVE;
+	else
+		aio = BLOCKIF_AIO_THREADS;
+	blockif_start(clone, bc->ident, aio);
+
+	return clone;
+}
+
+/*
+ * Run the threads of 'bc' on 'cpu'.
+ */
+int
+blockif_set_cpu(struct blockif_ctxt *bc, int cpu)
+{
+	assert(bc->magic == BLOCKIF_SIG);
+
+	bc->cpu = cpu;
+	return blockif_pin(bc);
+}
+
 static int
 blockif_request(struct blockif_ctxt *bc, struct blockif_req *breq,
 		enum blockop op)
 {
+	bool noaio;
 	int err;
 
 	err = 0;
@@ -688,8 +2222,14 @@ blockif_request(struct blockif_ctxt *bc, struct blockif_req *breq,
 		 * Enqueue and inform the block i/o thread
 		 * that there is work available
 		 */
-		if (blockif_enqueue(bc, breq, op))
-			pthread_cond_signal(&bc->cond);
+		noaio = bc->engine && blockif_noaio(bc, breq, op);
+		if (blockif_enqueue(bc, breq, op, noaio)) {
+			if (bc->engine && (bc->engine->ops & (1U << op)) &&
+			    !noaio)
+				blockif_aio_submit(bc);
+			else
+				pthread_cond_signal(&bc->cond);
+		}
 	} else {
 		/*
 		 * Callers are not allowed to enqueue more than
@@ -732,6 +2272,13 @@ blockif_delete(struct blockif_ctxt *bc, struct blockif_req *breq)
 	return blockif_request(bc, breq, BOP_DELETE);
 }
 
+int
+blockif_write_zeroes(struct blockif_ctxt *bc, struct blockif_req *breq)
+{
+	assert(bc->magic == BLOCKIF_SIG);
+	return blockif_request(bc, breq, BOP_ZERO);
+}
+
 int
 blockif_cancel(struct blockif_ctxt *bc, struct blockif_req *breq)
 {
@@ -772,6 +2319,15 @@ blockif_cancel(struct blockif_ctxt *bc, struct blockif_req *breq)
 		return -1;
 	}
 
+	/*
+	 * Requests in the async engine can't be interrupted, the callback
+	 * will be called when they complete.
+	 */
+	if (be->tid == 0) {
+		pthread_mutex_unlock(&bc->mtx);
+		return -EBUSY;
+	}
+
 	/*
 	 * Interrupt the processing thread to force it return
 	 * prematurely via it's normal callback path.
@@ -818,6 +2374,13 @@ blockif_close(struct blockif_ctxt *bc)
 	assert(bc->magic == BLOCKIF_SIG);
 	sub_file_unlock(bc);
 
+	pthread_mutex_lock(&blockif_list_mtx);
+	LIST_REMOVE(bc, list);
+	pthread_mutex_unlock(&blockif_list_mtx);
+
+	if (bc->btrace && bc->parent == NULL)
+		btrace_stop(bc->btrace);
+
 	/*
 	 * Stop the block i/o thread
 	 */
@@ -825,16 +2388,29 @@ blockif_close(struct blockif_ctxt *bc)
 	bc->closing = 1;
 	pthread_mutex_unlock(&bc->mtx);
 	pthread_cond_broadcast(&bc->cond);
-	for (i = 0; i < BLOCKIF_NUMTHR; i++)
+	for (i = 0; i < bc->nthr; i++)
 		pthread_join(bc->btid[i], &jval);
 
+	blockif_aio_deinit(bc);
+
 	/* XXX Cancel queued i/o's ??? */
 
 	/*
 	 * Release resources
 	 */
 	bc->magic = 0;
-	close(bc->fd);
+	for (i = 0; i < bc->nbounce; i++)
+		free(bc->bounce[i]);
+	if (bc->parent == NULL) {
+		if (bc->bcache)
+			bcache_close(bc->bcache);
+		if (bc->cow)
+			cow_close(bc->cow);
+		else
+			close(bc->fd);
+		pthread_mutex_destroy(&bc->limits->mtx);
+		free(bc->limits);
+	}
 	free(bc);
 
 	return 0;
@@ -0,0 +1,355 @@
+/*-
+ * Copyright (c) 2018 Intel Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+/*
+ * Boot I/O trace recording and replay.
+ *
+ * The first time an image is opened with a trace, the (offset, length)
+ * of the reads of its first seconds are recorded, sequential reads being
+ * merged, and saved in "<image>.btrace", or "<image>.<start>.btrace" for
+ * a sub-file starting at byte <start> of the image. On the next opens,
+ * a thread reads these extents ahead, in the order they were read, while
+ * the guest boots, so its reads find them in the page cache or the shared
+ * cache rather than waiting for the disk. Remove the trace file to
+ * record a new one, it is also recorded again if the image size changed.
+ */
+
+#include <sys/param.h>
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "dm.h"
+#include "block_trace.h"
+
+#define	BTRACE_MAGIC		0x52544241	/* "ABTR" */
+#define	BTRACE_VERSION		1
+#define	BTRACE_SUFFIX		".btrace"
+#define	BTRACE_MAX		65536		/* extents recorded */
+#define	BTRACE_EXTENT_MAX	(16 * 1024 * 1024)
+#define	BTRACE_CHUNK		(1024 * 1024)	/* replay read size */
+
+#define WPRINTF(params) (printf params)
+
+/* On disk, little endian */
+struct btrace_header {
+	uint32_t	magic;
+	uint32_t	version;
+	uint64_t	size;		/* of the image */
+	uint32_t	count;		/* extents following the header */
+	uint32_t	secs;		/* recorded */
+};
+
+struct btrace_extent {
+	uint64_t	off;
+	uint32_t	len;
+	uint32_t	pad;
+};
+
+struct btrace {
+	char		*path;		/* of the trace file */
+	off_t		size;
+	int		secs;
+	bool		recording;	/* atomic, cleared under mtx */
+	bool		stopping;	/* atomic, also set under mtx */
+	struct timespec	deadline;	/* end of the recording */
+	pthread_mutex_t	mtx;
+	pthread_cond_t	cond;
+	pthread_t	tid;
+
+	/* recorded or replayed extents, in host order */
+	struct btrace_extent *ext;
+	uint32_t	count;
+
+	btrace_fill_t	fill;
+	void		*arg;
+};
+
+/*
+ * Load the trace file, returns false if there isn't a usable one.
+ */
+static bool
+btrace_load(struct btrace *bt)
+{
+	struct btrace_header hdr;
+	uint32_t i, count;
+	FILE *fp;
+
+	fp = fopen(bt->path, "r");
+	if (fp == NULL)
+		return false;
+
+	if (fread(&hdr, sizeof(hdr), 1, fp) != 1 ||
+	    le32toh(hdr.magic) != BTRACE_MAGIC ||
+	    le32toh(hdr.version) != BTRACE_VERSION ||
+	    le64toh(hdr.size) != (uint64_t)bt->size) {
+		WPRINTF(("block_trace: %s is stale, recording again\n",
+			 bt->path));
+		goto fail;
+	}
+
+	count = MIN(le32toh(hdr.count), BTRACE_MAX);
+	bt->ext = calloc(count ? count : 1, sizeof(struct btrace_extent));
+	if (bt->ext == NULL)
+		goto fail;
+	bt->count = fread(bt->ext, sizeof(struct btrace_extent), count, fp);
+	for (i = 0; i < bt->count; i++) {
+		bt->ext[i].off = le64toh(bt->ext[i].off);
+		bt->ext[i].len = le32toh(bt->ext[i].len);
+	}
+	fclose(fp);
+	return true;
+
+fail:
+	fclose(fp);
+	return false;
+}
+
+/*
+ * Write the recorded extents, to a temporary file renamed over the trace
+ * file so a crash doesn't leave a truncated one.
+ */
+static void
+btrace_save(struct btrace *bt)
+{
+	struct btrace_header hdr;
+	struct btrace_extent ext;
+	char tmp[PATH_MAX];
+	uint32_t i;
+	FILE *fp;
+	bool ok;
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", bt->path);
+	fp = fopen(tmp, "w");
+	if (fp == NULL) {
+		WPRINTF(("block_trace: can't create %s, errno %d\n", tmp,
+			 errno));
+		return;
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = htole32(BTRACE_MAGIC);
+	hdr.version = htole32(BTRACE_VERSION);
+	hdr.size = htole64(bt->size);
+	hdr.count = htole32(bt->count);
+	hdr.secs = htole32(bt->secs);
+	ok = fwrite(&hdr, sizeof(hdr), 1, fp) == 1;
+	for (i = 0; ok && i < bt->count; i++) {
+		memset(&ext, 0, sizeof(ext));
+		ext.off = htole64(bt->ext[i].off);
+		ext.len = htole32(bt->ext[i].len);
+		ok = fwrite(&ext, sizeof(ext), 1, fp) == 1;
+	}
+	if (fclose(fp) != 0)
+		ok = false;
+
+	if (!ok || rename(tmp, bt->path) < 0) {
+		WPRINTF(("block_trace: failed to write %s\n", bt->path));
+		unlink(tmp);
+		return;
+	}
+	WPRINTF(("block_trace: %u extents recorded in %s\n", bt->count,
+		 bt->path));
+}
+
+/* Wait for the end of the recording, and save it */
+static void
+btrace_record_thr(struct btrace *bt)
+{
+	pthread_mutex_lock(&bt->mtx);
+	while (!bt->stopping &&
+	       pthread_cond_timedwait(&bt->cond, &bt->mtx,
+				      &bt->deadline) != ETIMEDOUT)
+		;
+	__atomic_store_n(&bt->recording, false, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&bt->mtx);
+
+	/* an image closed before the guest read it gets no trace */
+	if (bt->count)
+		btrace_save(bt);
+}
+
+static inline bool
+btrace_stopping(struct btrace *bt)
+{
+	return __atomic_load_n(&bt->stopping, __ATOMIC_RELAXED);
+}
+
+/* Read the extents ahead of the guest */
+static void
+btrace_replay_thr(struct btrace *bt)
+{
+	uint64_t off, end;
+	size_t len;
+	uint32_t i;
+	void *buf;
+	int err;
+
+	if (posix_memalign(&buf, getpagesize(), BTRACE_CHUNK) != 0)
+		return;
+
+	for (i = 0; i < bt->count && !btrace_stopping(bt); i++) {
+		off = bt->ext[i].off;
+		end = MIN(off + bt->ext[i].len, (uint64_t)bt->size);
+		for (; off < end && !btrace_stopping(bt); off += len) {
+			len = MIN(end - off, BTRACE_CHUNK);
+			err = (*bt->fill)(bt->arg, off, buf, len);
+			if (err) {
+				WPRINTF(("block_trace: read ahead failed, "
+					 "errno %d\n", err));
+				goto done;
+			}
+		}
+	}
+done:
+	free(buf);
+}
+
+static void *
+btrace_thr(void *arg)
+{
+	struct btrace *bt = arg;
+
+	if (bt->recording)
+		btrace_record_thr(bt);
+	else
+		btrace_replay_thr(bt);
+	return NULL;
+}
+
+/*
+ * Replay the trace of the image at 'path' of 'size' bytes with 'fill',
+ * or record the reads of its first 'secs' seconds if it has none. For a
+ * sub-file of the image, 'start' is its offset in the image, else -1.
+ */
+struct btrace *
+btrace_start(const char *path, off_t start, off_t size, int secs,
+	     btrace_fill_t fill, void *arg)
+{
+	struct btrace *bt;
+	pthread_condattr_t cattr;
+	int n;
+
+	bt = calloc(1, sizeof(struct btrace));
+	if (bt == NULL)
+		return NULL;
+	if (start >= 0)
+		n = asprintf(&bt->path, "%s.%ld%s", path, (long)start,
+			     BTRACE_SUFFIX);
+	else
+		n = asprintf(&bt->path, "%s%s", path, BTRACE_SUFFIX);
+	if (n < 0) {
+		free(bt);
+		return NULL;
+	}
+	bt->size = size;
+	bt->secs = secs;
+	bt->fill = fill;
+	bt->arg = arg;
+
+	if (!btrace_load(bt)) {
+		bt->ext = calloc(BTRACE_MAX, sizeof(struct btrace_extent));
+		if (bt->ext == NULL)
+			goto fail;
+		bt->count = 0;
+		bt->recording = true;
+		clock_gettime(CLOCK_MONOTONIC, &bt->deadline);
+		bt->deadline.tv_sec += secs;
+	}
+
+	pthread_mutex_init(&bt->mtx, NULL);
+	pthread_condattr_init(&cattr);
+	pthread_condattr_setclock(&cattr, CLOCK_MONOTONIC);
+	pthread_cond_init(&bt->cond, &cattr);
+	pthread_condattr_destroy(&cattr);
+
+	if (pthread_create(&bt->tid, NULL, btrace_thr, bt) != 0)
+		goto fail;
+	pthread_setname_np(bt->tid, bt->recording ? "btrace-rec" :
+			   "btrace-play");
+	return bt;
+
+fail:
+	free(bt->ext);
+	free(bt->path);
+	free(bt);
+	return NULL;
+}
+
+/*
+ * Stop replaying, or stop recording and save what was recorded so far.
+ */
+void
+btrace_stop(struct btrace *bt)
+{
+	pthread_mutex_lock(&bt->mtx);
+	__atomic_store_n(&bt->stopping, true, __ATOMIC_RELAXED);
+	pthread_cond_signal(&bt->cond);
+	pthread_mutex_unlock(&bt->mtx);
+	pthread_join(bt->tid, NULL);
+
+	pthread_cond_destroy(&bt->cond);
+	pthread_mutex_destroy(&bt->mtx);
+	free(bt->ext);
+	free(bt->path);
+	free(bt);
+}
+
+/*
+ * Record a guest read, merged with the previous one if it follows it.
+ */
+void
+btrace_read(struct btrace *bt, off_t off, size_t len)
+{
+	struct btrace_extent *last;
+
+	if (!__atomic_load_n(&bt->recording, __ATOMIC_RELAXED) || len == 0)
+		return;
+
+	pthread_mutex_lock(&bt->mtx);
+	if (!bt->recording)
+		goto out;
+	last = bt->count ? &bt->ext[bt->count - 1] : NULL;
+	if (last != NULL && last->off + last->len == (uint64_t)off &&
+	    last->len + len <= BTRACE_EXTENT_MAX)
+		last->len += len;
+	else if (bt->count < BTRACE_MAX) {
+		bt->ext[bt->count].off = off;
+		bt->ext[bt->count].len = MIN(len, BTRACE_EXTENT_MAX);
+		bt->count++;
+	}
+out:
+	pthread_mutex_unlock(&bt->mtx);
+}
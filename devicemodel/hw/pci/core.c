@@ -45,6 +45,7 @@
 #include "inout.h"
 #include "ioapic.h"
 #include "mem.h"
+#include "doorbell.h"
 #include "pci_core.h"
 #include "irq.h"
 #include "lpc.h"
@@ -476,8 +477,11 @@ modify_bar_registration(struct pci_vdev *dev, int idx, int registration)
 			iop.handler = pci_emul_io_handler;
 			iop.arg = dev;
 			error = register_inout(&iop);
-		} else
+		} else {
+			doorbell_del_range(dev->vmctx, REQ_PORTIO, iop.port,
+					iop.size);
 			error = unregister_inout(&iop);
+		}
 		break;
 	case PCIBAR_MEM32:
 	case PCIBAR_MEM64:
@@ -491,8 +495,11 @@ modify_bar_registration(struct pci_vdev *dev, int idx, int registration)
 			mr.arg1 = dev;
 			mr.arg2 = idx;
 			error = register_mem(&mr);
-		} else
+		} else {
+			doorbell_del_range(dev->vmctx, REQ_MMIO, mr.base,
+					mr.size);
 			error = unregister_mem(&mr);
+		}
 		break;
 	default:
 		error = EINVAL;
@@ -178,6 +178,8 @@ lpc_deinit(struct vmctx *ctx)
 		iop.flags = IOPORT_F_INOUT;
 		unregister_inout(&iop);
 
+		vm_del_posted_range(ctx, REQ_PORTIO, lpc_uart->iobase, 1);
+
 		uart_release_backend(lpc_uart->uart, lpc_uart->opts);
 		uart_deinit(lpc_uart->uart);
 		uart_legacy_dealloc(unit);
@@ -235,6 +237,9 @@ lpc_init(struct vmctx *ctx)
 
 		error = register_inout(&iop);
 		assert(error == 0);
+
+		/* THR writes don't need the vcpu to wait for emulation */
+		vm_add_posted_range(ctx, REQ_PORTIO, lpc_uart->iobase, 1);
 		lpc_uart->enabled = 1;
 	}
 
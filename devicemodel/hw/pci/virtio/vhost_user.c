@@ -0,0 +1,469 @@
+/*
+ * Copyright (C) 2018 Intel Corporation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ *   * Neither the name of Intel Corporation nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/* vhost-user front end, see vhost_user.h */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/eventfd.h>
+
+#include "mevent.h"
+#include "pci_core.h"
+#include "virtio.h"
+#include "virtio_kernel.h"
+#include "vhost_user.h"
+#include "vmmapi.h"
+
+static int vhost_user_debug;
+#define DPRINTF(params) do { if (vhost_user_debug) printf params; } while (0)
+#define WPRINTF(params) (printf params)
+
+/* the messages we send, the others are not used */
+#define VHOST_USER_GET_FEATURES		1
+#define VHOST_USER_SET_FEATURES		2
+#define VHOST_USER_SET_OWNER		3
+#define VHOST_USER_SET_MEM_TABLE	5
+#define VHOST_USER_SET_VRING_NUM	8
+#define VHOST_USER_SET_VRING_ADDR	9
+#define VHOST_USER_SET_VRING_BASE	10
+#define VHOST_USER_GET_VRING_BASE	11
+#define VHOST_USER_SET_VRING_KICK	12
+#define VHOST_USER_SET_VRING_CALL	13
+
+#define VHOST_USER_VERSION	0x1
+#define VHOST_USER_REPLY	0x4
+
+#define VHOST_USER_MAX_REGIONS	8
+
+struct vhost_user_mem_region {
+	uint64_t	guest_phys_addr;
+	uint64_t	memory_size;
+	uint64_t	userspace_addr;	/* where we have it */
+	uint64_t	mmap_offset;	/* in the fd */
+};
+
+struct vhost_user_msg {
+	uint32_t	request;
+	uint32_t	flags;
+	uint32_t	size;		/* of the payload */
+	union {
+		uint64_t	u64;
+		struct vhost_vring_state state;
+		struct vhost_vring_addr addr;
+		struct {
+			uint32_t	nregions;
+			uint32_t	padding;
+			struct vhost_user_mem_region
+					regions[VHOST_USER_MAX_REGIONS];
+		} memory;
+	} payload;
+} __attribute__((packed));
+
+#define VHOST_USER_HDR_SIZE	offsetof(struct vhost_user_msg, payload)
+
+/* send a message, with the fds given */
+static int
+vhost_user_send(struct vhost_user *vu, struct vhost_user_msg *msg,
+		int *fds, int nfds)
+{
+	char control[CMSG_SPACE(VHOST_USER_MAX_REGIONS * sizeof(int))];
+	struct msghdr mh;
+	struct cmsghdr *cmsg;
+	struct iovec iov;
+	ssize_t n;
+
+	msg->flags = VHOST_USER_VERSION;
+	iov.iov_base = msg;
+	iov.iov_len = VHOST_USER_HDR_SIZE + msg->size;
+
+	memset(&mh, 0, sizeof(mh));
+	mh.msg_iov = &iov;
+	mh.msg_iovlen = 1;
+	if (nfds > 0) {
+		memset(control, 0, sizeof(control));
+		mh.msg_control = control;
+		mh.msg_controllen = CMSG_SPACE(nfds * sizeof(int));
+		cmsg = CMSG_FIRSTHDR(&mh);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+		memcpy(CMSG_DATA(cmsg), fds, nfds * sizeof(int));
+	}
+
+	do {
+		n = sendmsg(vu->fd, &mh, MSG_NOSIGNAL);
+	} while (n < 0 && errno == EINTR);
+	if (n != iov.iov_len) {
+		WPRINTF(("vhost-user: cannot send request %u, errno %d\n",
+			 msg->request, errno));
+		return -1;
+	}
+	return 0;
+}
+
+/* wait for the reply to the request sent */
+static int
+vhost_user_recv(struct vhost_user *vu, uint32_t request,
+		struct vhost_user_msg *msg)
+{
+	ssize_t n;
+
+	do {
+		n = recv(vu->fd, msg, VHOST_USER_HDR_SIZE, MSG_WAITALL);
+	} while (n < 0 && errno == EINTR);
+	if (n != VHOST_USER_HDR_SIZE || msg->request != request ||
+	    !(msg->flags & VHOST_USER_REPLY) ||
+	    msg->size > sizeof(msg->payload))
+		goto fail;
+	if (msg->size == 0)
+		return 0;
+	do {
+		n = recv(vu->fd, &msg->payload, msg->size, MSG_WAITALL);
+	} while (n < 0 && errno == EINTR);
+	if (n != msg->size)
+		goto fail;
+	return 0;
+
+fail:
+	WPRINTF(("vhost-user: bad reply to request %u\n", request));
+	return -1;
+}
+
+static int
+vhost_user_u64(struct vhost_user *vu, uint32_t request, uint64_t u64,
+	       int fd)
+{
+	struct vhost_user_msg msg;
+
+	msg.request = request;
+	msg.size = sizeof(msg.payload.u64);
+	msg.payload.u64 = u64;
+	return vhost_user_send(vu, &msg, &fd, fd >= 0);
+}
+
+static int
+vhost_user_state(struct vhost_user *vu, uint32_t request, int i,
+		 unsigned int num)
+{
+	struct vhost_user_msg msg;
+
+	msg.request = request;
+	msg.size = sizeof(msg.payload.state);
+	msg.payload.state.index = i;
+	msg.payload.state.num = num;
+	return vhost_user_send(vu, &msg, NULL, 0);
+}
+
+/* the backend asks for an interrupt */
+static void
+vhost_user_call(int fd, enum ev_type t, void *arg)
+{
+	struct vhost_user_vq *uvq = arg;
+	uint64_t n;
+
+	if (read(fd, &n, sizeof(n)) != sizeof(n))
+		return;
+	vq_interrupt(uvq->vq->base, uvq->vq);
+}
+
+/*
+ * Connect to the backend at 'path' for the first nvq queues of the
+ * device, to be started once the guest set them up.
+ */
+int
+vhost_user_init(struct vhost_user *vu, const char *path,
+		struct virtio_base *base, int nvq)
+{
+	struct vm_mem_region regions[VHOST_USER_MAX_REGIONS];
+	struct sockaddr_un sun;
+	struct vhost_user_msg msg;
+	struct vhost_user_vq *uvq;
+	int i;
+
+	memset(vu, 0, sizeof(*vu));
+	vu->fd = -1;
+	for (i = 0; i < VHOST_USER_MAX_VQS; i++)
+		vu->vqs[i].kick_fd = vu->vqs[i].call_fd = -1;
+
+	if (nvq > VHOST_USER_MAX_VQS) {
+		WPRINTF(("%s: too many queues\n", __func__));
+		return -VIRTIO_ERROR_GENERAL;
+	}
+	if (hugetlb_get_regions(base->dev->vmctx, regions,
+				VHOST_USER_MAX_REGIONS) < 0) {
+		WPRINTF(("vhost-user: guest memory must be from hugetlbfs\n"));
+		return -VIRTIO_ERROR_GENERAL;
+	}
+
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(sun.sun_path)) {
+		WPRINTF(("vhost-user: path too long: %s\n", path));
+		return -VIRTIO_ERROR_GENERAL;
+	}
+	strcpy(sun.sun_path, path);
+	vu->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (vu->fd < 0 ||
+	    connect(vu->fd, (struct sockaddr *)&sun, sizeof(sun)) < 0) {
+		WPRINTF(("vhost-user: cannot connect to %s, errno %d\n",
+			 path, errno));
+		goto fail;
+	}
+
+	msg.request = VHOST_USER_SET_OWNER;
+	msg.size = 0;
+	if (vhost_user_send(vu, &msg, NULL, 0) < 0)
+		goto fail;
+	msg.request = VHOST_USER_GET_FEATURES;
+	msg.size = 0;
+	if (vhost_user_send(vu, &msg, NULL, 0) < 0 ||
+	    vhost_user_recv(vu, VHOST_USER_GET_FEATURES, &msg) < 0 ||
+	    msg.size != sizeof(msg.payload.u64))
+		goto fail;
+	vu->features = msg.payload.u64 & ~VHOST_USER_F_PROTOCOL_FEATURES;
+
+	vu->nvq = nvq;
+	for (i = 0; i < nvq; i++) {
+		uvq = &vu->vqs[i];
+		uvq->vq = &base->queues[i];
+		uvq->kick_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		uvq->call_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if (uvq->kick_fd < 0 || uvq->call_fd < 0)
+			goto fail;
+		uvq->mevp = mevent_add(uvq->call_fd, EVF_READ,
+				       vhost_user_call, uvq);
+		if (uvq->mevp == NULL)
+			goto fail;
+	}
+
+	DPRINTF(("vhost-user: %s, features 0x%lx\n", path, vu->features));
+	return VIRTIO_SUCCESS;
+
+fail:
+	vhost_user_deinit(vu);
+	return -VIRTIO_ERROR_GENERAL;
+}
+
+void
+vhost_user_deinit(struct vhost_user *vu)
+{
+	struct vhost_user_vq *uvq;
+	int i;
+
+	for (i = 0; i < VHOST_USER_MAX_VQS; i++) {
+		uvq = &vu->vqs[i];
+		if (uvq->mevp != NULL)
+			mevent_delete(uvq->mevp);
+		if (uvq->kick_fd >= 0)
+			close(uvq->kick_fd);
+		if (uvq->call_fd >= 0)
+			close(uvq->call_fd);
+		uvq->mevp = NULL;
+		uvq->kick_fd = uvq->call_fd = -1;
+	}
+	if (vu->fd >= 0)
+		close(vu->fd);
+	vu->fd = -1;
+	vu->nvq = 0;
+}
+
+/*
+ * The guest memory, with the fds of the hugetlbfs files it is mapped
+ * from, and where we have it to translate the ring addresses.
+ */
+static int
+vhost_user_set_mem(struct vhost_user *vu, struct vmctx *ctx)
+{
+	struct vm_mem_region regions[VHOST_USER_MAX_REGIONS];
+	struct vhost_user_mem_region r;
+	struct vhost_user_msg msg;
+	int fds[VHOST_USER_MAX_REGIONS];
+	int i, n;
+
+	n = hugetlb_get_regions(ctx, regions, VHOST_USER_MAX_REGIONS);
+	if (n < 0)
+		return -1;
+
+	msg.request = VHOST_USER_SET_MEM_TABLE;
+	msg.size = sizeof(msg.payload.memory);
+	msg.payload.memory.nregions = n;
+	msg.payload.memory.padding = 0;
+	for (i = 0; i < n; i++) {
+		/* the message is packed, so no pointer into it */
+		r.guest_phys_addr = regions[i].gpa;
+		r.memory_size = regions[i].len;
+		r.userspace_addr = (uintptr_t)regions[i].hva;
+		r.mmap_offset = regions[i].fd_offset;
+		memcpy(&msg.payload.memory.regions[i], &r, sizeof(r));
+		fds[i] = regions[i].fd;
+	}
+	return vhost_user_send(vu, &msg, fds, n);
+}
+
+/* Hand ring 'i' to the backend, if the guest set it up */
+static int
+vhost_user_start_vq(struct vhost_user *vu, int i)
+{
+	struct vhost_user_msg msg;
+	struct virtio_vq_info *vq;
+
+	vq = vu->vqs[i].vq;
+	if (vu->vqs[i].started || !vq_ring_ready(vq))
+		return 0;
+
+	if (vhost_user_state(vu, VHOST_USER_SET_VRING_NUM, i,
+			     vq->qsize) < 0 ||
+	    vhost_user_state(vu, VHOST_USER_SET_VRING_BASE, i,
+			     vq->last_avail) < 0)
+		return -1;
+
+	msg.request = VHOST_USER_SET_VRING_ADDR;
+	msg.size = sizeof(msg.payload.addr);
+	memset(&msg.payload.addr, 0, sizeof(msg.payload.addr));
+	msg.payload.addr.index = i;
+	msg.payload.addr.desc_user_addr = (uintptr_t)vq->desc;
+	msg.payload.addr.avail_user_addr = (uintptr_t)vq->avail;
+	msg.payload.addr.used_user_addr = (uintptr_t)vq->used;
+	if (vhost_user_send(vu, &msg, NULL, 0) < 0)
+		return -1;
+
+	/* the ring runs once it has its kick fd */
+	if (vhost_user_u64(vu, VHOST_USER_SET_VRING_CALL, i,
+			   vu->vqs[i].call_fd) < 0 ||
+	    vhost_user_u64(vu, VHOST_USER_SET_VRING_KICK, i,
+			   vu->vqs[i].kick_fd) < 0)
+		return -1;
+	vu->vqs[i].started = 1;
+	return 0;
+}
+
+/*
+ * Hand the rings the guest set up, of the first nvq queues, to the
+ * backend, which takes over from where we are.
+ */
+int
+vhost_user_start(struct vhost_user *vu, uint64_t features, int nvq)
+{
+	if (vu->started)
+		return VIRTIO_SUCCESS;
+	if (vu->fd < 0)
+		return -VIRTIO_ERROR_FD_OPEN_FAILED;
+
+	features &= vu->features;
+	if (vhost_user_u64(vu, VHOST_USER_SET_FEATURES, features, -1) < 0 ||
+	    vhost_user_set_mem(vu, vu->vqs[0].vq->base->dev->vmctx) < 0) {
+		WPRINTF(("vhost-user: cannot set features/memory\n"));
+		return -VIRTIO_ERROR_START;
+	}
+
+	vu->started = 1;
+	return vhost_user_start_vqs(vu, nvq);
+}
+
+/*
+ * Hand the rings of the first nvq queues the backend doesn't have yet,
+ * e.g. the ones of queue pairs the guest enabled after DRIVER_OK.
+ */
+int
+vhost_user_start_vqs(struct vhost_user *vu, int nvq)
+{
+	int i;
+
+	if (!vu->started)
+		return VIRTIO_SUCCESS;
+
+	for (i = 0; i < nvq && i < vu->nvq; i++) {
+		if (vhost_user_start_vq(vu, i) < 0) {
+			WPRINTF(("vhost-user: cannot set queue %d\n", i));
+			vhost_user_stop(vu);
+			return -VIRTIO_ERROR_START;
+		}
+	}
+	return VIRTIO_SUCCESS;
+}
+
+/*
+ * Take the rings back from the backend, which stops each of them, and
+ * go on from where it is.
+ */
+int
+vhost_user_stop(struct vhost_user *vu)
+{
+	struct vhost_user_msg msg;
+	struct virtio_vq_info *vq;
+	int i, ret = VIRTIO_SUCCESS;
+
+	if (!vu->started)
+		return VIRTIO_SUCCESS;
+
+	for (i = 0; i < vu->nvq; i++) {
+		if (!vu->vqs[i].started)
+			continue;
+		vu->vqs[i].started = 0;
+		vq = vu->vqs[i].vq;
+		if (vhost_user_state(vu, VHOST_USER_GET_VRING_BASE, i, 0) < 0 ||
+		    vhost_user_recv(vu, VHOST_USER_GET_VRING_BASE, &msg) < 0 ||
+		    msg.size != sizeof(msg.payload.state)) {
+			WPRINTF(("vhost-user: cannot get queue %d\n", i));
+			ret = -VIRTIO_ERROR_GENERAL;
+			continue;
+		}
+		vq->last_avail = msg.payload.state.num;
+		vq->save_used = vq->used->idx;
+	}
+
+	vu->started = 0;
+	return ret;
+}
+
+/* pass a guest notify on to the backend */
+int
+vhost_user_kick(struct vhost_user *vu, struct virtio_vq_info *vq)
+{
+	uint64_t n = 1;
+	int i;
+
+	for (i = 0; i < vu->nvq; i++)
+		if (vu->vqs[i].vq == vq)
+			break;
+	if (i == vu->nvq || !vu->vqs[i].started)
+		return -VIRTIO_ERROR_GENERAL;
+
+	if (write(vu->vqs[i].kick_fd, &n, sizeof(n)) != sizeof(n))
+		return -VIRTIO_ERROR_GENERAL;
+	return VIRTIO_SUCCESS;
+}
@@ -28,11 +28,16 @@
 #include <sys/param.h>
 #include <sys/uio.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
+#include <time.h>
 #include <pthread.h>
 
 #include "dm.h"
 #include "pci_core.h"
+#include "doorbell.h"
+#include "vmmapi.h"
 #include "virtio.h"
 
 /*
@@ -103,6 +108,9 @@ virtio_reset_dev(struct virtio_base *base)
 		vq->gpa_used[0] = 0;
 		vq->gpa_used[1] = 0;
 		vq->enabled = 0;
+		free(vq->ids);
+		vq->ids = NULL;
+		vq->nids = 0;
 	}
 	base->negotiated_caps = 0;
 	base->curq = 0;
@@ -116,6 +124,22 @@ virtio_reset_dev(struct virtio_base *base)
 	base->config_generation = 0;
 }
 
+/*
+ * Free what the queues of a device allocated, from its deinit.
+ */
+void
+virtio_deinit(struct virtio_base *base)
+{
+	struct virtio_vq_info *vq;
+	int i;
+
+	for (vq = base->queues, i = 0; i < base->vops->nvq; vq++, i++) {
+		free(vq->ids);
+		vq->ids = NULL;
+		vq->nids = 0;
+	}
+}
+
 /*
  * Set I/O BAR (usually 0) to map PCI config registers.
  */
@@ -218,6 +242,55 @@ virtio_vq_init(struct virtio_base *base, uint32_t pfn)
 	vq->save_used = 0;
 }
 
+/*
+ * virtio_vq_enable() for a packed virtqueue: the gpa of the desc ring
+ * and of the driver and device event suppression structures.  The
+ * buffer id table is freed on reset.
+ */
+static void
+virtio_vq_enable_packed(struct virtio_base *base, struct virtio_vq_info *vq)
+{
+	struct vq_packed_id *ids;
+	uint16_t qsz;
+	uint64_t phys;
+
+	qsz = vq->qsize;
+	if (qsz == 0 || qsz > VRING_PACKED_WRAP) {
+		fprintf(stderr, "%s: invalid packed queue size %u\r\n",
+			base->vops->name, qsz);
+		return;
+	}
+	if (vq->nids < qsz) {
+		ids = calloc(qsz, sizeof(*ids));
+		if (ids == NULL) {
+			fprintf(stderr, "%s: cannot allocate queue %d\r\n",
+				base->vops->name, vq->num);
+			return;
+		}
+		free(vq->ids);
+		vq->ids = ids;
+		vq->nids = qsz;
+	}
+
+	phys = (((uint64_t)vq->gpa_desc[1]) << 32) | vq->gpa_desc[0];
+	vq->pdesc = paddr_guest2host(base->dev->vmctx, phys,
+		qsz * sizeof(struct vring_packed_desc));
+	phys = (((uint64_t)vq->gpa_avail[1]) << 32) | vq->gpa_avail[0];
+	vq->driver_event = paddr_guest2host(base->dev->vmctx, phys,
+		sizeof(struct vring_packed_event));
+	phys = (((uint64_t)vq->gpa_used[1]) << 32) | vq->gpa_used[0];
+	vq->device_event = paddr_guest2host(base->dev->vmctx, phys,
+		sizeof(struct vring_packed_event));
+
+	/* Both wrap counters start at 1. */
+	vq->flags = VQ_ALLOC | VQ_PACKED;
+	vq->last_avail = VRING_PACKED_WRAP;
+	vq->used_idx = VRING_PACKED_WRAP;
+	vq->save_used = VRING_PACKED_WRAP;
+	vq->last_id = 0;
+	vq->enabled = true;
+}
+
 /*
  * Initialize the currently-selected virtio queue (base->curq).
  * The guest just gave us the gpa of desc array, avail ring and
@@ -236,6 +309,11 @@ virtio_vq_enable(struct virtio_base *base)
 	vq = &base->queues[base->curq];
 	qsz = vq->qsize;
 
+	if (base->negotiated_caps & VIRTIO_F_RING_PACKED) {
+		virtio_vq_enable_packed(base, vq);
+		return;
+	}
+
 	/* descriptors */
 	phys = (((uint64_t)vq->gpa_desc[1]) << 32) | vq->gpa_desc[0];
 	size = qsz * sizeof(struct virtio_desc);
@@ -273,13 +351,35 @@ _vq_record(int i, volatile struct virtio_desc *vd, struct vmctx *ctx,
 
 	if (i >= n_iov)
 		return;
-	iov[i].iov_base = paddr_guest2host(ctx, vd->addr, vd->len);
+	iov[i].iov_base = vm_map_gpa(ctx, vd->addr, vd->len);
+	iov[i].iov_len = vd->len;
+	if (flags != NULL)
+		flags[i] = vd->flags;
+}
+
+/* Same, for a packed descriptor. */
+static inline void
+_vq_record_packed(int i, volatile struct vring_packed_desc *vd,
+		  struct vmctx *ctx, struct iovec *iov, int n_iov,
+		  uint16_t *flags)
+{
+	if (i >= n_iov)
+		return;
+	iov[i].iov_base = vm_map_gpa(ctx, vd->addr, vd->len);
 	iov[i].iov_len = vd->len;
 	if (flags != NULL)
 		flags[i] = vd->flags;
 }
 #define	VQ_MAX_DESCRIPTORS	512	/* see below */
 
+static int _vq_parse(struct virtio_vq_info *vq, uint16_t head,
+		     struct iovec *iov, int n_iov, uint16_t *flags);
+static int _vq_getchain_packed(struct virtio_vq_info *vq, uint16_t *pidx,
+			       struct iovec *iov, int n_iov, uint16_t *flags);
+static int _vq_getchains_packed(struct virtio_vq_info *vq,
+				struct vq_chain *chains, int nchains,
+				struct iovec *iov, int n_iov, uint16_t *flags);
+
 /*
  * Examine the chain of descriptors starting at the "next one" to
  * make sure that they describe a sensible request.  If so, return
@@ -323,17 +423,14 @@ int
 vq_getchain(struct virtio_vq_info *vq, uint16_t *pidx,
 	    struct iovec *iov, int n_iov, uint16_t *flags)
 {
-	int i;
-	u_int ndesc, n_indir;
-	u_int idx, next;
-
-	volatile struct virtio_desc *vdir, *vindir, *vp;
-	struct vmctx *ctx;
-	struct virtio_base *base;
+	u_int ndesc;
+	u_int idx;
 	const char *name;
 
-	base = vq->base;
-	name = base->vops->name;
+	if (vq->flags & VQ_PACKED)
+		return _vq_getchain_packed(vq, pidx, iov, n_iov, flags);
+
+	name = vq->base->vops->name;
 
 	/*
 	 * Note: it's the responsibility of the guest not to
@@ -360,17 +457,92 @@ vq_getchain(struct virtio_vq_info *vq, uint16_t *pidx,
 		return -1;
 	}
 
-	/*
-	 * Now count/parse "involved" descriptors starting from
-	 * the head of the chain.
-	 *
-	 * To prevent loops, we could be more complicated and
-	 * check whether we're re-visiting a previously visited
-	 * index, but we just abort if the count gets excessive.
-	 */
-	ctx = base->dev->vmctx;
-	*pidx = next = vq->avail->ring[idx & (vq->qsize - 1)];
+	*pidx = vq->avail->ring[idx & (vq->qsize - 1)];
 	vq->last_avail++;
+	return _vq_parse(vq, *pidx, iov, n_iov, flags);
+}
+
+/*
+ * Pull up to 'nchains' available chains in one pass, their descriptors
+ * going in turn in iov[] (and flags[]) as vq_getchain() puts them.
+ * A chain whose descriptors don't fit in what is left of iov[] is left
+ * in the ring for the next call, unless it is the first one, which is
+ * then taken as vq_getchain() would.
+ *
+ * Returns the number of chains taken, described in chains[], 0 if none
+ * is available, or -1 if the first one is invalid. An invalid chain
+ * after the first one ends the batch, and is reported by the next call.
+ */
+int
+vq_getchains(struct virtio_vq_info *vq, struct vq_chain *chains, int nchains,
+	     struct iovec *iov, int n_iov, uint16_t *flags)
+{
+	u_int ndesc, idx;
+	uint16_t head;
+	int c, n, used;
+
+	if (vq->flags & VQ_PACKED)
+		return _vq_getchains_packed(vq, chains, nchains, iov, n_iov,
+					    flags);
+
+	idx = vq->last_avail;
+	ndesc = (uint16_t)((u_int)vq->avail->idx - idx);
+	if (ndesc > vq->qsize) {
+		fprintf(stderr,
+		    "%s: ndesc (%u) out of range, driver confused?\r\n",
+		    vq->base->vops->name, (u_int)ndesc);
+		return -1;
+	}
+	/* the chains are read after avail->idx */
+	__asm __volatile("" ::: "memory");
+
+	used = 0;
+	for (c = 0; c < nchains && c < ndesc; c++) {
+		head = vq->avail->ring[(idx + c) & (vq->qsize - 1)];
+		n = _vq_parse(vq, head, iov + used, n_iov - used,
+			      flags ? flags + used : NULL);
+		if (c > 0 && (n < 0 || n > n_iov - used))
+			break;
+		if (n < 0) {
+			vq->last_avail++;
+			return -1;
+		}
+		chains[c].idx = head;
+		chains[c].n = n;
+		chains[c].iov = iov + used;
+		chains[c].flags = flags ? flags + used : NULL;
+		chains[c].len = 0;
+		used += MIN(n, n_iov - used);
+	}
+	vq->last_avail += c;
+	return c;
+}
+
+/*
+ * Count/parse the "involved" descriptors of the chain at 'head', for
+ * vq_getchain() and vq_getchains().
+ *
+ * To prevent loops, we could be more complicated and
+ * check whether we're re-visiting a previously visited
+ * index, but we just abort if the count gets excessive.
+ */
+static int
+_vq_parse(struct virtio_vq_info *vq, uint16_t head,
+	  struct iovec *iov, int n_iov, uint16_t *flags)
+{
+	int i;
+	u_int n_indir;
+	u_int next;
+
+	volatile struct virtio_desc *vdir, *vindir, *vp;
+	struct vmctx *ctx;
+	struct virtio_base *base;
+	const char *name;
+
+	base = vq->base;
+	name = base->vops->name;
+	ctx = base->dev->vmctx;
+	next = head;
 	for (i = 0; i < VQ_MAX_DESCRIPTORS; next = vdir->next) {
 		if (next >= vq->qsize) {
 			fprintf(stderr,
@@ -399,8 +571,14 @@ vq_getchain(struct virtio_vq_info *vq, uint16_t *pidx,
 				    name, (u_int)vdir->len);
 				return -1;
 			}
-			vindir = paddr_guest2host(ctx,
-			    vdir->addr, vdir->len);
+			vindir = vm_map_gpa(ctx, vdir->addr, vdir->len);
+			if (vindir == NULL) {
+				fprintf(stderr,
+				    "%s: invalid indir addr 0x%lx, "
+				    "driver confused?\r\n",
+				    name, (uint64_t)vdir->addr);
+				return -1;
+			}
 			/*
 			 * Indirects start at the 0th, then follow
 			 * their own embedded "next"s until those run
@@ -443,6 +621,240 @@ loopy:
 	return -1;
 }
 
+/*
+ * The position 'n' descriptors after (or before, if n < 0) 'pos' in a
+ * packed ring, flipping the wrap counter in bit 15 on wrapping around.
+ */
+static inline uint16_t
+_vq_packed_move(struct virtio_vq_info *vq, uint16_t pos, int n)
+{
+	int idx;
+
+	idx = (pos & ~VRING_PACKED_WRAP) + n;
+	pos &= VRING_PACKED_WRAP;
+	if (idx >= vq->qsize) {
+		idx -= vq->qsize;
+		pos ^= VRING_PACKED_WRAP;
+	} else if (idx < 0) {
+		idx += vq->qsize;
+		pos ^= VRING_PACKED_WRAP;
+	}
+	return pos | idx;
+}
+
+/*
+ * _vq_parse() for a packed ring: the chain is the run of descriptors
+ * from *ppos to the first one without NEXT, or a single INDIRECT one,
+ * and is identified by the buffer id of its last descriptor.  *ppos is
+ * moved past it (or past what was looked at, on error), and the buffer
+ * id and the number of ring descriptors used are returned in *pid and
+ * *pndesc.
+ */
+static int
+_vq_parse_packed(struct virtio_vq_info *vq, uint16_t *ppos, uint16_t *pid,
+		 uint16_t *pndesc, struct iovec *iov, int n_iov,
+		 uint16_t *flags)
+{
+	int i;
+	u_int j, n_indir;
+	uint16_t dflags, ndesc;
+
+	volatile struct vring_packed_desc *vd, *vindir;
+	struct vmctx *ctx;
+	struct virtio_base *base;
+	const char *name;
+
+	base = vq->base;
+	name = base->vops->name;
+	ctx = base->dev->vmctx;
+	for (i = 0, ndesc = 0;;) {
+		if (ndesc == vq->qsize) {
+			fprintf(stderr,
+			    "%s: chain longer than the ring, "
+			    "driver confused?\r\n",
+			    name);
+			return -1;
+		}
+		vd = &vq->pdesc[*ppos & ~VRING_PACKED_WRAP];
+		dflags = vd->flags;
+		*ppos = _vq_packed_move(vq, *ppos, 1);
+		ndesc++;
+		if ((dflags & VRING_DESC_F_INDIRECT) == 0) {
+			_vq_record_packed(i, vd, ctx, iov, n_iov, flags);
+			if (++i > VQ_MAX_DESCRIPTORS)
+				goto loopy;
+			if ((dflags & VRING_DESC_F_NEXT) == 0)
+				break;
+			continue;
+		}
+		if ((base->vops->hv_caps & VIRTIO_RING_F_INDIRECT_DESC) == 0 ||
+		    (dflags & VRING_DESC_F_NEXT)) {
+			fprintf(stderr,
+			    "%s: descriptor has forbidden INDIRECT flag, "
+			    "driver confused?\r\n",
+			    name);
+			return -1;
+		}
+		n_indir = vd->len / 16;
+		if ((vd->len & 0xf) || n_indir == 0) {
+			fprintf(stderr,
+			    "%s: invalid indir len 0x%x, "
+			    "driver confused?\r\n",
+			    name, (u_int)vd->len);
+			return -1;
+		}
+		vindir = vm_map_gpa(ctx, vd->addr, vd->len);
+		if (vindir == NULL) {
+			fprintf(stderr,
+			    "%s: invalid indir addr 0x%lx, "
+			    "driver confused?\r\n",
+			    name, (uint64_t)vd->addr);
+			return -1;
+		}
+		/* Indirect tables are used whole, in order. */
+		for (j = 0; j < n_indir; j++) {
+			if (vindir[j].flags & VRING_DESC_F_INDIRECT) {
+				fprintf(stderr,
+				    "%s: indirect desc has INDIR flag,"
+				    " driver confused?\r\n",
+				    name);
+				return -1;
+			}
+			_vq_record_packed(i, &vindir[j], ctx, iov, n_iov,
+					  flags);
+			if (++i > VQ_MAX_DESCRIPTORS)
+				goto loopy;
+		}
+		break;
+	}
+	*pid = vd->id;
+	*pndesc = ndesc;
+	if (*pid >= vq->qsize) {
+		fprintf(stderr,
+		    "%s: buffer id %u out of range, driver confused?\r\n",
+		    name, *pid);
+		return -1;
+	}
+	return i;
+loopy:
+	fprintf(stderr,
+	    "%s: descriptor loop? count > %d - driver confused?\r\n",
+	    name, i);
+	return -1;
+}
+
+/*
+ * Account for the chain 'id' just taken, which ends before 'pos', so
+ * that it can be released, or given back by vq_retchain().
+ */
+static inline void
+_vq_packed_take(struct virtio_vq_info *vq, uint16_t pos, uint16_t id,
+		uint16_t ndesc)
+{
+	vq->ids[id].ndesc = ndesc;
+	vq->ids[id].prev = vq->last_id;
+	vq->last_id = id;
+	vq->last_avail = pos;
+}
+
+/*
+ * vq_getchain() for a packed ring.  The index given back for
+ * vq_relchain() is the buffer id.
+ */
+static int
+_vq_getchain_packed(struct virtio_vq_info *vq, uint16_t *pidx,
+		    struct iovec *iov, int n_iov, uint16_t *flags)
+{
+	uint16_t pos, id, ndesc;
+	int n;
+
+	pos = vq->last_avail;
+	if (!vq_packed_avail(vq, pos))
+		return 0;
+	/* the chain is read after the flags of its head */
+	__asm __volatile("" ::: "memory");
+
+	n = _vq_parse_packed(vq, &pos, &id, &ndesc, iov, n_iov, flags);
+	if (n < 0) {
+		vq->last_avail = pos;
+		return -1;
+	}
+	_vq_packed_take(vq, pos, id, ndesc);
+	*pidx = id;
+	return n;
+}
+
+/* vq_getchains() for a packed ring. */
+static int
+_vq_getchains_packed(struct virtio_vq_info *vq, struct vq_chain *chains,
+		     int nchains, struct iovec *iov, int n_iov,
+		     uint16_t *flags)
+{
+	uint16_t pos, id, ndesc;
+	int c, n, used;
+
+	used = 0;
+	for (c = 0; c < nchains && vq_packed_avail(vq, vq->last_avail);
+	     c++) {
+		__asm __volatile("" ::: "memory");
+		pos = vq->last_avail;
+		n = _vq_parse_packed(vq, &pos, &id, &ndesc, iov + used,
+				     n_iov - used, flags ? flags + used : NULL);
+		if (c > 0 && (n < 0 || n > n_iov - used))
+			break;
+		if (n < 0) {
+			vq->last_avail = pos;
+			return -1;
+		}
+		_vq_packed_take(vq, pos, id, ndesc);
+		chains[c].idx = id;
+		chains[c].n = n;
+		chains[c].iov = iov + used;
+		chains[c].flags = flags ? flags + used : NULL;
+		chains[c].len = 0;
+		used += MIN(n, n_iov - used);
+	}
+	return c;
+}
+
+/* vq_retchains() for a packed ring. */
+static void
+_vq_retchains_packed(struct virtio_vq_info *vq, int n)
+{
+	struct vq_packed_id *last;
+
+	while (n-- > 0) {
+		last = &vq->ids[vq->last_id];
+		vq->last_avail = _vq_packed_move(vq, vq->last_avail,
+						 -(int)last->ndesc);
+		vq->last_id = last->prev;
+	}
+}
+
+/*
+ * Write the used descriptor of chain 'id' at the used position of a
+ * packed ring, and move past the chain.  Its flags, which hand it to
+ * the guest, are left to the caller: they are returned, with where to
+ * put them in *pvd.
+ */
+static inline uint16_t
+_vq_packed_used(struct virtio_vq_info *vq, uint16_t id, uint32_t iolen,
+		volatile struct vring_packed_desc **pvd)
+{
+	volatile struct vring_packed_desc *vd;
+	uint16_t flags;
+
+	vd = &vq->pdesc[vq->used_idx & ~VRING_PACKED_WRAP];
+	vd->id = id;
+	vd->len = iolen;
+	flags = iolen ? VRING_DESC_F_WRITE : 0;
+	if (vq->used_idx & VRING_PACKED_WRAP)
+		flags |= VRING_PACKED_DESC_F_AVAIL | VRING_PACKED_DESC_F_USED;
+	vq->used_idx = _vq_packed_move(vq, vq->used_idx, vq->ids[id].ndesc);
+	*pvd = vd;
+	return flags;
+}
+
 /*
  * Return the currently-first request chain back to the available queue.
  *
@@ -452,7 +864,23 @@ loopy:
 void
 vq_retchain(struct virtio_vq_info *vq)
 {
-	vq->last_avail--;
+	if (vq->flags & VQ_PACKED)
+		_vq_retchains_packed(vq, 1);
+	else
+		vq->last_avail--;
+}
+
+/*
+ * Return the last 'n' chains taken back to the available queue, e.g.
+ * the ones of a vq_getchains() batch that could not be handled.
+ */
+void
+vq_retchains(struct virtio_vq_info *vq, int n)
+{
+	if (vq->flags & VQ_PACKED)
+		_vq_retchains_packed(vq, n);
+	else
+		vq->last_avail -= n;
 }
 
 /*
@@ -468,6 +896,15 @@ vq_relchain(struct virtio_vq_info *vq, uint16_t idx, uint32_t iolen)
 	uint16_t uidx, mask;
 	volatile struct vring_used *vuh;
 	volatile struct virtio_used *vue;
+	volatile struct vring_packed_desc *vd;
+	uint16_t flags;
+
+	if (vq->flags & VQ_PACKED) {
+		flags = _vq_packed_used(vq, idx, iolen, &vd);
+		__asm __volatile("" ::: "memory");
+		vd->flags = flags;
+		return;
+	}
 
 	/*
 	 * Notes:
@@ -489,6 +926,54 @@ vq_relchain(struct virtio_vq_info *vq, uint16_t idx, uint32_t iolen)
 	vuh->idx = uidx;
 }
 
+/*
+ * Return 'n' chains to the guest, with the lengths in their 'len', and
+ * a single update of the used index. As after vq_relchain(), call
+ * vq_endchains() when done.
+ */
+void
+vq_relchains(struct virtio_vq_info *vq, const struct vq_chain *chains, int n)
+{
+	uint16_t uidx, mask;
+	volatile struct vring_used *vuh;
+	volatile struct virtio_used *vue;
+	volatile struct vring_packed_desc *vd, *first;
+	uint16_t flags, first_flags;
+	int i;
+
+	if (vq->flags & VQ_PACKED) {
+		/*
+		 * The guest reads used descriptors in order, so it sees
+		 * none of them until the first one has its flags.
+		 */
+		if (n == 0)
+			return;
+		first_flags = _vq_packed_used(vq, chains[0].idx,
+					      chains[0].len, &first);
+		for (i = 1; i < n; i++) {
+			flags = _vq_packed_used(vq, chains[i].idx,
+						chains[i].len, &vd);
+			vd->flags = flags;
+		}
+		__asm __volatile("" ::: "memory");
+		first->flags = first_flags;
+		return;
+	}
+
+	mask = vq->qsize - 1;
+	vuh = vq->used;
+
+	uidx = vuh->idx;
+	for (i = 0; i < n; i++) {
+		vue = &vuh->ring[uidx++ & mask];
+		vue->idx = chains[i].idx;
+		vue->tlen = chains[i].len;
+	}
+	/* the guest sees the entries before the index */
+	__asm __volatile("" ::: "memory");
+	vuh->idx = uidx;
+}
+
 /*
  * Driver has finished processing "available" chains and calling
  * vq_relchain on each one.  If driver used all the available
@@ -503,14 +988,72 @@ vq_relchain(struct virtio_vq_info *vq, uint16_t idx, uint32_t iolen)
  * a snapshot of the ring state when he decided to finish interrupt
  * processing -- it's possible that descriptors became available after
  * that point.  (It's also typically a constant 1/True as well.)
+ *
+ * vq_endchains_intr() does the same but leaves the interrupt to the
+ * caller, who may deliver it after dropping its queue lock.
  */
 void
 vq_endchains(struct virtio_vq_info *vq, int used_all_avail)
+{
+	if (vq_endchains_intr(vq, used_all_avail))
+		vq_interrupt(vq->base, vq);
+}
+
+/*
+ * vq_endchains_intr() for a packed ring, where the guest asks for
+ * interrupts through the driver event suppression structure, and
+ * with EVENT_IDX, at a given position (and wrap counter).
+ */
+static int
+_vq_endchains_packed(struct virtio_vq_info *vq, int used_all_avail)
+{
+	struct virtio_base *base;
+	uint16_t new_idx, old_idx, off_wrap, flags;
+	int n, off;
+
+	base = vq->base;
+	old_idx = vq->save_used;
+	vq->save_used = new_idx = vq->used_idx;
+	if (used_all_avail &&
+	    (base->negotiated_caps & VIRTIO_F_NOTIFY_ON_EMPTY))
+		return 1;
+	if (new_idx == old_idx)
+		return 0;
+
+	/* the used descriptors are visible before the event is read */
+	mb();
+	flags = vq->driver_event->flags;
+	if (flags == VRING_PACKED_EVENT_F_DISABLE)
+		return 0;
+	if (flags != VRING_PACKED_EVENT_F_DESC ||
+	    (base->negotiated_caps & VIRTIO_RING_F_EVENT_IDX) == 0)
+		return 1;
+
+	/*
+	 * As for the split ring, but with the event position and the
+	 * old one made relative to the lap of the new one.
+	 */
+	off_wrap = vq->driver_event->off_wrap;
+	n = (new_idx & ~VRING_PACKED_WRAP) - (old_idx & ~VRING_PACKED_WRAP);
+	if ((new_idx ^ old_idx) & VRING_PACKED_WRAP)
+		n += vq->qsize;
+	off = off_wrap & ~VRING_PACKED_WRAP;
+	if ((new_idx ^ off_wrap) & VRING_PACKED_WRAP)
+		off -= vq->qsize;
+	return (uint16_t)((new_idx & ~VRING_PACKED_WRAP) - off - 1) <
+		(uint16_t)n;
+}
+
+int
+vq_endchains_intr(struct virtio_vq_info *vq, int used_all_avail)
 {
 	struct virtio_base *base;
 	uint16_t event_idx, new_idx, old_idx;
 	int intr;
 
+	if (vq->flags & VQ_PACKED)
+		return _vq_endchains_packed(vq, used_all_avail);
+
 	/*
 	 * Interrupt generation: if we're using EVENT_IDX,
 	 * interrupt if we've crossed the event threshold.
@@ -538,8 +1081,287 @@ vq_endchains(struct virtio_vq_info *vq, int used_all_avail)
 		intr = new_idx != old_idx &&
 		    !(vq->avail->flags & VRING_AVAIL_F_NO_INTERRUPT);
 	}
-	if (intr)
-		vq_interrupt(base, vq);
+	return intr;
+}
+
+/*
+ * Queue polling and interrupt moderation, see struct virtio_poll.
+ */
+static inline uint64_t
+virtio_poll_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+/*
+ * Hold back the interrupt of 'vq' if one was delivered less than the
+ * interrupt period ago; the polling thread delivers it at the end of
+ * the period.
+ */
+bool
+virtio_poll_intr(struct virtio_base *base, struct virtio_vq_info *vq)
+{
+	struct virtio_poll *poll = &base->poll;
+	uint64_t now;
+	bool held;
+
+	now = virtio_poll_now();
+	held = false;
+	pthread_mutex_lock(&poll->mtx);
+	if (poll->intr == 0)
+		;
+	else if (now < vq->intr_next) {
+		if ((poll->pending & (1UL << vq->num)) == 0) {
+			poll->pending |= 1UL << vq->num;
+			pthread_cond_signal(&poll->cond);
+		}
+		held = true;
+	} else
+		vq->intr_next = now + poll->intr;
+	pthread_mutex_unlock(&poll->mtx);
+	return held;
+}
+
+/*
+ * Deliver the interrupts held back whose period is over, or all of
+ * them if 'all'.  Returns when the next one is due, or 0 if none is
+ * left.
+ */
+static uint64_t
+virtio_poll_flush(struct virtio_base *base, uint64_t now, bool all)
+{
+	struct virtio_poll *poll = &base->poll;
+	struct virtio_vq_info *vq;
+	uint64_t due, next;
+	int i;
+
+	due = next = 0;
+	pthread_mutex_lock(&poll->mtx);
+	for (i = 0; i < base->vops->nvq; i++) {
+		if ((poll->pending & (1UL << i)) == 0)
+			continue;
+		vq = &base->queues[i];
+		if (all || vq->intr_next <= now) {
+			due |= 1UL << i;
+			vq->intr_next = now + poll->intr;
+		} else if (next == 0 || vq->intr_next < next)
+			next = vq->intr_next;
+	}
+	poll->pending &= ~due;
+	pthread_mutex_unlock(&poll->mtx);
+
+	for (i = 0; due != 0; i++, due >>= 1)
+		if (due & 1)
+			vq_do_interrupt(base, &base->queues[i]);
+	return next;
+}
+
+/* Pass a new chain on to the queue notify callback, as a kick would. */
+static void
+virtio_poll_notify(struct virtio_base *base, struct virtio_vq_info *vq)
+{
+	struct virtio_ops *vops = base->vops;
+
+	if (!(base->flags & VIRTIO_NOTIFY_UNLOCKED))
+		VIRTIO_BASE_LOCK(base);
+	if (vq->notify)
+		(*vq->notify)(DEV_STRUCT(base), vq);
+	else if (vops->qnotify)
+		(*vops->qnotify)(DEV_STRUCT(base), vq);
+	if (!(base->flags & VIRTIO_NOTIFY_UNLOCKED))
+		VIRTIO_BASE_UNLOCK(base);
+}
+
+/*
+ * Poll the queues until they are idle for the budget.  Activity is
+ * the device taking chains, which it may do in its own thread; the
+ * notify callbacks are called as long as chains are left, and the
+ * devices are expected to cope with that, as with spurious kicks.
+ */
+static void
+virtio_poll_run(struct virtio_base *base)
+{
+	struct virtio_poll *poll = &base->poll;
+	struct virtio_vq_info *vq;
+	uint16_t seen[64];
+	uint64_t now, idle;
+	bool busy;
+	int i, nvq;
+
+	nvq = base->vops->nvq;
+	for (i = 0; i < nvq; i++) {
+		vq = &base->queues[i];
+		seen[i] = vq->last_avail;
+		if ((poll->vqmask & (1UL << i)) && vq_ring_ready(vq))
+			vq_set_notify(vq, false);
+	}
+
+	idle = virtio_poll_now();
+	for (;;) {
+		busy = false;
+		for (i = 0; i < nvq; i++) {
+			if ((poll->vqmask & (1UL << i)) == 0)
+				continue;
+			vq = &base->queues[i];
+			if (!vq_has_descs(vq))
+				continue;
+			/* the driver may have turned notifies back on */
+			vq_set_notify(vq, false);
+			virtio_poll_notify(base, vq);
+			if (vq->last_avail != seen[i]) {
+				seen[i] = vq->last_avail;
+				busy = true;
+			}
+		}
+		now = virtio_poll_now();
+		if (poll->pending)
+			virtio_poll_flush(base, now, false);
+		if (busy)
+			idle = now;
+		else if (now - idle > poll->budget || poll->closing)
+			break;
+		__asm __volatile("pause");
+	}
+
+	/*
+	 * Back to notifies.  Chains made available before the driver
+	 * sees them on are passed on now, as no kick will come for them.
+	 */
+	for (i = 0; i < nvq; i++) {
+		vq = &base->queues[i];
+		if ((poll->vqmask & (1UL << i)) && vq_ring_ready(vq))
+			vq_set_notify(vq, true);
+	}
+	mb();
+	for (i = 0; i < nvq; i++) {
+		vq = &base->queues[i];
+		if ((poll->vqmask & (1UL << i)) && vq_has_descs(vq))
+			virtio_poll_notify(base, vq);
+	}
+}
+
+static void *
+virtio_poll_thread(void *arg)
+{
+	struct virtio_base *base = arg;
+	struct virtio_poll *poll = &base->poll;
+	struct timespec ts;
+	uint64_t next;
+
+	pthread_mutex_lock(&poll->mtx);
+	while (!poll->closing) {
+		if (poll->kicked) {
+			poll->kicked = false;
+			pthread_mutex_unlock(&poll->mtx);
+			virtio_poll_run(base);
+			pthread_mutex_lock(&poll->mtx);
+			continue;
+		}
+		if (poll->pending == 0) {
+			pthread_cond_wait(&poll->cond, &poll->mtx);
+			continue;
+		}
+		pthread_mutex_unlock(&poll->mtx);
+		next = virtio_poll_flush(base, virtio_poll_now(), false);
+		pthread_mutex_lock(&poll->mtx);
+		if (next != 0 && !poll->kicked && !poll->closing) {
+			ts.tv_sec = next / 1000000000UL;
+			ts.tv_nsec = next % 1000000000UL;
+			pthread_cond_timedwait(&poll->cond, &poll->mtx, &ts);
+		}
+	}
+	pthread_mutex_unlock(&poll->mtx);
+	return NULL;
+}
+
+/* A guest notify came: start polling, if not yet. */
+static inline void
+virtio_poll_kick(struct virtio_base *base)
+{
+	struct virtio_poll *poll = &base->poll;
+
+	if (!(base->flags & VIRTIO_POLL) || poll->budget == 0)
+		return;
+	pthread_mutex_lock(&poll->mtx);
+	if (!poll->kicked) {
+		poll->kicked = true;
+		pthread_cond_signal(&poll->cond);
+	}
+	pthread_mutex_unlock(&poll->mtx);
+}
+
+int
+virtio_poll_start(struct virtio_base *base, uint64_t vqmask,
+		  uint32_t budget_us, uint32_t intr_us)
+{
+	struct virtio_poll *poll = &base->poll;
+	pthread_condattr_t cattr;
+	char tname[MAXCOMLEN + 1];
+
+	if (base->vops->nvq > 64) {
+		fprintf(stderr, "%s: too many queues to poll\r\n",
+			base->vops->name);
+		return -1;
+	}
+	if (budget_us == 0 && intr_us == 0)
+		return 0;
+
+	memset(poll, 0, sizeof(*poll));
+	poll->vqmask = budget_us ? vqmask : 0;
+	poll->budget = budget_us * 1000UL;
+	poll->intr = intr_us * 1000UL;
+	pthread_mutex_init(&poll->mtx, NULL);
+	pthread_condattr_init(&cattr);
+	pthread_condattr_setclock(&cattr, CLOCK_MONOTONIC);
+	pthread_cond_init(&poll->cond, &cattr);
+	pthread_condattr_destroy(&cattr);
+
+	if (pthread_create(&poll->tid, NULL, virtio_poll_thread, base)) {
+		fprintf(stderr, "%s: cannot create poll thread\r\n",
+			base->vops->name);
+		return -1;
+	}
+	snprintf(tname, sizeof(tname), "%s-%d:%d poll", base->vops->name,
+		 base->dev->slot, base->dev->func);
+	pthread_setname_np(poll->tid, tname);
+	base->flags |= VIRTIO_POLL;
+	return 0;
+}
+
+void
+virtio_poll_stop(struct virtio_base *base)
+{
+	struct virtio_poll *poll = &base->poll;
+
+	if (!(base->flags & VIRTIO_POLL))
+		return;
+
+	pthread_mutex_lock(&poll->mtx);
+	poll->closing = true;
+	pthread_cond_signal(&poll->cond);
+	pthread_mutex_unlock(&poll->mtx);
+	pthread_join(poll->tid, NULL);
+
+	/*
+	 * The mutex stays, for the interrupts racing with this: those
+	 * see intr cleared, and are delivered right away.
+	 */
+	pthread_mutex_lock(&poll->mtx);
+	poll->intr = 0;
+	pthread_mutex_unlock(&poll->mtx);
+	virtio_poll_flush(base, 0, true);
+}
+
+int
+virtio_poll_parse(const char *opt, uint32_t *budget_us, uint32_t *intr_us)
+{
+	*intr_us = 0;
+	if (sscanf(opt, "poll=%u/%u", budget_us, intr_us) < 1)
+		return -1;
+	return 0;
 }
 
 struct config_reg {
@@ -741,6 +1563,44 @@ done:
 	return value;
 }
 
+/*
+ * Doorbell handler of a virtqueue: same as a guest queue notify.
+ */
+static void
+virtio_vq_doorbell(void *arg)
+{
+	struct virtio_vq_info *vq = arg;
+	struct virtio_base *base = vq->base;
+	struct virtio_ops *vops = base->vops;
+
+	if (!(base->flags & VIRTIO_NOTIFY_UNLOCKED))
+		VIRTIO_BASE_LOCK(base);
+	if (vq->notify)
+		(*vq->notify)(DEV_STRUCT(base), vq);
+	else if (vops->qnotify)
+		(*vops->qnotify)(DEV_STRUCT(base), vq);
+	if (!(base->flags & VIRTIO_NOTIFY_UNLOCKED))
+		VIRTIO_BASE_UNLOCK(base);
+	virtio_poll_kick(base);
+}
+
+/*
+ * Called after a queue notify at 'addr' went through the DM: let the
+ * hypervisor complete the following ones by itself. The doorbell goes
+ * away when the BAR holding 'addr' is unregistered, and is added back
+ * on the next notify. Must be called without base->mtx held.
+ */
+static void
+virtio_add_doorbell(struct virtio_base *base, uint64_t idx, uint32_t type,
+		    uint64_t addr)
+{
+	if (idx >= base->vops->nvq)
+		return;
+
+	doorbell_add(base->dev->vmctx, type, addr, idx, DOORBELL_F_DATAMATCH,
+		     virtio_vq_doorbell, &base->queues[idx]);
+}
+
 /*
  * Handle pci config space writes.
  * If it's to the MSI-X info, do that.
@@ -848,6 +1708,7 @@ bad:
 			fprintf(stderr,
 			    "%s: qnotify queue %d: missing vq/vops notify\r\n",
 				name, (int)value);
+		virtio_poll_kick(base);
 		break;
 	case VIRTIO_CR_STATUS:
 		base->status = value;
@@ -875,6 +1736,10 @@ bad_qindex:
 done:
 	if (base->mtx)
 		pthread_mutex_unlock(base->mtx);
+
+	if (offset == VIRTIO_CR_QNOTIFY && size == 2)
+		virtio_add_doorbell(base, value, REQ_PORTIO,
+				    dev->bar[baridx].addr + offset);
 }
 
 /*
@@ -1051,6 +1916,22 @@ virtio_get_cap_id(uint64_t offset, int size)
 	return rc;
 }
 
+/*
+ * Features offered to modern drivers: the packed ring comes on top of
+ * the device's own, as the vq_* functions handle it for every device.
+ * Legacy-only devices never get it, VIRTIO_F_RING_PACKED is above the
+ * 32 feature bits of the legacy interface.
+ */
+static uint64_t
+virtio_modern_caps(struct virtio_base *base)
+{
+	uint64_t caps = base->vops->hv_caps;
+
+	if (caps & VIRTIO_F_VERSION_1)
+		caps |= VIRTIO_F_RING_PACKED;
+	return caps;
+}
+
 static uint32_t
 virtio_common_cfg_read(struct pci_vdev *dev, uint64_t offset, int size)
 {
@@ -1086,9 +1967,9 @@ virtio_common_cfg_read(struct pci_vdev *dev, uint64_t offset, int size)
 		break;
 	case VIRTIO_COMMON_DF:
 		if (base->device_feature_select == 0)
-			value = vops->hv_caps & 0xffffffff;
+			value = virtio_modern_caps(base) & 0xffffffff;
 		else if (base->device_feature_select == 1)
-			value = (vops->hv_caps >> 32) & 0xffffffff;
+			value = (virtio_modern_caps(base) >> 32) & 0xffffffff;
 		else /* present 0, see 4.1.4.3.1 */
 			value = 0;
 		break;
@@ -1212,10 +2093,13 @@ virtio_common_cfg_write(struct pci_vdev *dev, uint64_t offset, int size,
 		if (base->status & VIRTIO_CR_STATUS_DRIVER_OK)
 			break;
 		if (base->driver_feature_select < 2) {
+			/* keep the other half, written with the other select */
 			value &= 0xffffffff;
-			base->negotiated_caps =
+			base->negotiated_caps &=
+				~(0xffffffffUL << (base->driver_feature_select * 32));
+			base->negotiated_caps |=
 				(value << (base->driver_feature_select * 32))
-				& vops->hv_caps;
+				& virtio_modern_caps(base);
 			if (vops->apply_features)
 				(*vops->apply_features)(DEV_STRUCT(base),
 					base->negotiated_caps);
@@ -1411,6 +2295,7 @@ virtio_notify_cfg_write(struct pci_vdev *dev, uint64_t offset, int size,
 		fprintf(stderr,
 			"%s: qnotify queue %lu: missing vq/vops notify\r\n",
 			name, idx);
+	virtio_poll_kick(base);
 }
 
 static uint32_t
@@ -1479,6 +2364,7 @@ virtio_pci_modern_mmio_write(struct vmctx *ctx, int vcpu, struct pci_vdev *dev,
 	struct virtio_base *base = dev->arg;
 	struct virtio_ops *vops;
 	const char *name;
+	bool locked;
 	int capid;
 
 	assert(base->modern_mmio_bar_idx == baridx);
@@ -1501,7 +2387,9 @@ virtio_pci_modern_mmio_write(struct vmctx *ctx, int vcpu, struct pci_vdev *dev,
 		return;
 	}
 
-	if (base->mtx)
+	locked = base->mtx && !(capid == VIRTIO_PCI_CAP_NOTIFY_CFG &&
+				(base->flags & VIRTIO_NOTIFY_UNLOCKED));
+	if (locked)
 		pthread_mutex_lock(base->mtx);
 
 	switch (capid) {
@@ -1523,8 +2411,14 @@ virtio_pci_modern_mmio_write(struct vmctx *ctx, int vcpu, struct pci_vdev *dev,
 			name, baridx, offset, size);
 	}
 
-	if (base->mtx)
+	if (locked)
 		pthread_mutex_unlock(base->mtx);
+
+	if (capid == VIRTIO_PCI_CAP_NOTIFY_CFG)
+		virtio_add_doorbell(base,
+				    offset / VIRTIO_MODERN_NOTIFY_OFF_MULT,
+				    REQ_MMIO, dev->bar[baridx].addr +
+				    VIRTIO_CAP_NOTIFY_OFFSET + offset);
 }
 
 static uint32_t
@@ -1568,8 +2462,8 @@ virtio_pci_modern_pio_write(struct vmctx *ctx, int vcpu, struct pci_vdev *dev,
 		return;
 	}
 
-	if (base->mtx)
-		pthread_mutex_lock(base->mtx);
+	if (!(base->flags & VIRTIO_NOTIFY_UNLOCKED))
+		VIRTIO_BASE_LOCK(base);
 
 	vq = &base->queues[idx];
 	if (vq->notify)
@@ -1581,8 +2475,12 @@ virtio_pci_modern_pio_write(struct vmctx *ctx, int vcpu, struct pci_vdev *dev,
 			"%s: qnotify queue %lu: missing vq/vops notify\r\n",
 			name, idx);
 
-	if (base->mtx)
-		pthread_mutex_unlock(base->mtx);
+	if (!(base->flags & VIRTIO_NOTIFY_UNLOCKED))
+		VIRTIO_BASE_UNLOCK(base);
+	virtio_poll_kick(base);
+
+	virtio_add_doorbell(base, idx, REQ_PORTIO,
+			    dev->bar[baridx].addr + offset);
 }
 
 uint64_t
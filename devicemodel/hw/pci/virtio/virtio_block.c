@@ -46,6 +46,7 @@
 #include "dm.h"
 #include "pci_core.h"
 #include "virtio.h"
+#include "vhost_user.h"
 #include "block_if.h"
 
 #define VIRTIO_BLK_RINGSZ	64
@@ -61,6 +62,16 @@
 #define	VIRTIO_BLK_F_BLK_SIZE	(1 << 6)	/* cfg block size valid */
 #define	VIRTIO_BLK_F_FLUSH	(1 << 9)	/* Cache flush support */
 #define	VIRTIO_BLK_F_TOPOLOGY	(1 << 10)	/* Optimal I/O alignment */
+#define	VIRTIO_BLK_F_MQ		(1 << 12)	/* Multiple request queues */
+#define	VIRTIO_BLK_F_DISCARD	(1 << 13)	/* Discard support */
+#define	VIRTIO_BLK_F_WRITE_ZEROES	(1 << 14)	/* Write zeroes support */
+
+/* One range per discard or write zeroes request */
+#define	VIRTIO_BLK_MAX_DISCARD_SEG	1
+#define	VIRTIO_BLK_MAX_DISCARD_SECTORS	(1U << 22)	/* 2GB */
+
+#define	VIRTIO_BLK_MAX_QUEUES	16
+#define	VIRTIO_BLK_BATCH	8	/* requests taken from a queue at once */
 
 /*
  * Host capabilities
@@ -72,6 +83,10 @@
 	VIRTIO_BLK_F_TOPOLOGY |						    \
 	VIRTIO_RING_F_INDIRECT_DESC)	/* indirect descriptors */
 
+/* what comes from our config space with a vhost-user backend */
+#define VIRTIO_BLK_S_VHOST_USER \
+	(VIRTIO_BLK_F_BLK_SIZE | VIRTIO_BLK_F_TOPOLOGY | VIRTIO_BLK_F_MQ)
+
 /*
  * Config space "registers"
  */
@@ -92,6 +107,15 @@ struct virtio_blk_config {
 		uint32_t opt_io_size;
 	} topology;
 	uint8_t	writeback;
+	uint8_t	unused0;
+	uint16_t num_queues;
+	uint32_t max_discard_sectors;
+	uint32_t max_discard_seg;
+	uint32_t discard_sector_alignment;
+	uint32_t max_write_zeroes_sectors;
+	uint32_t max_write_zeroes_seg;
+	uint8_t	write_zeroes_may_unmap;
+	uint8_t	unused1[3];
 } __attribute__((packed));
 
 /*
@@ -103,12 +127,23 @@ struct virtio_blk_hdr {
 #define	VBH_OP_FLUSH		4
 #define	VBH_OP_FLUSH_OUT	5
 #define	VBH_OP_IDENT		8
+#define	VBH_OP_DISCARD		11
+#define	VBH_OP_WRITE_ZEROES	13
 #define	VBH_FLAG_BARRIER	0x80000000	/* OR'ed into type */
 	uint32_t type;
 	uint32_t ioprio;
 	uint64_t sector;
 } __attribute__((packed));
 
+/*
+ * Range of a discard or write zeroes request
+ */
+struct virtio_blk_discard_write_zeroes {
+	uint64_t sector;
+	uint32_t num_sectors;
+	uint32_t flags;
+} __attribute__((packed));
+
 /*
  * Debug printf
  */
@@ -118,25 +153,42 @@ static int virtio_blk_debug;
 
 struct virtio_blk_ioreq {
 	struct blockif_req req;
-	struct virtio_blk *blk;
+	struct virtio_blk_queue *q;
 	uint8_t *status;
 	uint16_t idx;
 };
 
+/*
+ * Per-queue struct. Each request queue has its own lock, MSI-X vector
+ * and blockif, so queues used by different vCPUs don't contend.
+ */
+struct virtio_blk_queue {
+	pthread_mutex_t mtx;
+	struct virtio_blk *blk;
+	struct virtio_vq_info *vq;
+	struct blockif_ctxt *bc;	/* the device's one for queue 0 */
+	struct virtio_blk_ioreq ios[VIRTIO_BLK_RINGSZ];
+};
+
 /*
  * Per-device struct
  */
 struct virtio_blk {
 	struct virtio_base base;
+	struct virtio_ops ops;	/* host caps depend on the backend */
 	pthread_mutex_t mtx;
-	struct virtio_vq_info vq;
+	int nqueues;
+	struct virtio_vq_info vqs[VIRTIO_BLK_MAX_QUEUES];
+	struct virtio_blk_queue queues[VIRTIO_BLK_MAX_QUEUES];
 	struct virtio_blk_config cfg;
 	struct blockif_ctxt *bc;
 	char ident[VIRTIO_BLK_BLK_ID_BYTES + 1];
-	struct virtio_blk_ioreq ios[VIRTIO_BLK_RINGSZ];
+	int vhost_user;		/* the requests go to vu */
+	struct vhost_user vu;
 };
 
 static void virtio_blk_reset(void *);
+static void virtio_blk_set_status(void *, uint64_t);
 static void virtio_blk_notify(void *, struct virtio_vq_info *);
 static int virtio_blk_cfgread(void *, int, int, uint32_t *);
 static int virtio_blk_cfgwrite(void *, int, int, uint32_t);
@@ -150,7 +202,7 @@ static struct virtio_ops virtio_blk_ops = {
 	virtio_blk_cfgread,	/* read PCI config */
 	virtio_blk_cfgwrite,	/* write PCI config */
 	NULL,			/* apply negotiated features */
-	NULL,			/* called on guest set status */
+	virtio_blk_set_status,	/* called on guest set status */
 	VIRTIO_BLK_S_HOSTCAPS,	/* our capabilities */
 };
 
@@ -158,17 +210,36 @@ static void
 virtio_blk_reset(void *vdev)
 {
 	struct virtio_blk *blk = vdev;
+	int i;
 
 	DPRINTF(("virtio_blk: device reset requested !\n"));
+	if (blk->vhost_user)
+		vhost_user_stop(&blk->vu);
+	for (i = 0; i < blk->nqueues; i++)
+		pthread_mutex_lock(&blk->queues[i].mtx);
 	virtio_reset_dev(&blk->base);
+	for (i = blk->nqueues - 1; i >= 0; i--)
+		pthread_mutex_unlock(&blk->queues[i].mtx);
 }
 
 static void
-virtio_blk_done(struct blockif_req *br, int err)
+virtio_blk_set_status(void *vdev, uint64_t status)
 {
-	struct virtio_blk_ioreq *io = br->param;
-	struct virtio_blk *blk = io->blk;
+	struct virtio_blk *blk = vdev;
+
+	if (blk->vhost_user && (status & VIRTIO_CR_STATUS_DRIVER_OK) &&
+	    vhost_user_start(&blk->vu, blk->base.negotiated_caps,
+			     blk->nqueues) < 0)
+		WPRINTF(("virtio_blk: vhost-user failed to start\n"));
+}
 
+/*
+ * Complete a request, with the queue lock held: the caller checks
+ * whether the guest wants an interrupt.
+ */
+static void
+virtio_blk_complete(struct virtio_blk_ioreq *io, int err)
+{
 	/* convert errno into a virtio block error return */
 	if (err == EOPNOTSUPP || err == ENOSYS)
 		*io->status = VIRTIO_BLK_S_UNSUPP;
@@ -181,14 +252,58 @@ virtio_blk_done(struct blockif_req *br, int err)
 	 * Return the descriptor back to the host.
 	 * We wrote 1 byte (our status) to host.
 	 */
-	pthread_mutex_lock(&blk->mtx);
-	vq_relchain(&blk->vq, io->idx, 1);
-	vq_endchains(&blk->vq, 0);
-	pthread_mutex_unlock(&blk->mtx);
+	vq_relchain(io->q->vq, io->idx, 1);
 }
 
 static void
-virtio_blk_proc(struct virtio_blk *blk, struct virtio_vq_info *vq)
+virtio_blk_done(struct blockif_req *br, int err)
+{
+	struct virtio_blk_ioreq *io = br->param;
+	struct virtio_blk_queue *q = io->q;
+	int intr;
+
+	/*
+	 * The interrupt may need the device lock, so it is sent without
+	 * the queue lock held.
+	 */
+	pthread_mutex_lock(&q->mtx);
+	virtio_blk_complete(io, err);
+	intr = vq_endchains_intr(q->vq, 0);
+	pthread_mutex_unlock(&q->mtx);
+	if (intr)
+		vq_interrupt(&q->blk->base, q->vq);
+}
+
+/*
+ * Turn the single range of a discard or write zeroes request into the
+ * offset and length of the block request.
+ */
+static int
+virtio_blk_range(struct virtio_blk *blk, struct blockif_req *br)
+{
+	struct virtio_blk_discard_write_zeroes *range;
+
+	if (br->iovcnt != 1 || br->iov[0].iov_len != sizeof(*range))
+		return -1;
+
+	range = br->iov[0].iov_base;
+	if (range->num_sectors > VIRTIO_BLK_MAX_DISCARD_SECTORS ||
+	    range->sector + range->num_sectors > blk->cfg.capacity)
+		return -1;
+
+	br->iovcnt = 0;
+	br->offset = range->sector * DEV_BSIZE;
+	br->resid = (ssize_t)range->num_sectors * DEV_BSIZE;
+	return 0;
+}
+
+/*
+ * Start a request, with the queue lock held. Return 1 if it was completed
+ * right away, in which case the caller sends the interrupt.
+ */
+static int
+virtio_blk_proc(struct virtio_blk *blk, struct virtio_blk_queue *q,
+		struct vq_chain *c)
 {
 	struct virtio_blk_hdr *vbh;
 	struct virtio_blk_ioreq *io;
@@ -196,10 +311,10 @@ virtio_blk_proc(struct virtio_blk *blk, struct virtio_vq_info *vq)
 	int err;
 	ssize_t iolen;
 	int writeop, type;
-	struct iovec iov[BLOCKIF_IOV_MAX + 2];
-	uint16_t idx, flags[BLOCKIF_IOV_MAX + 2];
+	struct iovec *iov = c->iov;
+	uint16_t *flags = c->flags;
 
-	n = vq_getchain(vq, &idx, iov, BLOCKIF_IOV_MAX + 2, flags);
+	n = c->n;
 
 	/*
 	 * The first descriptor will be the read-only fixed header,
@@ -211,7 +326,7 @@ virtio_blk_proc(struct virtio_blk *blk, struct virtio_vq_info *vq)
 	 */
 	assert(n >= 2 && n <= BLOCKIF_IOV_MAX + 2);
 
-	io = &blk->ios[idx];
+	io = &q->ios[c->idx];
 	assert((flags[0] & VRING_DESC_F_WRITE) == 0);
 	assert(iov[0].iov_len == sizeof(struct virtio_blk_hdr));
 	vbh = iov[0].iov_base;
@@ -228,7 +343,8 @@ virtio_blk_proc(struct virtio_blk *blk, struct virtio_vq_info *vq)
 	 * we don't advertise the capability.
 	 */
 	type = vbh->type & ~VBH_FLAG_BARRIER;
-	writeop = (type == VBH_OP_WRITE);
+	writeop = (type == VBH_OP_WRITE || type == VBH_OP_DISCARD ||
+		   type == VBH_OP_WRITE_ZEROES);
 
 	iolen = 0;
 	for (i = 1; i < n; i++) {
@@ -249,14 +365,25 @@ virtio_blk_proc(struct virtio_blk *blk, struct virtio_vq_info *vq)
 
 	switch (type) {
 	case VBH_OP_READ:
-		err = blockif_read(blk->bc, &io->req);
+		err = blockif_read(q->bc, &io->req);
 		break;
 	case VBH_OP_WRITE:
-		err = blockif_write(blk->bc, &io->req);
+		err = blockif_write(q->bc, &io->req);
 		break;
 	case VBH_OP_FLUSH:
 	case VBH_OP_FLUSH_OUT:
-		err = blockif_flush(blk->bc, &io->req);
+		err = blockif_flush(q->bc, &io->req);
+		break;
+	case VBH_OP_DISCARD:
+	case VBH_OP_WRITE_ZEROES:
+		if (virtio_blk_range(blk, &io->req) != 0) {
+			virtio_blk_complete(io, EINVAL);
+			return 1;
+		}
+		if (type == VBH_OP_DISCARD)
+			err = blockif_delete(q->bc, &io->req);
+		else
+			err = blockif_write_zeroes(q->bc, &io->req);
 		break;
 	case VBH_OP_IDENT:
 		/* Assume a single buffer */
@@ -264,34 +391,121 @@ virtio_blk_proc(struct virtio_blk *blk, struct virtio_vq_info *vq)
 		memset(iov[1].iov_base, 0, iov[1].iov_len);
 		strncpy(iov[1].iov_base, blk->ident,
 		    MIN(iov[1].iov_len, sizeof(blk->ident)));
-		virtio_blk_done(&io->req, 0);
-		return;
+		virtio_blk_complete(io, 0);
+		return 1;
 	default:
-		virtio_blk_done(&io->req, EOPNOTSUPP);
-		return;
+		virtio_blk_complete(io, EOPNOTSUPP);
+		return 1;
 	}
 	assert(err == 0);
+	return 0;
 }
 
+/*
+ * Called without the device lock, but for legacy notifies
+ */
 static void
 virtio_blk_notify(void *vdev, struct virtio_vq_info *vq)
 {
 	struct virtio_blk *blk = vdev;
+	struct virtio_blk_queue *q = &blk->queues[vq->num];
+	struct vq_chain chains[VIRTIO_BLK_BATCH];
+	struct iovec iov[VIRTIO_BLK_BATCH * (BLOCKIF_IOV_MAX + 2)];
+	uint16_t flags[VIRTIO_BLK_BATCH * (BLOCKIF_IOV_MAX + 2)];
+	int i, n, done, intr;
+
+	if (blk->vhost_user) {
+		vhost_user_kick(&blk->vu, vq);
+		return;
+	}
+
+	done = 0;
+	pthread_mutex_lock(&q->mtx);
+	while (vq_has_descs(vq)) {
+		n = vq_getchains(vq, chains, VIRTIO_BLK_BATCH, iov,
+				 VIRTIO_BLK_BATCH * (BLOCKIF_IOV_MAX + 2),
+				 flags);
+		assert(n >= 1);
+		for (i = 0; i < n; i++)
+			done |= virtio_blk_proc(blk, q, &chains[i]);
+	}
+	/* as in virtio_blk_done(), interrupt without the queue lock */
+	intr = done && vq_endchains_intr(vq, 0);
+	pthread_mutex_unlock(&q->mtx);
+	if (intr)
+		vq_interrupt(&blk->base, vq);
+}
 
-	while (vq_has_descs(vq))
-		virtio_blk_proc(blk, vq);
+/*
+ * Take the virtio-blk options out of 'opts', leaving the blockif ones:
+ * "queues=<n>", "queue_cpus=<cpu>[:<cpu>...]", the host CPUs to run
+ * the blockif threads of the queues on, in turn, and
+ * "poll=<us>[/<us>]", see virtio_poll_parse(), and
+ * "vhost-user=<socket>", the backend to serve the requests.  The image
+ * is still opened for the config space values.
+ */
+static int
+virtio_blk_parse_opts(char *opts, char *bopts, int *nqueues, int *cpus,
+		      int *ncpus, uint32_t *poll_us, uint32_t *intr_us,
+		      char **vu_path)
+{
+	char *cp, *cpu, *xopts;
+	int n;
+
+	*nqueues = 1;
+	*ncpus = 0;
+	*poll_us = *intr_us = 0;
+	*vu_path = NULL;
+	bopts[0] = '\0';
+	xopts = opts;
+	while ((cp = strsep(&xopts, ",")) != NULL) {
+		if (sscanf(cp, "queues=%d", nqueues) == 1) {
+			if (*nqueues < 1 || *nqueues > VIRTIO_BLK_MAX_QUEUES) {
+				fprintf(stderr, "virtio_blk: queues must be "
+					"1 to %d\n", VIRTIO_BLK_MAX_QUEUES);
+				return -1;
+			}
+		} else if (!strncmp(cp, "queue_cpus=", strlen("queue_cpus="))) {
+			cp += strlen("queue_cpus=");
+			while ((cpu = strsep(&cp, ":")) != NULL) {
+				if (*ncpus == VIRTIO_BLK_MAX_QUEUES ||
+				    sscanf(cpu, "%d", &n) != 1 || n < 0) {
+					fprintf(stderr, "virtio_blk: invalid "
+						"queue_cpus\n");
+					return -1;
+				}
+				cpus[(*ncpus)++] = n;
+			}
+		} else if (!strncmp(cp, "poll=", strlen("poll="))) {
+			if (virtio_poll_parse(cp, poll_us, intr_us)) {
+				fprintf(stderr, "virtio_blk: invalid poll\n");
+				return -1;
+			}
+		} else if (!strncmp(cp, "vhost-user=", strlen("vhost-user="))) {
+			*vu_path = cp + strlen("vhost-user=");
+		} else {
+			if (bopts[0] != '\0')
+				strcat(bopts, ",");
+			strcat(bopts, cp);
+		}
+	}
+	return 0;
 }
 
 static int
 virtio_blk_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 {
 	char bident[16];
+	char *xopts, *bopts, *vu_path;
 	struct blockif_ctxt *bctxt;
 	MD5_CTX mdctx;
 	u_char digest[16];
 	struct virtio_blk *blk;
+	struct virtio_blk_queue *q;
 	off_t size;
-	int i, sectsz, sts, sto;
+	int i, j, sectsz, sts, sto;
+	int nqueues, ncpus, cpus[VIRTIO_BLK_MAX_QUEUES];
+	uint32_t poll_us, intr_us;
 	pthread_mutexattr_t attr;
 	int rc;
 
@@ -300,13 +514,25 @@ virtio_blk_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 		return -1;
 	}
 
+	xopts = strdup(opts);
+	bopts = calloc(1, strlen(opts) + 1);
+	if (xopts == NULL || bopts == NULL ||
+	    virtio_blk_parse_opts(xopts, bopts, &nqueues, cpus, &ncpus,
+				  &poll_us, &intr_us, &vu_path)) {
+		free(xopts);
+		free(bopts);
+		return -1;
+	}
+
 	/*
 	 * The supplied backing file has to exist
 	 */
 	snprintf(bident, sizeof(bident), "%d:%d", dev->slot, dev->func);
-	bctxt = blockif_open(opts, bident);
+	bctxt = blockif_open(bopts, bident);
+	free(bopts);
 	if (bctxt == NULL) {
 		perror("Could not open backing file");
+		free(xopts);
 		return -1;
 	}
 
@@ -317,18 +543,13 @@ virtio_blk_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 	blk = calloc(1, sizeof(struct virtio_blk));
 	if (!blk) {
 		WPRINTF(("virtio_blk: calloc returns NULL\n"));
+		blockif_close(bctxt);
+		free(xopts);
 		return -1;
 	}
 
 	blk->bc = bctxt;
-	for (i = 0; i < VIRTIO_BLK_RINGSZ; i++) {
-		struct virtio_blk_ioreq *io = &blk->ios[i];
-
-		io->req.callback = virtio_blk_done;
-		io->req.param = io;
-		io->blk = blk;
-		io->idx = i;
-	}
+	blk->nqueues = nqueues;
 
 	/* init mutex attribute properly to avoid deadlock */
 	rc = pthread_mutexattr_init(&attr);
@@ -344,12 +565,75 @@ virtio_blk_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 		DPRINTF(("virtio_blk: pthread_mutex_init failed with "
 					"error %d!\n", rc));
 
+	/*
+	 * Queue 0 uses the device's blockif, the others a clone of it with
+	 * its own threads. Each runs on the next of the queue CPUs, if any.
+	 */
+	if (ncpus > 0)
+		blockif_set_cpu(bctxt, cpus[0]);
+	for (i = 0; i < nqueues; i++) {
+		q = &blk->queues[i];
+		q->blk = blk;
+		q->vq = &blk->vqs[i];
+		q->bc = i ? blockif_clone(bctxt, ncpus ? cpus[i % ncpus] : -1)
+			  : bctxt;
+		if (q->bc == NULL) {
+			while (--i > 0)
+				blockif_close(blk->queues[i].bc);
+			blockif_close(bctxt);
+			free(blk);
+			free(xopts);
+			return -1;
+		}
+		pthread_mutex_init(&q->mtx, &attr);
+		for (j = 0; j < VIRTIO_BLK_RINGSZ; j++) {
+			struct virtio_blk_ioreq *io = &q->ios[j];
+
+			io->req.callback = virtio_blk_done;
+			io->req.param = io;
+			io->q = q;
+			io->idx = j;
+		}
+	}
+
+	/* discard and write zeroes need a writable backend */
+	blk->ops = virtio_blk_ops;
+	blk->ops.nvq = nqueues;
+	if (nqueues > 1)
+		blk->ops.hv_caps |= VIRTIO_BLK_F_MQ;
+	if (!blockif_is_ro(bctxt)) {
+		blk->ops.hv_caps |= VIRTIO_BLK_F_WRITE_ZEROES;
+		if (blockif_candelete(bctxt))
+			blk->ops.hv_caps |= VIRTIO_BLK_F_DISCARD;
+	}
+
 	/* init virtio struct and virtqueues */
-	virtio_linkup(&blk->base, &virtio_blk_ops, blk, dev, &blk->vq);
+	virtio_linkup(&blk->base, &blk->ops, blk, dev, blk->vqs);
 	blk->base.mtx = &blk->mtx;
+	/* the queues have their own locks */
+	blk->base.flags |= VIRTIO_NOTIFY_UNLOCKED;
+
+	/*
+	 * A vhost-user backend serves the requests, with the features it
+	 * supports, but the config space is ours.
+	 */
+	if (vu_path != NULL) {
+		if (vhost_user_init(&blk->vu, vu_path, &blk->base,
+				    nqueues) < 0) {
+			for (i = nqueues - 1; i >= 0; i--)
+				blockif_close(blk->queues[i].bc);
+			free(blk);
+			free(xopts);
+			return -1;
+		}
+		blk->vhost_user = 1;
+		blk->ops.hv_caps &= blk->vu.features | VIRTIO_BLK_S_VHOST_USER;
+		poll_us = intr_us = 0;
+	}
+	free(xopts);
 
-	blk->vq.qsize = VIRTIO_BLK_RINGSZ;
-	/* blk->vq.vq_notify = we have no per-queue notify */
+	for (i = 0; i < nqueues; i++)
+		blk->vqs[i].qsize = VIRTIO_BLK_RINGSZ;
 
 	/*
 	 * Create an identifier for the backing file. Use parts of the
@@ -376,6 +660,13 @@ virtio_blk_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 	blk->cfg.topology.min_io_size = 0;
 	blk->cfg.topology.opt_io_size = 0;
 	blk->cfg.writeback = 0;
+	blk->cfg.max_discard_sectors = VIRTIO_BLK_MAX_DISCARD_SECTORS;
+	blk->cfg.max_discard_seg = VIRTIO_BLK_MAX_DISCARD_SEG;
+	blk->cfg.discard_sector_alignment = MAX(sts, sectsz) / DEV_BSIZE;
+	blk->cfg.max_write_zeroes_sectors = VIRTIO_BLK_MAX_DISCARD_SECTORS;
+	blk->cfg.max_write_zeroes_seg = VIRTIO_BLK_MAX_DISCARD_SEG;
+	blk->cfg.write_zeroes_may_unmap = 0;
+	blk->cfg.num_queues = nqueues;
 
 	/*
 	 * Should we move some of this into virtio.c?  Could
@@ -389,25 +680,38 @@ virtio_blk_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 	pci_set_cfgdata16(dev, PCIR_SUBVEND_0, VIRTIO_VENDOR);
 
 	if (virtio_interrupt_init(&blk->base, virtio_uses_msix())) {
-		blockif_close(blk->bc);
+		if (blk->vhost_user)
+			vhost_user_deinit(&blk->vu);
+		for (i = nqueues - 1; i >= 0; i--)
+			blockif_close(blk->queues[i].bc);
 		free(blk);
 		return -1;
 	}
 	virtio_set_io_bar(&blk->base, 0);
+
+	if (virtio_poll_start(&blk->base, (1UL << nqueues) - 1, poll_us,
+			      intr_us))
+		WPRINTF(("virtio_blk: polling disabled\n"));
 	return 0;
 }
 
 static void
 virtio_blk_deinit(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 {
-	struct blockif_ctxt *bctxt;
 	struct virtio_blk *blk;
+	int i;
 
 	if (dev->arg) {
 		DPRINTF(("virtio_blk: deinit\n"));
 		blk = (struct virtio_blk *) dev->arg;
-		bctxt = blk->bc;
-		blockif_close(bctxt);
+		virtio_poll_stop(&blk->base);
+		if (blk->vhost_user) {
+			vhost_user_stop(&blk->vu);
+			vhost_user_deinit(&blk->vu);
+		}
+		/* the clones go first */
+		for (i = blk->nqueues - 1; i >= 0; i--)
+			blockif_close(blk->queues[i].bc);
 		free(blk);
 	}
 }
@@ -56,6 +56,7 @@
 #define	VIRTIO_CONSOLE_RINGSZ	64
 #define	VIRTIO_CONSOLE_MAXPORTS	16
 #define	VIRTIO_CONSOLE_MAXQ	(VIRTIO_CONSOLE_MAXPORTS * 2 + 2)
+#define	VIRTIO_CONSOLE_BATCH	16	/* chains taken from a ring at once */
 
 #define	VIRTIO_CONSOLE_DEVICE_READY	0
 #define	VIRTIO_CONSOLE_DEVICE_ADD	1
@@ -386,22 +387,27 @@ virtio_console_notify_tx(void *vdev, struct virtio_vq_info *vq)
 {
 	struct virtio_console *console;
 	struct virtio_console_port *port;
-	struct iovec iov[1];
-	uint16_t idx;
-	uint16_t flags[8];
+	struct vq_chain chains[VIRTIO_CONSOLE_BATCH];
+	struct iovec iov[VIRTIO_CONSOLE_BATCH];
+	int i, n;
 
 	console = vdev;
 	port = virtio_console_vq_to_port(console, vq);
 
 	while (vq_has_descs(vq)) {
-		vq_getchain(vq, &idx, iov, 1, flags);
-		if (port != NULL)
-			port->cb(port, port->arg, iov, 1);
+		n = vq_getchains(vq, chains, VIRTIO_CONSOLE_BATCH, iov,
+				 VIRTIO_CONSOLE_BATCH, NULL);
+		if (n <= 0)
+			break;
+		for (i = 0; i < n; i++) {
+			if (port != NULL)
+				port->cb(port, port->arg, chains[i].iov, 1);
+		}
 
 		/*
-		 * Release this chain and handle more
+		 * Release these chains and handle more
 		 */
-		vq_relchain(vq, idx, 0);
+		vq_relchains(vq, chains, n);
 	}
 	vq_endchains(vq, 1);	/* Generate interrupt if appropriate. */
 }
@@ -417,7 +423,7 @@ virtio_console_notify_rx(void *vdev, struct virtio_vq_info *vq)
 
 	if (!port->rx_ready) {
 		port->rx_ready = 1;
-		vq->used->flags |= VRING_USED_F_NO_NOTIFY;
+		vq_set_notify(vq, false);
 	}
 }
 
@@ -450,10 +456,10 @@ virtio_console_backend_read(int fd __attribute__((unused)),
 	struct virtio_console_port *port;
 	struct virtio_console_backend *be = arg;
 	struct virtio_vq_info *vq;
-	struct iovec iov;
+	struct vq_chain chains[VIRTIO_CONSOLE_BATCH];
+	struct iovec iov[VIRTIO_CONSOLE_BATCH];
 	static char dummybuf[2048];
-	int len, n;
-	uint16_t idx;
+	int i, len, n;
 
 	port = be->port;
 	vq = virtio_console_port_to_vq(port, true);
@@ -474,24 +480,32 @@ virtio_console_backend_read(int fd __attribute__((unused)),
 	}
 
 	do {
-		n = vq_getchain(vq, &idx, &iov, 1, NULL);
-		len = readv(be->fd, &iov, n);
-		if (len <= 0) {
-			vq_retchain(vq);
-			vq_endchains(vq, 0);
-
-			/* no data available */
-			if (len == -1 && errno == EAGAIN)
-				return;
-
-			/* any other errors */
-			goto close;
+		n = vq_getchains(vq, chains, VIRTIO_CONSOLE_BATCH, iov,
+				 VIRTIO_CONSOLE_BATCH, NULL);
+		if (n <= 0)
+			break;
+		for (i = 0; i < n; i++) {
+			len = readv(be->fd, chains[i].iov, 1);
+			if (len <= 0) {
+				vq_retchains(vq, n - i);
+				vq_relchains(vq, chains, i);
+				vq_endchains(vq, 0);
+
+				/* no data available */
+				if (len == -1 && errno == EAGAIN)
+					return;
+
+				/* any other errors */
+				goto close;
+			}
+			chains[i].len = len;
 		}
 
-		vq_relchain(vq, idx, len);
+		vq_relchains(vq, chains, n);
 	} while (vq_has_descs(vq));
 
 	vq_endchains(vq, 1);
+	return;
 
 close:
 	virtio_console_reset_backend(be);
@@ -987,7 +987,7 @@ static void *virtio_heci_tx_thread(void *param)
 	while (!vheci->deiniting) {
 		/* note - tx mutex is locked here */
 		while (!vq_has_descs(vq)) {
-			vq->used->flags &= ~VRING_USED_F_NO_NOTIFY;
+			vq_set_notify(vq, true);
 			mb();
 			if (vq_has_descs(vq) && !vheci->resetting)
 				break;
@@ -998,7 +998,7 @@ static void *virtio_heci_tx_thread(void *param)
 			if (vheci->deiniting)
 				goto out;
 		}
-		vq->used->flags |= VRING_USED_F_NO_NOTIFY;
+		vq_set_notify(vq, false);
 		pthread_mutex_unlock(&vheci->tx_mutex);
 
 		do {
@@ -1139,7 +1139,7 @@ static void *virtio_heci_rx_thread(void *param)
 	while (!vheci->deiniting) {
 		/* note - rx mutex is locked here */
 		while (vq_ring_ready(vq)) {
-			vq->used->flags &= ~VRING_USED_F_NO_NOTIFY;
+			vq_set_notify(vq, true);
 			mb();
 			if (vq_has_descs(vq) &&
 				vheci->rx_need_sched &&
@@ -1152,7 +1152,7 @@ static void *virtio_heci_rx_thread(void *param)
 			if (vheci->deiniting)
 				goto out;
 		}
-		vq->used->flags |= VRING_USED_F_NO_NOTIFY;
+		vq_set_notify(vq, false);
 
 		do {
 			if (virtio_heci_proc_rx(vheci, vq))
@@ -1180,7 +1180,7 @@ virtio_heci_notify_rx(void *heci, struct virtio_vq_info *vq)
 	/* Signal the rx thread for processing */
 	pthread_mutex_lock(&vheci->rx_mutex);
 	DPRINTF(("vheci: RX: New IN buffer available!\n\r"));
-	vq->used->flags |= VRING_USED_F_NO_NOTIFY;
+	vq_set_notify(vq, false);
 	pthread_cond_signal(&vheci->rx_cond);
 	pthread_mutex_unlock(&vheci->rx_mutex);
 }
@@ -1198,7 +1198,7 @@ virtio_heci_notify_tx(void *heci, struct virtio_vq_info *vq)
 	/* Signal the tx thread for processing */
 	pthread_mutex_lock(&vheci->tx_mutex);
 	DPRINTF(("vheci: TX: New OUT buffer available!\n\r"));
-	vq->used->flags |= VRING_USED_F_NO_NOTIFY;
+	vq_set_notify(vq, false);
 	pthread_cond_signal(&vheci->tx_cond);
 	pthread_mutex_unlock(&vheci->tx_mutex);
 }
@@ -695,6 +695,7 @@ virtio_input_deinit(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 
 	vi = (struct virtio_input *)dev->arg;
 	if (vi) {
+		virtio_deinit(&vi->base);
 		pthread_mutex_destroy(&vi->mtx);
 		if (vi->event_queue)
 			free(vi->event_queue);
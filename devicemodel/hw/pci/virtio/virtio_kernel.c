@@ -32,8 +32,19 @@
 /* Routines to notify the VBS-K in kernel */
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
 #include <sys/ioctl.h>
+#include <sys/eventfd.h>
+
+#include "mevent.h"
+#include "pci_core.h"
+#include "virtio.h"
 #include "virtio_kernel.h"
+#include "vmmapi.h"			/* for vmctx */
 
 static int virtio_kernel_debug;
 #define DPRINTF(params) do { if (virtio_kernel_debug) printf params; } while (0)
@@ -102,3 +113,263 @@ vbs_kernel_stop(int fd)
 	DPRINTF(("%s\n", __func__));
 	return VIRTIO_SUCCESS;
 }
+
+/*
+ * vhost
+ */
+
+/* the driver asks for an interrupt */
+static void
+vhost_kernel_call(int fd, enum ev_type t, void *arg)
+{
+	struct vhost_kernel_vq *kvq = arg;
+	uint64_t n;
+
+	if (read(fd, &n, sizeof(n)) != sizeof(n))
+		return;
+	vq_interrupt(kvq->vq->base, kvq->vq);
+}
+
+/*
+ * Open the vhost driver at 'path' for queues vq_idx to vq_idx + nvq - 1
+ * of the device, to be started once the guest set them up.
+ */
+int
+vhost_kernel_init(struct vhost_kernel *vhost, const char *path,
+		  struct virtio_base *base, int vq_idx, int nvq)
+{
+	struct vhost_kernel_vq *kvq;
+	int i;
+
+	memset(vhost, 0, sizeof(*vhost));
+	for (i = 0; i < VHOST_MAX_VQS; i++)
+		vhost->vqs[i].kick_fd = vhost->vqs[i].call_fd = -1;
+
+	if (nvq > VHOST_MAX_VQS) {
+		WPRINTF(("%s: too many queues\n", __func__));
+		return -VIRTIO_ERROR_GENERAL;
+	}
+
+	vhost->fd = open(path, O_RDWR);
+	if (vhost->fd < 0) {
+		WPRINTF(("vhost: failed to open %s\n", path));
+		return -VIRTIO_ERROR_FD_OPEN_FAILED;
+	}
+	if (ioctl(vhost->fd, VHOST_SET_OWNER) < 0 ||
+	    ioctl(vhost->fd, VHOST_GET_FEATURES, &vhost->features) < 0) {
+		WPRINTF(("vhost: %s setup failed, errno %d\n", path, errno));
+		goto fail;
+	}
+
+	vhost->nvq = nvq;
+	for (i = 0; i < nvq; i++) {
+		kvq = &vhost->vqs[i];
+		kvq->vq = &base->queues[vq_idx + i];
+		kvq->kick_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		kvq->call_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if (kvq->kick_fd < 0 || kvq->call_fd < 0)
+			goto fail;
+		kvq->mevp = mevent_add(kvq->call_fd, EVF_READ,
+				       vhost_kernel_call, kvq);
+		if (kvq->mevp == NULL)
+			goto fail;
+	}
+
+	DPRINTF(("vhost: %s, features 0x%lx\n", path, vhost->features));
+	return VIRTIO_SUCCESS;
+
+fail:
+	vhost_kernel_deinit(vhost);
+	return -VIRTIO_ERROR_GENERAL;
+}
+
+void
+vhost_kernel_deinit(struct vhost_kernel *vhost)
+{
+	struct vhost_kernel_vq *kvq;
+	int i;
+
+	for (i = 0; i < VHOST_MAX_VQS; i++) {
+		kvq = &vhost->vqs[i];
+		if (kvq->mevp != NULL)
+			mevent_delete(kvq->mevp);
+		if (kvq->kick_fd >= 0)
+			close(kvq->kick_fd);
+		if (kvq->call_fd >= 0)
+			close(kvq->call_fd);
+		kvq->mevp = NULL;
+		kvq->kick_fd = kvq->call_fd = -1;
+	}
+	if (vhost->fd >= 0)
+		close(vhost->fd);
+	vhost->fd = -1;
+	vhost->nvq = 0;
+}
+
+/*
+ * The guest memory, as mapped by us, is what the driver reads the rings
+ * and buffers from.
+ */
+static int
+vhost_kernel_set_mem(struct vhost_kernel *vhost, struct vmctx *ctx)
+{
+	struct vhost_memory *mem;
+	struct vhost_memory_region *r;
+	int ret;
+
+	mem = calloc(1, sizeof(*mem) + 2 * sizeof(*r));
+	if (mem == NULL)
+		return -VIRTIO_ERROR_MEM_ALLOC_FAILED;
+
+	r = &mem->regions[mem->nregions++];
+	r->guest_phys_addr = 0;
+	r->memory_size = ctx->lowmem;
+	r->userspace_addr = (uintptr_t)ctx->baseaddr;
+	if (ctx->highmem > 0) {
+		r = &mem->regions[mem->nregions++];
+		r->guest_phys_addr = 4 * GB;
+		r->memory_size = ctx->highmem;
+		r->userspace_addr = (uintptr_t)ctx->baseaddr + 4 * GB;
+	}
+
+	ret = ioctl(vhost->fd, VHOST_SET_MEM_TABLE, mem);
+	free(mem);
+	return ret;
+}
+
+/*
+ * Hand the rings to the driver, which takes over from where we are.
+ * All of them must be set up by the guest.
+ */
+int
+vhost_kernel_start(struct vhost_kernel *vhost, uint64_t features)
+{
+	struct vhost_vring_state state;
+	struct vhost_vring_addr addr;
+	struct vhost_vring_file file;
+	struct virtio_vq_info *vq;
+	int i;
+
+	if (vhost->started)
+		return VIRTIO_SUCCESS;
+	if (vhost->fd < 0)
+		return -VIRTIO_ERROR_FD_OPEN_FAILED;
+
+	for (i = 0; i < vhost->nvq; i++)
+		if (!vq_ring_ready(vhost->vqs[i].vq))
+			return -VIRTIO_ERROR_START;
+
+	features &= vhost->features;
+	if (ioctl(vhost->fd, VHOST_SET_FEATURES, &features) < 0 ||
+	    vhost_kernel_set_mem(vhost, vhost->vqs[0].vq->base->dev->vmctx)
+			< 0) {
+		WPRINTF(("vhost: cannot set features/memory, errno %d\n",
+			 errno));
+		return -VIRTIO_ERROR_START;
+	}
+
+	for (i = 0; i < vhost->nvq; i++) {
+		vq = vhost->vqs[i].vq;
+
+		state.index = i;
+		state.num = vq->qsize;
+		if (ioctl(vhost->fd, VHOST_SET_VRING_NUM, &state) < 0)
+			goto fail;
+		state.num = vq->last_avail;
+		if (ioctl(vhost->fd, VHOST_SET_VRING_BASE, &state) < 0)
+			goto fail;
+
+		memset(&addr, 0, sizeof(addr));
+		addr.index = i;
+		addr.desc_user_addr = (uintptr_t)vq->desc;
+		addr.avail_user_addr = (uintptr_t)vq->avail;
+		addr.used_user_addr = (uintptr_t)vq->used;
+		if (ioctl(vhost->fd, VHOST_SET_VRING_ADDR, &addr) < 0)
+			goto fail;
+
+		file.index = i;
+		file.fd = vhost->vqs[i].kick_fd;
+		if (ioctl(vhost->fd, VHOST_SET_VRING_KICK, &file) < 0)
+			goto fail;
+		file.fd = vhost->vqs[i].call_fd;
+		if (ioctl(vhost->fd, VHOST_SET_VRING_CALL, &file) < 0)
+			goto fail;
+	}
+
+	vhost->started = 1;
+	return VIRTIO_SUCCESS;
+
+fail:
+	WPRINTF(("vhost: cannot set queue %d, errno %d\n", i, errno));
+	return -VIRTIO_ERROR_START;
+}
+
+/*
+ * Take the rings back from the driver, whose backend must be stopped,
+ * and go on from where it is.
+ */
+int
+vhost_kernel_stop(struct vhost_kernel *vhost)
+{
+	struct vhost_vring_state state;
+	struct virtio_vq_info *vq;
+	int i, ret = VIRTIO_SUCCESS;
+
+	if (!vhost->started)
+		return VIRTIO_SUCCESS;
+
+	for (i = 0; i < vhost->nvq; i++) {
+		vq = vhost->vqs[i].vq;
+		state.index = i;
+		if (ioctl(vhost->fd, VHOST_GET_VRING_BASE, &state) < 0) {
+			WPRINTF(("vhost: cannot get queue %d\n", i));
+			ret = -VIRTIO_ERROR_GENERAL;
+			continue;
+		}
+		vq->last_avail = state.num;
+		vq->save_used = vq->used->idx;
+	}
+
+	vhost->started = 0;
+	return ret;
+}
+
+/* pass a guest notify on to the driver */
+int
+vhost_kernel_kick(struct vhost_kernel *vhost, struct virtio_vq_info *vq)
+{
+	uint64_t n = 1;
+	int i;
+
+	for (i = 0; i < vhost->nvq; i++)
+		if (vhost->vqs[i].vq == vq)
+			break;
+	if (i == vhost->nvq)
+		return -VIRTIO_ERROR_GENERAL;
+
+	if (write(vhost->vqs[i].kick_fd, &n, sizeof(n)) != sizeof(n))
+		return -VIRTIO_ERROR_GENERAL;
+	return VIRTIO_SUCCESS;
+}
+
+/*
+ * vhost-net: the tap (or other socket) the packets go to and come from,
+ * or -1 to stop the data path.
+ */
+int
+vhost_kernel_net_set_backend(struct vhost_kernel *vhost, int fd)
+{
+	struct vhost_vring_file file;
+	int i;
+
+	for (i = 0; i < vhost->nvq; i++) {
+		file.index = i;
+		file.fd = fd;
+		if (ioctl(vhost->fd, VHOST_NET_SET_BACKEND, &file) < 0) {
+			WPRINTF(("vhost: cannot set backend %d, errno %d\n",
+				 fd, errno));
+			return -VIRTIO_ERROR_GENERAL;
+		}
+	}
+	return VIRTIO_SUCCESS;
+}
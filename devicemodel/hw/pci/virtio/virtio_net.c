@@ -31,7 +31,10 @@
 #include <sys/select.h>
 #include <sys/uio.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
 #include <net/ethernet.h>
+#include <arpa/inet.h>
 #ifndef NETMAP_WITH_LIBS
 #define NETMAP_WITH_LIBS
 #endif
@@ -53,12 +56,31 @@
 #include "pci_core.h"
 #include "mevent.h"
 #include "virtio.h"
+#include "virtio_kernel.h"
+#include "vhost_user.h"
+#include "vswitch.h"
 #include "netmap_user.h"
 #include <net/if.h>
 #include <linux/if_tun.h>
+#include <linux/if_packet.h>
 
 #define VIRTIO_NET_RINGSZ	1024
 #define VIRTIO_NET_MAXSEGS	256
+#define VIRTIO_NET_BATCH	32	/* chains taken from a ring at once */
+#define VIRTIO_NET_RXBATCH	64	/* enough for a 64K packet in 1K bufs */
+
+#define VIRTIO_NET_MAXPKT	(ETHER_HDR_LEN + ETHERMTU + 4)	/* VLAN tagged */
+
+/*
+ * AF_PACKET rings: the rx blocks are handed over full, or after
+ * VIRTIO_NET_PKT_TOV ms.  Each tx frame holds one packet.
+ */
+#define VIRTIO_NET_PKT_BLKSZ	(1 << 17)
+#define VIRTIO_NET_PKT_RXBLKS	64
+#define VIRTIO_NET_PKT_TXBLKS	8
+#define VIRTIO_NET_PKT_FRAMESZ	2048
+#define VIRTIO_NET_PKT_TOV	1
+#define VIRTIO_NET_MAXGSO	(ETHER_HDR_LEN + 65535 + 4)	/* 64K IP packet */
 
 /*
  * Host capabilities.  Note that we only offer a few of these.
@@ -82,11 +104,30 @@
 #define	VIRTIO_NET_F_CTRL_VLAN	(1 << 19) /* control channel VLAN filtering */
 #define	VIRTIO_NET_F_GUEST_ANNOUNCE \
 				(1 << 21) /* guest can send gratuitous pkts */
+#define	VIRTIO_NET_F_MQ		(1 << 22) /* multiple queue pairs */
 
 #define VIRTIO_NET_S_HOSTCAPS      \
 	(VIRTIO_NET_F_MAC | VIRTIO_NET_F_MRG_RXBUF | VIRTIO_NET_F_STATUS | \
 	VIRTIO_F_NOTIFY_ON_EMPTY | VIRTIO_RING_F_INDIRECT_DESC)
 
+/*
+ * Checksum and segmentation offloads, offered when the backend takes
+ * the packets with their virtio-net header.  The guest offloads are
+ * only those the tap can do.
+ */
+#define VIRTIO_NET_S_HOSTOFFLOADS \
+	(VIRTIO_NET_F_CSUM | VIRTIO_NET_F_HOST_TSO4 | \
+	VIRTIO_NET_F_HOST_TSO6 | VIRTIO_NET_F_HOST_ECN | VIRTIO_NET_F_HOST_UFO)
+
+#define VIRTIO_NET_F_GUEST_GSO \
+	(VIRTIO_NET_F_GUEST_TSO4 | VIRTIO_NET_F_GUEST_TSO6 | \
+	VIRTIO_NET_F_GUEST_UFO)
+
+/* what we do ourselves when the data path is in a vhost-user backend */
+#define VIRTIO_NET_S_VHOST_USER \
+	(VIRTIO_NET_F_MAC | VIRTIO_NET_F_STATUS | VIRTIO_NET_F_CTRL_VQ | \
+	VIRTIO_NET_F_MQ)
+
 /* is address mcast/bcast? */
 #define ETHER_IS_MULTICAST(addr) (*(addr) & 0x01)
 
@@ -96,16 +137,35 @@
 struct virtio_net_config {
 	uint8_t  mac[6];
 	uint16_t status;
+	uint16_t max_virtqueue_pairs;
 } __attribute__((packed));
 
 /*
- * Queue definitions.
+ * Queue definitions.  Queue pair n is rx queue 2n and tx queue 2n + 1.
+ * The control queue, only there with several pairs, comes after the
+ * last one, or is queue 2 if the guest doesn't use VIRTIO_NET_F_MQ.
  */
 #define VIRTIO_NET_RXQ	0
 #define VIRTIO_NET_TXQ	1
-#define VIRTIO_NET_CTLQ	2	/* NB: not yet supported */
+#define VIRTIO_NET_CTLQ	2
 
-#define VIRTIO_NET_MAXQ	3
+#define VIRTIO_NET_MAX_PAIRS	8
+#define VIRTIO_NET_MAXQ	(2 * VIRTIO_NET_MAX_PAIRS + 1)
+
+/*
+ * Control queue commands: a class and command header, the command data,
+ * then the ack byte we write back.
+ */
+struct virtio_net_ctrl_hdr {
+	uint8_t		class;
+	uint8_t		cmd;
+} __attribute__((packed));
+
+#define VIRTIO_NET_OK	0
+#define VIRTIO_NET_ERR	1
+
+#define VIRTIO_NET_CTRL_MQ		4
+#define VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET	0
 
 /*
  * Fixed network header size
@@ -127,19 +187,61 @@ static int virtio_net_debug;
 #define DPRINTF(params) do { if (virtio_net_debug) printf params; } while (0)
 #define WPRINTF(params) (printf params)
 
+/*
+ * Per queue pair struct: each has its own backend queue (one fd of a
+ * multiqueue tap), whose packets go to its rx queue, and tx thread.
+ */
+struct virtio_net_pair {
+	struct virtio_net *net;
+	int		idx;
+	struct virtio_vq_info *rxq;
+	struct virtio_vq_info *txq;
+	struct mevent	*mevp;
+
+	int		tapfd;
+	int		attached;	/* tap queue attached */
+
+	int		rx_ready;
+	int		rx_stalled;	/* vsw waits for rx buffers, atomic */
+	pthread_mutex_t	rx_mtx;
+	int		rx_in_progress;
+	pthread_t	tx_tid;
+	pthread_mutex_t	tx_mtx;
+	pthread_cond_t	tx_cond;
+	int		tx_in_progress;
+
+	struct vhost_kernel vhost;	/* vhost-net data path */
+};
+
 /*
  * Per-device struct
  */
 struct virtio_net {
 	struct virtio_base base;
-	struct virtio_vq_info queues[VIRTIO_NET_MAXQ - 1];
+	struct virtio_ops ops;
+	struct virtio_vq_info queues[VIRTIO_NET_MAXQ];
 	pthread_mutex_t mtx;
-	struct mevent	*mevp;
 
-	int		tapfd;
 	struct nm_desc	*nmd;
 
-	int		rx_ready;
+	/* AF_PACKET backend */
+	struct {
+		int		fd;
+		uint8_t		*ring;	/* rx blocks, then tx frames */
+		size_t		size;
+		int		rx_blk;	/* block we are in */
+		int		rx_left; /* its packets left, -1 if not yet */
+		struct tpacket3_hdr *rx_next;
+		int		tx_frame; /* next free tx frame */
+		int		tx_pending; /* frames not sent yet */
+	} pkt;
+
+	struct vswitch_port *vsw;	/* shared memory switch backend */
+
+	struct virtio_net_pair pairs[VIRTIO_NET_MAX_PAIRS];
+	int		npairs;		/* queue pairs offered */
+	int		curr_pairs;	/* queue pairs in use */
+	int		ctlq;		/* control queue index, or -1 */
 
 	volatile int	resetting;	/* set and checked outside lock */
 	volatile int	closing;	/* stop the tx i/o thread */
@@ -148,18 +250,20 @@ struct virtio_net {
 
 	struct virtio_net_config config;
 
-	pthread_mutex_t	rx_mtx;
-	int		rx_in_progress;
 	int		rx_vhdrlen;
 	int		rx_merge;	/* merged rx bufs in use */
-	pthread_t	tx_tid;
-	pthread_mutex_t	tx_mtx;
-	pthread_cond_t	tx_cond;
-	int		tx_in_progress;
+	int		rx_maxlen;	/* largest packet, with its header */
 
-	void (*virtio_net_rx)(struct virtio_net *net);
-	void (*virtio_net_tx)(struct virtio_net *net, struct iovec *iov,
+	int		vnet_hdr;	/* backend has the virtio-net header */
+	int		vhost;		/* pairs go to vhost-net once ready */
+	int		vhost_user;	/* all pairs are in vu */
+	struct vhost_user vu;
+	unsigned int	tap_offloads;	/* TUN_F_* the tap can do */
+
+	void (*virtio_net_rx)(struct virtio_net_pair *pair);
+	void (*virtio_net_tx)(struct virtio_net_pair *pair, struct iovec *iov,
 			     int iovcnt, int len);
+	void (*virtio_net_tx_flush)(struct virtio_net_pair *pair);
 };
 
 static void virtio_net_reset(void *);
@@ -168,17 +272,18 @@ static void virtio_net_tx_stop(struct virtio_net *);
 static int virtio_net_cfgread(void *, int, int, uint32_t *);
 static int virtio_net_cfgwrite(void *, int, int, uint32_t);
 static void virtio_net_neg_features(void *, uint64_t);
+static void virtio_net_set_status(void *, uint64_t);
 
 static struct virtio_ops virtio_net_ops = {
 	"vtnet",			/* our name */
-	VIRTIO_NET_MAXQ - 1,		/* we currently support 2 virtqueues */
+	2,				/* 2 virtqueues, more with pairs */
 	sizeof(struct virtio_net_config), /* config reg size */
 	virtio_net_reset,		/* reset */
 	NULL,				/* device-wide qnotify -- not used */
 	virtio_net_cfgread,		/* read PCI config */
 	virtio_net_cfgwrite,		/* write PCI config */
 	virtio_net_neg_features,	/* apply negotiated features */
-	NULL,				/* called on guest set status */
+	virtio_net_set_status,		/* called on guest set status */
 	VIRTIO_NET_S_HOSTCAPS,		/* our capabilities */
 };
 
@@ -204,51 +309,202 @@ ether_aton(const char *a, struct ether_addr *e)
  * If the transmit thread is active then stall until it is done.
  */
 static void
-virtio_net_txwait(struct virtio_net *net)
+virtio_net_txwait(struct virtio_net_pair *pair)
 {
-	pthread_mutex_lock(&net->tx_mtx);
-	while (net->tx_in_progress) {
-		pthread_mutex_unlock(&net->tx_mtx);
+	pthread_mutex_lock(&pair->tx_mtx);
+	while (pair->tx_in_progress) {
+		pthread_mutex_unlock(&pair->tx_mtx);
 		usleep(10000);
-		pthread_mutex_lock(&net->tx_mtx);
+		pthread_mutex_lock(&pair->tx_mtx);
 	}
-	pthread_mutex_unlock(&net->tx_mtx);
+	pthread_mutex_unlock(&pair->tx_mtx);
 }
 
 /*
  * If the receive thread is active then stall until it is done.
  */
 static void
-virtio_net_rxwait(struct virtio_net *net)
+virtio_net_rxwait(struct virtio_net_pair *pair)
 {
-	pthread_mutex_lock(&net->rx_mtx);
-	while (net->rx_in_progress) {
-		pthread_mutex_unlock(&net->rx_mtx);
+	pthread_mutex_lock(&pair->rx_mtx);
+	while (pair->rx_in_progress) {
+		pthread_mutex_unlock(&pair->rx_mtx);
 		usleep(10000);
-		pthread_mutex_lock(&net->rx_mtx);
+		pthread_mutex_lock(&pair->rx_mtx);
+	}
+	pthread_mutex_unlock(&pair->rx_mtx);
+}
+
+/*
+ * Attach the tap queues of the pairs in use, detach the others, so that
+ * the tap spreads the flows it receives over the former only.
+ */
+static void
+virtio_net_tap_queues(struct virtio_net *net)
+{
+	struct virtio_net_pair *pair;
+	struct ifreq ifr;
+	int i, attach;
+
+	for (i = 0; i < net->npairs; i++) {
+		pair = &net->pairs[i];
+		attach = i < net->curr_pairs;
+		if (pair->tapfd < 0 || pair->attached == attach)
+			continue;
+		memset(&ifr, 0, sizeof(ifr));
+		ifr.ifr_flags = attach ? IFF_ATTACH_QUEUE : IFF_DETACH_QUEUE;
+		if (ioctl(pair->tapfd, TUNSETQUEUE, &ifr) < 0) {
+			WPRINTF(("vtnet: cannot %s tap queue %d\n",
+				 attach ? "attach" : "detach", i));
+			continue;
+		}
+		pair->attached = attach;
 	}
-	pthread_mutex_unlock(&net->rx_mtx);
+}
+
+/*
+ * Tell the tap how long the guest's virtio-net header is, and which
+ * offloads the packets it gives us may use.
+ */
+static void
+virtio_net_tap_offloads(struct virtio_net *net, unsigned int offloads)
+{
+	struct virtio_net_pair *pair;
+	int i, hdrlen;
+
+	if (!net->vnet_hdr)
+		return;
+
+	hdrlen = net->rx_vhdrlen;
+	for (i = 0; i < net->npairs; i++) {
+		pair = &net->pairs[i];
+		if (pair->tapfd < 0)
+			continue;
+		if (ioctl(pair->tapfd, TUNSETVNETHDRSZ, &hdrlen) < 0 ||
+		    ioctl(pair->tapfd, TUNSETOFFLOAD, offloads) < 0)
+			WPRINTF(("vtnet: cannot set tap offloads 0x%x\n",
+				 offloads));
+	}
+}
+
+/*
+ * vhost-net: once the guest is ready, the rings of each pair it set up
+ * go to the kernel along with the tap queue of the pair, and we only
+ * pass on the notifies and interrupts.  Pairs not in use have no
+ * backend.
+ */
+static void
+virtio_net_vhost_backends(struct virtio_net *net)
+{
+	struct virtio_net_pair *pair;
+	int i;
+
+	for (i = 0; i < net->npairs; i++) {
+		pair = &net->pairs[i];
+		if (pair->vhost.started)
+			vhost_kernel_net_set_backend(&pair->vhost,
+				i < net->curr_pairs ? pair->tapfd : -1);
+	}
+}
+
+static void
+virtio_net_vhost_stop(struct virtio_net *net)
+{
+	struct virtio_net_pair *pair;
+	int i;
+
+	for (i = 0; i < net->npairs; i++) {
+		pair = &net->pairs[i];
+		if (!pair->vhost.started)
+			continue;
+		vhost_kernel_net_set_backend(&pair->vhost, -1);
+		pthread_mutex_lock(&pair->rx_mtx);
+		vhost_kernel_stop(&pair->vhost);
+		pthread_mutex_unlock(&pair->rx_mtx);
+		mevent_enable(pair->mevp);
+	}
+}
+
+static void
+virtio_net_vhost_start(struct virtio_net *net)
+{
+	struct virtio_net_pair *pair;
+	int i, rc;
+
+	for (i = 0; i < net->npairs; i++) {
+		pair = &net->pairs[i];
+		if (pair->vhost.started || !vq_ring_ready(pair->rxq) ||
+		    !vq_ring_ready(pair->txq))
+			continue;
+
+		/* the rx and tx threads keep off the rings from now on */
+		mevent_disable(pair->mevp);
+		virtio_net_txwait(pair);
+		pthread_mutex_lock(&pair->rx_mtx);
+		rc = vhost_kernel_start(&pair->vhost, net->features);
+		pthread_mutex_unlock(&pair->rx_mtx);
+		if (rc < 0) {
+			mevent_enable(pair->mevp);
+			WPRINTF(("vtnet: vhost-net failed, staying in "
+				 "userspace\n"));
+			virtio_net_vhost_stop(net);
+			return;
+		}
+	}
+	virtio_net_vhost_backends(net);
+}
+
+static void
+virtio_net_set_status(void *vdev, uint64_t status)
+{
+	struct virtio_net *net = vdev;
+
+	if (net->vhost && (status & VIRTIO_CR_STATUS_DRIVER_OK))
+		virtio_net_vhost_start(net);
+
+	/* without VIRTIO_NET_F_MQ, queue 2 is the control one */
+	if (net->vhost_user && (status & VIRTIO_CR_STATUS_DRIVER_OK) &&
+	    vhost_user_start(&net->vu, net->features,
+			     (net->features & VIRTIO_NET_F_MQ) ?
+			     2 * net->npairs : 2) < 0)
+		WPRINTF(("vtnet: vhost-user failed to start\n"));
 }
 
 static void
 virtio_net_reset(void *vdev)
 {
 	struct virtio_net *net = vdev;
+	int i;
 
 	DPRINTF(("vtnet: device reset requested !\n"));
 
 	net->resetting = 1;
 
+	/* take the rings back from vhost-net or vhost-user */
+	virtio_net_vhost_stop(net);
+	if (net->vhost_user)
+		vhost_user_stop(&net->vu);
+
 	/*
 	 * Wait for the transmit and receive threads to finish their
 	 * processing.
 	 */
-	virtio_net_txwait(net);
-	virtio_net_rxwait(net);
+	for (i = 0; i < net->npairs; i++) {
+		virtio_net_txwait(&net->pairs[i]);
+		virtio_net_rxwait(&net->pairs[i]);
+		net->pairs[i].rx_ready = 0;
+	}
+
+	/* back to a single pair */
+	net->curr_pairs = 1;
+	virtio_net_tap_queues(net);
 
-	net->rx_ready = 0;
 	net->rx_merge = 1;
 	net->rx_vhdrlen = sizeof(struct virtio_net_rxhdr);
+	net->rx_maxlen = net->rx_vhdrlen + VIRTIO_NET_MAXPKT;
+
+	/* no more offloads until the guest asks for them again */
+	virtio_net_tap_offloads(net, 0);
 
 	/* now reset rings, MSI-X vectors, and negotiated capabilities */
 	virtio_reset_dev(&net->base);
@@ -258,44 +514,51 @@ virtio_net_reset(void *vdev)
 }
 
 /*
- * Send signal to tx I/O thread and wait till it exits
+ * Send signal to tx I/O threads and wait till they exit
  */
 static void
 virtio_net_tx_stop(struct virtio_net *net)
 {
+	struct virtio_net_pair *pair;
 	void *jval;
+	int i;
 
 	net->closing = 1;
 
-	pthread_cond_broadcast(&net->tx_cond);
-
-	pthread_join(net->tx_tid, &jval);
+	for (i = 0; i < net->npairs; i++) {
+		pair = &net->pairs[i];
+		pthread_mutex_lock(&pair->tx_mtx);
+		pthread_cond_broadcast(&pair->tx_cond);
+		pthread_mutex_unlock(&pair->tx_mtx);
+		pthread_join(pair->tx_tid, &jval);
+	}
 }
 
 /*
  * Called to send a buffer chain out to the tap device
  */
 static void
-virtio_net_tap_tx(struct virtio_net *net, struct iovec *iov, int iovcnt,
+virtio_net_tap_tx(struct virtio_net_pair *pair, struct iovec *iov, int iovcnt,
 		  int len)
 {
 	static char pad[60]; /* all zero bytes */
 	ssize_t ret;
 
-	if (net->tapfd == -1)
+	if (pair->tapfd == -1)
 		return;
 
 	/*
 	 * If the length is < 60, pad out to that and add the
 	 * extra zero'd segment to the iov. It is guaranteed that
 	 * there is always an extra iov available by the caller.
+	 * The tap pads the packets with a virtio-net header itself.
 	 */
-	if (len < 60) {
+	if (len < 60 && !pair->net->vnet_hdr) {
 		iov[iovcnt].iov_base = pad;
 		iov[iovcnt].iov_len = 60 - len;
 		iovcnt++;
 	}
-	ret = writev(net->tapfd, iov, iovcnt);
+	ret = writev(pair->tapfd, iov, iovcnt);
 	(void)ret; /*avoid compiler warning*/
 }
 
@@ -329,30 +592,65 @@ rx_iov_trim(struct iovec *iov, int *niov, int tlen)
 	return riov;
 }
 
+static inline int
+rx_chain_len(const struct vq_chain *c)
+{
+	int i, len = 0;
+
+	for (i = 0; i < c->n; i++)
+		len += c->iov[i].iov_len;
+	return len;
+}
+
+/*
+ * How many of the chains a packet read from the tap may need: with
+ * merged rx buffers, enough for the largest packet the guest can get.
+ * Returns 0 if those left are not enough, and more may be in the ring.
+ */
+static int
+virtio_net_tap_rx_span(struct virtio_net *net, struct vq_chain *chains,
+		       int nchains, int first)
+{
+	int m, space;
+
+	if (!net->rx_merge || !net->vnet_hdr)
+		return 1;
+
+	space = 0;
+	for (m = 0; first + m < nchains && space < net->rx_maxlen; m++)
+		space += rx_chain_len(&chains[first + m]);
+	if (space < net->rx_maxlen && first > 0)
+		return 0;
+	return m;
+}
+
 static void
-virtio_net_tap_rx(struct virtio_net *net)
+virtio_net_tap_rx(struct virtio_net_pair *pair)
 {
+	struct virtio_net *net = pair->net;
 	struct iovec iov[VIRTIO_NET_MAXSEGS], *riov;
+	struct vq_chain chains[VIRTIO_NET_RXBATCH], *c;
 	struct virtio_vq_info *vq;
 	void *vrx;
-	int len, n;
-	uint16_t idx;
+	int i, m, len, n, nchains;
 	ssize_t ret;
 
 	/*
 	 * Should never be called without a valid tap fd
 	 */
-	assert(net->tapfd != -1);
+	assert(pair->tapfd != -1);
 
 	/*
 	 * But, will be called when the rx ring hasn't yet
-	 * been set up or the guest is resetting the device.
+	 * been set up, the guest is resetting the device, or
+	 * the pair was just taken out of use.
 	 */
-	if (!net->rx_ready || net->resetting) {
+	if (!pair->rx_ready || net->resetting ||
+	    pair->idx >= net->curr_pairs) {
 		/*
 		 * Drop the packet and try later.
 		 */
-		ret = read(net->tapfd, dummybuf, sizeof(dummybuf));
+		ret = read(pair->tapfd, dummybuf, sizeof(dummybuf));
 		(void)ret; /*avoid compiler warning*/
 
 		return;
@@ -361,13 +659,13 @@ virtio_net_tap_rx(struct virtio_net *net)
 	/*
 	 * Check for available rx buffers
 	 */
-	vq = &net->queues[VIRTIO_NET_RXQ];
+	vq = pair->rxq;
 	if (!vq_has_descs(vq)) {
 		/*
 		 * Drop the packet and try later.  Interrupt on
 		 * empty, if that's negotiated.
 		 */
-		ret = read(net->tapfd, dummybuf, sizeof(dummybuf));
+		ret = read(pair->tapfd, dummybuf, sizeof(dummybuf));
 		(void)ret; /*avoid compiler warning*/
 
 		vq_endchains(vq, 1);
@@ -376,47 +674,93 @@ virtio_net_tap_rx(struct virtio_net *net)
 
 	do {
 		/*
-		 * Get descriptor chain.
+		 * Get a batch of descriptor chains.
 		 */
-		n = vq_getchain(vq, &idx, iov, VIRTIO_NET_MAXSEGS, NULL);
-		assert(n >= 1 && n <= VIRTIO_NET_MAXSEGS);
+		nchains = vq_getchains(vq, chains, VIRTIO_NET_RXBATCH, iov,
+				       VIRTIO_NET_MAXSEGS, NULL);
+		assert(nchains >= 1 && chains[0].n <= VIRTIO_NET_MAXSEGS);
 
-		/*
-		 * Get a pointer to the rx header, and use the
-		 * data immediately following it for the packet buffer.
-		 */
-		vrx = iov[0].iov_base;
-		riov = rx_iov_trim(iov, &n, net->rx_vhdrlen);
+		for (i = 0; i < nchains; i += m) {
+			c = &chains[i];
 
-		len = readv(net->tapfd, riov, n);
+			/*
+			 * Start again from a new batch if this one can't
+			 * hold the next packet.
+			 */
+			m = virtio_net_tap_rx_span(net, chains, nchains, i);
+			if (m == 0) {
+				vq_retchains(vq, nchains - i);
+				nchains = i;
+				break;
+			}
 
-		if (len < 0 && errno == EWOULDBLOCK) {
 			/*
-			 * No more packets, but still some avail ring
-			 * entries.  Interrupt if needed/appropriate.
+			 * Get a pointer to the rx header.  The tap fills it
+			 * in if it has one, otherwise use the data
+			 * immediately following it for the packet buffer.
+			 * The chains are in turn in iov[].
 			 */
-			vq_retchain(vq);
-			vq_endchains(vq, 0);
-			return;
-		}
+			vrx = c->iov[0].iov_base;
+			if (net->vnet_hdr) {
+				riov = c->iov;
+				n = chains[i + m - 1].iov +
+				    chains[i + m - 1].n - c->iov;
+			} else {
+				n = c->n;
+				riov = rx_iov_trim(c->iov, &n,
+						   net->rx_vhdrlen);
+			}
 
-		/*
-		 * The only valid field in the rx packet header is the
-		 * number of buffers if merged rx bufs were negotiated.
-		 */
-		memset(vrx, 0, net->rx_vhdrlen);
+			len = readv(pair->tapfd, riov, n);
+
+			if (len < 0 && errno == EWOULDBLOCK) {
+				/*
+				 * No more packets, but still some avail ring
+				 * entries. Give back the chains not used, and
+				 * interrupt if needed/appropriate.
+				 */
+				vq_retchains(vq, nchains - i);
+				vq_relchains(vq, chains, i);
+				vq_endchains(vq, 0);
+				return;
+			}
+
+			if (net->vnet_hdr) {
+				/*
+				 * Split the packet over the chains it
+				 * needs, the others go to the next one.
+				 */
+				len = MAX(len, 0);
+				for (n = 0; n < m; n++) {
+					c[n].len = MIN(len,
+						       rx_chain_len(&c[n]));
+					len -= c[n].len;
+					if (len == 0)
+						break;
+				}
+				m = MIN(n + 1, m);
+			} else {
+				/*
+				 * The only valid field in the rx packet header
+				 * is the number of buffers if merged rx bufs
+				 * were negotiated.
+				 */
+				memset(vrx, 0, net->rx_vhdrlen);
+				c->len = len + net->rx_vhdrlen;
+			}
 
-		if (net->rx_merge) {
-			struct virtio_net_rxhdr *vrxh;
+			if (net->rx_merge) {
+				struct virtio_net_rxhdr *vrxh;
 
-			vrxh = vrx;
-			vrxh->vrh_bufs = 1;
+				vrxh = vrx;
+				vrxh->vrh_bufs = m;
+			}
 		}
 
 		/*
-		 * Release this chain and handle more chains.
+		 * Release the batch and handle more chains.
 		 */
-		vq_relchain(vq, idx, len + net->rx_vhdrlen);
+		vq_relchains(vq, chains, nchains);
 	} while (vq_has_descs(vq));
 
 	/* Interrupt if needed, including for NOTIFY_ON_EMPTY. */
@@ -510,9 +854,10 @@ virtio_net_netmap_readv(struct nm_desc *nmd, struct iovec *iov, int iovcnt)
  * Called to send a buffer chain out to the vale port
  */
 static void
-virtio_net_netmap_tx(struct virtio_net *net, struct iovec *iov, int iovcnt,
-		    int len)
+virtio_net_netmap_tx(struct virtio_net_pair *pair, struct iovec *iov,
+		    int iovcnt, int len)
 {
+	struct virtio_net *net = pair->net;
 	static char pad[60]; /* all zero bytes */
 
 	if (net->nmd == NULL)
@@ -532,13 +877,14 @@ virtio_net_netmap_tx(struct virtio_net *net, struct iovec *iov, int iovcnt,
 }
 
 static void
-virtio_net_netmap_rx(struct virtio_net *net)
+virtio_net_netmap_rx(struct virtio_net_pair *pair)
 {
+	struct virtio_net *net = pair->net;
 	struct iovec iov[VIRTIO_NET_MAXSEGS], *riov;
+	struct vq_chain chains[VIRTIO_NET_BATCH], *c;
 	struct virtio_vq_info *vq;
 	void *vrx;
-	int len, n;
-	uint16_t idx;
+	int i, len, n, nchains;
 
 	/*
 	 * Should never be called without a valid netmap descriptor
@@ -549,7 +895,7 @@ virtio_net_netmap_rx(struct virtio_net *net)
 	 * But, will be called when the rx ring hasn't yet
 	 * been set up or the guest is resetting the device.
 	 */
-	if (!net->rx_ready || net->resetting) {
+	if (!pair->rx_ready || net->resetting) {
 		/*
 		 * Drop the packet and try later.
 		 */
@@ -560,7 +906,7 @@ virtio_net_netmap_rx(struct virtio_net *net)
 	/*
 	 * Check for available rx buffers
 	 */
-	vq = &net->queues[VIRTIO_NET_RXQ];
+	vq = pair->rxq;
 	if (!vq_has_descs(vq)) {
 		/*
 		 * Drop the packet and try later.  Interrupt on
@@ -573,114 +919,498 @@ virtio_net_netmap_rx(struct virtio_net *net)
 
 	do {
 		/*
-		 * Get descriptor chain.
+		 * Get a batch of descriptor chains.
 		 */
-		n = vq_getchain(vq, &idx, iov, VIRTIO_NET_MAXSEGS, NULL);
-		assert(n >= 1 && n <= VIRTIO_NET_MAXSEGS);
+		nchains = vq_getchains(vq, chains, VIRTIO_NET_BATCH, iov,
+				       VIRTIO_NET_MAXSEGS, NULL);
+		assert(nchains >= 1 && chains[0].n <= VIRTIO_NET_MAXSEGS);
 
-		/*
-		 * Get a pointer to the rx header, and use the
-		 * data immediately following it for the packet buffer.
-		 */
-		vrx = iov[0].iov_base;
-		riov = rx_iov_trim(iov, &n, net->rx_vhdrlen);
+		for (i = 0; i < nchains; i++) {
+			c = &chains[i];
 
-		len = virtio_net_netmap_readv(net->nmd, riov, n);
+			/*
+			 * Get a pointer to the rx header, and use the data
+			 * immediately following it for the packet buffer.
+			 */
+			n = c->n;
+			vrx = c->iov[0].iov_base;
+			riov = rx_iov_trim(c->iov, &n, net->rx_vhdrlen);
+
+			len = virtio_net_netmap_readv(net->nmd, riov, n);
+
+			if (len == 0) {
+				/*
+				 * No more packets, but still some avail ring
+				 * entries. Give back the chains not used, and
+				 * interrupt if needed/appropriate.
+				 */
+				vq_retchains(vq, nchains - i);
+				vq_relchains(vq, chains, i);
+				vq_endchains(vq, 0);
+				return;
+			}
 
-		if (len == 0) {
 			/*
-			 * No more packets, but still some avail ring
-			 * entries.  Interrupt if needed/appropriate.
+			 * The only valid field in the rx packet header is the
+			 * number of buffers if merged rx bufs were negotiated.
 			 */
-			vq_retchain(vq);
-			vq_endchains(vq, 0);
-			return;
+			memset(vrx, 0, net->rx_vhdrlen);
+
+			if (net->rx_merge) {
+				struct virtio_net_rxhdr *vrxh;
+
+				vrxh = vrx;
+				vrxh->vrh_bufs = 1;
+			}
+			c->len = len + net->rx_vhdrlen;
 		}
 
 		/*
-		 * The only valid field in the rx packet header is the
-		 * number of buffers if merged rx bufs were negotiated.
+		 * Release the batch and handle more chains.
 		 */
-		memset(vrx, 0, net->rx_vhdrlen);
+		vq_relchains(vq, chains, nchains);
+	} while (vq_has_descs(vq));
 
-		if (net->rx_merge) {
-			struct virtio_net_rxhdr *vrxh;
+	/* Interrupt if needed, including for NOTIFY_ON_EMPTY. */
+	vq_endchains(vq, 1);
+}
+
+/*
+ * AF_PACKET backend: a TPACKET_V3 socket bound to a host interface, with
+ * its rx and tx rings mapped here.  The packets are copied between the
+ * ring slots and the guest buffers, and the kernel is only called to
+ * send a batch of tx frames.
+ */
+#define PKT_RXBLK(net, i) \
+	((struct tpacket_block_desc *)((net)->pkt.ring + \
+	 (size_t)(i) * VIRTIO_NET_PKT_BLKSZ))
+#define PKT_TXFRAME(net, i) \
+	((struct tpacket3_hdr *)((net)->pkt.ring + \
+	 (size_t)VIRTIO_NET_PKT_RXBLKS * VIRTIO_NET_PKT_BLKSZ + \
+	 (size_t)(i) * VIRTIO_NET_PKT_FRAMESZ))
+#define PKT_TXFRAMES \
+	(VIRTIO_NET_PKT_TXBLKS * (VIRTIO_NET_PKT_BLKSZ / VIRTIO_NET_PKT_FRAMESZ))
+#define PKT_TXOFF	(TPACKET3_HDRLEN - sizeof(struct sockaddr_ll))
 
-			vrxh = vrx;
-			vrxh->vrh_bufs = 1;
+/*
+ * The next packet received, left in its block, which goes back to the
+ * kernel when we are done with all of its packets.  Our own, looped
+ * back, are skipped.
+ */
+static struct tpacket3_hdr *
+virtio_net_packet_next(struct virtio_net *net)
+{
+	struct tpacket_block_desc *bd;
+	struct tpacket3_hdr *ppd;
+	struct sockaddr_ll *sll;
+
+	for (;;) {
+		bd = PKT_RXBLK(net, net->pkt.rx_blk);
+		if (!(bd->hdr.bh1.block_status & TP_STATUS_USER))
+			return NULL;
+		if (net->pkt.rx_left < 0) {
+			mb();
+			net->pkt.rx_left = bd->hdr.bh1.num_pkts;
+			net->pkt.rx_next = (struct tpacket3_hdr *)
+			    ((uint8_t *)bd + bd->hdr.bh1.offset_to_first_pkt);
 		}
+		while (net->pkt.rx_left > 0) {
+			ppd = net->pkt.rx_next;
+			net->pkt.rx_left--;
+			net->pkt.rx_next = (struct tpacket3_hdr *)
+			    ((uint8_t *)ppd + ppd->tp_next_offset);
+			sll = (struct sockaddr_ll *)((uint8_t *)ppd +
+			    TPACKET_ALIGN(sizeof(struct tpacket3_hdr)));
+			if (sll->sll_pkttype != PACKET_OUTGOING)
+				return ppd;
+		}
+
+		/* done with the block */
+		mb();
+		bd->hdr.bh1.block_status = TP_STATUS_KERNEL;
+		net->pkt.rx_blk = (net->pkt.rx_blk + 1) % VIRTIO_NET_PKT_RXBLKS;
+		net->pkt.rx_left = -1;
+	}
+}
+
+static int
+virtio_net_packet_readv(struct virtio_net *net, struct iovec *iov, int iovcnt)
+{
+	struct tpacket3_hdr *ppd;
+	uint8_t *buf;
+	size_t left;
+	int i, len = 0;
+
+	ppd = virtio_net_packet_next(net);
+	if (ppd == NULL)
+		return 0;
+
+	buf = (uint8_t *)ppd + ppd->tp_mac;
+	left = ppd->tp_snaplen;
+	for (i = 0; i < iovcnt && left > 0; i++) {
+		if (iov[i].iov_len > left)
+			iov[i].iov_len = left;
+		memcpy(iov[i].iov_base, &buf[len], iov[i].iov_len);
+		len += iov[i].iov_len;
+		left -= iov[i].iov_len;
+	}
+	for (; i < iovcnt; i++)
+		iov[i].iov_len = 0;
+
+	return len;
+}
+
+/*
+ * Called to queue a buffer chain in the tx ring, sent with the others
+ * of the batch by virtio_net_packet_tx_flush()
+ */
+static void
+virtio_net_packet_tx(struct virtio_net_pair *pair, struct iovec *iov,
+		     int iovcnt, int len)
+{
+	struct virtio_net *net = pair->net;
+	struct tpacket3_hdr *ppd;
+	uint8_t *buf;
+	int i, off;
+
+	if (net->pkt.fd < 0)
+		return;
+	if (len > VIRTIO_NET_PKT_FRAMESZ - PKT_TXOFF) {
+		WPRINTF(("vtnet: dropping %d bytes packet\n", len));
+		return;
+	}
+
+	/* the ring is full: send what's there, then drop if still full */
+	ppd = PKT_TXFRAME(net, net->pkt.tx_frame);
+	if (ppd->tp_status & (TP_STATUS_SEND_REQUEST | TP_STATUS_SENDING)) {
+		net->virtio_net_tx_flush(pair);
+		if (ppd->tp_status &
+		    (TP_STATUS_SEND_REQUEST | TP_STATUS_SENDING))
+			return;
+	}
+
+	buf = (uint8_t *)ppd + PKT_TXOFF;
+	for (i = 0, off = 0; i < iovcnt; i++) {
+		memcpy(buf + off, iov[i].iov_base, iov[i].iov_len);
+		off += iov[i].iov_len;
+	}
+	ppd->tp_len = len;
+	ppd->tp_next_offset = 0;
+	mb();
+	ppd->tp_status = TP_STATUS_SEND_REQUEST;
 
+	net->pkt.tx_frame = (net->pkt.tx_frame + 1) % PKT_TXFRAMES;
+	net->pkt.tx_pending++;
+}
+
+static void
+virtio_net_packet_tx_flush(struct virtio_net_pair *pair)
+{
+	struct virtio_net *net = pair->net;
+
+	if (net->pkt.tx_pending == 0)
+		return;
+	if (send(net->pkt.fd, NULL, 0, MSG_DONTWAIT) < 0 && errno != EAGAIN)
+		DPRINTF(("vtnet: packet send failed, errno %d\n", errno));
+	net->pkt.tx_pending = 0;
+}
+
+static void
+virtio_net_packet_rx(struct virtio_net_pair *pair)
+{
+	struct virtio_net *net = pair->net;
+	struct iovec iov[VIRTIO_NET_MAXSEGS], *riov;
+	struct vq_chain chains[VIRTIO_NET_BATCH], *c;
+	struct virtio_vq_info *vq;
+	void *vrx;
+	int i, len, n, nchains;
+
+	/*
+	 * Should never be called without a valid socket
+	 */
+	assert(net->pkt.fd >= 0);
+
+	/*
+	 * But, will be called when the rx ring hasn't yet
+	 * been set up or the guest is resetting the device.
+	 */
+	if (!pair->rx_ready || net->resetting) {
 		/*
-		 * Release this chain and handle more chains.
+		 * Drop the packet and try later.
 		 */
-		vq_relchain(vq, idx, len + net->rx_vhdrlen);
+		(void) virtio_net_packet_next(net);
+		return;
+	}
+
+	/*
+	 * Check for available rx buffers
+	 */
+	vq = pair->rxq;
+	if (!vq_has_descs(vq)) {
+		/*
+		 * Drop the packet and try later.  Interrupt on
+		 * empty, if that's negotiated.
+		 */
+		(void) virtio_net_packet_next(net);
+		vq_endchains(vq, 1);
+		return;
+	}
+
+	do {
+		/*
+		 * Get a batch of descriptor chains.
+		 */
+		nchains = vq_getchains(vq, chains, VIRTIO_NET_BATCH, iov,
+				       VIRTIO_NET_MAXSEGS, NULL);
+		assert(nchains >= 1 && chains[0].n <= VIRTIO_NET_MAXSEGS);
+
+		for (i = 0; i < nchains; i++) {
+			c = &chains[i];
+
+			/*
+			 * Get a pointer to the rx header, and use the data
+			 * immediately following it for the packet buffer.
+			 */
+			n = c->n;
+			vrx = c->iov[0].iov_base;
+			riov = rx_iov_trim(c->iov, &n, net->rx_vhdrlen);
+
+			len = virtio_net_packet_readv(net, riov, n);
+
+			if (len == 0) {
+				/*
+				 * No more packets, but still some avail ring
+				 * entries. Give back the chains not used, and
+				 * interrupt if needed/appropriate.
+				 */
+				vq_retchains(vq, nchains - i);
+				vq_relchains(vq, chains, i);
+				vq_endchains(vq, 0);
+				return;
+			}
+
+			/*
+			 * The only valid field in the rx packet header is the
+			 * number of buffers if merged rx bufs were negotiated.
+			 */
+			memset(vrx, 0, net->rx_vhdrlen);
+
+			if (net->rx_merge) {
+				struct virtio_net_rxhdr *vrxh;
+
+				vrxh = vrx;
+				vrxh->vrh_bufs = 1;
+			}
+			c->len = len + net->rx_vhdrlen;
+		}
+
+		/*
+		 * Release the batch and handle more chains.
+		 */
+		vq_relchains(vq, chains, nchains);
 	} while (vq_has_descs(vq));
 
 	/* Interrupt if needed, including for NOTIFY_ON_EMPTY. */
 	vq_endchains(vq, 1);
 }
 
+/*
+ * Shared memory switch: the frames are copied from the tx buffers to
+ * the ring of the receiving port, and from there to its rx buffers.
+ */
 static void
-virtio_net_rx_callback(int fd, enum ev_type type, void *param)
+virtio_net_vsw_tx(struct virtio_net_pair *pair, struct iovec *iov,
+		  int iovcnt, int len)
+{
+	if (vswitch_send(pair->net->vsw, iov, iovcnt, len) < 0)
+		DPRINTF(("vtnet: dropping %d bytes packet\n", len));
+}
+
+static void
+virtio_net_vsw_tx_flush(struct virtio_net_pair *pair)
+{
+	vswitch_flush(pair->net->vsw);
+}
+
+/*
+ * Returns true if the guest has no rx buffers left: the frames stay in
+ * the rings of the switch, which hold the senders back, and rx goes on
+ * from virtio_net_ping_rxq() once the guest posts buffers.
+ */
+static bool
+virtio_net_vsw_rxq(struct virtio_net_pair *pair)
 {
-	struct virtio_net *net = param;
+	struct virtio_net *net = pair->net;
+	struct iovec iov[VIRTIO_NET_MAXSEGS], *riov;
+	struct vq_chain chains[VIRTIO_NET_BATCH], *c;
+	struct virtio_vq_info *vq;
+	void *vrx;
+	int i, len, n, nchains;
+
+	/*
+	 * Drop what came in if the rx ring hasn't yet been set up or
+	 * the guest is resetting the device.
+	 */
+	if (!pair->rx_ready || net->resetting) {
+		while (vswitch_recv(net->vsw, NULL, 0) > 0)
+			;
+		return false;
+	}
+
+	vq = pair->rxq;
+	for (;;) {
+		if (!vq_has_descs(vq)) {
+			/* have the guest tell us when it posts buffers */
+			__atomic_store_n(&pair->rx_stalled, 1, __ATOMIC_SEQ_CST);
+			vq_set_notify(vq, true);
+			__atomic_thread_fence(__ATOMIC_SEQ_CST);
+			if (!vq_has_descs(vq))
+				break;
+			__atomic_store_n(&pair->rx_stalled, 0, __ATOMIC_SEQ_CST);
+			vq_set_notify(vq, false);
+		}
+
+		nchains = vq_getchains(vq, chains, VIRTIO_NET_BATCH, iov,
+				       VIRTIO_NET_MAXSEGS, NULL);
+		assert(nchains >= 1 && chains[0].n <= VIRTIO_NET_MAXSEGS);
+
+		for (i = 0; i < nchains; i++) {
+			c = &chains[i];
+			n = c->n;
+			vrx = c->iov[0].iov_base;
+			riov = rx_iov_trim(c->iov, &n, net->rx_vhdrlen);
+
+			len = vswitch_recv(net->vsw, riov, n);
+			if (len == 0) {
+				vq_retchains(vq, nchains - i);
+				vq_relchains(vq, chains, i);
+				vq_endchains(vq, 0);
+				return false;
+			}
 
-	pthread_mutex_lock(&net->rx_mtx);
-	net->rx_in_progress = 1;
-	net->virtio_net_rx(net);
-	net->rx_in_progress = 0;
-	pthread_mutex_unlock(&net->rx_mtx);
+			memset(vrx, 0, net->rx_vhdrlen);
+			if (net->rx_merge) {
+				struct virtio_net_rxhdr *vrxh;
 
+				vrxh = vrx;
+				vrxh->vrh_bufs = 1;
+			}
+			c->len = len + net->rx_vhdrlen;
+		}
+		vq_relchains(vq, chains, nchains);
+	}
+
+	/* Interrupt on empty, if that's negotiated. */
+	vq_endchains(vq, 1);
+	return true;
 }
 
+/*
+ * Until there is nothing left, as the doorbell only rings once, or
+ * until the guest runs out of buffers: the doorbell then stays quiet.
+ */
 static void
-virtio_net_ping_rxq(void *vdev, struct virtio_vq_info *vq)
+virtio_net_vsw_rx(struct virtio_net_pair *pair)
 {
-	struct virtio_net *net = vdev;
+	do {
+		if (virtio_net_vsw_rxq(pair))
+			return;
+	} while (!vswitch_idle(pair->net->vsw));
+}
 
+static void
+virtio_net_rx_callback(int fd, enum ev_type type, void *param)
+{
+	struct virtio_net_pair *pair = param;
+
+	pthread_mutex_lock(&pair->rx_mtx);
+	if (pair->vhost.started) {
+		/* an event from before vhost-net took over */
+		pthread_mutex_unlock(&pair->rx_mtx);
+		return;
+	}
+	pair->rx_in_progress = 1;
+	pair->net->virtio_net_rx(pair);
+	pair->rx_in_progress = 0;
+	pthread_mutex_unlock(&pair->rx_mtx);
+
+}
+
+static void
+virtio_net_ping_rxq(struct virtio_net_pair *pair, struct virtio_vq_info *vq)
+{
 	/*
 	 * A qnotify means that the rx process can now begin
 	 */
-	if (net->rx_ready == 0) {
-		net->rx_ready = 1;
-		vq->used->flags |= VRING_USED_F_NO_NOTIFY;
+	if (pair->rx_ready == 0) {
+		pair->rx_ready = 1;
+		vq_set_notify(vq, false);
+	}
+
+	/*
+	 * Buffers for the frames held back in the switch: go on receiving
+	 * from the event loop, which the doorbell wakes.
+	 */
+	if (__atomic_exchange_n(&pair->rx_stalled, 0, __ATOMIC_SEQ_CST)) {
+		vq_set_notify(vq, false);
+		vswitch_kick(pair->net->vsw);
 	}
 }
 
 static void
-virtio_net_proctx(struct virtio_net *net, struct virtio_vq_info *vq)
+virtio_net_proctx(struct virtio_net_pair *pair, struct virtio_vq_info *vq)
 {
+	struct virtio_net *net = pair->net;
 	struct iovec iov[VIRTIO_NET_MAXSEGS + 1];
-	int i, n;
-	int plen, tlen;
-	uint16_t idx;
+	struct vq_chain chains[VIRTIO_NET_BATCH], *c;
+	int plen[VIRTIO_NET_BATCH];
+	int i, j, nchains;
 
 	/*
-	 * Obtain chain of descriptors.  The first one is
-	 * really the header descriptor, so we need to sum
+	 * Obtain a batch of descriptor chains.  The first descriptor
+	 * of each is really the header descriptor, so we need to sum
 	 * up two lengths: packet length and transfer length.
 	 */
-	n = vq_getchain(vq, &idx, iov, VIRTIO_NET_MAXSEGS, NULL);
-	assert(n >= 1 && n <= VIRTIO_NET_MAXSEGS);
-	plen = 0;
-	tlen = iov[0].iov_len;
-	for (i = 1; i < n; i++) {
-		plen += iov[i].iov_len;
-		tlen += iov[i].iov_len;
+	nchains = vq_getchains(vq, chains, VIRTIO_NET_BATCH, iov,
+			       VIRTIO_NET_MAXSEGS, NULL);
+	assert(nchains >= 1 && chains[0].n <= VIRTIO_NET_MAXSEGS);
+	for (i = 0; i < nchains; i++) {
+		c = &chains[i];
+		plen[i] = 0;
+		c->len = c->iov[0].iov_len;
+		for (j = 1; j < c->n; j++) {
+			plen[i] += c->iov[j].iov_len;
+			c->len += c->iov[j].iov_len;
+		}
 	}
 
-	DPRINTF(("virtio: packet send, %d bytes, %d segs\n\r", plen, n));
-	net->virtio_net_tx(net, &iov[1], n - 1, plen);
+	/*
+	 * The iov after a packet is used to pad it if it is short: that
+	 * is the header of the next one, which was accounted above, or
+	 * the spare one at the end of iov[].
+	 */
+	for (i = 0; i < nchains; i++) {
+		c = &chains[i];
+		DPRINTF(("virtio: packet send, %d bytes, %d segs\n\r",
+			 plen[i], c->n));
+		if (net->vnet_hdr)
+			net->virtio_net_tx(pair, c->iov, c->n, plen[i]);
+		else
+			net->virtio_net_tx(pair, &c->iov[1], c->n - 1,
+					   plen[i]);
+	}
 
-	/* chain is processed, release it and set tlen */
-	vq_relchain(vq, idx, tlen);
+	/* send what the backend queued */
+	if (net->virtio_net_tx_flush)
+		net->virtio_net_tx_flush(pair);
+
+	/* chains are processed, release them and set their tlen */
+	vq_relchains(vq, chains, nchains);
 }
 
 static void
-virtio_net_ping_txq(void *vdev, struct virtio_vq_info *vq)
+virtio_net_ping_txq(struct virtio_net_pair *pair, struct virtio_vq_info *vq)
 {
-	struct virtio_net *net = vdev;
-
 	/*
 	 * Any ring entries to process?
 	 */
@@ -688,11 +1418,11 @@ virtio_net_ping_txq(void *vdev, struct virtio_vq_info *vq)
 		return;
 
 	/* Signal the tx thread for processing */
-	pthread_mutex_lock(&net->tx_mtx);
-	vq->used->flags |= VRING_USED_F_NO_NOTIFY;
-	if (net->tx_in_progress == 0)
-		pthread_cond_signal(&net->tx_cond);
-	pthread_mutex_unlock(&net->tx_mtx);
+	pthread_mutex_lock(&pair->tx_mtx);
+	vq_set_notify(vq, false);
+	if (pair->tx_in_progress == 0)
+		pthread_cond_signal(&pair->tx_cond);
+	pthread_mutex_unlock(&pair->tx_mtx);
 }
 
 /*
@@ -701,46 +1431,48 @@ virtio_net_ping_txq(void *vdev, struct virtio_vq_info *vq)
 static void *
 virtio_net_tx_thread(void *param)
 {
-	struct virtio_net *net = param;
+	struct virtio_net_pair *pair = param;
+	struct virtio_net *net = pair->net;
 	struct virtio_vq_info *vq;
 	int error;
 
-	vq = &net->queues[VIRTIO_NET_TXQ];
+	vq = pair->txq;
 
 	/*
 	 * Let us wait till the tx queue pointers get initialised &
 	 * first tx signaled
 	 */
-	pthread_mutex_lock(&net->tx_mtx);
-	error = pthread_cond_wait(&net->tx_cond, &net->tx_mtx);
+	pthread_mutex_lock(&pair->tx_mtx);
+	error = pthread_cond_wait(&pair->tx_cond, &pair->tx_mtx);
 	assert(error == 0);
 	if (net->closing) {
 		WPRINTF(("vtnet tx thread closing...\n"));
-		pthread_mutex_unlock(&net->tx_mtx);
+		pthread_mutex_unlock(&pair->tx_mtx);
 		return NULL;
 	}
 
 	for (;;) {
 		/* note - tx mutex is locked here */
 		while (net->resetting || !vq_has_descs(vq)) {
-			vq->used->flags &= ~VRING_USED_F_NO_NOTIFY;
+			vq_set_notify(vq, true);
 			/* memory barrier */
 			mb();
 			if (!net->resetting && vq_has_descs(vq))
 				break;
 
-			net->tx_in_progress = 0;
-			error = pthread_cond_wait(&net->tx_cond, &net->tx_mtx);
+			pair->tx_in_progress = 0;
+			error = pthread_cond_wait(&pair->tx_cond,
+						  &pair->tx_mtx);
 			assert(error == 0);
 			if (net->closing) {
 				WPRINTF(("vtnet tx thread closing...\n"));
-				pthread_mutex_unlock(&net->tx_mtx);
+				pthread_mutex_unlock(&pair->tx_mtx);
 				return NULL;
 			}
 		}
-		vq->used->flags |= VRING_USED_F_NO_NOTIFY;
-		net->tx_in_progress = 1;
-		pthread_mutex_unlock(&net->tx_mtx);
+		vq_set_notify(vq, false);
+		pair->tx_in_progress = 1;
+		pthread_mutex_unlock(&pair->tx_mtx);
 
 		do {
 			/*
@@ -748,7 +1480,7 @@ virtio_net_tx_thread(void *param)
 			 * iovecs and sending when an end-of-packet
 			 * is found
 			 */
-			virtio_net_proctx(net, vq);
+			virtio_net_proctx(pair, vq);
 		} while (vq_has_descs(vq));
 
 		/*
@@ -756,17 +1488,115 @@ virtio_net_tx_thread(void *param)
 		 */
 		vq_endchains(vq, 1);
 
-		pthread_mutex_lock(&net->tx_mtx);
+		pthread_mutex_lock(&pair->tx_mtx);
 	}
 }
 
-#ifdef notyet
+/*
+ * VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET: the guest uses the first 'n' pairs
+ * from now on.
+ */
+static int
+virtio_net_ctrl_mq(struct virtio_net *net, uint8_t cmd, uint8_t *data,
+		   int len)
+{
+	uint16_t n;
+
+	if (cmd != VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET || len < sizeof(n))
+		return VIRTIO_NET_ERR;
+	memcpy(&n, data, sizeof(n));
+	if (n < 1 || n > net->npairs ||
+	    !(net->features & VIRTIO_NET_F_MQ))
+		return VIRTIO_NET_ERR;
+
+	DPRINTF(("vtnet: %d queue pairs\n\r", n));
+	net->curr_pairs = n;
+	virtio_net_tap_queues(net);
+	virtio_net_vhost_backends(net);
+	if (net->vhost_user &&
+	    vhost_user_start_vqs(&net->vu, 2 * net->curr_pairs) < 0)
+		return VIRTIO_NET_ERR;
+	return VIRTIO_NET_OK;
+}
+
+/*
+ * Control queue: each chain is a command header, its data, and the ack
+ * byte, in that order, in as many descriptors as the guest likes.
+ */
 static void
-virtio_net_ping_ctlq(void *vdev, struct virtio_vq_info *vq)
+virtio_net_ping_ctlq(struct virtio_net *net, struct virtio_vq_info *vq)
 {
-	DPRINTF(("vtnet: control qnotify!\n\r"));
+	struct iovec iov[VIRTIO_NET_MAXSEGS];
+	uint16_t flags[VIRTIO_NET_MAXSEGS];
+	struct virtio_net_ctrl_hdr hdr;
+	uint8_t buf[64], *ack;
+	uint16_t idx;
+	int i, n, len, status;
+
+	while (vq_has_descs(vq)) {
+		n = vq_getchain(vq, &idx, iov, VIRTIO_NET_MAXSEGS, flags);
+		if (n < 0)
+			break;
+		n = MIN(n, VIRTIO_NET_MAXSEGS);
+
+		/* the readable part, then the ack */
+		len = 0;
+		for (i = 0; i < n && !(flags[i] & VRING_DESC_F_WRITE); i++) {
+			memcpy(buf + len, iov[i].iov_base,
+			       MIN(iov[i].iov_len, sizeof(buf) - len));
+			len += MIN(iov[i].iov_len, sizeof(buf) - len);
+		}
+		if (i == n || iov[i].iov_len < 1 ||
+		    len < sizeof(hdr)) {
+			WPRINTF(("vtnet: invalid control command\n"));
+			vq_relchain(vq, idx, 0);
+			continue;
+		}
+		ack = iov[i].iov_base;
+
+		memcpy(&hdr, buf, sizeof(hdr));
+		if (hdr.class == VIRTIO_NET_CTRL_MQ)
+			status = virtio_net_ctrl_mq(net, hdr.cmd,
+						    buf + sizeof(hdr),
+						    len - sizeof(hdr));
+		else
+			status = VIRTIO_NET_ERR;
+		*ack = status;
+		vq_relchain(vq, idx, 1);
+	}
+	vq_endchains(vq, 1);
+}
+
+/*
+ * Queue notifies: which queue is the control one depends on whether the
+ * guest uses VIRTIO_NET_F_MQ.
+ */
+static void
+virtio_net_notify(void *vdev, struct virtio_vq_info *vq)
+{
+	struct virtio_net *net = vdev;
+	struct virtio_net_pair *pair;
+
+	if (vq->num == net->ctlq) {
+		virtio_net_ping_ctlq(net, vq);
+		return;
+	}
+	if (vq->num / 2 >= net->npairs)
+		return;
+	if (net->vhost_user) {
+		vhost_user_kick(&net->vu, vq);
+		return;
+	}
+	pair = &net->pairs[vq->num / 2];
+	if (pair->vhost.started) {
+		vhost_kernel_kick(&pair->vhost, vq);
+		return;
+	}
+	if (vq->num & 1)
+		virtio_net_ping_txq(pair, vq);
+	else
+		virtio_net_ping_rxq(pair, vq);
 }
-#endif
 
 static int
 virtio_net_parsemac(char *mac_str, uint8_t *mac_addr)
@@ -794,7 +1624,7 @@ virtio_net_parsemac(char *mac_str, uint8_t *mac_addr)
 }
 
 static int
-virtio_net_tap_open(char *devname)
+virtio_net_tap_open(char *devname, int mq)
 {
 	int tunfd, rc;
 	struct ifreq ifr;
@@ -807,7 +1637,9 @@ virtio_net_tap_open(char *devname)
 	}
 
 	memset(&ifr, 0, sizeof(ifr));
-	ifr.ifr_flags = IFF_TAP | IFF_NO_PI;
+	ifr.ifr_flags = IFF_TAP | IFF_NO_PI | IFF_VNET_HDR;
+	if (mq)
+		ifr.ifr_flags |= IFF_MULTI_QUEUE;
 
 	if (*devname)
 		strncpy(ifr.ifr_name, devname, IFNAMSIZ);
@@ -823,11 +1655,18 @@ virtio_net_tap_open(char *devname)
 	return tunfd;
 }
 
+/*
+ * Open one tap queue per pair.  With several, the tap is a multiqueue
+ * one and the kernel steers each flow, by its hash, to one of the
+ * attached queues, so to one rx queue of the guest.
+ */
 static void
 virtio_net_tap_setup(struct virtio_net *net, char *devname)
 {
 	char tbuf[80 + 5];	/* room for "acrn_" prefix */
 	char *tbuf_ptr;
+	struct virtio_net_pair *pair;
+	int i;
 
 	tbuf_ptr = tbuf;
 
@@ -840,55 +1679,235 @@ virtio_net_tap_setup(struct virtio_net *net, char *devname)
 	net->virtio_net_rx = virtio_net_tap_rx;
 	net->virtio_net_tx = virtio_net_tap_tx;
 
-	net->tapfd = virtio_net_tap_open(tbuf);
-	if (net->tapfd == -1) {
-		WPRINTF(("open of tap device %s failed\n", tbuf));
-		return;
+	for (i = 0; i < net->npairs; i++) {
+		pair = &net->pairs[i];
+		pair->tapfd = virtio_net_tap_open(tbuf, net->npairs > 1);
+		if (pair->tapfd == -1) {
+			WPRINTF(("open of tap device %s failed\n", tbuf));
+			break;
+		}
+		DPRINTF(("open of tap device %s success!\n", tbuf));
+		pair->attached = 1;
+
+		/*
+		 * Set non-blocking and register for read
+		 * notifications with the event loop
+		 */
+		int opt = 1;
+
+		if (ioctl(pair->tapfd, FIONBIO, &opt) < 0) {
+			WPRINTF(("tap device O_NONBLOCK failed\n"));
+			close(pair->tapfd);
+			pair->tapfd = -1;
+			break;
+		}
+
+		pair->mevp = mevent_add(pair->tapfd, EVF_READ,
+					virtio_net_rx_callback, pair);
+		if (pair->mevp == NULL) {
+			WPRINTF(("Could not register event\n"));
+			close(pair->tapfd);
+			pair->tapfd = -1;
+			break;
+		}
+	}
+
+	/* make do with the queues we could open */
+	if (i > 0 && i < net->npairs) {
+		WPRINTF(("vtnet: %d queue pairs only\n", i));
+		net->npairs = i;
 	}
-	DPRINTF(("open of tap device %s success!\n", tbuf));
 
 	/*
-	 * Set non-blocking and register for read
-	 * notifications with the event loop
+	 * The packets go with their virtio-net header: see which
+	 * offloads the tap can take from us, none until negotiated.
 	 */
-	int opt = 1;
-
-	if (ioctl(net->tapfd, FIONBIO, &opt) < 0) {
-		WPRINTF(("tap device O_NONBLOCK failed\n"));
-		close(net->tapfd);
-		net->tapfd = -1;
+	if (i > 0) {
+		net->vnet_hdr = 1;
+		net->tap_offloads = TUN_F_CSUM | TUN_F_TSO4 | TUN_F_TSO6 |
+				    TUN_F_TSO_ECN | TUN_F_UFO;
+		if (ioctl(net->pairs[0].tapfd, TUNSETOFFLOAD,
+			  net->tap_offloads) < 0)
+			net->tap_offloads &= ~TUN_F_UFO;
+		if (ioctl(net->pairs[0].tapfd, TUNSETOFFLOAD,
+			  net->tap_offloads) < 0)
+			net->tap_offloads = 0;
+		virtio_net_tap_offloads(net, 0);
 	}
 
-	net->mevp = mevent_add(net->tapfd, EVF_READ,
-			       virtio_net_rx_callback, net);
-	if (net->mevp == NULL) {
-		WPRINTF(("Could not register event\n"));
-		close(net->tapfd);
-		net->tapfd = -1;
-	}
+	/* the guest starts with a single pair */
+	virtio_net_tap_queues(net);
 }
 
 static void
 virtio_net_netmap_setup(struct virtio_net *net, char *ifname)
 {
+	struct virtio_net_pair *pair = &net->pairs[0];
+
 	net->virtio_net_rx = virtio_net_netmap_rx;
 	net->virtio_net_tx = virtio_net_netmap_tx;
 
+	if (net->npairs > 1) {
+		WPRINTF(("vtnet: netmap backend has a single queue pair\n"));
+		net->npairs = 1;
+	}
+
 	net->nmd = nm_open(ifname, NULL, 0, 0);
 	if (net->nmd == NULL) {
 		WPRINTF(("open of netmap device %s failed\n", ifname));
 		return;
 	}
 
-	net->mevp = mevent_add(net->nmd->fd, EVF_READ,
-			       virtio_net_rx_callback, net);
-	if (net->mevp == NULL) {
+	pair->mevp = mevent_add(net->nmd->fd, EVF_READ,
+				virtio_net_rx_callback, pair);
+	if (pair->mevp == NULL) {
 		WPRINTF(("Could not register event\n"));
 		nm_close(net->nmd);
 		net->nmd = NULL;
 	}
 }
 
+static void
+virtio_net_packet_setup(struct virtio_net *net, char *ifname)
+{
+	struct virtio_net_pair *pair = &net->pairs[0];
+	struct tpacket_req3 req;
+	struct packet_mreq mreq;
+	struct sockaddr_ll sll;
+	int ver = TPACKET_V3, one = 1;
+
+	net->virtio_net_rx = virtio_net_packet_rx;
+	net->virtio_net_tx = virtio_net_packet_tx;
+	net->virtio_net_tx_flush = virtio_net_packet_tx_flush;
+
+	if (net->npairs > 1) {
+		WPRINTF(("vtnet: packet backend has a single queue pair\n"));
+		net->npairs = 1;
+	}
+
+	net->pkt.fd = socket(AF_PACKET, SOCK_RAW, htons(ETH_P_ALL));
+	if (net->pkt.fd < 0) {
+		WPRINTF(("vtnet: cannot open packet socket\n"));
+		return;
+	}
+	if (setsockopt(net->pkt.fd, SOL_PACKET, PACKET_VERSION, &ver,
+		       sizeof(ver)) < 0)
+		goto fail;
+
+	/* the guest doesn't want its own packets back, nor the qdisc */
+	(void) setsockopt(net->pkt.fd, SOL_PACKET, PACKET_IGNORE_OUTGOING,
+			  &one, sizeof(one));
+	(void) setsockopt(net->pkt.fd, SOL_PACKET, PACKET_QDISC_BYPASS,
+			  &one, sizeof(one));
+
+	memset(&req, 0, sizeof(req));
+	req.tp_block_size = VIRTIO_NET_PKT_BLKSZ;
+	req.tp_block_nr = VIRTIO_NET_PKT_RXBLKS;
+	req.tp_frame_size = VIRTIO_NET_PKT_FRAMESZ;
+	req.tp_frame_nr = VIRTIO_NET_PKT_RXBLKS *
+			  (VIRTIO_NET_PKT_BLKSZ / VIRTIO_NET_PKT_FRAMESZ);
+	req.tp_retire_blk_tov = VIRTIO_NET_PKT_TOV;
+	if (setsockopt(net->pkt.fd, SOL_PACKET, PACKET_RX_RING, &req,
+		       sizeof(req)) < 0)
+		goto fail;
+
+	memset(&req, 0, sizeof(req));
+	req.tp_block_size = VIRTIO_NET_PKT_BLKSZ;
+	req.tp_block_nr = VIRTIO_NET_PKT_TXBLKS;
+	req.tp_frame_size = VIRTIO_NET_PKT_FRAMESZ;
+	req.tp_frame_nr = PKT_TXFRAMES;
+	if (setsockopt(net->pkt.fd, SOL_PACKET, PACKET_TX_RING, &req,
+		       sizeof(req)) < 0)
+		goto fail;
+
+	net->pkt.size = (size_t)(VIRTIO_NET_PKT_RXBLKS +
+			VIRTIO_NET_PKT_TXBLKS) * VIRTIO_NET_PKT_BLKSZ;
+	net->pkt.ring = mmap(NULL, net->pkt.size, PROT_READ | PROT_WRITE,
+			     MAP_SHARED, net->pkt.fd, 0);
+	if (net->pkt.ring == MAP_FAILED) {
+		net->pkt.ring = NULL;
+		goto fail;
+	}
+	net->pkt.rx_left = -1;
+
+	/* all that goes through the interface is for the guest to see */
+	memset(&sll, 0, sizeof(sll));
+	sll.sll_family = AF_PACKET;
+	sll.sll_protocol = htons(ETH_P_ALL);
+	sll.sll_ifindex = if_nametoindex(ifname);
+	if (sll.sll_ifindex == 0 ||
+	    bind(net->pkt.fd, (struct sockaddr *)&sll, sizeof(sll)) < 0)
+		goto fail;
+
+	memset(&mreq, 0, sizeof(mreq));
+	mreq.mr_ifindex = sll.sll_ifindex;
+	mreq.mr_type = PACKET_MR_PROMISC;
+	if (setsockopt(net->pkt.fd, SOL_PACKET, PACKET_ADD_MEMBERSHIP, &mreq,
+		       sizeof(mreq)) < 0)
+		WPRINTF(("vtnet: %s not in promiscuous mode\n", ifname));
+
+	pair->mevp = mevent_add(net->pkt.fd, EVF_READ,
+				virtio_net_rx_callback, pair);
+	if (pair->mevp == NULL) {
+		WPRINTF(("Could not register event\n"));
+		goto fail;
+	}
+	return;
+
+fail:
+	WPRINTF(("vtnet: packet socket on %s failed, errno %d\n", ifname,
+		 errno));
+	if (net->pkt.ring != NULL)
+		munmap(net->pkt.ring, net->pkt.size);
+	net->pkt.ring = NULL;
+	close(net->pkt.fd);
+	net->pkt.fd = -1;
+}
+
+static void
+virtio_net_vsw_setup(struct virtio_net *net, char *name)
+{
+	struct virtio_net_pair *pair = &net->pairs[0];
+
+	net->virtio_net_rx = virtio_net_vsw_rx;
+	net->virtio_net_tx = virtio_net_vsw_tx;
+	net->virtio_net_tx_flush = virtio_net_vsw_tx_flush;
+
+	if (net->npairs > 1) {
+		WPRINTF(("vtnet: vsw backend has a single queue pair\n"));
+		net->npairs = 1;
+	}
+
+	net->vsw = vswitch_open(name);
+	if (net->vsw == NULL)
+		return;
+
+	pair->mevp = mevent_add(vswitch_fd(net->vsw), EVF_READ,
+				virtio_net_rx_callback, pair);
+	if (pair->mevp == NULL) {
+		WPRINTF(("Could not register event\n"));
+		vswitch_close(net->vsw);
+		net->vsw = NULL;
+	}
+}
+
+/* one vhost-net instance per queue pair */
+static int
+virtio_net_vhost_init(struct virtio_net *net)
+{
+	int i;
+
+	for (i = 0; i < net->npairs; i++) {
+		if (vhost_kernel_init(&net->pairs[i].vhost, "/dev/vhost-net",
+				      &net->base, 2 * i, 2) < 0) {
+			while (--i >= 0)
+				vhost_kernel_deinit(&net->pairs[i].vhost);
+			return -1;
+		}
+	}
+	return 0;
+}
+
 static int
 virtio_net_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 {
@@ -897,11 +1916,14 @@ virtio_net_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 	char nstr[80];
 	char tname[MAXCOMLEN + 1];
 	struct virtio_net *net;
-	char *devname;
-	char *vtopts;
-	int mac_provided;
+	struct virtio_net_pair *pair;
+	char *devname, *vu_path;
+	char *vtopts, *opt;
+	int mac_provided, vhost;
+	uint32_t poll_us, intr_us;
+	unsigned long txmask;
 	pthread_mutexattr_t attr;
-	int rc;
+	int i, rc;
 
 	net = calloc(1, sizeof(struct virtio_net));
 	if (!net) {
@@ -923,25 +1945,16 @@ virtio_net_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 		DPRINTF(("virtio_net: pthread_mutex_init failed with "
 			"error %d!\n", rc));
 
-	virtio_linkup(&net->base, &virtio_net_ops, net, dev, net->queues);
-	net->base.mtx = &net->mtx;
-
-	net->queues[VIRTIO_NET_RXQ].qsize = VIRTIO_NET_RINGSZ;
-	net->queues[VIRTIO_NET_RXQ].notify = virtio_net_ping_rxq;
-	net->queues[VIRTIO_NET_TXQ].qsize = VIRTIO_NET_RINGSZ;
-	net->queues[VIRTIO_NET_TXQ].notify = virtio_net_ping_txq;
-#ifdef notyet
-	net->queues[VIRTIO_NET_CTLQ].qsize = VIRTIO_NET_RINGSZ;
-	net->queues[VIRTIO_NET_CTLQ].notify = virtio_net_ping_ctlq;
-#endif
-
 	/*
-	 * Attempt to open the tap device and read the MAC address
-	 * if specified
+	 * Parse the options and read the MAC address if specified
 	 */
 	mac_provided = 0;
-	net->tapfd = -1;
+	vhost = 0;
+	poll_us = intr_us = 0;
+	devname = vu_path = NULL;
+	net->npairs = 1;
 	net->nmd = NULL;
+	net->pkt.fd = -1;
 	if (opts != NULL) {
 		int err;
 
@@ -953,22 +1966,130 @@ virtio_net_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 
 		(void) strsep(&vtopts, ",");
 
-		if (vtopts != NULL) {
-			err = virtio_net_parsemac(vtopts, net->config.mac);
+		while ((opt = strsep(&vtopts, ",")) != NULL) {
+			err = 0;
+			if (!strncmp(opt, "poll=", strlen("poll="))) {
+				err = virtio_poll_parse(opt, &poll_us,
+							&intr_us);
+				if (err != 0)
+					fprintf(stderr, "Invalid %s\n", opt);
+			} else if (!strncmp(opt, "mac=", strlen("mac="))) {
+				err = virtio_net_parsemac(opt,
+							  net->config.mac);
+				mac_provided = 1;
+			} else if (!strcmp(opt, "vhost")) {
+				vhost = 1;
+			} else if (!strncmp(opt, "queues=",
+					    strlen("queues="))) {
+				if (sscanf(opt, "queues=%d", &net->npairs)
+				    != 1 || net->npairs < 1 ||
+				    net->npairs > VIRTIO_NET_MAX_PAIRS) {
+					fprintf(stderr, "Invalid %s\n", opt);
+					err = -1;
+				}
+			} else
+				fprintf(stderr, "Ignoring %s\n", opt);
 			if (err != 0) {
 				free(devname);
 				return err;
 			}
-			mac_provided = 1;
 		}
+	}
+
+	for (i = 0; i < VIRTIO_NET_MAX_PAIRS; i++) {
+		pair = &net->pairs[i];
+		pair->net = net;
+		pair->idx = i;
+		pair->tapfd = -1;
+		pair->rxq = &net->queues[2 * i + VIRTIO_NET_RXQ];
+		pair->txq = &net->queues[2 * i + VIRTIO_NET_TXQ];
+	}
 
+	net->rx_merge = 1;
+	net->rx_vhdrlen = sizeof(struct virtio_net_rxhdr);
+	net->rx_maxlen = net->rx_vhdrlen + VIRTIO_NET_MAXPKT;
+
+	/*
+	 * Attempt to open the backend, which may settle for fewer
+	 * queue pairs than asked for
+	 */
+	if (devname != NULL) {
 		if (strncmp(devname, "vale", 4) == 0)
 			virtio_net_netmap_setup(net, devname);
+		if (strncmp(devname, "packet=", 7) == 0)
+			virtio_net_packet_setup(net, devname + 7);
+		if (strncmp(devname, "vsw=", 4) == 0)
+			virtio_net_vsw_setup(net, devname + 4);
 		if (strncmp(devname, "tap", 3) == 0 ||
 		    strncmp(devname, "vmnet", 5) == 0)
 			virtio_net_tap_setup(net, devname);
+		if (strncmp(devname, "vhost-user=", 11) == 0)
+			vu_path = devname + 11;
+	}
+	net->curr_pairs = 1;
+	net->ctlq = -1;
+	net->config.max_virtqueue_pairs = net->npairs;
 
-		free(devname);
+	/*
+	 * A single pair has no control queue, as before; several pairs
+	 * come with the control queue to pick how many are in use.
+	 */
+	net->ops = virtio_net_ops;
+	if (net->npairs > 1) {
+		net->ops.nvq = 2 * net->npairs + 1;
+		net->ops.hv_caps |= VIRTIO_NET_F_MQ | VIRTIO_NET_F_CTRL_VQ;
+	}
+	if (net->vnet_hdr)
+		net->ops.hv_caps |= VIRTIO_NET_S_HOSTOFFLOADS;
+	if (net->tap_offloads & TUN_F_CSUM) {
+		net->ops.hv_caps |= VIRTIO_NET_F_GUEST_CSUM;
+		if (net->tap_offloads & TUN_F_TSO4)
+			net->ops.hv_caps |= VIRTIO_NET_F_GUEST_TSO4;
+		if (net->tap_offloads & TUN_F_TSO6)
+			net->ops.hv_caps |= VIRTIO_NET_F_GUEST_TSO6;
+		if (net->tap_offloads & TUN_F_TSO_ECN)
+			net->ops.hv_caps |= VIRTIO_NET_F_GUEST_ECN;
+		if (net->tap_offloads & TUN_F_UFO)
+			net->ops.hv_caps |= VIRTIO_NET_F_GUEST_UFO;
+	}
+	virtio_linkup(&net->base, &net->ops, net, dev, net->queues);
+	net->base.mtx = &net->mtx;
+
+	/*
+	 * A vhost-user backend has all the pairs, and the offloads it can
+	 * do, but the control queue stays with us.
+	 */
+	if (vu_path != NULL) {
+		if (vhost_user_init(&net->vu, vu_path, &net->base,
+				    2 * net->npairs) < 0) {
+			pthread_mutex_destroy(&net->mtx);
+			free(devname);
+			free(net);
+			return -1;
+		}
+		net->vhost_user = 1;
+		net->ops.hv_caps |= VIRTIO_NET_S_HOSTOFFLOADS |
+			VIRTIO_NET_F_GUEST_CSUM | VIRTIO_NET_F_GUEST_GSO |
+			VIRTIO_NET_F_GUEST_ECN;
+		net->ops.hv_caps &= net->vu.features | VIRTIO_NET_S_VHOST_USER;
+		poll_us = intr_us = 0;
+	}
+	free(devname);
+
+	/* vhost-net takes the rings of each pair, so no polling here */
+	if (vhost) {
+		if (net->pairs[0].tapfd >= 0 &&
+		    virtio_net_vhost_init(net) == 0) {
+			net->vhost = 1;
+			poll_us = intr_us = 0;
+		} else
+			WPRINTF(("vtnet: no vhost-net, data path in "
+				 "userspace\n"));
+	}
+
+	for (i = 0; i < net->ops.nvq; i++) {
+		net->queues[i].qsize = VIRTIO_NET_RINGSZ;
+		net->queues[i].notify = virtio_net_notify;
 	}
 
 	/*
@@ -998,9 +2119,10 @@ virtio_net_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 	pci_set_cfgdata16(dev, PCIR_SUBDEV_0, VIRTIO_TYPE_NET);
 	pci_set_cfgdata16(dev, PCIR_SUBVEND_0, VIRTIO_VENDOR);
 
-	/* Link is up if we managed to open tap device or vale port. */
-	net->config.status = (opts == NULL || net->tapfd >= 0 ||
-			      net->nmd != NULL);
+	/* Link is up if we managed to open tap device, vale port or socket. */
+	net->config.status = (opts == NULL || net->pairs[0].tapfd >= 0 ||
+			      net->nmd != NULL || net->pkt.fd >= 0 ||
+			      net->vhost_user || net->vsw != NULL);
 
 	/* use BAR 1 to map MSI-X table and PBA, if we're using MSI-X */
 	if (virtio_interrupt_init(&net->base, virtio_uses_msix())) {
@@ -1015,24 +2137,31 @@ virtio_net_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 	net->resetting = 0;
 	net->closing = 0;
 
-	net->rx_merge = 1;
-	net->rx_vhdrlen = sizeof(struct virtio_net_rxhdr);
-	net->rx_in_progress = 0;
-	pthread_mutex_init(&net->rx_mtx, NULL);
-
 	/*
-	 * Initialize tx semaphore & spawn TX processing thread.
-	 * As of now, only one thread for TX desc processing is
-	 * spawned.
+	 * Initialize tx semaphores & spawn one TX processing thread
+	 * per queue pair.
 	 */
-	net->tx_in_progress = 0;
-	pthread_mutex_init(&net->tx_mtx, NULL);
-	pthread_cond_init(&net->tx_cond, NULL);
-	pthread_create(&net->tx_tid, NULL, virtio_net_tx_thread,
-		       (void *)net);
-	snprintf(tname, sizeof(tname), "vtnet-%d:%d tx", dev->slot,
-		 dev->func);
-	pthread_setname_np(net->tx_tid, tname);
+	txmask = 0;
+	for (i = 0; i < net->npairs; i++) {
+		pair = &net->pairs[i];
+		pair->rx_in_progress = 0;
+		pthread_mutex_init(&pair->rx_mtx, NULL);
+
+		pair->tx_in_progress = 0;
+		pthread_mutex_init(&pair->tx_mtx, NULL);
+		pthread_cond_init(&pair->tx_cond, NULL);
+		pthread_create(&pair->tx_tid, NULL, virtio_net_tx_thread,
+			       (void *)pair);
+		snprintf(tname, sizeof(tname), "vtnet-%d:%d tx%d", dev->slot,
+			 dev->func, i);
+		pthread_setname_np(pair->tx_tid, tname);
+
+		txmask |= 1UL << (2 * i + VIRTIO_NET_TXQ);
+	}
+
+	/* rx is driven by the backend, only tx is worth polling */
+	if (virtio_poll_start(&net->base, txmask, poll_us, intr_us))
+		WPRINTF(("virtio_net: polling disabled\n"));
 
 	return 0;
 }
@@ -1073,34 +2202,88 @@ static void
 virtio_net_neg_features(void *vdev, uint64_t negotiated_features)
 {
 	struct virtio_net *net = vdev;
+	unsigned int offloads;
 
 	net->features = negotiated_features;
 
 	if (!(net->features & VIRTIO_NET_F_MRG_RXBUF)) {
 		net->rx_merge = 0;
 		/* non-merge rx header is 2 bytes shorter */
-		net->rx_vhdrlen -= 2;
+		net->rx_vhdrlen = sizeof(struct virtio_net_rxhdr) - 2;
+	}
+
+	/*
+	 * The tap may give us what the guest can receive: partially
+	 * checksummed packets, and up to 64K with segmentation offloads.
+	 */
+	offloads = 0;
+	if (net->features & VIRTIO_NET_F_GUEST_CSUM) {
+		offloads |= TUN_F_CSUM;
+		if (net->features & VIRTIO_NET_F_GUEST_TSO4)
+			offloads |= TUN_F_TSO4;
+		if (net->features & VIRTIO_NET_F_GUEST_TSO6)
+			offloads |= TUN_F_TSO6;
+		if (net->features & VIRTIO_NET_F_GUEST_ECN)
+			offloads |= TUN_F_TSO_ECN;
+		if (net->features & VIRTIO_NET_F_GUEST_UFO)
+			offloads |= TUN_F_UFO;
 	}
+	virtio_net_tap_offloads(net, offloads);
+
+	if (net->features & VIRTIO_NET_F_GUEST_GSO)
+		net->rx_maxlen = net->rx_vhdrlen + VIRTIO_NET_MAXGSO;
+	else
+		net->rx_maxlen = net->rx_vhdrlen + VIRTIO_NET_MAXPKT;
+
+	/* without VIRTIO_NET_F_MQ, the control queue follows pair 0 */
+	if (!(net->features & VIRTIO_NET_F_CTRL_VQ))
+		net->ctlq = -1;
+	else if (net->features & VIRTIO_NET_F_MQ)
+		net->ctlq = 2 * net->npairs;
+	else
+		net->ctlq = VIRTIO_NET_CTLQ;
 }
 
 static void
 virtio_net_deinit(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 {
 	struct virtio_net *net;
+	struct virtio_net_pair *pair;
+	int i;
 
 	if (dev->arg) {
 		net = (struct virtio_net *) dev->arg;
 
+		virtio_poll_stop(&net->base);
+		if (net->vhost) {
+			virtio_net_vhost_stop(net);
+			for (i = 0; i < net->npairs; i++)
+				vhost_kernel_deinit(&net->pairs[i].vhost);
+		}
+		if (net->vhost_user) {
+			vhost_user_stop(&net->vu);
+			vhost_user_deinit(&net->vu);
+		}
 		virtio_net_tx_stop(net);
 
-		if (net->tapfd >= 0) {
-			close(net->tapfd);
-			net->tapfd = -1;
-		} else
-			fprintf(stderr, "net->tapfd is -1!\n");
+		for (i = 0; i < net->npairs; i++) {
+			pair = &net->pairs[i];
+			if (pair->mevp != NULL)
+				mevent_delete(pair->mevp);
+			if (pair->tapfd >= 0) {
+				close(pair->tapfd);
+				pair->tapfd = -1;
+			} else if (net->nmd == NULL && net->pkt.fd < 0 &&
+				   !net->vhost_user && net->vsw == NULL)
+				fprintf(stderr, "pair %d tapfd is -1!\n", i);
+		}
 
-		if (net->mevp != NULL)
-			mevent_delete(net->mevp);
+		if (net->pkt.fd >= 0) {
+			munmap(net->pkt.ring, net->pkt.size);
+			close(net->pkt.fd);
+		}
+		if (net->vsw != NULL)
+			vswitch_close(net->vsw);
 
 		free(net);
 
@@ -0,0 +1,569 @@
+/*-
+ * Copyright (c) 2018 Intel Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+/*
+ * Shared memory switch.
+ *
+ * The switch is a POSIX shared memory segment named after it, which the
+ * virtio-net devices of any acrn-dm using it attach to, each as one of
+ * its ports. Every ordered pair of ports has a single producer, single
+ * consumer ring of frame slots: the sender copies a frame from its
+ * guest's tx buffers into the slot, the receiver from the slot into its
+ * guest's rx buffers, and neither takes a lock or makes a system call
+ * for it.
+ *
+ * The forwarding database maps the MAC addresses learnt from the frames
+ * sent to the port they came from, one entry per hash bucket. Frames to
+ * unknown, broadcast and multicast addresses go to all the other ports.
+ *
+ * A receiver with nothing left to do sets its kick flag before it
+ * sleeps on its doorbell, a datagram socket in the abstract namespace;
+ * the senders ring it once per batch, only if the flag is set.
+ *
+ * A port belongs to the process whose pid it has, and may be taken over
+ * once that process is gone. The segment outlives the VMs.
+ */
+
+#include <sys/param.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "dm.h"
+#include "vswitch.h"
+
+#define	VSWITCH_MAGIC		0x57535641	/* "AVSW" */
+#define	VSWITCH_VERSION		1
+#define	VSWITCH_PORTS		8
+#define	VSWITCH_SLOTS		256		/* per ring, a power of 2 */
+#define	VSWITCH_SLOTSZ		2048
+#define	VSWITCH_FDB		1024		/* a power of 2 */
+#define	VSWITCH_WAIT_MS		1000	/* for another process to set it up */
+#define	VSWITCH_NAME_MAX	32
+
+#define	VSWITCH_MAXFRAME	(VSWITCH_SLOTSZ - sizeof(uint32_t))
+
+#define WPRINTF(params) (printf params)
+
+struct vswitch_slot {
+	uint32_t	len;
+	uint8_t		data[VSWITCH_MAXFRAME];
+};
+
+struct vswitch_ring {
+	uint32_t	head __attribute__((aligned(64)));	/* sender's */
+	uint32_t	tail __attribute__((aligned(64)));	/* receiver's */
+	struct vswitch_slot slot[VSWITCH_SLOTS] __attribute__((aligned(64)));
+};
+
+struct vswitch_shm_port {
+	int32_t		pid;		/* owner, 0 if free */
+	uint32_t	kick;		/* ring the doorbell */
+} __attribute__((aligned(64)));
+
+struct vswitch_shm {
+	uint32_t	magic;		/* set last by the creator */
+	uint32_t	version;
+	uint32_t	nports;
+	uint32_t	nslots;
+	uint32_t	slot_size;
+	struct vswitch_shm_port port[VSWITCH_PORTS];
+	uint64_t	fdb[VSWITCH_FDB];	/* port + 1 << 48 | MAC */
+	struct vswitch_ring ring[VSWITCH_PORTS][VSWITCH_PORTS];	/* [from][to] */
+};
+
+struct vswitch_port {
+	struct vswitch_shm *shm;
+	char		name[VSWITCH_NAME_MAX + 1];
+	int		idx;
+	int		fd;		/* doorbell */
+	uint32_t	tx_tail[VSWITCH_PORTS];	/* last seen, if not full */
+	uint32_t	rx_head[VSWITCH_PORTS];	/* ditto, if not empty */
+	uint32_t	tx_pending;	/* ports we sent to */
+	int		rx_next;	/* port to receive from first */
+};
+
+static inline struct vswitch_ring *
+vswitch_ring(struct vswitch_port *port, int from, int to)
+{
+	return &port->shm->ring[from][to];
+}
+
+static inline uint64_t
+vswitch_mac(const uint8_t *mac)
+{
+	uint64_t m = 0;
+
+	memcpy(&m, mac, 6);
+	return m;
+}
+
+static inline uint64_t *
+vswitch_fdb(struct vswitch_port *port, uint64_t mac)
+{
+	return &port->shm->fdb[(mac * 0x9e3779b97f4a7c15ULL >> 32) &
+			       (VSWITCH_FDB - 1)];
+}
+
+/* the port which has sent from 'mac', or -1 */
+static int
+vswitch_lookup(struct vswitch_port *port, uint64_t mac)
+{
+	uint64_t e;
+	int idx;
+
+	e = __atomic_load_n(vswitch_fdb(port, mac), __ATOMIC_RELAXED);
+	if ((e & 0xffffffffffffULL) != mac || (e >> 48) == 0)
+		return -1;
+	idx = (e >> 48) - 1;
+	if (idx >= VSWITCH_PORTS ||
+	    __atomic_load_n(&port->shm->port[idx].pid, __ATOMIC_RELAXED) == 0)
+		return -1;
+	return idx;
+}
+
+static void
+vswitch_learn(struct vswitch_port *port, uint64_t mac)
+{
+	uint64_t *e, v;
+
+	v = (uint64_t)(port->idx + 1) << 48 | mac;
+	e = vswitch_fdb(port, mac);
+	if (__atomic_load_n(e, __ATOMIC_RELAXED) != v)
+		__atomic_store_n(e, v, __ATOMIC_RELAXED);
+}
+
+/* forget the addresses of our port, which may have had another owner */
+static void
+vswitch_forget(struct vswitch_port *port)
+{
+	uint64_t e;
+	int i;
+
+	for (i = 0; i < VSWITCH_FDB; i++) {
+		e = __atomic_load_n(&port->shm->fdb[i], __ATOMIC_RELAXED);
+		if ((e >> 48) == port->idx + 1)
+			__atomic_compare_exchange_n(&port->shm->fdb[i], &e, 0,
+				false, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+	}
+}
+
+/* Copy 'len' bytes of 'iov' to 'buf' */
+static void
+vswitch_from_iov(uint8_t *buf, const struct iovec *iov, int iovcnt,
+		 size_t len)
+{
+	size_t n;
+	int i;
+
+	for (i = 0; i < iovcnt && len > 0; i++) {
+		n = MIN(iov[i].iov_len, len);
+		memcpy(buf, iov[i].iov_base, n);
+		buf += n;
+		len -= n;
+	}
+}
+
+/* Put a frame in the ring to port 'to', if there is room */
+static int
+vswitch_put(struct vswitch_port *port, int to, const struct iovec *iov,
+	    int iovcnt, size_t len)
+{
+	struct vswitch_ring *ring;
+	struct vswitch_slot *slot;
+	uint32_t head;
+
+	ring = vswitch_ring(port, port->idx, to);
+	head = ring->head;
+	if (head - port->tx_tail[to] == VSWITCH_SLOTS) {
+		port->tx_tail[to] = __atomic_load_n(&ring->tail,
+						    __ATOMIC_ACQUIRE);
+		if (head - port->tx_tail[to] == VSWITCH_SLOTS)
+			return -1;
+	}
+
+	slot = &ring->slot[head & (VSWITCH_SLOTS - 1)];
+	vswitch_from_iov(slot->data, iov, iovcnt, len);
+	slot->len = len;
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+	port->tx_pending |= 1U << to;
+	return 0;
+}
+
+/*
+ * Send the frame in 'iov' to the port its destination was learnt from,
+ * or to all the others. Frames the receivers have no room for are
+ * dropped. Returns -1 if it went nowhere.
+ */
+int
+vswitch_send(struct vswitch_port *port, const struct iovec *iov, int iovcnt,
+	     size_t len)
+{
+	uint8_t hdr[12];
+	uint64_t src;
+	int to, i, sent;
+
+	if (len < sizeof(hdr) || len > VSWITCH_MAXFRAME)
+		return -1;
+
+	vswitch_from_iov(hdr, iov, iovcnt, sizeof(hdr));
+	src = vswitch_mac(&hdr[6]);
+	if (!(hdr[6] & 0x01))
+		vswitch_learn(port, src);
+
+	to = (hdr[0] & 0x01) ? -1 : vswitch_lookup(port, vswitch_mac(hdr));
+	if (to == port->idx)
+		return -1;
+	if (to >= 0)
+		return vswitch_put(port, to, iov, iovcnt, len);
+
+	sent = 0;
+	for (i = 0; i < VSWITCH_PORTS; i++) {
+		if (i == port->idx ||
+		    __atomic_load_n(&port->shm->port[i].pid,
+				    __ATOMIC_RELAXED) == 0)
+			continue;
+		if (vswitch_put(port, i, iov, iovcnt, len) == 0)
+			sent++;
+	}
+	return sent ? 0 : -1;
+}
+
+static void
+vswitch_doorbell(struct vswitch_port *port, int idx, struct sockaddr_un *sun,
+		 socklen_t *len)
+{
+	memset(sun, 0, sizeof(*sun));
+	sun->sun_family = AF_UNIX;
+	/* abstract: sun_path[0] is 0 */
+	snprintf(sun->sun_path + 1, sizeof(sun->sun_path) - 1,
+		 "acrn-vsw-%s-%d", port->name, idx);
+	*len = offsetof(struct sockaddr_un, sun_path) + 1 +
+		strlen(sun->sun_path + 1);
+}
+
+/* Wake the receivers of what was sent since the last flush, if asleep */
+void
+vswitch_flush(struct vswitch_port *port)
+{
+	struct sockaddr_un sun;
+	socklen_t len;
+	char c = 0;
+	int i;
+
+	if (port->tx_pending == 0)
+		return;
+
+	/* the heads are visible before we look at the kick flags */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	for (i = 0; i < VSWITCH_PORTS; i++) {
+		if (!(port->tx_pending & (1U << i)) ||
+		    !__atomic_exchange_n(&port->shm->port[i].kick, 0,
+					 __ATOMIC_SEQ_CST))
+			continue;
+		vswitch_doorbell(port, i, &sun, &len);
+		(void) sendto(port->fd, &c, 1, MSG_DONTWAIT,
+			      (struct sockaddr *)&sun, len);
+	}
+	port->tx_pending = 0;
+}
+
+/* Ring our own doorbell, to resume receiving from the event loop */
+void
+vswitch_kick(struct vswitch_port *port)
+{
+	struct sockaddr_un sun;
+	socklen_t len;
+	char c = 0;
+
+	vswitch_doorbell(port, port->idx, &sun, &len);
+	(void) sendto(port->fd, &c, 1, MSG_DONTWAIT,
+		      (struct sockaddr *)&sun, len);
+}
+
+/*
+ * Copy the next frame received to 'iov', trimming its lengths to the
+ * frame, or drop it if 'iovcnt' is 0. Returns its length, 0 if there
+ * is none.
+ */
+int
+vswitch_recv(struct vswitch_port *port, struct iovec *iov, int iovcnt)
+{
+	struct vswitch_ring *ring;
+	struct vswitch_slot *slot;
+	uint32_t tail;
+	size_t n, len, off;
+	int i, from;
+
+	for (i = 0; i < VSWITCH_PORTS; i++) {
+		from = (port->rx_next + i) % VSWITCH_PORTS;
+		if (from == port->idx)
+			continue;
+		ring = vswitch_ring(port, from, port->idx);
+		tail = ring->tail;
+		if (tail != port->rx_head[from])
+			break;
+		port->rx_head[from] = __atomic_load_n(&ring->head,
+						      __ATOMIC_ACQUIRE);
+		if (tail != port->rx_head[from])
+			break;
+	}
+	if (i == VSWITCH_PORTS)
+		return 0;
+
+	/* round robin between the senders */
+	port->rx_next = (from + 1) % VSWITCH_PORTS;
+
+	slot = &ring->slot[tail & (VSWITCH_SLOTS - 1)];
+	len = MIN(slot->len, VSWITCH_MAXFRAME);
+	for (i = 0, off = 0; i < iovcnt; i++) {
+		n = MIN(iov[i].iov_len, len - off);
+		memcpy(iov[i].iov_base, slot->data + off, n);
+		iov[i].iov_len = n;
+		off += n;
+	}
+	__atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+	return iovcnt ? off : len;
+}
+
+/*
+ * Called when done with what was received: returns true if we may sleep
+ * on the doorbell, with the kick flag set, or false if more came in.
+ */
+bool
+vswitch_idle(struct vswitch_port *port)
+{
+	struct vswitch_shm_port *sp = &port->shm->port[port->idx];
+	char buf[64];
+	int i;
+
+	while (recv(port->fd, buf, sizeof(buf), MSG_DONTWAIT) > 0)
+		;
+
+	__atomic_store_n(&sp->kick, 1, __ATOMIC_SEQ_CST);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	for (i = 0; i < VSWITCH_PORTS; i++) {
+		if (i == port->idx)
+			continue;
+		if (__atomic_load_n(&vswitch_ring(port, i, port->idx)->head,
+				    __ATOMIC_ACQUIRE) !=
+		    vswitch_ring(port, i, port->idx)->tail) {
+			__atomic_store_n(&sp->kick, 0, __ATOMIC_RELAXED);
+			return false;
+		}
+	}
+	return true;
+}
+
+/* the doorbell to wait on for frames */
+int
+vswitch_fd(struct vswitch_port *port)
+{
+	return port->fd;
+}
+
+/* Take a port which is free, or whose owner is gone */
+static int
+vswitch_claim(struct vswitch_shm *shm)
+{
+	int32_t pid, self = getpid();
+	int i;
+
+	for (i = 0; i < VSWITCH_PORTS; i++) {
+		pid = __atomic_load_n(&shm->port[i].pid, __ATOMIC_ACQUIRE);
+		if (pid != 0 && (kill(pid, 0) == 0 || errno != ESRCH))
+			continue;
+		if (__atomic_compare_exchange_n(&shm->port[i].pid, &pid, self,
+				false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+			return i;
+	}
+	return -1;
+}
+
+/*
+ * Attach to the switch 'name' as a new port, creating it if it doesn't
+ * exist yet.
+ */
+struct vswitch_port *
+vswitch_open(const char *name)
+{
+	struct vswitch_port *port;
+	struct vswitch_shm *shm;
+	struct sockaddr_un sun;
+	struct stat sbuf;
+	char shm_name[NAME_MAX];
+	socklen_t len;
+	size_t map_size;
+	int sfd, i;
+	bool creator;
+
+	if (strlen(name) > VSWITCH_NAME_MAX || strchr(name, '/') != NULL) {
+		WPRINTF(("vswitch: invalid name %s\n", name));
+		return NULL;
+	}
+	snprintf(shm_name, sizeof(shm_name), "/acrn-vsw-%s", name);
+	map_size = roundup(sizeof(struct vswitch_shm), 4096);
+
+	creator = true;
+	sfd = shm_open(shm_name, O_RDWR | O_CREAT | O_EXCL, 0600);
+	if (sfd < 0 && errno == EEXIST) {
+		creator = false;
+		sfd = shm_open(shm_name, O_RDWR, 0600);
+	}
+	if (sfd < 0) {
+		WPRINTF(("vswitch: shm_open %s failed, errno %d\n",
+			 shm_name, errno));
+		return NULL;
+	}
+
+	if (creator) {
+		if (ftruncate(sfd, map_size) < 0)
+			goto fail_unlink;
+	} else {
+		/* the creator sets the size */
+		sbuf.st_size = 0;
+		for (i = 0; i < VSWITCH_WAIT_MS; i++) {
+			if (fstat(sfd, &sbuf) == 0 && sbuf.st_size > 0)
+				break;
+			usleep(1000);
+		}
+		if (sbuf.st_size != map_size)
+			goto fail;
+	}
+
+	shm = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, sfd, 0);
+	close(sfd);
+	sfd = -1;
+	if (shm == MAP_FAILED)
+		goto fail_unlink;
+
+	if (creator) {
+		shm->version = VSWITCH_VERSION;
+		shm->nports = VSWITCH_PORTS;
+		shm->nslots = VSWITCH_SLOTS;
+		shm->slot_size = VSWITCH_SLOTSZ;
+		__atomic_store_n(&shm->magic, VSWITCH_MAGIC, __ATOMIC_RELEASE);
+	} else {
+		for (i = 0; i < VSWITCH_WAIT_MS; i++) {
+			if (__atomic_load_n(&shm->magic, __ATOMIC_ACQUIRE) ==
+			    VSWITCH_MAGIC)
+				break;
+			usleep(1000);
+		}
+		if (shm->magic != VSWITCH_MAGIC ||
+		    shm->version != VSWITCH_VERSION ||
+		    shm->nports != VSWITCH_PORTS ||
+		    shm->nslots != VSWITCH_SLOTS ||
+		    shm->slot_size != VSWITCH_SLOTSZ) {
+			WPRINTF(("vswitch: %s is not usable\n", shm_name));
+			munmap(shm, map_size);
+			return NULL;
+		}
+	}
+
+	port = calloc(1, sizeof(struct vswitch_port));
+	if (port == NULL) {
+		munmap(shm, map_size);
+		return NULL;
+	}
+	port->shm = shm;
+	strcpy(port->name, name);
+	port->fd = -1;
+	port->idx = vswitch_claim(shm);
+	if (port->idx < 0) {
+		WPRINTF(("vswitch: %s has no free port\n", name));
+		goto fail_port;
+	}
+
+	port->fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+			  0);
+	vswitch_doorbell(port, port->idx, &sun, &len);
+	if (port->fd < 0 || bind(port->fd, (struct sockaddr *)&sun, len) < 0) {
+		WPRINTF(("vswitch: cannot set up the doorbell of %s port %d,"
+			 " errno %d\n", name, port->idx, errno));
+		goto fail_port;
+	}
+
+	/* drop what was left for the previous owner */
+	vswitch_forget(port);
+	for (i = 0; i < VSWITCH_PORTS; i++) {
+		struct vswitch_ring *ring = vswitch_ring(port, i, port->idx);
+
+		port->rx_head[i] = __atomic_load_n(&ring->head,
+						   __ATOMIC_ACQUIRE);
+		__atomic_store_n(&ring->tail, port->rx_head[i],
+				 __ATOMIC_RELEASE);
+		port->tx_tail[i] = vswitch_ring(port, port->idx, i)->tail;
+	}
+	__atomic_store_n(&shm->port[port->idx].kick, 1, __ATOMIC_SEQ_CST);
+
+	printf("vswitch: %s port %d\n", name, port->idx);
+	return port;
+
+fail_port:
+	if (port->fd >= 0)
+		close(port->fd);
+	if (port->idx >= 0)
+		__atomic_store_n(&shm->port[port->idx].pid, 0,
+				 __ATOMIC_RELEASE);
+	free(port);
+	munmap(shm, map_size);
+	return NULL;
+
+fail_unlink:
+	if (creator)
+		shm_unlink(shm_name);
+fail:
+	if (sfd >= 0)
+		close(sfd);
+	WPRINTF(("vswitch: could not set up %s\n", shm_name));
+	return NULL;
+}
+
+void
+vswitch_close(struct vswitch_port *port)
+{
+	struct vswitch_shm *shm = port->shm;
+
+	vswitch_forget(port);
+	__atomic_store_n(&shm->port[port->idx].kick, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&shm->port[port->idx].pid, 0, __ATOMIC_RELEASE);
+	close(port->fd);
+	munmap(shm, roundup(sizeof(struct vswitch_shm), 4096));
+	free(port);
+}
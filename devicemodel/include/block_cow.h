@@ -0,0 +1,53 @@
+/*-
+ * Copyright (c) 2018 Intel Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+/*
+ * Sparse copy-on-write disk images for block_if. Only the clusters the
+ * guest wrote are stored in the image, the others are read from the
+ * backing file, which may itself be a CoW image.
+ */
+
+#ifndef _BLOCK_COW_H_
+#define _BLOCK_COW_H_
+
+#include <sys/uio.h>
+#include <stdbool.h>
+
+struct cow_image;
+
+int	cow_create(const char *path, const char *backing, bool backing_cow);
+struct cow_image *cow_open(const char *path, bool ro, bool sync,
+			   size_t cache_mb);
+void	cow_close(struct cow_image *img);
+int	cow_fd(struct cow_image *img);
+off_t	cow_size(struct cow_image *img);
+int	cow_readv(struct cow_image *img, const struct iovec *iov, int iovcnt,
+		  off_t off);
+int	cow_writev(struct cow_image *img, const struct iovec *iov, int iovcnt,
+		   off_t off);
+
+#endif /* _BLOCK_COW_H_ */
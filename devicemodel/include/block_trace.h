@@ -0,0 +1,51 @@
+/*-
+ * Copyright (c) 2018 Intel Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+/*
+ * Boot I/O traces: the reads of the first seconds after an image is
+ * opened are recorded next to it, and read ahead on the next boots.
+ */
+
+#ifndef _BLOCK_TRACE_H_
+#define _BLOCK_TRACE_H_
+
+#include <sys/types.h>
+
+struct btrace;
+
+/*
+ * Read 'len' bytes at 'off' in the caches, 'buf' is scratch space of
+ * 'len' bytes. Returns 0 or an errno.
+ */
+typedef int (*btrace_fill_t)(void *arg, off_t off, void *buf, size_t len);
+
+struct btrace *btrace_start(const char *path, off_t start, off_t size,
+			    int secs, btrace_fill_t fill, void *arg);
+void	btrace_stop(struct btrace *bt);
+void	btrace_read(struct btrace *bt, off_t off, size_t len);
+
+#endif /* _BLOCK_TRACE_H_ */
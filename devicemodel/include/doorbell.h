@@ -0,0 +1,50 @@
+/*-
+ * Copyright (c) 2018 Intel Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#ifndef _DOORBELL_H_
+#define	_DOORBELL_H_
+
+#include "types.h"
+struct vmctx;
+
+/*
+ * Doorbell handlers are called from the vm_loop thread after the
+ * hypervisor completed a write to the doorbell address on its own. They
+ * may be called spuriously and must not call doorbell_add/doorbell_del_range.
+ */
+typedef void (*doorbell_func_t)(void *arg);
+
+#define	DOORBELL_F_DATAMATCH	0x1	/* only writes of 'data' ring */
+
+int	doorbell_add(struct vmctx *ctx, uint32_t type, uint64_t addr,
+		     uint64_t data, uint32_t flags, doorbell_func_t handler,
+		     void *arg);
+void	doorbell_del_range(struct vmctx *ctx, uint32_t type, uint64_t base,
+			   uint64_t size);
+void	doorbell_handle(struct vmctx *ctx);
+
+#endif	/* _DOORBELL_H_ */
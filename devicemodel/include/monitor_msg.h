@@ -57,6 +57,7 @@ enum msgid {
 
 	MSG_STR,
 	MSG_HANDSHAKE,		/* handshake */
+	REQ_BLKIO_LIMIT,	/* VM Mngr -> ACRN-DM(vm) */
 
 	MSGID_MAX
 };
@@ -104,4 +105,21 @@ struct vmm_msg_handshake {
 	/*   message to such client */
 };
 
+/*
+ * Query, or set if 'set' is non zero, the I/O limits of the block device
+ * 'ident', as named by its device model (e.g. "5:0" for virtio-blk at
+ * slot 5, "03:00:01" for port 1 of the AHCI at slot 3). The reply is the
+ * same message with the limits in effect. A limit of 0 means unlimited,
+ * a burst of 0 one second worth of the rate.
+ */
+struct vmm_msg_blkio_limit {
+	struct vmm_msg vmsg;
+	char ident[CLIENT_NAME_LEN];
+	int set;
+	unsigned long long iops;	/* requests per second */
+	unsigned long long iops_burst;
+	unsigned long long bps;		/* bytes per second */
+	unsigned long long bps_burst;
+};
+
 #endif
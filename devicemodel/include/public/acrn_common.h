@@ -164,6 +164,61 @@ struct vhm_request_buffer {
 	};
 } __aligned(4096);
 
+/*
+ * Posted write requests
+ *
+ * Writes to ranges the DM registered as posted are queued by ACRN in a
+ * per-VM ring instead of req_queue, and the vcpu resumes right away. The
+ * DM drains the ring before handling any request from req_queue, so the
+ * writes are still emulated in guest order.
+ */
+#define VHM_BUF_REQUEST_MAX	128	/* must be a power of 2 */
+
+/*
+ * Doorbells
+ *
+ * A write to a registered doorbell address is completed by ACRN itself:
+ * it only sets the doorbell bit in doorbell_pending of the posted write
+ * request ring and signals VHM if the bit was clear. This is used for
+ * "queue N has work" style registers such as virtio queue notify.
+ */
+#define VHM_DOORBELL_MAX	64	/* must be a multiple of 64 */
+
+struct vhm_buf_request {
+	/* REQ_PORTIO or REQ_MMIO */
+	uint32_t type;
+
+	/* the vcpu which issued the write */
+	uint16_t vcpu;
+
+	/* access size in bytes */
+	uint16_t size;
+
+	int64_t address;
+	int64_t value;
+} __aligned(8);
+
+struct vhm_buf_request_ring {
+	/* free running index of the next slot to fill.
+	 * ACRN write, VHM/DM read only
+	 */
+	uint32_t tail;
+	int32_t reserved0[15];
+
+	/* free running index of the next slot to drain.
+	 * DM write, ACRN read only
+	 */
+	uint32_t head;
+	int32_t reserved1[15];
+
+	struct vhm_buf_request reqs[VHM_BUF_REQUEST_MAX];
+
+	/* one bit per doorbell id, set when the doorbell was rung.
+	 * ACRN set, DM clear
+	 */
+	uint64_t doorbell_pending[VHM_DOORBELL_MAX / 64];
+} __aligned(4096);
+
 /**
  * @brief Info to create a VM, the parameter for HC_CREATE_VM hypercall
  */
@@ -209,6 +264,53 @@ struct acrn_set_ioreq_buffer {
 	uint64_t req_buf;
 } __aligned(8);
 
+/**
+ * @brief Info to add or remove a posted write range for a VM
+ *
+ * the parameter for HC_ADD_POSTED_RANGE/HC_DEL_POSTED_RANGE hypercall
+ */
+struct acrn_posted_range {
+	/** REQ_PORTIO or REQ_MMIO */
+	uint32_t type;
+
+	/** reserved for alignment padding */
+	uint32_t reserved;
+
+	/** start address of the range */
+	uint64_t start;
+
+	/** size of the range in bytes */
+	uint64_t size;
+} __aligned(8);
+
+/** Only writes of acrn_doorbell.data ring the doorbell */
+#define ACRN_DOORBELL_DATAMATCH		(1U << 0)
+
+/**
+ * @brief Info to add or remove a doorbell for a VM
+ *
+ * the parameter for HC_ADD_DOORBELL/HC_DEL_DOORBELL hypercall
+ */
+struct acrn_doorbell {
+	/** REQ_PORTIO or REQ_MMIO */
+	uint32_t type;
+
+	/** bit set in doorbell_pending, less than VHM_DOORBELL_MAX */
+	uint32_t id;
+
+	/** address of the notify register */
+	uint64_t addr;
+
+	/** value to match if ACRN_DOORBELL_DATAMATCH is set */
+	uint64_t data;
+
+	/** ACRN_DOORBELL_* flags */
+	uint32_t flags;
+
+	/** reserved for alignment padding */
+	uint32_t reserved;
+} __aligned(8);
+
 /** Interrupt type for acrn_irqline: inject interrupt to IOAPIC */
 #define	ACRN_INTR_TYPE_ISA	0
 
@@ -250,6 +352,58 @@ struct acrn_msi_entry {
 	uint64_t msi_data;
 } __aligned(8);
 
+/** Operation type for acrn_intr_op: assert irqline */
+#define	ACRN_INTR_OP_ASSERT	0
+
+/** Operation type for acrn_intr_op: deassert irqline */
+#define	ACRN_INTR_OP_DEASSERT	1
+
+/** Operation type for acrn_intr_op: pulse irqline */
+#define	ACRN_INTR_OP_PULSE	2
+
+/** Operation type for acrn_intr_op: inject MSI */
+#define	ACRN_INTR_OP_MSI	3
+
+/**
+ * @brief One interrupt operation of a HC_INJECT_INTR_BATCH hypercall
+ */
+struct acrn_intr_op {
+	/** ACRN_INTR_OP_* */
+	uint32_t op;
+
+	/** reserved for alignment padding */
+	uint32_t reserved;
+
+	union {
+		/** irqline for ACRN_INTR_OP_ASSERT/DEASSERT/PULSE */
+		struct acrn_irqline irqline;
+
+		/** MSI for ACRN_INTR_OP_MSI */
+		struct acrn_msi_entry msi;
+	};
+} __aligned(8);
+
+/** Max number of operations in one HC_INJECT_INTR_BATCH hypercall */
+#define	ACRN_INTR_BATCH_MAX	64
+
+/**
+ * @brief Info to inject several interrupts to a VM at once
+ *
+ * the parameter for HC_INJECT_INTR_BATCH hypercall
+ */
+struct acrn_intr_batch {
+	/** number of operations, up to ACRN_INTR_BATCH_MAX */
+	uint32_t nr_ops;
+
+	/** reserved for alignment padding */
+	uint32_t reserved;
+
+	/** guest physical address of the acrn_intr_op array, which is
+	 *  done in order
+	 */
+	uint64_t ops;
+} __aligned(8);
+
 /**
  * @brief Info to inject a NMI interrupt for a VM
  */
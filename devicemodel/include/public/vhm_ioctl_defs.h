@@ -79,6 +79,7 @@
 #define IC_DEASSERT_IRQLINE            _IC_ID(IC_ID, IC_ID_IRQ_BASE + 0x01)
 #define IC_PULSE_IRQLINE               _IC_ID(IC_ID, IC_ID_IRQ_BASE + 0x02)
 #define IC_INJECT_MSI                  _IC_ID(IC_ID, IC_ID_IRQ_BASE + 0x03)
+#define IC_INJECT_INTR_BATCH           _IC_ID(IC_ID, IC_ID_IRQ_BASE + 0x04)
 
 /* DM ioreq management */
 #define IC_ID_IOREQ_BASE                0x30UL
@@ -87,6 +88,11 @@
 #define IC_CREATE_IOREQ_CLIENT          _IC_ID(IC_ID, IC_ID_IOREQ_BASE + 0x02)
 #define IC_ATTACH_IOREQ_CLIENT          _IC_ID(IC_ID, IC_ID_IOREQ_BASE + 0x03)
 #define IC_DESTROY_IOREQ_CLIENT         _IC_ID(IC_ID, IC_ID_IOREQ_BASE + 0x04)
+#define IC_SET_BUF_IOREQ_RING           _IC_ID(IC_ID, IC_ID_IOREQ_BASE + 0x05)
+#define IC_ADD_POSTED_RANGE             _IC_ID(IC_ID, IC_ID_IOREQ_BASE + 0x06)
+#define IC_DEL_POSTED_RANGE             _IC_ID(IC_ID, IC_ID_IOREQ_BASE + 0x07)
+#define IC_ADD_DOORBELL                 _IC_ID(IC_ID, IC_ID_IOREQ_BASE + 0x08)
+#define IC_DEL_DOORBELL                 _IC_ID(IC_ID, IC_ID_IOREQ_BASE + 0x09)
 
 /* Guest memory management */
 #define IC_ID_MEM_BASE                  0x40UL
@@ -68,4 +68,59 @@ struct vbs_dev_info {
 #define VBS_K_SET_DEV _IOW(VBS_K_IOCTL, 0x00, struct vbs_dev_info)
 #define VBS_K_SET_VQ _IOW(VBS_K_IOCTL, 0x01, struct vbs_vqs_info)
 
+/*
+ * The Linux vhost interface, from <linux/vhost.h>, whose virtio ring
+ * definitions clash with ours.
+ */
+struct vhost_vring_state {
+	unsigned int index;
+	unsigned int num;
+};
+
+struct vhost_vring_file {
+	unsigned int index;
+	int fd;			/* -1 to unbind */
+};
+
+struct vhost_vring_addr {
+	unsigned int index;
+	unsigned int flags;
+	uint64_t desc_user_addr;
+	uint64_t used_user_addr;
+	uint64_t avail_user_addr;
+	uint64_t log_guest_addr;
+};
+
+struct vhost_memory_region {
+	uint64_t guest_phys_addr;
+	uint64_t memory_size;
+	uint64_t userspace_addr;
+	uint64_t flags_padding;
+};
+
+struct vhost_memory {
+	uint32_t nregions;
+	uint32_t padding;
+	struct vhost_memory_region regions[0];
+};
+
+#define VHOST_GET_FEATURES	_IOR(VBS_K_IOCTL, 0x00, uint64_t)
+#define VHOST_SET_FEATURES	_IOW(VBS_K_IOCTL, 0x00, uint64_t)
+#define VHOST_SET_OWNER		_IO(VBS_K_IOCTL, 0x01)
+#define VHOST_SET_MEM_TABLE	_IOW(VBS_K_IOCTL, 0x03, struct vhost_memory)
+#define VHOST_SET_VRING_NUM	_IOW(VBS_K_IOCTL, 0x10, \
+				     struct vhost_vring_state)
+#define VHOST_SET_VRING_ADDR	_IOW(VBS_K_IOCTL, 0x11, \
+				     struct vhost_vring_addr)
+#define VHOST_SET_VRING_BASE	_IOW(VBS_K_IOCTL, 0x12, \
+				     struct vhost_vring_state)
+#define VHOST_GET_VRING_BASE	_IOWR(VBS_K_IOCTL, 0x12, \
+				      struct vhost_vring_state)
+#define VHOST_SET_VRING_KICK	_IOW(VBS_K_IOCTL, 0x20, \
+				     struct vhost_vring_file)
+#define VHOST_SET_VRING_CALL	_IOW(VBS_K_IOCTL, 0x21, \
+				     struct vhost_vring_file)
+#define VHOST_NET_SET_BACKEND	_IOW(VBS_K_IOCTL, 0x30, \
+				     struct vhost_vring_file)
+
 #endif /* _VBS_COMMON_IF_H_ */
@@ -0,0 +1,79 @@
+/*
+ * Copyright (C) 2018 Intel Corporation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ *   * Neither the name of Intel Corporation nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/*
+ * vhost-user: the rings of a device, or of some of its queues, served by
+ * another process on the UNIX socket given.  It maps the guest memory,
+ * which must come from hugetlbfs (-T), from the fds we pass it.  As with
+ * vhost, the guest notifies are passed on through the kick eventfds and
+ * the interrupts it asks for through the call eventfds are delivered
+ * from the mevent loop.
+ */
+
+#ifndef _VHOST_USER_H_
+#define _VHOST_USER_H_
+
+#include <stdint.h>
+
+#define VHOST_USER_MAX_VQS	32
+
+/* no protocol features: the rings run as soon as they get a kick fd */
+#define VHOST_USER_F_PROTOCOL_FEATURES	(1UL << 30)
+
+struct virtio_base;
+struct virtio_vq_info;
+struct mevent;
+
+struct vhost_user_vq {
+	int		kick_fd;	/* we signal guest notifies */
+	int		call_fd;	/* the backend asks for interrupts */
+	int		started;
+	struct mevent	*mevp;
+	struct virtio_vq_info *vq;
+};
+
+struct vhost_user {
+	int		fd;		/* the socket */
+	int		nvq;
+	int		started;
+	uint64_t	features;	/* the backend supports */
+	struct vhost_user_vq vqs[VHOST_USER_MAX_VQS];
+};
+
+int vhost_user_init(struct vhost_user *vu, const char *path,
+		    struct virtio_base *base, int nvq);
+void vhost_user_deinit(struct vhost_user *vu);
+int vhost_user_start(struct vhost_user *vu, uint64_t features, int nvq);
+int vhost_user_start_vqs(struct vhost_user *vu, int nvq);
+int vhost_user_stop(struct vhost_user *vu);
+int vhost_user_kick(struct vhost_user *vu, struct virtio_vq_info *vq);
+
+#endif
@@ -126,6 +126,8 @@
  * not be implemented.)
  */
 
+#include <pthread.h>
+#include <stdbool.h>
 #include "types.h"
 
 /**
@@ -171,6 +173,53 @@ struct vring_used {
 /*	uint16_t	avail_event;	-- after N ring entries */
 } __attribute__((packed));
 
+/*
+ * With VIRTIO_F_RING_PACKED (modern devices only), a virtqueue is a
+ * single ring of <N> 16-byte descriptors, a 64-bit <addr>, a 32-bit
+ * <len>, a 16-bit buffer <id> and 16-bit <flags>, which both sides
+ * walk in order, wrapping around to the start.  <N> need not be a
+ * power of two.  Each side keeps a "wrap counter", starting at 1 and
+ * flipped each time it wraps.
+ *
+ * The driver makes a descriptor available by setting its AVAIL flag
+ * to its wrap counter and its USED flag to the inverse.  A chain is
+ * a run of descriptors with NEXT set on all but the last (or a single
+ * INDIRECT one, pointing to a table of packed descriptors), and the
+ * buffer <id> is the one of the last descriptor.  The device returns
+ * the whole chain by writing one descriptor at its own used position,
+ * with the buffer <id>, the written <len>, and both AVAIL and USED set
+ * to its wrap counter, and then skips as many descriptors as the chain
+ * had.  Chains may be returned in any order.
+ *
+ * The "avail" and "used" addresses of the queue then give two event
+ * suppression structures instead: the "driver" one (at "avail"),
+ * through which the guest asks for interrupts, and the "device" one
+ * (at "used"), through which we ask for notifies.  Each has <flags>,
+ * ENABLE, DISABLE or DESC, and with VIRTIO_RING_F_EVENT_IDX and DESC,
+ * an <off_wrap> position (and wrap counter, in bit 15) at which to
+ * send the next event.
+ */
+#define VRING_PACKED_DESC_F_AVAIL	(1 << 7)
+#define VRING_PACKED_DESC_F_USED	(1 << 15)
+
+struct vring_packed_desc {
+	uint64_t	addr;	/* guest physical address */
+	uint32_t	len;	/* length of scatter/gather seg */
+	uint16_t	id;	/* buffer id */
+	uint16_t	flags;	/* VRING_DESC_F_*, VRING_PACKED_DESC_F_* */
+} __attribute__((packed));
+
+#define VRING_PACKED_EVENT_F_ENABLE	0
+#define VRING_PACKED_EVENT_F_DISABLE	1
+#define VRING_PACKED_EVENT_F_DESC	2
+
+#define VRING_PACKED_WRAP		(1 << 15)	/* in a position */
+
+struct vring_packed_event {
+	uint16_t	off_wrap;	/* event position and wrap counter */
+	uint16_t	flags;		/* VRING_PACKED_EVENT_F_* */
+} __attribute__((packed));
+
 /*
  * The address of any given virtual queue is determined by a single
  * Page Frame Number register.  The guest writes the PFN into the
@@ -317,6 +366,9 @@ struct vring_used {
 /* v1.0 compliant. */
 #define VIRTIO_F_VERSION_1		(1UL << 32)
 
+/* packed virtqueue layout, see above */
+#define VIRTIO_F_RING_PACKED		(1UL << 34)
+
 /* From section 2.3, "Virtqueue Configuration", of the virtio specification */
 /**
  * @brief Calculate size of a virtual ring, this interface is only valid for
@@ -373,12 +425,22 @@ struct virtio_vq_info;
  * However, the driver must verify the read or write size and offset
  * and that no one is writing a readonly register.)
  *
+ * The NOTIFY_UNLOCKED flag is for drivers with per-queue locks: queue
+ * notifies, other than through the legacy BAR, are then passed on
+ * without base->mtx held.
+ *
  * The BROKED flag ("this thing done gone and broked") is for future
  * use.
+ *
+ * Modern devices are offered VIRTIO_F_RING_PACKED on top of their own
+ * hv_caps, since the vq_* functions handle both layouts.  Legacy-only
+ * devices can't negotiate it.
  */
 #define	VIRTIO_USE_MSIX		0x01
 #define	VIRTIO_EVENT_IDX	0x02	/* use the event-index values */
+#define	VIRTIO_NOTIFY_UNLOCKED	0x04	/* modern queue notifies without mtx */
 #define	VIRTIO_BROKED		0x08	/* ??? */
+#define	VIRTIO_POLL		0x20	/* queue polling, see virtio_poll */
 
 /*
  * virtio pci device bar layout
@@ -498,6 +560,27 @@ struct virtio_pci_cfg_cap {
 	uint8_t pci_cfg_data[4]; /* Data for BAR access. */
 };
 
+/**
+ * @brief Queue polling state of a virtio device
+ *
+ * After a kick, a thread keeps looking for new chains on the polled
+ * queues, with notifies off, until none came for 'budget'; notifies are
+ * then turned back on until the next kick.  With 'intr', the interrupts
+ * of each queue are moderated to one per period, the thread delivering
+ * the ones held back.  See virtio_poll_start().
+ */
+struct virtio_poll {
+	uint64_t	vqmask;		/**< polled queues */
+	uint64_t	budget;		/**< polling time after activity, ns */
+	uint64_t	intr;		/**< interrupt period, ns, or 0 */
+	uint64_t	pending;	/**< queues with an interrupt held back */
+	bool		kicked;		/**< guest notify while not polling */
+	bool		closing;	/**< thread to exit */
+	pthread_t	tid;		/**< polling thread */
+	pthread_mutex_t	mtx;		/**< protects the above */
+	pthread_cond_t	cond;		/**< wakes the thread up */
+};
+
 /**
  * @brief Base component to any virtio device
  */
@@ -518,6 +601,7 @@ struct virtio_base {
 	uint8_t config_generation;	/**< configuration generation */
 	uint32_t device_feature_select;	/**< current selected device feature */
 	uint32_t driver_feature_select;	/**< current selected guest feature */
+	struct virtio_poll poll;	/**< queue polling, with VIRTIO_POLL */
 };
 
 #define	VIRTIO_BASE_LOCK(vb)					\
@@ -556,6 +640,16 @@ struct virtio_ops {
 
 #define	VQ_ALLOC	0x01	/* set once we have a pfn */
 #define	VQ_BROKED	0x02	/* ??? */
+#define	VQ_PACKED	0x04	/* packed layout, see above */
+
+/**
+ * @brief Per buffer id state of a packed virtqueue
+ */
+struct vq_packed_id {
+	uint16_t ndesc;		/**< ring descriptors of the chain */
+	uint16_t prev;		/**< id of the chain taken before it */
+};
+
 /**
  * @brief Virtqueue data structure
  *
@@ -602,6 +696,24 @@ struct virtio_vq_info {
 	uint32_t gpa_avail[2];	/**< gpa of avail_ring */
 	uint32_t gpa_used[2];	/**< gpa of used_ring */
 	bool enabled;		/**< whether the virtqueue is enabled */
+
+	/*
+	 * With VQ_PACKED, last_avail and save_used hold a ring position
+	 * with the wrap counter in bit 15, and the rings are these.
+	 */
+	volatile struct vring_packed_desc *pdesc;
+				/**< packed descriptor ring */
+	volatile struct vring_packed_event *driver_event;
+				/**< driver event suppression */
+	volatile struct vring_packed_event *device_event;
+				/**< device event suppression */
+	uint16_t used_idx;	/**< next used position and wrap counter */
+	uint16_t last_id;	/**< buffer id of the last chain taken */
+	uint16_t nids;		/**< size of ids[] */
+	struct vq_packed_id *ids;
+				/**< chains in flight, by buffer id */
+
+	uint64_t intr_next;	/**< no interrupt before, if moderated */
 };
 
 /* as noted above, these are sort of backwards, name-wise */
@@ -623,6 +735,25 @@ vq_ring_ready(struct virtio_vq_info *vq)
 	return (vq->flags & VQ_ALLOC);
 }
 
+/**
+ * @brief Is the descriptor at a position of a packed ring available?
+ *
+ * @param vq Pointer to struct virtio_vq_info, with VQ_PACKED.
+ * @param pos Ring position, with the wrap counter in bit 15.
+ *
+ * @return 0 on no and 1 on yes.
+ */
+static inline int
+vq_packed_avail(struct virtio_vq_info *vq, uint16_t pos)
+{
+	uint16_t flags, wrap;
+
+	flags = vq->pdesc[pos & ~VRING_PACKED_WRAP].flags;
+	wrap = !!(pos & VRING_PACKED_WRAP);
+	return !!(flags & VRING_PACKED_DESC_F_AVAIL) == wrap &&
+	    !!(flags & VRING_PACKED_DESC_F_USED) != wrap;
+}
+
 /**
  * @brief Are there "available" descriptors?
  *
@@ -635,14 +766,39 @@ vq_ring_ready(struct virtio_vq_info *vq)
 static inline int
 vq_has_descs(struct virtio_vq_info *vq)
 {
-	return (vq_ring_ready(vq) && vq->last_avail !=
-	    vq->avail->idx);
+	if (!vq_ring_ready(vq))
+		return 0;
+	if (vq->flags & VQ_PACKED)
+		return vq_packed_avail(vq, vq->last_avail);
+	return vq->last_avail != vq->avail->idx;
 }
 
 /**
- * @brief Deliver an interrupt to guest on the given virtqueue.
+ * @brief Ask the guest for notifies on new available chains, or not.
+ *
+ * Callers re-enabling notifies should check vq_has_descs() again,
+ * after a barrier, for chains made available in between.
  *
- * The interrupt could be MSI-X or a generic MSI interrupt.
+ * @param vq Pointer to struct virtio_vq_info.
+ * @param enable Whether to be notified.
+ *
+ * @return N/A
+ */
+static inline void
+vq_set_notify(struct virtio_vq_info *vq, bool enable)
+{
+	if (vq->flags & VQ_PACKED)
+		vq->device_event->flags = enable ?
+		    VRING_PACKED_EVENT_F_ENABLE : VRING_PACKED_EVENT_F_DISABLE;
+	else if (enable)
+		vq->used->flags &= ~VRING_USED_F_NO_NOTIFY;
+	else
+		vq->used->flags |= VRING_USED_F_NO_NOTIFY;
+}
+
+/**
+ * @brief Deliver an interrupt to guest on the given virtqueue, even if
+ * interrupts are moderated.
  *
  * @param vb Pointer to struct virtio_base.
  * @param vq Pointer to struct virtio_vq_info.
@@ -650,7 +806,7 @@ vq_has_descs(struct virtio_vq_info *vq)
  * @return NULL
  */
 static inline void
-vq_interrupt(struct virtio_base *vb, struct virtio_vq_info *vq)
+vq_do_interrupt(struct virtio_base *vb, struct virtio_vq_info *vq)
 {
 	if (pci_msix_enabled(vb->dev))
 		pci_generate_msix(vb->dev, vq->msix_idx);
@@ -663,6 +819,29 @@ vq_interrupt(struct virtio_base *vb, struct virtio_vq_info *vq)
 	}
 }
 
+bool virtio_poll_intr(struct virtio_base *vb, struct virtio_vq_info *vq);
+
+/**
+ * @brief Deliver an interrupt to guest on the given virtqueue.
+ *
+ * The interrupt could be MSI-X or a generic MSI interrupt.  If the
+ * interrupts of the device are moderated, it may be held back and
+ * delivered later by the polling thread.
+ *
+ * @param vb Pointer to struct virtio_base.
+ * @param vq Pointer to struct virtio_vq_info.
+ *
+ * @return NULL
+ */
+static inline void
+vq_interrupt(struct virtio_base *vb, struct virtio_vq_info *vq)
+{
+	if ((vb->flags & VIRTIO_POLL) && vb->poll.intr &&
+	    virtio_poll_intr(vb, vq))
+		return;
+	vq_do_interrupt(vb, vq);
+}
+
 /**
  * @brief Deliver an config changed interrupt to guest.
  *
@@ -748,6 +927,18 @@ int virtio_intr_init(struct virtio_base *vb, int barnum, int use_msix);
  */
 void virtio_reset_dev(struct virtio_base *vb);
 
+/**
+ * @brief Free what the virtqueues of a device allocated.
+ *
+ * Devices offering the modern interface, hence the packed ring, call
+ * it from their deinit.
+ *
+ * @param vb Pointer to struct virtio_base.
+ *
+ * @return N/A
+ */
+void virtio_deinit(struct virtio_base *vb);
+
 /**
  * @brief Set I/O BAR (usually 0) to map PCI config registers.
  *
@@ -774,6 +965,37 @@ void virtio_set_io_bar(struct virtio_base *vb, int barnum);
 int vq_getchain(struct virtio_vq_info *vq, uint16_t *pidx,
 		struct iovec *iov, int n_iov, uint16_t *flags);
 
+/**
+ * @brief A request chain taken by vq_getchains()
+ */
+struct vq_chain {
+	uint16_t idx;		/**< head descriptor, for vq_relchains() */
+	int n;			/**< number of descriptors */
+	struct iovec *iov;	/**< its descriptors, in the caller's iov[] */
+	uint16_t *flags;	/**< their flags, in the caller's flags[] */
+	uint32_t len;		/**< bytes returned to frontend */
+};
+
+/**
+ * @brief Take up to nchains available request chains in one pass.
+ *
+ * The descriptors of the chains go in turn in iov[] and flags[], as
+ * vq_getchain() puts them. A chain which doesn't fit in what is left of
+ * iov[] stays in the ring, unless it is the first one.
+ *
+ * @param vq Pointer to struct virtio_vq_info.
+ * @param chains Pointer to chains[] array prepared by caller.
+ * @param nchains Size of chains[] array.
+ * @param iov Pointer to iov[] array prepared by caller.
+ * @param n_iov Size of iov[] array.
+ * @param flags Pointer to a uint16_t array of n_iov entries which will
+ * contain flag of each descriptor, or NULL.
+ *
+ * @return number of chains, or -1 if the first one is invalid.
+ */
+int vq_getchains(struct virtio_vq_info *vq, struct vq_chain *chains,
+		 int nchains, struct iovec *iov, int n_iov, uint16_t *flags);
+
 /**
  * @brief Return the currently-first request chain back to the
  * available ring.
@@ -784,6 +1006,17 @@ int vq_getchain(struct virtio_vq_info *vq, uint16_t *pidx,
  */
 void vq_retchain(struct virtio_vq_info *vq);
 
+/**
+ * @brief Return the last n request chains taken back to the available
+ * ring.
+ *
+ * @param vq Pointer to struct virtio_vq_info.
+ * @param n Number of chains.
+ *
+ * @return N/A
+ */
+void vq_retchains(struct virtio_vq_info *vq, int n);
+
 /**
  * @brief Return specified request chain to the guest,
  * setting its I/O length to the provided value.
@@ -796,6 +1029,19 @@ void vq_retchain(struct virtio_vq_info *vq);
  */
 void vq_relchain(struct virtio_vq_info *vq, uint16_t idx, uint32_t iolen);
 
+/**
+ * @brief Return request chains to the guest, setting the I/O length of
+ * each to its len, with a single update of the used index.
+ *
+ * @param vq Pointer to struct virtio_vq_info.
+ * @param chains Chains returned by vq_getchains(), len set by the caller.
+ * @param n Number of chains.
+ *
+ * @return N/A
+ */
+void vq_relchains(struct virtio_vq_info *vq, const struct vq_chain *chains,
+		  int n);
+
 /**
  * @brief Driver has finished processing "available" chains and calling
  * vq_relchain on each one.
@@ -809,6 +1055,19 @@ void vq_relchain(struct virtio_vq_info *vq, uint16_t idx, uint32_t iolen);
  */
 void vq_endchains(struct virtio_vq_info *vq, int used_all_avail);
 
+/**
+ * @brief Same as vq_endchains(), without delivering the interrupt.
+ *
+ * For drivers with per-queue locks: the interrupt may take base->mtx,
+ * so it is delivered with vq_interrupt() after the queue lock is dropped.
+ *
+ * @param vq Pointer to struct virtio_vq_info.
+ * @param used_all_avail Flag indicating if driver used all available chains.
+ *
+ * @return 1 if an interrupt is needed, 0 otherwise.
+ */
+int vq_endchains_intr(struct virtio_vq_info *vq, int used_all_avail);
+
 /**
  * @brief Handle PCI configuration space reads.
  *
@@ -859,6 +1118,48 @@ void virtio_pci_write(struct vmctx *ctx, int vcpu, struct pci_vdev *dev,
  */
 void virtio_dev_error(struct virtio_base *base);
 
+/**
+ * @brief Start polling some queues of a device, and/or moderating its
+ * interrupts.
+ *
+ * The polling thread passes new chains on to the queue notify
+ * callbacks, as guest notifies do, with the same locking.
+ *
+ * @param vb Pointer to struct virtio_base.
+ * @param vqmask Queues to poll, bit n for queue n.
+ * @param budget_us How long to keep polling after the last new chain,
+ * in microseconds, or 0 not to poll.
+ * @param intr_us Minimum interval between the interrupts of a queue,
+ * in microseconds, or 0 not to moderate them.
+ *
+ * @return 0 on success and non-zero on fail.
+ */
+int virtio_poll_start(struct virtio_base *vb, uint64_t vqmask,
+		      uint32_t budget_us, uint32_t intr_us);
+
+/**
+ * @brief Stop the polling thread of a device, if any.
+ *
+ * Interrupts held back are delivered, and no longer moderated.
+ *
+ * @param vb Pointer to struct virtio_base.
+ *
+ * @return N/A
+ */
+void virtio_poll_stop(struct virtio_base *vb);
+
+/**
+ * @brief Parse a "poll=<budget us>[/<interrupt interval us>]" option.
+ *
+ * @param opt The option, "poll=" included.
+ * @param budget_us Where to put the polling budget.
+ * @param intr_us Where to put the interrupt interval, 0 if not given.
+ *
+ * @return 0 on success, -1 if opt is not a valid poll option.
+ */
+int virtio_poll_parse(const char *opt, uint32_t *budget_us,
+		      uint32_t *intr_us);
+
 /**
  * @brief Set modern BAR (usually 4) to map PCI config registers.
  *
@@ -63,4 +63,40 @@ int vbs_kernel_start(int fd, struct vbs_dev_info *dev,
 		     struct vbs_vqs_info *vqs);
 int vbs_kernel_stop(int fd);
 
+/*
+ * vhost: the rings of a device, or of some of its queues, handed to a
+ * Linux vhost driver (e.g. /dev/vhost-net) which does the data path.
+ * The guest notifies are passed on through the kick eventfds, and the
+ * interrupts the driver asks for through the call eventfds are
+ * delivered from the mevent loop.
+ */
+#define VHOST_MAX_VQS	2
+
+struct virtio_base;
+struct virtio_vq_info;
+struct mevent;
+
+struct vhost_kernel_vq {
+	int		kick_fd;	/* we signal guest notifies */
+	int		call_fd;	/* the driver asks for interrupts */
+	struct mevent	*mevp;
+	struct virtio_vq_info *vq;
+};
+
+struct vhost_kernel {
+	int		fd;
+	int		nvq;
+	int		started;
+	uint64_t	features;	/* the driver supports */
+	struct vhost_kernel_vq vqs[VHOST_MAX_VQS];
+};
+
+int vhost_kernel_init(struct vhost_kernel *vhost, const char *path,
+		      struct virtio_base *base, int vq_idx, int nvq);
+void vhost_kernel_deinit(struct vhost_kernel *vhost);
+int vhost_kernel_start(struct vhost_kernel *vhost, uint64_t features);
+int vhost_kernel_stop(struct vhost_kernel *vhost);
+int vhost_kernel_kick(struct vhost_kernel *vhost, struct virtio_vq_info *vq);
+int vhost_kernel_net_set_backend(struct vhost_kernel *vhost, int fd);
+
 #endif
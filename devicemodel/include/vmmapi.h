@@ -49,6 +49,8 @@ struct vmctx {
 	int     fd;
 	int     vmid;
 	int     ioreq_client;
+	struct vhm_buf_request_ring *buf_ioreq_ring;
+	int     intr_batch;	/* IC_INJECT_INTR_BATCH is supported */
 	uint32_t lowmem_limit;
 	int     memflags;
 	size_t  lowmem;
@@ -112,6 +114,15 @@ struct	vmctx *vm_open(const char *name);
 void	vm_close(struct vmctx *ctx);
 void	vm_pause(struct vmctx *ctx);
 int	vm_set_shared_io_page(struct vmctx *ctx, uint64_t page_vma);
+int	vm_set_buf_ioreq_ring(struct vmctx *ctx,
+			      struct vhm_buf_request_ring *ring);
+int	vm_add_posted_range(struct vmctx *ctx, uint32_t type, uint64_t start,
+			    uint64_t size);
+int	vm_del_posted_range(struct vmctx *ctx, uint32_t type, uint64_t start,
+			    uint64_t size);
+int	vm_add_doorbell(struct vmctx *ctx, uint32_t type, uint32_t id,
+			uint64_t addr, uint64_t data, uint32_t flags);
+int	vm_del_doorbell(struct vmctx *ctx, uint32_t id);
 int	vm_create_ioreq_client(struct vmctx *ctx);
 int	vm_destroy_ioreq_client(struct vmctx *ctx);
 int	vm_attach_ioreq_client(struct vmctx *ctx);
@@ -127,7 +138,49 @@ void	vm_unsetup_memory(struct vmctx *ctx);
 bool	check_hugetlb_support(void);
 int	hugetlb_setup_memory(struct vmctx *ctx);
 void	hugetlb_unsetup_memory(struct vmctx *ctx);
-void	*vm_map_gpa(struct vmctx *ctx, vm_paddr_t gaddr, size_t len);
+
+/* a piece of guest memory, and the file it is mapped from */
+struct vm_mem_region {
+	vm_paddr_t	gpa;
+	size_t		len;
+	void		*hva;
+	int		fd;
+	off_t		fd_offset;
+};
+int	hugetlb_get_regions(struct vmctx *ctx, struct vm_mem_region *regions,
+			    int n);
+
+/*
+ * Returns a non-NULL pointer if [gaddr, gaddr+len) is entirely contained in
+ * the lowmem or highmem regions.
+ *
+ * In particular return NULL if [gaddr, gaddr+len) falls in guest MMIO region.
+ * The instruction emulation code depends on this behavior.
+ *
+ * Inline, as the virtio code translates every descriptor with it.
+ */
+static inline void *
+vm_map_gpa(struct vmctx *ctx, vm_paddr_t gaddr, size_t len)
+{
+
+	if (ctx->lowmem > 0) {
+		if (gaddr < ctx->lowmem && len <= ctx->lowmem &&
+		    gaddr + len <= ctx->lowmem)
+			return (ctx->baseaddr + gaddr);
+	}
+
+	if (ctx->highmem > 0) {
+		if (gaddr >= 4*GB) {
+			if (gaddr < 4*GB + ctx->highmem &&
+			    len <= ctx->highmem &&
+			    gaddr + len <= 4*GB + ctx->highmem)
+				return (ctx->baseaddr + gaddr);
+		}
+	}
+
+	return NULL;
+}
+
 uint32_t vm_get_lowmem_limit(struct vmctx *ctx);
 void	vm_set_lowmem_limit(struct vmctx *ctx, uint32_t limit);
 void	vm_set_memflags(struct vmctx *ctx, int flags);
@@ -143,6 +196,8 @@ int	vm_ioapic_deassert_irq(struct vmctx *ctx, int irq);
 int	vm_isa_assert_irq(struct vmctx *ctx, int atpic_irq, int ioapic_irq);
 int	vm_isa_deassert_irq(struct vmctx *ctx, int atpic_irq, int ioapic_irq);
 int	vm_isa_pulse_irq(struct vmctx *ctx, int atpic_irq, int ioapic_irq);
+void	vm_intr_batch_begin(void);
+int	vm_intr_batch_end(void);
 int	vm_assign_ptdev(struct vmctx *ctx, int bus, int slot, int func);
 int	vm_unassign_ptdev(struct vmctx *ctx, int bus, int slot, int func);
 int	vm_map_ptdev_mmio(struct vmctx *ctx, int bus, int slot, int func,
@@ -0,0 +1,51 @@
+/*-
+ * Copyright (c) 2018 Intel Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+/*
+ * Shared memory L2 switch between the virtio-net devices of the acrn-dm
+ * instances on the same host, for the traffic between their guests.
+ */
+
+#ifndef _VSWITCH_H_
+#define _VSWITCH_H_
+
+#include <sys/uio.h>
+#include <stdbool.h>
+
+struct vswitch_port;
+
+struct vswitch_port *vswitch_open(const char *name);
+void	vswitch_close(struct vswitch_port *port);
+int	vswitch_fd(struct vswitch_port *port);
+int	vswitch_send(struct vswitch_port *port, const struct iovec *iov,
+		     int iovcnt, size_t len);
+void	vswitch_flush(struct vswitch_port *port);
+void	vswitch_kick(struct vswitch_port *port);
+int	vswitch_recv(struct vswitch_port *port, struct iovec *iov, int iovcnt);
+bool	vswitch_idle(struct vswitch_port *port);
+
+#endif /* _VSWITCH_H_ */
@@ -489,6 +489,15 @@ int ept_violation_vmexit_handler(struct vcpu *vcpu)
 		status = dm_emulate_mmio_pre(vcpu, exit_qual);
 		if (status != 0)
 			goto out;
+
+		/* doorbells and writes to posted ranges don't need to wait
+		 * for the DM
+		 */
+		if (acrn_ring_doorbell(vcpu, &vcpu->req) == 0)
+			return 0;
+		if (acrn_insert_request_posted(vcpu, &vcpu->req) == 0)
+			return 0;
+
 		status = acrn_insert_request_wait(vcpu, &vcpu->req);
 	}
 
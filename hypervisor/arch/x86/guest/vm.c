@@ -170,6 +170,10 @@ int create_vm(struct vm_description *vm_desc, struct vm **rtn_vm)
 			/* Populate return VM handle */
 			*rtn_vm = vm;
 			vm->sw.io_shared_page = NULL;
+			vm->sw.buf_req_ring = NULL;
+			vm->sw.nr_posted_ranges = 0;
+			vm->sw.nr_doorbells = 0;
+			spinlock_init(&vm->sw.buf_req_lock);
 
 			status = set_vcpuid_entries(vm);
 			if (status)
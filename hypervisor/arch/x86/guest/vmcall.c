@@ -94,6 +94,10 @@ int vmcall_vmexit_handler(struct vcpu *vcpu)
 		ret = hcall_inject_msi(vm, param1, param2);
 		break;
 
+	case HC_INJECT_INTR_BATCH:
+		ret = hcall_inject_intr_batch(vm, param1, param2);
+		break;
+
 	case HC_SET_IOREQ_BUFFER:
 		ret = hcall_set_ioreq_buffer(vm, param1, param2);
 		break;
@@ -102,6 +106,26 @@ int vmcall_vmexit_handler(struct vcpu *vcpu)
 		ret = hcall_notify_req_finish(param1, param2);
 		break;
 
+	case HC_SET_BUF_IOREQ_RING:
+		ret = hcall_set_buf_ioreq_ring(vm, param1, param2);
+		break;
+
+	case HC_ADD_POSTED_RANGE:
+		ret = hcall_add_posted_range(vm, param1, param2);
+		break;
+
+	case HC_DEL_POSTED_RANGE:
+		ret = hcall_del_posted_range(vm, param1, param2);
+		break;
+
+	case HC_ADD_DOORBELL:
+		ret = hcall_add_doorbell(vm, param1, param2);
+		break;
+
+	case HC_DEL_DOORBELL:
+		ret = hcall_del_doorbell(vm, param1, param2);
+		break;
+
 	case HC_VM_SET_MEMMAP:
 		ret = hcall_set_vm_memmap(vm, param1, param2);
 		break;
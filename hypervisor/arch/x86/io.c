@@ -144,7 +144,15 @@ int io_instr_vmexit_handler(struct vcpu *vcpu)
 
 		memset(&vcpu->req, 0, sizeof(struct vhm_request));
 		dm_emulate_pio_pre(vcpu, exit_qual, sz, *rax);
-		status = acrn_insert_request_wait(vcpu, &vcpu->req);
+
+		/* doorbells and writes to posted ranges don't need to wait
+		 * for the DM
+		 */
+		status = acrn_ring_doorbell(vcpu, &vcpu->req);
+		if (status != 0)
+			status = acrn_insert_request_posted(vcpu, &vcpu->req);
+		if (status != 0)
+			status = acrn_insert_request_wait(vcpu, &vcpu->req);
 	}
 
 	if (status != 0) {
@@ -319,6 +319,63 @@ int64_t hcall_inject_msi(struct vm *vm, uint64_t vmid, uint64_t param)
 	return ret;
 }
 
+int64_t hcall_inject_intr_batch(struct vm *vm, uint64_t vmid, uint64_t param)
+{
+	int64_t ret = 0;
+	uint32_t i;
+	struct acrn_intr_batch batch;
+	struct acrn_intr_op op;
+	struct vm *target_vm = get_vm_from_vmid(vmid);
+
+	if (target_vm == NULL)
+		return -1;
+
+	memset((void *)&batch, 0, sizeof(batch));
+	if (copy_from_vm(vm, &batch, param)) {
+		pr_err("%s: Unable copy param to vm\n", __func__);
+		return -1;
+	}
+
+	if (batch.nr_ops > ACRN_INTR_BATCH_MAX)
+		return -1;
+
+	for (i = 0; i < batch.nr_ops; i++) {
+		if (copy_from_vm(vm, &op, batch.ops + i * sizeof(op))) {
+			pr_err("%s: Unable copy param to vm\n", __func__);
+			return -1;
+		}
+
+		switch (op.op) {
+		case ACRN_INTR_OP_ASSERT:
+			if (handle_virt_irqline(vm, vmid, &op.irqline,
+					IRQ_ASSERT) != 0)
+				ret = -1;
+			break;
+		case ACRN_INTR_OP_DEASSERT:
+			if (handle_virt_irqline(vm, vmid, &op.irqline,
+					IRQ_DEASSERT) != 0)
+				ret = -1;
+			break;
+		case ACRN_INTR_OP_PULSE:
+			if (handle_virt_irqline(vm, vmid, &op.irqline,
+					IRQ_PULSE) != 0)
+				ret = -1;
+			break;
+		case ACRN_INTR_OP_MSI:
+			if (vlapic_intr_msi(target_vm, op.msi.msi_addr,
+					op.msi.msi_data) != 0)
+				ret = -1;
+			break;
+		default:
+			dev_dbg(ACRN_DBG_HYCALL, "bad intr op %d", op.op);
+			ret = -1;
+			break;
+		}
+	}
+
+	return ret;
+}
+
 int64_t hcall_set_ioreq_buffer(struct vm *vm, uint64_t vmid, uint64_t param)
 {
 	int64_t ret = 0;
@@ -351,6 +408,42 @@ int64_t hcall_set_ioreq_buffer(struct vm *vm, uint64_t vmid, uint64_t param)
 	return ret;
 }
 
+int64_t hcall_set_buf_ioreq_ring(struct vm *vm, uint64_t vmid, uint64_t param)
+{
+	uint64_t hpa = 0;
+	struct acrn_set_ioreq_buffer iobuf;
+	struct vm *target_vm = get_vm_from_vmid(vmid);
+
+	if (target_vm == NULL)
+		return -1;
+
+	memset((void *)&iobuf, 0, sizeof(iobuf));
+
+	if (copy_from_vm(vm, &iobuf, param)) {
+		pr_err("%s: Unable copy param to vm\n", __func__);
+		return -1;
+	}
+
+	dev_dbg(ACRN_DBG_HYCALL, "[%d] SET BUF RING=0x%p",
+			vmid, iobuf.req_buf);
+
+	hpa = gpa2hpa(vm, iobuf.req_buf);
+
+	spinlock_obtain(&target_vm->sw.buf_req_lock);
+	if (hpa == 0)
+		target_vm->sw.buf_req_ring = NULL;
+	else
+		target_vm->sw.buf_req_ring = HPA2HVA(hpa);
+	spinlock_release(&target_vm->sw.buf_req_lock);
+
+	if (hpa == 0) {
+		pr_err("%s: invalid GPA.\n", __func__);
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
 static void complete_request(struct vcpu *vcpu)
 {
 	/*
@@ -413,6 +506,158 @@ int64_t hcall_notify_req_finish(uint64_t vmid, uint64_t vcpu_id)
 	return ret;
 }
 
+static int copy_posted_range(struct vm *vm, uint64_t param,
+	struct acrn_posted_range *range)
+{
+	memset((void *)range, 0, sizeof(*range));
+	if (copy_from_vm(vm, range, param)) {
+		pr_err("%s: Unable copy param to vm\n", __func__);
+		return -1;
+	}
+
+	if ((range->type != REQ_PORTIO && range->type != REQ_MMIO) ||
+			range->size == 0)
+		return -EINVAL;
+
+	return 0;
+}
+
+int64_t hcall_add_posted_range(struct vm *vm, uint64_t vmid, uint64_t param)
+{
+	int64_t ret = 0;
+	struct acrn_posted_range range;
+	struct vm *target_vm = get_vm_from_vmid(vmid);
+
+	if (target_vm == NULL)
+		return -1;
+
+	ret = copy_posted_range(vm, param, &range);
+	if (ret != 0)
+		return ret;
+
+	dev_dbg(ACRN_DBG_HYCALL, "[%d] ADD POSTED type %d 0x%llx size 0x%llx",
+			vmid, range.type, range.start, range.size);
+
+	spinlock_obtain(&target_vm->sw.buf_req_lock);
+	if (target_vm->sw.nr_posted_ranges < MAX_POSTED_RANGES)
+		target_vm->sw.posted_ranges[target_vm->sw.nr_posted_ranges++] =
+			range;
+	else
+		ret = -1;
+	spinlock_release(&target_vm->sw.buf_req_lock);
+
+	return ret;
+}
+
+int64_t hcall_del_posted_range(struct vm *vm, uint64_t vmid, uint64_t param)
+{
+	int64_t ret = -1;
+	int i, nr;
+	struct acrn_posted_range range, *ranges;
+	struct vm *target_vm = get_vm_from_vmid(vmid);
+
+	if (target_vm == NULL)
+		return -1;
+
+	if (copy_posted_range(vm, param, &range) != 0)
+		return -1;
+
+	spinlock_obtain(&target_vm->sw.buf_req_lock);
+	ranges = target_vm->sw.posted_ranges;
+	nr = target_vm->sw.nr_posted_ranges;
+	for (i = 0; i < nr; i++) {
+		if (ranges[i].type == range.type &&
+				ranges[i].start == range.start &&
+				ranges[i].size == range.size) {
+			ranges[i] = ranges[nr - 1];
+			target_vm->sw.nr_posted_ranges--;
+			ret = 0;
+			break;
+		}
+	}
+	spinlock_release(&target_vm->sw.buf_req_lock);
+
+	return ret;
+}
+
+static int copy_doorbell(struct vm *vm, uint64_t param,
+	struct acrn_doorbell *db)
+{
+	memset((void *)db, 0, sizeof(*db));
+	if (copy_from_vm(vm, db, param)) {
+		pr_err("%s: Unable copy param to vm\n", __func__);
+		return -1;
+	}
+
+	if (db->id >= VHM_DOORBELL_MAX)
+		return -EINVAL;
+
+	return 0;
+}
+
+int64_t hcall_add_doorbell(struct vm *vm, uint64_t vmid, uint64_t param)
+{
+	int64_t ret = 0;
+	int i;
+	struct acrn_doorbell db;
+	struct vm *target_vm = get_vm_from_vmid(vmid);
+
+	if (target_vm == NULL)
+		return -1;
+
+	ret = copy_doorbell(vm, param, &db);
+	if (ret != 0)
+		return ret;
+
+	if (db.type != REQ_PORTIO && db.type != REQ_MMIO)
+		return -EINVAL;
+
+	dev_dbg(ACRN_DBG_HYCALL, "[%d] ADD DOORBELL %d type %d 0x%llx",
+			vmid, db.id, db.type, db.addr);
+
+	spinlock_obtain(&target_vm->sw.buf_req_lock);
+	if (target_vm->sw.buf_req_ring == NULL)
+		ret = -1;
+	for (i = 0; ret == 0 && i < target_vm->sw.nr_doorbells; i++) {
+		if (target_vm->sw.doorbells[i].id == db.id)
+			ret = -1;
+	}
+	if (ret == 0)
+		target_vm->sw.doorbells[target_vm->sw.nr_doorbells++] = db;
+	spinlock_release(&target_vm->sw.buf_req_lock);
+
+	return ret;
+}
+
+int64_t hcall_del_doorbell(struct vm *vm, uint64_t vmid, uint64_t param)
+{
+	int64_t ret = -1;
+	int i, nr;
+	struct acrn_doorbell db, *doorbells;
+	struct vm *target_vm = get_vm_from_vmid(vmid);
+
+	if (target_vm == NULL)
+		return -1;
+
+	if (copy_doorbell(vm, param, &db) != 0)
+		return -1;
+
+	spinlock_obtain(&target_vm->sw.buf_req_lock);
+	doorbells = target_vm->sw.doorbells;
+	nr = target_vm->sw.nr_doorbells;
+	for (i = 0; i < nr; i++) {
+		if (doorbells[i].id == db.id) {
+			doorbells[i] = doorbells[nr - 1];
+			target_vm->sw.nr_doorbells--;
+			ret = 0;
+			break;
+		}
+	}
+	spinlock_release(&target_vm->sw.buf_req_lock);
+
+	return ret;
+}
+
 int64_t hcall_set_vm_memmap(struct vm *vm, uint64_t vmid, uint64_t param)
 {
 	int64_t ret = 0;
@@ -877,6 +1122,174 @@ int acrn_insert_request_nowait(struct vcpu *vcpu, struct vhm_request *req)
 	return 0;
 }
 
+static bool is_posted_write(struct vm *vm, uint32_t type, uint64_t addr,
+	uint64_t size)
+{
+	struct acrn_posted_range *range;
+	int i;
+
+	for (i = 0; i < vm->sw.nr_posted_ranges; i++) {
+		range = &vm->sw.posted_ranges[i];
+		if (range->type == type && addr >= range->start &&
+				addr + size <= range->start + range->size)
+			return true;
+	}
+
+	return false;
+}
+
+/*
+ * Queue a write to a posted range in the posted write request ring.
+ * Unlike acrn_insert_request_wait, the vcpu is not paused. Return 0 if
+ * the request was queued, or non-zero if it has to go through the normal
+ * ioreq path: not a write to a posted range, or the ring is full.
+ */
+int acrn_insert_request_posted(struct vcpu *vcpu, struct vhm_request *req)
+{
+	struct vm *vm;
+	struct vhm_buf_request_ring *ring;
+	struct vhm_buf_request *buf_req;
+	uint32_t head, tail, direction;
+	uint64_t addr, size, value;
+	int ret = 0;
+
+	if (!vcpu || !req)
+		return -EINVAL;
+
+	vm = vcpu->vm;
+	if (vm->sw.buf_req_ring == NULL || vm->sw.nr_posted_ranges == 0)
+		return -ENODEV;
+
+	switch (req->type) {
+	case REQ_PORTIO:
+		direction = req->reqs.pio_request.direction;
+		addr = req->reqs.pio_request.address;
+		size = req->reqs.pio_request.size;
+		value = (uint32_t)req->reqs.pio_request.value;
+		break;
+	case REQ_MMIO:
+		direction = req->reqs.mmio_request.direction;
+		addr = req->reqs.mmio_request.address;
+		size = req->reqs.mmio_request.size;
+		value = req->reqs.mmio_request.value;
+		break;
+	default:
+		return -ENODEV;
+	}
+
+	if (direction != REQUEST_WRITE)
+		return -ENODEV;
+
+	spinlock_obtain(&vm->sw.buf_req_lock);
+
+	ring = vm->sw.buf_req_ring;
+	if (ring == NULL || !is_posted_write(vm, req->type, addr, size)) {
+		ret = -ENODEV;
+		goto out;
+	}
+
+	head = atomic_load_acq_32(&ring->head);
+	tail = ring->tail;
+	if (tail - head >= VHM_BUF_REQUEST_MAX) {
+		ret = -EBUSY;
+		goto out;
+	}
+
+	buf_req = &ring->reqs[tail & (VHM_BUF_REQUEST_MAX - 1)];
+	buf_req->type = req->type;
+	buf_req->vcpu = vcpu->vcpu_id;
+	buf_req->size = size;
+	buf_req->address = addr;
+	buf_req->value = value;
+
+	/* the slot must be visible before the new tail */
+	CPU_MEMORY_WRITE_BARRIER();
+	atomic_store_rel_32(&ring->tail, tail + 1);
+	CPU_MEMORY_BARRIER();
+
+	/*
+	 * Only signal VHM if the DM had drained the ring up to this slot,
+	 * otherwise it is still draining and will pick this slot up too.
+	 */
+	if ((uint32_t)atomic_load_acq_32(&ring->head) == tail)
+		fire_vhm_interrupt();
+
+out:
+	spinlock_release(&vm->sw.buf_req_lock);
+	return ret;
+}
+
+/*
+ * Complete a write to a doorbell address in place: set the doorbell bit
+ * in the posted write request ring and signal VHM if it was clear.
+ * Return 0 if the write rang a doorbell, or non-zero if it has to go
+ * through the normal ioreq path.
+ */
+int acrn_ring_doorbell(struct vcpu *vcpu, struct vhm_request *req)
+{
+	struct vm *vm;
+	struct acrn_doorbell *db;
+	uint32_t direction;
+	uint64_t addr, size, value;
+	unsigned long *pending;
+	int i, ret = -ENODEV;
+
+	if (!vcpu || !req)
+		return -EINVAL;
+
+	vm = vcpu->vm;
+	if (vm->sw.nr_doorbells == 0)
+		return -ENODEV;
+
+	switch (req->type) {
+	case REQ_PORTIO:
+		direction = req->reqs.pio_request.direction;
+		addr = req->reqs.pio_request.address;
+		size = req->reqs.pio_request.size;
+		value = req->reqs.pio_request.value;
+		break;
+	case REQ_MMIO:
+		direction = req->reqs.mmio_request.direction;
+		addr = req->reqs.mmio_request.address;
+		size = req->reqs.mmio_request.size;
+		value = req->reqs.mmio_request.value;
+		break;
+	default:
+		return -ENODEV;
+	}
+
+	if (direction != REQUEST_WRITE)
+		return -ENODEV;
+
+	/* only the bytes actually written are matched */
+	if (size < 8)
+		value &= (1UL << (size * 8)) - 1;
+
+	spinlock_obtain(&vm->sw.buf_req_lock);
+
+	if (vm->sw.buf_req_ring == NULL)
+		goto out;
+
+	for (i = 0; i < vm->sw.nr_doorbells; i++) {
+		db = &vm->sw.doorbells[i];
+		if (db->type != req->type || db->addr != addr)
+			continue;
+		if ((db->flags & ACRN_DOORBELL_DATAMATCH) && db->data != value)
+			continue;
+
+		pending = (unsigned long *)
+			&vm->sw.buf_req_ring->doorbell_pending[db->id / 64];
+		if (!bitmap_test_and_set(db->id % 64, pending))
+			fire_vhm_interrupt();
+		ret = 0;
+		break;
+	}
+
+out:
+	spinlock_release(&vm->sw.buf_req_lock);
+	return ret;
+}
+
 static void _get_req_info_(struct vhm_request *req, int *id, char *type,
 	char *state, char *dir, long *addr, long *val)
 {
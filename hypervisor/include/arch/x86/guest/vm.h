@@ -70,6 +70,8 @@ struct sw_kernel_info {
 	uint32_t kernel_size;
 };
 
+#define MAX_POSTED_RANGES	16
+
 struct vm_sw_info {
 	int kernel_type;	/* Guest kernel type */
 	/* Kernel information (common for all guest types) */
@@ -78,6 +80,16 @@ struct vm_sw_info {
 	struct sw_linux linux_info;
 	/* HVA to IO shared page */
 	void *io_shared_page;
+	/* HVA to posted write request ring */
+	struct vhm_buf_request_ring *buf_req_ring;
+	/* Serializes producers of buf_req_ring and posted range updates */
+	spinlock_t buf_req_lock;
+	/* Ranges whose writes are queued to buf_req_ring */
+	struct acrn_posted_range posted_ranges[MAX_POSTED_RANGES];
+	int nr_posted_ranges;
+	/* Doorbells whose writes only set a bit in buf_req_ring */
+	struct acrn_doorbell doorbells[VHM_DOORBELL_MAX];
+	int nr_doorbells;
 };
 
 struct vm_pm_info {
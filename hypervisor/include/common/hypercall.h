@@ -42,6 +42,8 @@ struct vhm_request;
 bool is_hypercall_from_ring0(void);
 int acrn_insert_request_wait(struct vcpu *vcpu, struct vhm_request *req);
 int acrn_insert_request_nowait(struct vcpu *vcpu, struct vhm_request *req);
+int acrn_insert_request_posted(struct vcpu *vcpu, struct vhm_request *req);
+int acrn_ring_doorbell(struct vcpu *vcpu, struct vhm_request *req);
 int get_req_info(char *str, int str_max);
 
 int acrn_vpic_inject_irq(struct vm *vm, int irq, enum irq_mode mode);
@@ -194,6 +196,24 @@ int64_t hcall_pulse_irqline(struct vm *vm, uint64_t vmid, uint64_t param);
  */
 int64_t hcall_inject_msi(struct vm *vm, uint64_t vmid, uint64_t param);
 
+/**
+ * @brief inject a batch of interrupts
+ *
+ * Assert/deassert/pulse irqlines and inject MSIs for a VM in one
+ * hypercall, in the order of the operations. All the operations are
+ * done even if some of them fail.
+ * The function will return -1 if the target VM does not exist, there are
+ * more than ACRN_INTR_BATCH_MAX operations, or any operation failed.
+ *
+ * @param vm Pointer to VM data structure
+ * @param vmid ID of the VM
+ * @param param guest physical address. This gpa points to
+ *              struct acrn_intr_batch
+ *
+ * @return 0 on success, non-zero on error.
+ */
+int64_t hcall_inject_intr_batch(struct vm *vm, uint64_t vmid, uint64_t param);
+
 /**
  * @brief set ioreq shared buffer
  *
@@ -222,6 +242,87 @@ int64_t hcall_set_ioreq_buffer(struct vm *vm, uint64_t vmid, uint64_t param);
  */
 int64_t hcall_notify_req_finish(uint64_t vmid, uint64_t param);
 
+/**
+ * @brief set posted write request ring
+ *
+ * Set the page used to queue writes to posted ranges for a VM.
+ * The function will return -1 if the target VM does not exist.
+ *
+ * @param vm Pointer to VM data structure
+ * @param vmid ID of the VM
+ * @param param guest physical address. This gpa points to
+ *              struct acrn_set_ioreq_buffer
+ *
+ * @return 0 on success, non-zero on error.
+ */
+int64_t hcall_set_buf_ioreq_ring(struct vm *vm, uint64_t vmid, uint64_t param);
+
+/**
+ * @brief add posted write range
+ *
+ * Writes from a VM to a posted range are queued to its posted write
+ * request ring and the vcpu is not paused. Reads still go through the
+ * ioreq shared buffer.
+ * The function will return -1 if the target VM does not exist or has
+ * no free posted range slot.
+ *
+ * @param vm Pointer to VM data structure
+ * @param vmid ID of the VM
+ * @param param guest physical address. This gpa points to
+ *              struct acrn_posted_range
+ *
+ * @return 0 on success, non-zero on error.
+ */
+int64_t hcall_add_posted_range(struct vm *vm, uint64_t vmid, uint64_t param);
+
+/**
+ * @brief remove posted write range
+ *
+ * Remove a range added by hcall_add_posted_range.
+ * The function will return -1 if the target VM or the range does not exist.
+ *
+ * @param vm Pointer to VM data structure
+ * @param vmid ID of the VM
+ * @param param guest physical address. This gpa points to
+ *              struct acrn_posted_range
+ *
+ * @return 0 on success, non-zero on error.
+ */
+int64_t hcall_del_posted_range(struct vm *vm, uint64_t vmid, uint64_t param);
+
+/**
+ * @brief add doorbell
+ *
+ * A write from a VM to a doorbell address is completed by the hypervisor,
+ * which only sets the doorbell bit in the posted write request ring.
+ * The function will return -1 if the target VM does not exist, has no
+ * posted write request ring, or the doorbell id is already in use.
+ *
+ * @param vm Pointer to VM data structure
+ * @param vmid ID of the VM
+ * @param param guest physical address. This gpa points to
+ *              struct acrn_doorbell
+ *
+ * @return 0 on success, non-zero on error.
+ */
+int64_t hcall_add_doorbell(struct vm *vm, uint64_t vmid, uint64_t param);
+
+/**
+ * @brief remove doorbell
+ *
+ * Remove the doorbell with the id of the given struct acrn_doorbell.
+ * The function will return -1 if the target VM or the doorbell does not
+ * exist.
+ *
+ * @param vm Pointer to VM data structure
+ * @param vmid ID of the VM
+ * @param param guest physical address. This gpa points to
+ *              struct acrn_doorbell
+ *
+ * @return 0 on success, non-zero on error.
+ */
+int64_t hcall_del_doorbell(struct vm *vm, uint64_t vmid, uint64_t param);
+
 /**
  * @brief setup ept memory mapping
  *
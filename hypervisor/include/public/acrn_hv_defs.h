@@ -70,11 +70,17 @@
 #define HC_DEASSERT_IRQLINE         _HC_ID(HC_ID, HC_ID_IRQ_BASE + 0x01)
 #define HC_PULSE_IRQLINE            _HC_ID(HC_ID, HC_ID_IRQ_BASE + 0x02)
 #define HC_INJECT_MSI               _HC_ID(HC_ID, HC_ID_IRQ_BASE + 0x03)
+#define HC_INJECT_INTR_BATCH        _HC_ID(HC_ID, HC_ID_IRQ_BASE + 0x04)
 
 /* DM ioreq management */
 #define HC_ID_IOREQ_BASE            0x30UL
 #define HC_SET_IOREQ_BUFFER         _HC_ID(HC_ID, HC_ID_IOREQ_BASE + 0x00)
 #define HC_NOTIFY_REQUEST_FINISH    _HC_ID(HC_ID, HC_ID_IOREQ_BASE + 0x01)
+#define HC_SET_BUF_IOREQ_RING       _HC_ID(HC_ID, HC_ID_IOREQ_BASE + 0x02)
+#define HC_ADD_POSTED_RANGE         _HC_ID(HC_ID, HC_ID_IOREQ_BASE + 0x03)
+#define HC_DEL_POSTED_RANGE         _HC_ID(HC_ID, HC_ID_IOREQ_BASE + 0x04)
+#define HC_ADD_DOORBELL             _HC_ID(HC_ID, HC_ID_IOREQ_BASE + 0x05)
+#define HC_DEL_DOORBELL             _HC_ID(HC_ID, HC_ID_IOREQ_BASE + 0x06)
 
 /* Guest memory management */
 #define HC_ID_MEM_BASE              0x40UL